@@ -0,0 +1,264 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "bldc_math.h"
+#include "utils.h"
+#include <math.h>
+#include <stdlib.h>
+
+// The floating phase and the sign of its back-EMF for each commutation step,
+// with the phases in the order of the direction of rotation.
+static const int8_t m_float_phase[6] = {0, 1, 2, 0, 1, 2};
+static const int8_t m_float_sign[6] = {1, -1, 1, -1, 1, -1};
+
+/*
+ * The shunt that carries the motor current in each commutation step, indexed
+ * by [direction][comm_step - 1], see the step tables in mcpwm. With two shunts
+ * the third phase is not measured directly, so the steps where it carries the
+ * current use one of the other shunts with the sign flipped as needed.
+ */
+static const bldc_shunt_t m_shunt_3[2][6] = {
+		{{1, -1}, {1, -1}, {2, -1}, {2, -1}, {0, -1}, {0, -1}},
+		{{2, -1}, {2, -1}, {1, -1}, {1, -1}, {0, -1}, {0, -1}}
+};
+
+static const bldc_shunt_t m_shunt_2[2][6] = {
+		{{1, 1}, {0, 1}, {1, -1}, {1, -1}, {0, -1}, {0, -1}},
+		{{1, -1}, {1, -1}, {0, 1}, {1, 1}, {0, -1}, {0, -1}}
+};
+
+/**
+ * Get the back-EMF of the floating phase for a commutation step.
+ *
+ * @param comm_step
+ * The commutation step, 1 to 6.
+ *
+ * @param ph
+ * The three phase voltages relative to the virtual ground, in the order of
+ * the direction of rotation.
+ *
+ * @param ph_raw
+ * The raw phase voltages, in the same order.
+ *
+ * @param v_diff
+ * The back-EMF of the floating phase. It goes from negative to positive
+ * during the step, regardless of the step.
+ *
+ * @param ph_now_raw
+ * The raw voltage of the floating phase.
+ */
+void bldc_floating_phase(int comm_step, const int *ph, const int *ph_raw,
+		int *v_diff, int *ph_now_raw) {
+	if (comm_step < 1 || comm_step > 6) {
+		*v_diff = 0;
+		*ph_now_raw = 0;
+		return;
+	}
+
+	const int phase = m_float_phase[comm_step - 1];
+	*v_diff = m_float_sign[comm_step - 1] * ph[phase];
+	*ph_now_raw = ph_raw[phase];
+}
+
+/**
+ * Reset the sensorless commutation state, e.g. when the motor is stuck.
+ *
+ * @param sl
+ * The state to reset.
+ */
+void bldc_sl_reset(bldc_sl_state_t *sl) {
+	sl->cycle_integrator = 0.0;
+	sl->cycle_sum = 0.0;
+}
+
+/**
+ * Run the sensorless commutation logic for one PWM cycle. In integrate mode
+ * the back-EMF after the zero crossing is integrated until it reaches the
+ * cycle integrator limit. In delay mode the time after the zero crossing
+ * is counted until half of the commutation period has passed.
+ *
+ * @param sl
+ * The commutation state.
+ *
+ * @param in
+ * The samples and timing of this PWM cycle.
+ *
+ * @param conf
+ * The motor configuration.
+ *
+ * @param rpm_dep
+ * The speed dependent limits, see bldc_update_rpm_dep.
+ *
+ * @return
+ * True if the motor should be commutated one step now.
+ */
+bool bldc_sl_update(bldc_sl_state_t *sl, const bldc_sl_input_t *in,
+		volatile mc_configuration *conf, volatile mc_rpm_dep_struct *rpm_dep) {
+	int v_diff = in->v_diff;
+
+	// Don't commutate while the motor is standing still and the signal only consists
+	// of weak noise.
+	if (abs(v_diff) < BLDC_BEMF_NOISE_MIN) {
+		v_diff = 0;
+	}
+
+	if (v_diff > 0) {
+		// Skip samples where the floating phase is clamped by the freewheeling diodes
+		int min = (int)((1.0 - in->duty_abs) * (float)in->v_in_raw * 0.3);
+		if (min > in->v_in_raw / 4) {
+			min = in->v_in_raw / 4;
+		}
+
+		if (in->pwm_cycles_sum > (in->last_pwm_cycles_sum / 2.0) ||
+				!in->has_commutated ||
+				(in->ph_now_raw > min && in->ph_now_raw < (in->v_in_raw - min))) {
+			sl->cycle_integrator += (float)v_diff / in->f_sw;
+		}
+	}
+
+	bool comm = false;
+
+	if (conf->comm_mode == COMM_MODE_INTEGRATE) {
+		float limit;
+		if (in->has_commutated) {
+			limit = rpm_dep->cycle_int_limit_running * sl->int_scale;
+		} else {
+			limit = rpm_dep->cycle_int_limit * sl->int_scale;
+		}
+
+		if (sl->cycle_integrator >= (rpm_dep->cycle_int_limit_max * sl->int_scale) ||
+				sl->cycle_integrator >= limit) {
+			comm = true;
+		}
+	} else if (conf->comm_mode == COMM_MODE_DELAY) {
+		if (v_diff > 0) {
+			sl->cycle_sum += conf->m_bldc_f_sw_max / in->f_sw;
+
+			if (sl->cycle_sum >= utils_map(in->rpm_abs, 0,
+					conf->sl_cycle_int_rpm_br, rpm_dep->comm_time_sum / 2.0,
+					(rpm_dep->comm_time_sum / 2.0) * conf->sl_phase_advance_at_br)) {
+				comm = true;
+			}
+		} else {
+			bldc_sl_reset(sl);
+		}
+	}
+
+	if (comm) {
+		sl->integrator_at_comm = sl->cycle_integrator;
+		bldc_sl_reset(sl);
+	}
+
+	return comm;
+}
+
+/**
+ * Initialize the bus current selection.
+ *
+ * @param cs
+ * The state to initialize.
+ *
+ * @param three_shunts
+ * True if the hardware has a shunt in every phase.
+ */
+void bldc_curr_init(bldc_curr_state_t *cs, bool three_shunts) {
+	cs->table = three_shunts ? m_shunt_3 : m_shunt_2;
+	cs->comm_step_prev = 1;
+	cs->prev_tot_sample = 0.0;
+}
+
+/**
+ * Get the motor current from the shunt that carries it in the present
+ * commutation step. In the sample right after a commutation the current
+ * has not settled in the new phase yet, so the previous sample is used.
+ *
+ * @param cs
+ * The bus current selection state.
+ *
+ * @param direction
+ * The direction of rotation, 0 or 1.
+ *
+ * @param comm_step
+ * The commutation step, 1 to 6.
+ *
+ * @param curr_norm
+ * The offset compensated phase current samples.
+ *
+ * @return
+ * The motor current in ADC counts.
+ */
+float bldc_curr_update(bldc_curr_state_t *cs, int direction, int comm_step,
+		const volatile int *curr_norm) {
+	float sample = 0.0;
+	if (comm_step >= 1 && comm_step <= 6) {
+		const bldc_shunt_t *shunt = &cs->table[direction ? 1 : 0][comm_step - 1];
+		sample = (float)(shunt->sign * curr_norm[shunt->index]);
+	}
+
+	float ret = sample;
+	if (comm_step != cs->comm_step_prev) {
+		ret = cs->prev_tot_sample;
+	}
+
+	cs->comm_step_prev = comm_step;
+	cs->prev_tot_sample = sample;
+
+	return ret;
+}
+
+/**
+ * Update the speed dependent cycle integrator limits and commutation times.
+ *
+ * @param rpm_dep
+ * The values to update. The commutation counters are not touched.
+ *
+ * @param conf
+ * The motor configuration.
+ *
+ * @param rpm_abs
+ * The absolute filtered speed in ERPM.
+ *
+ * @param v_in_raw
+ * The raw input voltage sample.
+ */
+void bldc_update_rpm_dep(volatile mc_rpm_dep_struct *rpm_dep,
+		volatile mc_configuration *conf, float rpm_abs, float v_in_raw) {
+	const float limit = conf->sl_cycle_int_limit;
+	const float bemf_comp = v_in_raw * conf->sl_bemf_coupling_k;
+
+	float limit_running = limit + bemf_comp /
+			(rpm_abs > conf->sl_min_erpm ? rpm_abs : conf->sl_min_erpm);
+	limit_running = utils_map(rpm_abs, 0, conf->sl_cycle_int_rpm_br, limit_running,
+			limit_running * conf->sl_phase_advance_at_br);
+	const float limit_max = limit + bemf_comp / conf->sl_min_erpm_cycle_int_limit;
+
+	if (limit_running < 1.0) {
+		limit_running = 1.0;
+	}
+
+	if (limit_running > limit_max) {
+		limit_running = limit_max;
+	}
+
+	rpm_dep->cycle_int_limit = limit;
+	rpm_dep->cycle_int_limit_running = limit_running;
+	rpm_dep->cycle_int_limit_max = limit_max;
+	rpm_dep->comm_time_sum = conf->m_bldc_f_sw_max / ((rpm_abs / 60.0) * 6.0);
+	rpm_dep->comm_time_sum_min_rpm = conf->m_bldc_f_sw_max / ((conf->sl_min_erpm / 60.0) * 6.0);
+}
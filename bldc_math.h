@@ -0,0 +1,80 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef BLDC_MATH_H_
+#define BLDC_MATH_H_
+
+#include "datatypes.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * The sensorless commutation math of the BLDC implementation in mcpwm, without
+ * any access to timers, ADCs or the RTOS. The ADC samples and the timer state
+ * are passed as arguments, so that the commutation decisions can also be run
+ * against a motor model.
+ */
+
+// Settings
+#define BLDC_BEMF_NOISE_MIN				10 // Smaller back-EMF samples are treated as zero
+
+// Types
+typedef struct {
+	float cycle_integrator;
+	float cycle_sum;
+	float integrator_at_comm; // Cycle integrator value at the last commutation
+	float int_scale; // Cycle integrator limit units to ADC counts * s, depends on the voltage divider
+} bldc_sl_state_t;
+
+typedef struct {
+	int v_diff; // Back-EMF of the floating phase, positive after the zero crossing
+	int ph_now_raw; // Raw voltage of the floating phase
+	int v_in_raw; // Raw input voltage
+	float duty_abs;
+	float rpm_abs;
+	float f_sw; // Switching frequency now
+	float pwm_cycles_sum; // PWM cycles at m_bldc_f_sw_max since the last commutation
+	float last_pwm_cycles_sum; // pwm_cycles_sum at the last commutation
+	bool has_commutated;
+} bldc_sl_input_t;
+
+typedef struct {
+	int8_t index; // Index in ADC_curr_norm_value
+	int8_t sign;
+} bldc_shunt_t;
+
+typedef struct {
+	const bldc_shunt_t (*table)[6]; // Shunt for [direction][comm_step - 1]
+	int comm_step_prev;
+	float prev_tot_sample;
+} bldc_curr_state_t;
+
+// Functions
+void bldc_floating_phase(int comm_step, const int *ph, const int *ph_raw,
+		int *v_diff, int *ph_now_raw);
+void bldc_sl_reset(bldc_sl_state_t *sl);
+bool bldc_sl_update(bldc_sl_state_t *sl, const bldc_sl_input_t *in,
+		volatile mc_configuration *conf, volatile mc_rpm_dep_struct *rpm_dep);
+void bldc_curr_init(bldc_curr_state_t *cs, bool three_shunts);
+float bldc_curr_update(bldc_curr_state_t *cs, int direction, int comm_step,
+		const volatile int *curr_norm);
+void bldc_update_rpm_dep(volatile mc_rpm_dep_struct *rpm_dep,
+		volatile mc_configuration *conf, float rpm_abs, float v_in_raw);
+
+#endif /* BLDC_MATH_H_ */
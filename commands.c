@@ -44,6 +44,9 @@
 #include <stdarg.h>
 #include <stdio.h>
 
+// Settings
+#define MCCONF_APPENDED_LEN		(60 + 16 * S_PID_SCHED_LEN) // Bytes of the COMM_SET_MCCONF fields added in FW 3.103
+
 // Threads
 static THD_FUNCTION(detect_thread, arg);
 static THD_WORKING_AREA(detect_thread_wa, 2048);
@@ -186,6 +189,9 @@ void commands_process_packet(unsigned char *data, unsigned int len) {
 		buffer_append_int32(send_buffer, mc_interface_get_tachometer_abs_value(false), &ind);
 		send_buffer[ind++] = mc_interface_get_fault();
 		buffer_append_float32(send_buffer, mc_interface_get_pid_pos_now(), 1e6, &ind);
+		buffer_append_float32(send_buffer, mcpwm_foc_get_est_res(), 1e6, &ind);
+		buffer_append_float32(send_buffer, mcpwm_foc_get_est_flux_linkage(), 1e6, &ind);
+		buffer_append_uint32(send_buffer, mc_interface_get_limit_sources(), &ind);
 		commands_send_packet(send_buffer, ind);
 		break;
 
@@ -219,6 +225,16 @@ void commands_process_packet(unsigned char *data, unsigned int len) {
 		timeout_reset();
 		break;
 
+	case COMM_SET_POS_MOVE: {
+		ind = 0;
+		float pos = (float)buffer_get_int32(data, &ind) / 1000000.0;
+		float vel = buffer_get_float32_auto(data, &ind);
+		float acc = buffer_get_float32_auto(data, &ind);
+		float jerk = buffer_get_float32_auto(data, &ind);
+		mc_interface_set_pid_pos_move(pos, vel, acc, jerk);
+		timeout_reset();
+	} break;
+
 	case COMM_SET_HANDBRAKE:
 		ind = 0;
 		mc_interface_set_handbrake(buffer_get_float32(data, 1e3, &ind));
@@ -365,6 +381,38 @@ void commands_process_packet(unsigned char *data, unsigned int len) {
 		mcconf.m_dc_f_sw = buffer_get_float32_auto(data, &ind);
 		mcconf.m_ntc_motor_beta = buffer_get_float32_auto(data, &ind);
 
+		// Packets from tools made for FW 3.102 and older end here, keep the
+		// present values of the newer settings for them.
+		if ((unsigned int)(ind + MCCONF_APPENDED_LEN) <= len) {
+			mcconf.foc_observer_type = data[ind++];
+			mcconf.foc_fw_current_max = buffer_get_float32_auto(data, &ind);
+			mcconf.foc_fw_duty_start = buffer_get_float32_auto(data, &ind);
+			mcconf.foc_fw_ramp_time = buffer_get_float32_auto(data, &ind);
+			mcconf.foc_motor_ld = buffer_get_float32_auto(data, &ind);
+			mcconf.foc_motor_lq = buffer_get_float32_auto(data, &ind);
+			mcconf.foc_mtpa_enable = data[ind++];
+			mcconf.foc_cc_decoupling = data[ind++];
+			mcconf.foc_modulation_mode = data[ind++];
+			mcconf.foc_dt_comp_band = buffer_get_float32_auto(data, &ind);
+			mcconf.foc_hfi_voltage = buffer_get_float32_auto(data, &ind);
+			mcconf.foc_hfi_erpm = buffer_get_float32_auto(data, &ind);
+			mcconf.foc_rls_enable = data[ind++];
+			mcconf.foc_encoder_comp_enable = data[ind++];
+			mcconf.foc_cogging_comp_enable = data[ind++];
+			mcconf.p_pid_ff_vel = buffer_get_float32_auto(data, &ind);
+			mcconf.p_pid_ff_acc = buffer_get_float32_auto(data, &ind);
+			mcconf.s_pid_ff_acc = buffer_get_float32_auto(data, &ind);
+			mcconf.s_pid_sched_points = data[ind++];
+			for (int i = 0;i < S_PID_SCHED_LEN;i++) {
+				mcconf.s_pid_sched_erpm[i] = buffer_get_float32_auto(data, &ind);
+				mcconf.s_pid_sched_kp[i] = buffer_get_float32_auto(data, &ind);
+				mcconf.s_pid_sched_ki[i] = buffer_get_float32_auto(data, &ind);
+				mcconf.s_pid_sched_kd[i] = buffer_get_float32_auto(data, &ind);
+			}
+			memcpy(mcconf.foc_hall_edge_corr, data + ind, 8);
+			ind += 8;
+		}
+
 		// Apply limits if they are defined
 #ifndef DISABLE_HW_LIMITS
 #ifdef HW_LIM_CURRENT
@@ -522,6 +570,33 @@ void commands_process_packet(unsigned char *data, unsigned int len) {
 		buffer_append_float32_auto(send_buffer, mcconf.m_bldc_f_sw_max, &ind);
 		buffer_append_float32_auto(send_buffer, mcconf.m_dc_f_sw, &ind);
 		buffer_append_float32_auto(send_buffer, mcconf.m_ntc_motor_beta, &ind);
+		send_buffer[ind++] = mcconf.foc_observer_type;
+		buffer_append_float32_auto(send_buffer, mcconf.foc_fw_current_max, &ind);
+		buffer_append_float32_auto(send_buffer, mcconf.foc_fw_duty_start, &ind);
+		buffer_append_float32_auto(send_buffer, mcconf.foc_fw_ramp_time, &ind);
+		buffer_append_float32_auto(send_buffer, mcconf.foc_motor_ld, &ind);
+		buffer_append_float32_auto(send_buffer, mcconf.foc_motor_lq, &ind);
+		send_buffer[ind++] = mcconf.foc_mtpa_enable;
+		send_buffer[ind++] = mcconf.foc_cc_decoupling;
+		send_buffer[ind++] = mcconf.foc_modulation_mode;
+		buffer_append_float32_auto(send_buffer, mcconf.foc_dt_comp_band, &ind);
+		buffer_append_float32_auto(send_buffer, mcconf.foc_hfi_voltage, &ind);
+		buffer_append_float32_auto(send_buffer, mcconf.foc_hfi_erpm, &ind);
+		send_buffer[ind++] = mcconf.foc_rls_enable;
+		send_buffer[ind++] = mcconf.foc_encoder_comp_enable;
+		send_buffer[ind++] = mcconf.foc_cogging_comp_enable;
+		buffer_append_float32_auto(send_buffer, mcconf.p_pid_ff_vel, &ind);
+		buffer_append_float32_auto(send_buffer, mcconf.p_pid_ff_acc, &ind);
+		buffer_append_float32_auto(send_buffer, mcconf.s_pid_ff_acc, &ind);
+		send_buffer[ind++] = mcconf.s_pid_sched_points;
+		for (int i = 0;i < S_PID_SCHED_LEN;i++) {
+			buffer_append_float32_auto(send_buffer, mcconf.s_pid_sched_erpm[i], &ind);
+			buffer_append_float32_auto(send_buffer, mcconf.s_pid_sched_kp[i], &ind);
+			buffer_append_float32_auto(send_buffer, mcconf.s_pid_sched_ki[i], &ind);
+			buffer_append_float32_auto(send_buffer, mcconf.s_pid_sched_kd[i], &ind);
+		}
+		memcpy(send_buffer + ind, mcconf.foc_hall_edge_corr, 8);
+		ind += 8;
 
 		commands_send_packet(send_buffer, ind);
 		break;
@@ -1254,6 +1329,66 @@ void commands_process_packet(unsigned char *data, unsigned int len) {
 		}
 		
 		break;
+
+	case COMM_FREQ_RESPONSE: {
+		ind = 0;
+		uint8_t target = data[ind++];
+		float amp = buffer_get_float32_auto(data, &ind);
+		float f_start = buffer_get_float32_auto(data, &ind);
+		float f_end = buffer_get_float32_auto(data, &ind);
+		float time = buffer_get_float32_auto(data, &ind);
+		utils_truncate_number(&time, 0.0, MCPWM_FOC_FREQ_RESP_TIME_MAX);
+
+		float freq[MCPWM_FOC_FREQ_RESP_POINTS];
+		float gain[MCPWM_FOC_FREQ_RESP_POINTS];
+		float phase[MCPWM_FOC_FREQ_RESP_POINTS];
+		float bandwidth = 0.0;
+		bool res = false;
+
+		if (mc_interface_get_configuration()->motor_type == MOTOR_TYPE_FOC &&
+				target <= FREQ_RESP_TARGET_SPEED) {
+			res = mcpwm_foc_measure_freq_resp((freq_resp_target)target, amp, f_start, f_end, time,
+					MCPWM_FOC_FREQ_RESP_POINTS, freq, gain, phase, &bandwidth);
+		}
+
+		ind = 0;
+		send_buffer[ind++] = COMM_FREQ_RESPONSE;
+		send_buffer[ind++] = res;
+		if (res) {
+			buffer_append_float32_auto(send_buffer, bandwidth, &ind);
+			send_buffer[ind++] = MCPWM_FOC_FREQ_RESP_POINTS;
+			for (int i = 0;i < MCPWM_FOC_FREQ_RESP_POINTS;i++) {
+				buffer_append_float32_auto(send_buffer, freq[i], &ind);
+				buffer_append_float32_auto(send_buffer, gain[i], &ind);
+				buffer_append_float32_auto(send_buffer, phase[i], &ind);
+			}
+		}
+		commands_send_packet(send_buffer, ind);
+	} break;
+
+	case COMM_CALC_FOC_GAINS: {
+		ind = 0;
+		float bandwidth = buffer_get_float32_auto(data, &ind);
+		bool store = data[ind++];
+
+		mcconf = *mc_interface_get_configuration();
+		bool res = conf_general_calc_foc_gains(&mcconf, bandwidth);
+
+		if (res && store) {
+			conf_general_store_mc_configuration(&mcconf);
+			mc_interface_set_configuration(&mcconf);
+		}
+
+		ind = 0;
+		send_buffer[ind++] = COMM_CALC_FOC_GAINS;
+		send_buffer[ind++] = res;
+		buffer_append_float32_auto(send_buffer, mcconf.foc_current_kp, &ind);
+		buffer_append_float32_auto(send_buffer, mcconf.foc_current_ki, &ind);
+		buffer_append_float32_auto(send_buffer, mcconf.foc_observer_gain, &ind);
+		commands_send_packet(send_buffer, ind);
+	}
+	break;
+
 	default:
 		break;
 	}
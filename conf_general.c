@@ -267,6 +267,7 @@ void conf_general_get_default_mc_configuration(mc_configuration *conf) {
 	conf->foc_hall_table[5] = MCCONF_FOC_HALL_TAB_5;
 	conf->foc_hall_table[6] = MCCONF_FOC_HALL_TAB_6;
 	conf->foc_hall_table[7] = MCCONF_FOC_HALL_TAB_7;
+	memset(conf->foc_hall_edge_corr, 0, sizeof(conf->foc_hall_edge_corr));
 	conf->foc_sl_erpm = MCCONF_FOC_SL_ERPM;
 	conf->foc_sample_v0_v7 = MCCONF_FOC_SAMPLE_V0_V7;
 	conf->foc_sample_high_current = MCCONF_FOC_SAMPLE_HIGH_CURRENT;
@@ -274,6 +275,25 @@ void conf_general_get_default_mc_configuration(mc_configuration *conf) {
 	conf->foc_temp_comp = MCCONF_FOC_TEMP_COMP;
 	conf->foc_temp_comp_base_temp = MCCONF_FOC_TEMP_COMP_BASE_TEMP;
 	conf->foc_current_filter_const = MCCONF_FOC_CURRENT_FILTER_CONST;
+	conf->foc_observer_type = MCCONF_FOC_OBSERVER_TYPE;
+	conf->foc_fw_current_max = MCCONF_FOC_FW_CURRENT_MAX;
+	conf->foc_fw_duty_start = MCCONF_FOC_FW_DUTY_START;
+	conf->foc_fw_ramp_time = MCCONF_FOC_FW_RAMP_TIME;
+	conf->foc_motor_ld = MCCONF_FOC_MOTOR_LD;
+	conf->foc_motor_lq = MCCONF_FOC_MOTOR_LQ;
+	conf->foc_mtpa_enable = MCCONF_FOC_MTPA_ENABLE;
+	conf->foc_cc_decoupling = MCCONF_FOC_CC_DECOUPLING;
+	conf->foc_modulation_mode = MCCONF_FOC_MODULATION_MODE;
+	conf->foc_dt_comp_band = MCCONF_FOC_DT_COMP_BAND;
+	conf->foc_hfi_voltage = MCCONF_FOC_HFI_VOLTAGE;
+	conf->foc_hfi_erpm = MCCONF_FOC_HFI_ERPM;
+	conf->foc_rls_enable = MCCONF_FOC_RLS_ENABLE;
+	conf->foc_encoder_comp_enable = MCCONF_FOC_ENCODER_COMP_ENABLE;
+	conf->foc_cogging_comp_enable = MCCONF_FOC_COGGING_COMP_ENABLE;
+	conf->foc_encoder_comp_scale = 0.0;
+	conf->foc_cogging_comp_scale = 0.0;
+	memset(conf->foc_encoder_comp_table, 0, sizeof(conf->foc_encoder_comp_table));
+	memset(conf->foc_cogging_comp_table, 0, sizeof(conf->foc_cogging_comp_table));
 
 	conf->s_pid_kp = MCCONF_S_PID_KP;
 	conf->s_pid_ki = MCCONF_S_PID_KI;
@@ -281,12 +301,22 @@ void conf_general_get_default_mc_configuration(mc_configuration *conf) {
 	conf->s_pid_kd_filter = MCCONF_S_PID_KD_FILTER;
 	conf->s_pid_min_erpm = MCCONF_S_PID_MIN_RPM;
 	conf->s_pid_allow_braking = MCCONF_S_PID_ALLOW_BRAKING;
+	conf->s_pid_ff_acc = MCCONF_S_PID_FF_ACC;
+	conf->s_pid_sched_points = MCCONF_S_PID_SCHED_POINTS;
+	for (int i = 0;i < S_PID_SCHED_LEN;i++) {
+		conf->s_pid_sched_erpm[i] = 0.0;
+		conf->s_pid_sched_kp[i] = 1.0;
+		conf->s_pid_sched_ki[i] = 1.0;
+		conf->s_pid_sched_kd[i] = 1.0;
+	}
 
 	conf->p_pid_kp = MCCONF_P_PID_KP;
 	conf->p_pid_ki = MCCONF_P_PID_KI;
 	conf->p_pid_kd = MCCONF_P_PID_KD;
 	conf->p_pid_kd_filter = MCCONF_P_PID_KD_FILTER;
 	conf->p_pid_ang_div = MCCONF_P_PID_ANG_DIV;
+	conf->p_pid_ff_vel = MCCONF_P_PID_FF_VEL;
+	conf->p_pid_ff_acc = MCCONF_P_PID_FF_ACC;
 
 	conf->cc_startup_boost_duty = MCCONF_CC_STARTUP_BOOST_DUTY;
 	conf->cc_min_current = MCCONF_CC_MIN_CURRENT;
@@ -798,3 +828,46 @@ bool conf_general_measure_flux_linkage(float current, float duty,
 
 	return true;
 }
+
+/**
+ * Calculate the current controller and observer gains from the motor
+ * resistance, inductance and flux linkage. The current controller is tuned
+ * so that its zero cancels the electrical pole of the motor, which gives a
+ * first order response with the requested bandwidth.
+ *
+ * @param conf
+ * The configuration to update. foc_motor_r, foc_motor_l,
+ * foc_motor_flux_linkage and foc_f_sw must be set. foc_current_kp,
+ * foc_current_ki and foc_observer_gain are updated if the calculation
+ * succeeds.
+ *
+ * @param bandwidth
+ * The current controller bandwidth in rad/s.
+ *
+ * @return
+ * True for success, false if the motor parameters are invalid or if the
+ * bandwidth is too high for the control loop rate.
+ */
+bool conf_general_calc_foc_gains(mc_configuration *conf, float bandwidth) {
+	if (conf->foc_motor_r <= 0.0 || conf->foc_motor_l <= 0.0 ||
+			conf->foc_motor_flux_linkage <= 0.0 || bandwidth <= 0.0) {
+		return false;
+	}
+
+	float f_ctrl = conf->foc_f_sw / 2.0;
+#ifdef HW_HAS_PHASE_SHUNTS
+	if (conf->foc_sample_v0_v7) {
+		f_ctrl = conf->foc_f_sw;
+	}
+#endif
+
+	if (bandwidth > (2.0 * M_PI * f_ctrl / CONF_FOC_GAINS_BW_RATIO_MIN)) {
+		return false;
+	}
+
+	conf->foc_current_kp = conf->foc_motor_l * bandwidth;
+	conf->foc_current_ki = conf->foc_motor_r * bandwidth;
+	conf->foc_observer_gain = 1000.0 / SQ(conf->foc_motor_flux_linkage);
+
+	return true;
+}
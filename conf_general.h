@@ -23,7 +23,7 @@
 
 // Firmware version
 #define FW_VERSION_MAJOR		3
-#define FW_VERSION_MINOR		102
+#define FW_VERSION_MINOR		103
 
 #include "datatypes.h"
 
@@ -142,6 +142,19 @@
 #define AS5047_USE_HW_SPI_PINS		0
 #endif
 
+/*
+ * Sine, cosine and atan2 implementation used by the FOC control loop.
+ * 0: Polynomial approximations (utils_fast_sincos_better and utils_fast_atan2)
+ * 1: Lookup tables with linear interpolation (foc_lut_sincos and foc_lut_atan2)
+ */
+#ifndef FOC_TRIG_USE_LUT
+#define FOC_TRIG_USE_LUT			0
+#endif
+
+// The current controller bandwidth has to be at least this many times lower
+// than the control loop rate for the automatically calculated gains.
+#define CONF_FOC_GAINS_BW_RATIO_MIN	10.0
+
 /*
  * MCU
  */
@@ -164,5 +177,6 @@ bool conf_general_detect_motor_param(float current, float min_rpm, float low_dut
 		float *int_limit, float *bemf_coupling_k, int8_t *hall_table, int *hall_res);
 bool conf_general_measure_flux_linkage(float current, float duty,
 		float min_erpm, float res, float *linkage);
+bool conf_general_calc_foc_gains(mc_configuration *conf, float bandwidth);
 
 #endif /* CONF_GENERAL_H_ */
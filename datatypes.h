@@ -28,6 +28,10 @@
 #include <stdbool.h>
 #include "ch.h"
 
+// Settings
+#define FOC_COMP_TABLE_LEN		128 // Entries in the encoder and cogging compensation tables
+#define S_PID_SCHED_LEN			4 // Maximum number of speed PID gain scheduling breakpoints
+
 // Data types
 typedef enum {
    MC_STATE_OFF = 0,
@@ -63,9 +67,30 @@ typedef enum {
 typedef enum {
 	FOC_SENSOR_MODE_SENSORLESS = 0,
 	FOC_SENSOR_MODE_ENCODER,
-	FOC_SENSOR_MODE_HALL
+	FOC_SENSOR_MODE_HALL,
+	FOC_SENSOR_MODE_HFI
 } mc_foc_sensor_mode;
 
+typedef enum {
+	FOC_OBSERVER_TYPE_FLUX = 0,
+	FOC_OBSERVER_TYPE_SMO,
+	FOC_OBSERVER_TYPE_MRAS
+} mc_foc_observer_type;
+
+typedef enum {
+	FOC_CC_DECOUPLING_DISABLED = 0,
+	FOC_CC_DECOUPLING_CROSS,
+	FOC_CC_DECOUPLING_BEMF,
+	FOC_CC_DECOUPLING_CROSS_BEMF
+} mc_foc_cc_decoupling_mode;
+
+typedef enum {
+	FOC_MODULATION_SVPWM = 0,
+	FOC_MODULATION_DPWMMIN,
+	FOC_MODULATION_DPWMMAX,
+	FOC_MODULATION_DPWM1
+} mc_foc_modulation_mode;
+
 typedef enum {
 	MOTOR_TYPE_BLDC = 0,
 	MOTOR_TYPE_DC,
@@ -82,6 +107,22 @@ typedef enum {
 	FAULT_CODE_OVER_TEMP_MOTOR
 } mc_fault_code;
 
+// Sources of the override limits, reported as a bitmask of (1 << source)
+typedef enum {
+	LIMIT_SOURCE_TEMP_FET = 0,
+	LIMIT_SOURCE_TEMP_MOTOR,
+	LIMIT_SOURCE_TEMP_FET_ACCEL,
+	LIMIT_SOURCE_TEMP_MOTOR_ACCEL,
+	LIMIT_SOURCE_RPM_MAX,
+	LIMIT_SOURCE_RPM_MIN,
+	LIMIT_SOURCE_BATT_CUT,
+	LIMIT_SOURCE_VIN_MAX,
+	LIMIT_SOURCE_WATT_MAX,
+	LIMIT_SOURCE_WATT_MIN,
+	LIMIT_SOURCE_IN_CURRENT,
+	LIMIT_SOURCE_NUM
+} mc_limit_source;
+
 typedef enum {
 	CONTROL_MODE_DUTY = 0,
 	CONTROL_MODE_SPEED,
@@ -137,6 +178,12 @@ typedef enum {
 	DEBUG_SAMPLING_SEND_LAST_SAMPLES
 } debug_sampling_mode;
 
+typedef enum {
+	FREQ_RESP_TARGET_ID = 0,
+	FREQ_RESP_TARGET_IQ,
+	FREQ_RESP_TARGET_SPEED
+} freq_resp_target;
+
 typedef enum {
 	CAN_BAUD_125K = 0,
 	CAN_BAUD_250K,
@@ -217,6 +264,7 @@ typedef struct {
 	float foc_sl_d_current_factor;
 	mc_foc_sensor_mode foc_sensor_mode;
 	uint8_t foc_hall_table[8];
+	int8_t foc_hall_edge_corr[8]; // Learned transition angle corrections in 0.1 degree
 	float foc_sl_erpm;
 	bool foc_sample_v0_v7;
 	bool foc_sample_high_current;
@@ -224,6 +272,26 @@ typedef struct {
 	bool foc_temp_comp;
 	float foc_temp_comp_base_temp;
 	float foc_current_filter_const;
+	mc_foc_observer_type foc_observer_type;
+	float foc_fw_current_max;
+	float foc_fw_duty_start;
+	float foc_fw_ramp_time;
+	float foc_motor_ld;
+	float foc_motor_lq;
+	bool foc_mtpa_enable;
+	mc_foc_cc_decoupling_mode foc_cc_decoupling;
+	mc_foc_modulation_mode foc_modulation_mode;
+	float foc_dt_comp_band;
+	float foc_hfi_voltage;
+	float foc_hfi_erpm;
+	bool foc_rls_enable;
+	bool foc_encoder_comp_enable;
+	bool foc_cogging_comp_enable;
+	// Compensation tables, written by the calibration and not sent with the configuration
+	float foc_encoder_comp_scale;
+	float foc_cogging_comp_scale;
+	int8_t foc_encoder_comp_table[FOC_COMP_TABLE_LEN];
+	int8_t foc_cogging_comp_table[FOC_COMP_TABLE_LEN];
 	// Speed PID
 	float s_pid_kp;
 	float s_pid_ki;
@@ -231,12 +299,20 @@ typedef struct {
 	float s_pid_kd_filter;
 	float s_pid_min_erpm;
 	bool s_pid_allow_braking;
+	float s_pid_ff_acc;
+	int s_pid_sched_points;
+	float s_pid_sched_erpm[S_PID_SCHED_LEN];
+	float s_pid_sched_kp[S_PID_SCHED_LEN];
+	float s_pid_sched_ki[S_PID_SCHED_LEN];
+	float s_pid_sched_kd[S_PID_SCHED_LEN];
 	// Pos PID
 	float p_pid_kp;
 	float p_pid_ki;
 	float p_pid_kd;
 	float p_pid_kd_filter;
 	float p_pid_ang_div;
+	float p_pid_ff_vel;
+	float p_pid_ff_acc;
 	// Current controller
 	float cc_startup_boost_duty;
 	float cc_min_current;
@@ -524,7 +600,10 @@ typedef enum {
 	COMM_SET_SPEED_MODE,
 	COMM_GET_SPEED_MODE,
 	COMM_SET_CURRENT_CONF_AS_DEFAULT,
-	COMM_SET_MOTOR_TYPE
+	COMM_SET_MOTOR_TYPE,
+	COMM_CALC_FOC_GAINS,
+	COMM_SET_POS_MOVE,
+	COMM_FREQ_RESPONSE
 } COMM_PACKET_ID;
 
 // CAN commands
@@ -0,0 +1,271 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "derate.h"
+#include "utils.h"
+#include <math.h>
+
+// Private functions
+static void build_ramp(derate_curve_t *curve, float x0, float y0, float x1, float y1);
+static void limit_to(float *value, uint32_t *sources, float limit, mc_limit_source source);
+
+/**
+ * Build a piecewise linear curve. The output is held at the first and the
+ * last value outside of the breakpoints.
+ *
+ * @param curve
+ * The curve to build.
+ *
+ * @param x
+ * The breakpoint inputs. A breakpoint that is lower than the one before it is
+ * moved up to it, which makes a step at that input.
+ *
+ * @param y
+ * The outputs at the breakpoints.
+ *
+ * @param points
+ * The number of breakpoints, at most DERATE_POINTS_MAX.
+ */
+void derate_curve_build(derate_curve_t *curve, const float *x, const float *y, int points) {
+	utils_truncate_number_int(&points, 0, DERATE_POINTS_MAX);
+
+	for (int i = 0;i < points;i++) {
+		curve->x[i] = x[i];
+		curve->y[i] = y[i];
+
+		if (i > 0 && curve->x[i] < curve->x[i - 1]) {
+			curve->x[i] = curve->x[i - 1];
+		}
+	}
+
+	for (int i = 0;i < (points - 1);i++) {
+		const float dx = curve->x[i + 1] - curve->x[i];
+		curve->slope[i] = dx > 0.0 ? (curve->y[i + 1] - curve->y[i]) / dx : 0.0;
+	}
+
+	curve->points = points;
+	curve->seg = 0;
+	curve->in_last = 0.0;
+	curve->out_last = 0.0;
+	curve->valid = false;
+}
+
+/**
+ * Evaluate a piecewise linear curve. The result for the previous input is
+ * reused when the input did not change, and the segment search starts at the
+ * segment of the previous evaluation.
+ *
+ * @param curve
+ * The curve.
+ *
+ * @param in
+ * The input.
+ *
+ * @return
+ * The output.
+ */
+float derate_curve_eval(derate_curve_t *curve, float in) {
+	if (curve->valid && in == curve->in_last) {
+		return curve->out_last;
+	}
+
+	const int last = curve->points - 1;
+	float out = 0.0;
+
+	if (last < 1) {
+		out = last == 0 ? curve->y[0] : 0.0;
+	} else if (in < curve->x[0]) {
+		out = curve->y[0];
+		curve->seg = 0;
+	} else if (in >= curve->x[last]) {
+		out = curve->y[last];
+		curve->seg = last - 1;
+	} else {
+		int i = curve->seg;
+		while (i > 0 && in < curve->x[i]) {
+			i--;
+		}
+		while (i < (last - 1) && in >= curve->x[i + 1]) {
+			i++;
+		}
+
+		curve->seg = i;
+		out = curve->y[i] + (in - curve->x[i]) * curve->slope[i];
+	}
+
+	curve->in_last = in;
+	curve->out_last = out;
+	curve->valid = true;
+
+	return out;
+}
+
+/**
+ * Build the derating curves from a configuration. Has to be called every
+ * time the limits in the configuration change.
+ *
+ * @param d
+ * The derating state.
+ *
+ * @param conf
+ * The configuration.
+ */
+void derate_build(derate_t *d, volatile mc_configuration *conf) {
+	// Temperatures, as a fraction of the current limits
+	build_ramp(&d->temp_fet, conf->l_temp_fet_start, 1.0, conf->l_temp_fet_end, 0.0);
+	build_ramp(&d->temp_motor, conf->l_temp_motor_start, 1.0, conf->l_temp_motor_end, 0.0);
+
+	// Decreased temperatures during acceleration
+	// in order to still have braking torque available
+	const float dec = conf->l_temp_accel_dec;
+	build_ramp(&d->temp_fet_accel,
+			utils_map(dec, 0.0, 1.0, conf->l_temp_fet_start, DERATE_ACCEL_TEMP), conf->l_current_max,
+			utils_map(dec, 0.0, 1.0, conf->l_temp_fet_end, DERATE_ACCEL_TEMP), 0.0);
+	build_ramp(&d->temp_motor_accel,
+			utils_map(dec, 0.0, 1.0, conf->l_temp_motor_start, DERATE_ACCEL_TEMP), conf->l_current_max,
+			utils_map(dec, 0.0, 1.0, conf->l_temp_motor_end, DERATE_ACCEL_TEMP), 0.0);
+
+	// RPM
+	build_ramp(&d->rpm_max, conf->l_max_erpm * conf->l_erpm_start, conf->l_current_max,
+			conf->l_max_erpm, 0.0);
+	build_ramp(&d->rpm_min, conf->l_min_erpm, 0.0,
+			conf->l_min_erpm * conf->l_erpm_start, conf->l_current_max);
+
+	// Battery cutoff and maximum voltage
+	build_ramp(&d->batt_cut, conf->l_battery_cut_end, 0.0,
+			conf->l_battery_cut_start, conf->l_in_current_max);
+	build_ramp(&d->vin_max, conf->l_max_vin - 1.0, conf->l_in_current_min,
+			conf->l_max_vin, -0.001);
+
+	d->watt_v_in_last = 0.0;
+	d->watt_in_max = 0.0;
+	d->watt_in_min = 0.0;
+	d->watt_valid = false;
+	d->sources = 0;
+}
+
+/**
+ * Update the override limits of a configuration.
+ *
+ * @param d
+ * The derating state, built for this configuration.
+ *
+ * @param conf
+ * The configuration to update.
+ *
+ * @param temp_fet
+ * The filtered MOSFET temperature.
+ *
+ * @param temp_motor
+ * The filtered motor temperature.
+ *
+ * @param rpm
+ * The present speed in ERPM.
+ *
+ * @param v_in
+ * The input voltage.
+ *
+ * @param duty_abs
+ * The absolute duty cycle, used to convert the input current limit to a
+ * motor current limit.
+ */
+void derate_update(derate_t *d, volatile mc_configuration *conf, float temp_fet,
+		float temp_motor, float rpm, float v_in, float duty_abs) {
+	uint32_t src_max = 0;
+	uint32_t src_min = 0;
+	uint32_t src_in_max = 0;
+	uint32_t src_in_min = 0;
+	uint32_t src_now = 0;
+
+	// Motor current
+	const float fact_fet = derate_curve_eval(&d->temp_fet, temp_fet);
+	const float fact_motor = derate_curve_eval(&d->temp_motor, temp_motor);
+
+	float lo_max = conf->l_current_max;
+	limit_to(&lo_max, &src_max, conf->l_current_max * fact_fet, LIMIT_SOURCE_TEMP_FET);
+	limit_to(&lo_max, &src_max, conf->l_current_max * fact_motor, LIMIT_SOURCE_TEMP_MOTOR);
+	limit_to(&lo_max, &src_max, derate_curve_eval(&d->rpm_max, rpm), LIMIT_SOURCE_RPM_MAX);
+	limit_to(&lo_max, &src_max, derate_curve_eval(&d->rpm_min, rpm), LIMIT_SOURCE_RPM_MIN);
+	limit_to(&lo_max, &src_max, derate_curve_eval(&d->temp_fet_accel, temp_fet),
+			LIMIT_SOURCE_TEMP_FET_ACCEL);
+	limit_to(&lo_max, &src_max, derate_curve_eval(&d->temp_motor_accel, temp_motor),
+			LIMIT_SOURCE_TEMP_MOTOR_ACCEL);
+
+	float lo_min = conf->l_current_min;
+	limit_to(&lo_min, &src_min, conf->l_current_min * fact_fet, LIMIT_SOURCE_TEMP_FET);
+	limit_to(&lo_min, &src_min, conf->l_current_min * fact_motor, LIMIT_SOURCE_TEMP_MOTOR);
+
+	if (lo_max < conf->cc_min_current) {
+		lo_max = conf->cc_min_current;
+	}
+
+	if (lo_min > -conf->cc_min_current) {
+		lo_min = -conf->cc_min_current;
+	}
+
+	conf->lo_current_max = lo_max;
+	conf->lo_current_min = lo_min;
+
+	// Input current
+	if (!d->watt_valid || v_in != d->watt_v_in_last) {
+		d->watt_in_max = conf->l_watt_max / v_in;
+		d->watt_in_min = conf->l_watt_min / v_in;
+		d->watt_v_in_last = v_in;
+		d->watt_valid = true;
+	}
+
+	float lo_in_max = conf->l_in_current_max;
+	limit_to(&lo_in_max, &src_in_max, d->watt_in_max, LIMIT_SOURCE_WATT_MAX);
+	limit_to(&lo_in_max, &src_in_max, derate_curve_eval(&d->batt_cut, v_in), LIMIT_SOURCE_BATT_CUT);
+
+	float lo_in_min = conf->l_in_current_min;
+	limit_to(&lo_in_min, &src_in_min, d->watt_in_min, LIMIT_SOURCE_WATT_MIN);
+	limit_to(&lo_in_min, &src_in_min, derate_curve_eval(&d->vin_max, v_in), LIMIT_SOURCE_VIN_MAX);
+
+	conf->lo_in_current_max = lo_in_max;
+	conf->lo_in_current_min = lo_in_min;
+
+	// Maximum current right now
+	float lo_now = lo_max;
+	if (duty_abs > 0.001) {
+		limit_to(&lo_now, &src_now, lo_in_max / duty_abs, LIMIT_SOURCE_IN_CURRENT);
+	}
+
+	conf->lo_current_motor_max_now = lo_now;
+	conf->lo_current_motor_min_now = lo_min;
+
+	d->sources = src_max | src_min | src_in_max | src_in_min | src_now;
+}
+
+static void build_ramp(derate_curve_t *curve, float x0, float y0, float x1, float y1) {
+	const float x[2] = {x0, x1};
+	const float y[2] = {y0, y1};
+	derate_curve_build(curve, x, y, 2);
+}
+
+/*
+ * Replace value with limit if limit has a lower magnitude, and make source
+ * the only limiting source in that case.
+ */
+static void limit_to(float *value, uint32_t *sources, float limit, mc_limit_source source) {
+	if (fabsf(limit) < fabsf(*value)) {
+		*value = limit;
+		*sources = 1 << source;
+	}
+}
@@ -0,0 +1,74 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef DERATE_H_
+#define DERATE_H_
+
+#include "datatypes.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Derating of the current limits based on temperature, speed and input
+ * voltage. Every limit is a piecewise linear curve whose breakpoints and
+ * slopes are computed from the configuration once, so that the 1 kHz update
+ * does not have to divide. A curve is only evaluated again when its input
+ * changes.
+ */
+
+// Settings
+#define DERATE_POINTS_MAX			4
+#define DERATE_ACCEL_TEMP			25.0 // Temperature the accel limits move towards with l_temp_accel_dec
+
+// Types
+typedef struct {
+	float x[DERATE_POINTS_MAX];
+	float y[DERATE_POINTS_MAX];
+	float slope[DERATE_POINTS_MAX - 1];
+	int points;
+	int seg; // Segment of the previous evaluation, where the next search starts
+	float in_last;
+	float out_last;
+	bool valid;
+} derate_curve_t;
+
+typedef struct {
+	derate_curve_t temp_fet; // Fraction of the current limits
+	derate_curve_t temp_motor;
+	derate_curve_t temp_fet_accel; // Motor current
+	derate_curve_t temp_motor_accel;
+	derate_curve_t rpm_max;
+	derate_curve_t rpm_min;
+	derate_curve_t batt_cut; // Input current
+	derate_curve_t vin_max;
+	float watt_v_in_last;
+	float watt_in_max;
+	float watt_in_min;
+	bool watt_valid;
+	uint32_t sources; // Limiting sources of the last update, bitmask of mc_limit_source
+} derate_t;
+
+// Functions
+void derate_curve_build(derate_curve_t *curve, const float *x, const float *y, int points);
+float derate_curve_eval(derate_curve_t *curve, float in);
+void derate_build(derate_t *d, volatile mc_configuration *conf);
+void derate_update(derate_t *d, volatile mc_configuration *conf, float temp_fet,
+		float temp_motor, float rpm, float v_in, float duty_abs);
+
+#endif /* DERATE_H_ */
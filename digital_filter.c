@@ -20,6 +20,7 @@
 #include  "digital_filter.h"
 #include  <math.h>
 #include  <stdint.h>
+#include  <string.h>
 
 // Found at http://paulbourke.net/miscellaneous//dft/
 void filter_fft(int dir, int m, float *real, float *imag) {
@@ -232,3 +233,265 @@ void filter_add_sample(float *buffer, float sample, int bits, uint32_t *offset)
 	*offset += 1;
 	*offset &= cnt_mask;
 }
+
+/**
+ * Initialize a FIR filter. The history is stored twice in a buffer of twice
+ * the filter length, so that the samples from the oldest to the newest are
+ * always contiguous and the filter loop does not have to wrap the index.
+ *
+ * @param fir
+ * The filter to initialize.
+ *
+ * @param coeffs
+ * The filter coefficients, e.g. from filter_create_fir_lowpass. They are not
+ * copied and must stay valid. With FILTER_FIR_USE_CMSIS a reversed copy is
+ * made for filter_fir_process_block, so they must not change afterwards.
+ *
+ * @param buffer
+ * Buffer for the samples with room for FILTER_FIR_BUFFER_LEN(taps) values.
+ *
+ * @param taps
+ * The length of the filter.
+ */
+void filter_fir_init(filter_fir_t *fir, const float *coeffs, float *buffer, int taps) {
+	fir->coeffs = coeffs;
+	fir->history = buffer;
+	fir->taps = taps;
+	fir->index = 0;
+	memset(buffer, 0, sizeof(float) * 2 * taps);
+
+#if FILTER_FIR_USE_CMSIS
+	// arm_fir_f32 applies the first coefficient to the newest sample
+	float *coeffs_rev = buffer + 2 * taps;
+	for (int i = 0;i < taps;i++) {
+		coeffs_rev[i] = coeffs[taps - 1 - i];
+	}
+
+	arm_fir_init_f32(&fir->arm_fir, taps, coeffs_rev, buffer + 3 * taps, FILTER_FIR_BLOCK_MAX);
+#endif
+}
+
+/**
+ * Add a sample to a FIR filter without computing the output.
+ *
+ * @param fir
+ * The filter.
+ *
+ * @param sample
+ * The sample to add.
+ */
+void filter_fir_add_sample(filter_fir_t *fir, float sample) {
+	int index = fir->index;
+	fir->history[index] = sample;
+	fir->history[index + fir->taps] = sample;
+
+	index++;
+	if (index >= fir->taps) {
+		index = 0;
+	}
+	fir->index = index;
+}
+
+/**
+ * Compute the output of a FIR filter for the samples added so far.
+ *
+ * @param fir
+ * The filter.
+ *
+ * @return
+ * The filtered sample.
+ */
+float filter_fir_run(const filter_fir_t *fir) {
+	const float *x = fir->history + fir->index;
+	const float *c = fir->coeffs;
+	const int taps = fir->taps;
+	float result = 0.0;
+
+	for (int i = 0;i < taps;i++) {
+		result += c[i] * x[i];
+	}
+
+	return result;
+}
+
+/**
+ * Add a sample to a FIR filter and compute the output.
+ *
+ * @param fir
+ * The filter.
+ *
+ * @param sample
+ * The sample to add.
+ *
+ * @return
+ * The filtered sample.
+ */
+float filter_fir_process(filter_fir_t *fir, float sample) {
+	filter_fir_add_sample(fir, sample);
+	return filter_fir_run(fir);
+}
+
+/**
+ * Filter a block of samples. The result is the same as calling
+ * filter_fir_process for each sample.
+ *
+ * @param fir
+ * The filter.
+ *
+ * @param in
+ * The input samples.
+ *
+ * @param out
+ * The filtered samples. Can be the same buffer as in.
+ *
+ * @param len
+ * The number of samples. Longer blocks are processed in chunks of
+ * FILTER_FIR_BLOCK_MAX samples.
+ */
+void filter_fir_process_block(filter_fir_t *fir, const float *in, float *out, int len) {
+#if FILTER_FIR_USE_CMSIS
+	while (len > 0) {
+		const int block = len > FILTER_FIR_BLOCK_MAX ? FILTER_FIR_BLOCK_MAX : len;
+
+		// The state starts with the taps - 1 newest samples, which can have
+		// been added with filter_fir_add_sample since the last block.
+		memcpy(fir->arm_fir.pState, fir->history + fir->index + 1, sizeof(float) * (fir->taps - 1));
+
+		// Update the history before the output is written, in case out is the same buffer as in
+		for (int i = 0;i < block;i++) {
+			filter_fir_add_sample(fir, in[i]);
+		}
+
+		arm_fir_f32(&fir->arm_fir, (float*)in, out, block);
+
+		in += block;
+		out += block;
+		len -= block;
+	}
+#else
+	for (int i = 0;i < len;i++) {
+		out[i] = filter_fir_process(fir, in[i]);
+	}
+#endif
+}
+
+/**
+ * Design a second order low pass filter with the bilinear transform. The
+ * cutoff frequency is prewarped, so the response is -3 dB at f_cut for a Q of
+ * 0.7071 regardless of the sample rate.
+ *
+ * @param c
+ * The coefficients to update. The state of the filters using them is kept.
+ *
+ * @param f_cut
+ * The cutoff frequency in Hz. It is limited to just below f_s / 2.
+ *
+ * @param f_s
+ * The sample rate in Hz.
+ *
+ * @param q
+ * The quality factor, 0.7071 for a Butterworth response.
+ */
+void filter_biquad_lowpass(volatile filter_biquad_coeffs_t *c, float f_cut, float f_s, float q) {
+	if (f_cut > (0.49 * f_s)) {
+		f_cut = 0.49 * f_s;
+	}
+
+	const float k = tanf(M_PI * f_cut / f_s);
+	const float k2 = k * k;
+	const float norm = 1.0 / (1.0 + k / q + k2);
+
+	c->b0 = k2 * norm;
+	c->b1 = 2.0 * c->b0;
+	c->b2 = c->b0;
+	c->a1 = 2.0 * (k2 - 1.0) * norm;
+	c->a2 = (1.0 - k / q + k2) * norm;
+}
+
+/**
+ * Design a first order low pass filter. The pole is placed with the matched
+ * z-transform, which gives the same response as UTILS_LP_FAST with the
+ * filter constant 1 - exp(-2 * pi * f_cut / f_s).
+ *
+ * @param c
+ * The coefficients to update. The state of the filters using them is kept.
+ *
+ * @param f_cut
+ * The cutoff frequency in Hz.
+ *
+ * @param f_s
+ * The sample rate in Hz.
+ */
+void filter_biquad_lowpass_1st(volatile filter_biquad_coeffs_t *c, float f_cut, float f_s) {
+	const float k = 1.0 - expf(-2.0 * M_PI * f_cut / f_s);
+
+	c->b0 = k;
+	c->b1 = 0.0;
+	c->b2 = 0.0;
+	c->a1 = k - 1.0;
+	c->a2 = 0.0;
+}
+
+/**
+ * Get the cutoff frequency of a UTILS_LP_FAST filter constant.
+ *
+ * @param filter_const
+ * The filter constant, between 0 and 1.
+ *
+ * @param f_s
+ * The rate the filter constant was used at in Hz.
+ *
+ * @return
+ * The cutoff frequency in Hz.
+ */
+float filter_lp_const_to_freq(float filter_const, float f_s) {
+	if (filter_const >= 1.0) {
+		return f_s;
+	}
+
+	if (filter_const <= 0.0) {
+		return 0.0;
+	}
+
+	return -logf(1.0 - filter_const) * f_s / (2.0 * M_PI);
+}
+
+/**
+ * Set the state of a biquad filter as if the input had been constant at
+ * value for a long time.
+ *
+ * @param c
+ * The coefficients of the filter.
+ *
+ * @param st
+ * The state to set.
+ *
+ * @param value
+ * The input and output value.
+ */
+void filter_biquad_reset(const volatile filter_biquad_coeffs_t *c, volatile filter_biquad_state_t *st, float value) {
+	st->z2 = (c->b2 - c->a2) * value;
+	st->z1 = (c->b1 - c->a1) * value + st->z2;
+}
+
+/**
+ * Run one sample through a biquad filter in transposed direct form II.
+ *
+ * @param c
+ * The coefficients of the filter.
+ *
+ * @param st
+ * The state of the filter.
+ *
+ * @param x
+ * The input sample.
+ *
+ * @return
+ * The filtered sample.
+ */
+float filter_biquad_run(const volatile filter_biquad_coeffs_t *c, volatile filter_biquad_state_t *st, float x) {
+	const float y = c->b0 * x + st->z1;
+	st->z1 = c->b1 * x - c->a1 * y + st->z2;
+	st->z2 = c->b2 * x - c->a2 * y;
+	return y;
+}
@@ -22,6 +22,58 @@
 
 #include <stdint.h>
 
+/*
+ * Use arm_fir_f32 from the CMSIS DSP library for filter_fir_process_block.
+ * The library is not part of the build by default, so it has to be added to
+ * the linker flags (e.g. ULIBS += -larm_cortexM4lf_math) together with
+ * -DARM_MATH_CM4 when this is enabled.
+ */
+#ifndef FILTER_FIR_USE_CMSIS
+#define FILTER_FIR_USE_CMSIS		0
+#endif
+
+#define FILTER_FIR_BLOCK_MAX		32 // Maximum block length for filter_fir_process_block
+
+#if FILTER_FIR_USE_CMSIS
+#include "arm_math.h"
+
+// History, reversed coefficients and arm_fir_f32 state
+#define FILTER_FIR_BUFFER_LEN(taps)	(2 * (taps) + (taps) + (taps) + FILTER_FIR_BLOCK_MAX - 1)
+#else
+// History only
+#define FILTER_FIR_BUFFER_LEN(taps)	(2 * (taps))
+#endif
+
+// Types
+typedef struct {
+	const float *coeffs; // taps coefficients, the first one is applied to the oldest sample
+	float *history; // 2 * taps samples, every sample is stored twice
+	int taps;
+	int index; // Position of the oldest sample
+#if FILTER_FIR_USE_CMSIS
+	arm_fir_instance_f32 arm_fir; // With the reversed coefficients and the state in the buffer
+#endif
+} filter_fir_t;
+
+/*
+ * Biquad (second order IIR) filter, split into coefficients and state so that
+ * several signals can share the coefficients. The coefficients are designed
+ * from a cutoff frequency and the sample rate, so they have to be updated
+ * when the rate changes.
+ */
+typedef struct {
+	float b0;
+	float b1;
+	float b2;
+	float a1;
+	float a2;
+} filter_biquad_coeffs_t;
+
+typedef struct {
+	float z1;
+	float z2;
+} filter_biquad_state_t;
+
 // Functions
 void filter_fft(int dir, int m, float *real, float *imag);
 void filter_dft(int dir, int len, float *real, float *imag);
@@ -31,5 +83,15 @@ void filter_zeroPad(float *data, float *result, int dataLen, int resultLen);
 void filter_create_fir_lowpass(float *filter_vector, float f_break, int bits, int use_hamming);
 float filter_run_fir_iteration(float *vector, float *filter, int bits, uint32_t offset);
 void filter_add_sample(float *buffer, float sample, int bits, uint32_t *offset);
+void filter_fir_init(filter_fir_t *fir, const float *coeffs, float *buffer, int taps);
+void filter_fir_add_sample(filter_fir_t *fir, float sample);
+float filter_fir_run(const filter_fir_t *fir);
+float filter_fir_process(filter_fir_t *fir, float sample);
+void filter_fir_process_block(filter_fir_t *fir, const float *in, float *out, int len);
+void filter_biquad_lowpass(volatile filter_biquad_coeffs_t *c, float f_cut, float f_s, float q);
+void filter_biquad_lowpass_1st(volatile filter_biquad_coeffs_t *c, float f_cut, float f_s);
+float filter_lp_const_to_freq(float filter_const, float f_s);
+void filter_biquad_reset(const volatile filter_biquad_coeffs_t *c, volatile filter_biquad_state_t *st, float value);
+float filter_biquad_run(const volatile filter_biquad_coeffs_t *c, volatile filter_biquad_state_t *st, float x);
 
 #endif /* DIGITAL_FILTER_H_ */
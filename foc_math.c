@@ -0,0 +1,1648 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "foc_math.h"
+#include "utils.h"
+#include <math.h>
+
+// Lookup table sizes. The sine table has to be a power of two.
+#define LUT_SIN_SIZE		256
+#define LUT_SIN_MASK		(LUT_SIN_SIZE - 1)
+#define LUT_ATAN_SIZE		128
+
+// One full period of the sine function
+static const float lut_sin[LUT_SIN_SIZE] = {
+	0.000000000, 0.024541229, 0.049067674, 0.073564564, 0.098017140, 0.122410675,
+	0.146730474, 0.170961889, 0.195090322, 0.219101240, 0.242980180, 0.266712757,
+	0.290284677, 0.313681740, 0.336889853, 0.359895037, 0.382683432, 0.405241314,
+	0.427555093, 0.449611330, 0.471396737, 0.492898192, 0.514102744, 0.534997620,
+	0.555570233, 0.575808191, 0.595699304, 0.615231591, 0.634393284, 0.653172843,
+	0.671558955, 0.689540545, 0.707106781, 0.724247083, 0.740951125, 0.757208847,
+	0.773010453, 0.788346428, 0.803207531, 0.817584813, 0.831469612, 0.844853565,
+	0.857728610, 0.870086991, 0.881921264, 0.893224301, 0.903989293, 0.914209756,
+	0.923879533, 0.932992799, 0.941544065, 0.949528181, 0.956940336, 0.963776066,
+	0.970031253, 0.975702130, 0.980785280, 0.985277642, 0.989176510, 0.992479535,
+	0.995184727, 0.997290457, 0.998795456, 0.999698819, 1.000000000, 0.999698819,
+	0.998795456, 0.997290457, 0.995184727, 0.992479535, 0.989176510, 0.985277642,
+	0.980785280, 0.975702130, 0.970031253, 0.963776066, 0.956940336, 0.949528181,
+	0.941544065, 0.932992799, 0.923879533, 0.914209756, 0.903989293, 0.893224301,
+	0.881921264, 0.870086991, 0.857728610, 0.844853565, 0.831469612, 0.817584813,
+	0.803207531, 0.788346428, 0.773010453, 0.757208847, 0.740951125, 0.724247083,
+	0.707106781, 0.689540545, 0.671558955, 0.653172843, 0.634393284, 0.615231591,
+	0.595699304, 0.575808191, 0.555570233, 0.534997620, 0.514102744, 0.492898192,
+	0.471396737, 0.449611330, 0.427555093, 0.405241314, 0.382683432, 0.359895037,
+	0.336889853, 0.313681740, 0.290284677, 0.266712757, 0.242980180, 0.219101240,
+	0.195090322, 0.170961889, 0.146730474, 0.122410675, 0.098017140, 0.073564564,
+	0.049067674, 0.024541229, 0.000000000, -0.024541229, -0.049067674, -0.073564564,
+	-0.098017140, -0.122410675, -0.146730474, -0.170961889, -0.195090322, -0.219101240,
+	-0.242980180, -0.266712757, -0.290284677, -0.313681740, -0.336889853, -0.359895037,
+	-0.382683432, -0.405241314, -0.427555093, -0.449611330, -0.471396737, -0.492898192,
+	-0.514102744, -0.534997620, -0.555570233, -0.575808191, -0.595699304, -0.615231591,
+	-0.634393284, -0.653172843, -0.671558955, -0.689540545, -0.707106781, -0.724247083,
+	-0.740951125, -0.757208847, -0.773010453, -0.788346428, -0.803207531, -0.817584813,
+	-0.831469612, -0.844853565, -0.857728610, -0.870086991, -0.881921264, -0.893224301,
+	-0.903989293, -0.914209756, -0.923879533, -0.932992799, -0.941544065, -0.949528181,
+	-0.956940336, -0.963776066, -0.970031253, -0.975702130, -0.980785280, -0.985277642,
+	-0.989176510, -0.992479535, -0.995184727, -0.997290457, -0.998795456, -0.999698819,
+	-1.000000000, -0.999698819, -0.998795456, -0.997290457, -0.995184727, -0.992479535,
+	-0.989176510, -0.985277642, -0.980785280, -0.975702130, -0.970031253, -0.963776066,
+	-0.956940336, -0.949528181, -0.941544065, -0.932992799, -0.923879533, -0.914209756,
+	-0.903989293, -0.893224301, -0.881921264, -0.870086991, -0.857728610, -0.844853565,
+	-0.831469612, -0.817584813, -0.803207531, -0.788346428, -0.773010453, -0.757208847,
+	-0.740951125, -0.724247083, -0.707106781, -0.689540545, -0.671558955, -0.653172843,
+	-0.634393284, -0.615231591, -0.595699304, -0.575808191, -0.555570233, -0.534997620,
+	-0.514102744, -0.492898192, -0.471396737, -0.449611330, -0.427555093, -0.405241314,
+	-0.382683432, -0.359895037, -0.336889853, -0.313681740, -0.290284677, -0.266712757,
+	-0.242980180, -0.219101240, -0.195090322, -0.170961889, -0.146730474, -0.122410675,
+	-0.098017140, -0.073564564, -0.049067674, -0.024541229
+};
+
+// atan(x) for x in [0, 1], including both end points
+static const float lut_atan[LUT_ATAN_SIZE + 1] = {
+	0.000000000, 0.007812341, 0.015623729, 0.023433210, 0.031239833, 0.039042650,
+	0.046840713, 0.054633079, 0.062418810, 0.070196971, 0.077966634, 0.085726876,
+	0.093476781, 0.101215442, 0.108941957, 0.116655435, 0.124354995, 0.132039762,
+	0.139708874, 0.147361481, 0.154996742, 0.162613829, 0.170211925, 0.177790229,
+	0.185347950, 0.192884312, 0.200398554, 0.207889927, 0.215357700, 0.222801154,
+	0.230219587, 0.237612314, 0.244978663, 0.252317981, 0.259629629, 0.266912988,
+	0.274167451, 0.281392433, 0.288587362, 0.295751686, 0.302884868, 0.309986391,
+	0.317055753, 0.324092470, 0.331096077, 0.338066123, 0.345002177, 0.351903825,
+	0.358770670, 0.365602332, 0.372398447, 0.379158669, 0.385882669, 0.392570135,
+	0.399220770, 0.405834293, 0.412410442, 0.418948967, 0.425449637, 0.431912235,
+	0.438336560, 0.444722424, 0.451069656, 0.457378099, 0.463647609, 0.469878058,
+	0.476069330, 0.482221324, 0.488333951, 0.494407135, 0.500440813, 0.506434934,
+	0.512389460, 0.518304364, 0.524179629, 0.530015251, 0.535811238, 0.541567605,
+	0.547284381, 0.552961602, 0.558599315, 0.564197577, 0.569756453, 0.575276018,
+	0.580756354, 0.586197551, 0.591599710, 0.596962937, 0.602287346, 0.607573058,
+	0.612820202, 0.618028912, 0.623199330, 0.628331602, 0.633425883, 0.638482330,
+	0.643501109, 0.648482388, 0.653426341, 0.658333148, 0.663202993, 0.668036062,
+	0.672832548, 0.677592646, 0.682316555, 0.687004478, 0.691656622, 0.696273194,
+	0.700854408, 0.705400477, 0.709911618, 0.714388052, 0.718830000, 0.723237685,
+	0.727611333, 0.731951171, 0.736257429, 0.740530337, 0.744770126, 0.748977029,
+	0.753151281, 0.757293116, 0.761402770, 0.765480479, 0.769526480, 0.773541012,
+	0.777524310, 0.781476615, 0.785398163
+};
+
+/**
+ * Update the terms of the control loop that only depend on the configuration
+ * and on the motor temperature.
+ *
+ * @param params
+ * The parameters to update.
+ *
+ * @param conf
+ * The motor configuration.
+ *
+ * @param temp_motor
+ * The filtered motor temperature.
+ *
+ * @param sample_v0_v7
+ * True if the control loop runs in both V0 and V7, which doubles its rate.
+ */
+void foc_derived_params_update(volatile foc_derived_params_t *params,
+		volatile mc_configuration *conf, float temp_motor, bool sample_v0_v7) {
+	// Temperature compensation
+	float temp_comp = 1.0;
+	if (conf->foc_temp_comp && temp_motor > -5.0) {
+		temp_comp += 0.00386 * (temp_motor - conf->foc_temp_comp_base_temp);
+	}
+
+	if (sample_v0_v7) {
+		params->dt = 1.0 / conf->foc_f_sw;
+	} else {
+		params->dt = 1.0 / (conf->foc_f_sw / 2.0);
+	}
+
+	params->l_obs = 1.5 * conf->foc_motor_l;
+	params->r_obs = 1.5 * conf->foc_motor_r * temp_comp;
+	params->lambda = conf->foc_motor_flux_linkage;
+	params->lambda_2 = SQ(conf->foc_motor_flux_linkage);
+	params->sat_comp_fact = conf->foc_sat_comp / conf->l_current_max;
+	params->current_ki = conf->foc_current_ki * temp_comp;
+	params->mod_comp_fact = conf->foc_dt_us * 1e-6 * conf->foc_f_sw;
+	params->dt_comp_band_inv = conf->foc_dt_comp_band > 0.0 ? 1.0 / conf->foc_dt_comp_band : 0.0;
+
+	if (conf->foc_fw_ramp_time > params->dt) {
+		params->fw_ramp_step = conf->foc_fw_current_max * params->dt / conf->foc_fw_ramp_time;
+	} else {
+		params->fw_ramp_step = conf->foc_fw_current_max;
+	}
+
+	// The ratio between the q and d axis response to the injection is about
+	// 2 * err * (Lq - Ld) / (2 * Lq) for small angle errors.
+	if (conf->foc_motor_lq > (conf->foc_motor_ld * 1.01)) {
+		params->hfi_err_gain = 1.0 / (1.0 - conf->foc_motor_ld / conf->foc_motor_lq);
+	} else {
+		params->hfi_err_gain = 0.0;
+	}
+	params->hfi_resp_min = 0.25 * conf->foc_hfi_voltage * params->dt / (1.5 * conf->foc_motor_ld);
+}
+
+/**
+ * Design the signal filters of the control loop for its present rate, so
+ * that their bandwidth does not change with foc_f_sw. Only has to be called
+ * when the rate or foc_current_filter_const changes, and after
+ * foc_derived_params_update has updated dt.
+ *
+ * foc_current_filter_const is the filter constant at FOC_FILTER_REF_RATE.
+ *
+ * @param params
+ * The parameters with the filter coefficients to update.
+ *
+ * @param conf
+ * The motor configuration.
+ */
+void foc_filters_update(volatile foc_derived_params_t *params,
+		volatile mc_configuration *conf) {
+	const float f_s = 1.0 / params->dt;
+
+	filter_biquad_lowpass_1st(&params->filter_current,
+			filter_lp_const_to_freq(conf->foc_current_filter_const, FOC_FILTER_REF_RATE), f_s);
+	filter_biquad_lowpass_1st(&params->filter_v_bus, FOC_FILTER_V_BUS_FREQ, f_s);
+	filter_biquad_lowpass_1st(&params->filter_v_dq, FOC_FILTER_V_DQ_FREQ, f_s);
+	filter_biquad_lowpass_1st(&params->filter_duty, FOC_FILTER_DUTY_FREQ, f_s);
+}
+
+/**
+ * Calculate how many integration steps the observer needs for the current
+ * speed. The phase advance of each step is kept below
+ * FOC_OBSERVER_STEP_ANGLE_MAX, so that the observer only spends time on
+ * sub-steps when the motor rotates fast.
+ *
+ * @param speed
+ * The electrical speed in radians per second, e.g. from the PLL.
+ *
+ * @param dt
+ * The time step of the control loop in seconds.
+ *
+ * @return
+ * The number of steps to pass to foc_observer_update.
+ */
+int foc_observer_iterations(float speed, float dt) {
+	const float advance = fabsf(speed) * dt;
+	int iterations = (int)(advance * (1.0 / FOC_OBSERVER_STEP_ANGLE_MAX)) + 1;
+	utils_truncate_number_int(&iterations, 1, FOC_OBSERVER_ITERATIONS_MAX);
+	return iterations;
+}
+
+/*
+ * Dead time compensation shape for a phase current. The voltage error of the
+ * dead time follows the direction of the current, but it decreases when the
+ * current is small enough for the output capacitance to be charged during the
+ * dead time. Ramping through a band around zero instead of using the sign
+ * removes the step at the zero crossings.
+ */
+static inline float deadtime_comp_shape(float current, float band_inv) {
+	if (band_inv > 0.0) {
+		float res = current * band_inv;
+		utils_truncate_number(&res, -1.0, 1.0);
+		return res;
+	} else {
+		return SIGN(current);
+	}
+}
+
+/*
+ * Time derivative of the observer state.
+ */
+static inline void observer_derivative(float x1, float x2, float L_ia, float L_ib,
+		float m_R_ia_p_v_alpha, float m_R_ib_p_v_beta, float lambda_2,
+		float gamma_half, float *x1_dot, float *x2_dot) {
+	float err = lambda_2 - (SQ(x1 - L_ia) + SQ(x2 - L_ib));
+	float gamma_tmp = gamma_half;
+	if (utils_truncate_number_abs(&err, lambda_2 * 0.2)) {
+		gamma_tmp *= 10.0;
+	}
+	*x1_dot = m_R_ia_p_v_alpha + gamma_tmp * (x1 - L_ia) * err;
+	*x2_dot = m_R_ib_p_v_beta + gamma_tmp * (x2 - L_ib) * err;
+}
+
+/**
+ * Run the flux observer.
+ *
+ * See http://cas.ensmp.fr/~praly/Telechargement/Journaux/2010-IEEE_TPEL-Lee-Hong-Nam-Ortega-Praly-Astolfi.pdf
+ *
+ * @param iterations
+ * The number of integration steps, see foc_observer_iterations. One step
+ * uses the second order Runge-Kutta (Heun) method, more steps use the same
+ * number of forward Euler sub-steps.
+ */
+void foc_observer_update(float v_alpha, float v_beta, float i_alpha, float i_beta,
+		float dt, float gamma, int iterations, volatile motor_state_t *state_m,
+		volatile foc_derived_params_t *params, volatile float *x1, volatile float *x2,
+		volatile float *phase) {
+
+	const float L = params->l_obs;
+	float R = params->r_obs;
+
+	// Saturation compensation
+	const float sign = (state_m->iq * state_m->vq) < 0.0 ? -1.0 : 1.0;
+	R -= R * sign * params->sat_comp_fact * state_m->i_abs_filter;
+
+	const float L_ia = L * i_alpha;
+	const float L_ib = L * i_beta;
+	const float m_R_ia_p_v_alpha = -R * i_alpha + v_alpha;
+	const float m_R_ib_p_v_beta = -R * i_beta + v_beta;
+	const float lambda_2 = params->lambda_2;
+	const float gamma_half = gamma * 0.5;
+
+	// Original
+//	float err = lambda_2 - (SQ(*x1 - L_ia) + SQ(*x2 - L_ib));
+//	float x1_dot = -R_ia + v_alpha + gamma_half * (*x1 - L_ia) * err;
+//	float x2_dot = -R_ib + v_beta + gamma_half * (*x2 - L_ib) * err;
+//	*x1 += x1_dot * dt;
+//	*x2 += x2_dot * dt;
+
+	float x1_tmp = *x1;
+	float x2_tmp = *x2;
+	float x1_dot, x2_dot;
+
+	if (iterations <= 1) {
+		// Heun's method
+		observer_derivative(x1_tmp, x2_tmp, L_ia, L_ib, m_R_ia_p_v_alpha, m_R_ib_p_v_beta,
+				lambda_2, gamma_half, &x1_dot, &x2_dot);
+
+		float x1_dot_2, x2_dot_2;
+		observer_derivative(x1_tmp + x1_dot * dt, x2_tmp + x2_dot * dt, L_ia, L_ib,
+				m_R_ia_p_v_alpha, m_R_ib_p_v_beta, lambda_2, gamma_half,
+				&x1_dot_2, &x2_dot_2);
+
+		x1_tmp += (x1_dot + x1_dot_2) * (0.5 * dt);
+		x2_tmp += (x2_dot + x2_dot_2) * (0.5 * dt);
+	} else {
+		// Forward Euler with sub-steps
+		const float dt_iteration = dt / (float)iterations;
+		for (int i = 0;i < iterations;i++) {
+			observer_derivative(x1_tmp, x2_tmp, L_ia, L_ib, m_R_ia_p_v_alpha, m_R_ib_p_v_beta,
+					lambda_2, gamma_half, &x1_dot, &x2_dot);
+			x1_tmp += x1_dot * dt_iteration;
+			x2_tmp += x2_dot * dt_iteration;
+		}
+	}
+
+	UTILS_NAN_ZERO(x1_tmp);
+	UTILS_NAN_ZERO(x2_tmp);
+	*x1 = x1_tmp;
+	*x2 = x2_tmp;
+
+	*phase = FOC_ATAN2(x2_tmp - L_ib, x1_tmp - L_ia);
+}
+
+/**
+ * Run the PLL that tracks the rotor phase and estimates the electrical speed.
+ *
+ * @param phase
+ * The phase to track in radians.
+ *
+ * @param dt
+ * The time step in seconds.
+ *
+ * @param kp
+ * Proportional gain.
+ *
+ * @param ki
+ * Integral gain.
+ *
+ * @param phase_var
+ * The PLL phase, will be updated.
+ *
+ * @param speed_var
+ * The PLL speed in electrical radians per second, will be updated.
+ */
+void foc_pll_run(float phase, float dt, float kp, float ki,
+		volatile float *phase_var, volatile float *speed_var) {
+	UTILS_NAN_ZERO(*phase_var);
+	float delta_theta = phase - *phase_var;
+	utils_norm_angle_rad(&delta_theta);
+	UTILS_NAN_ZERO(*speed_var);
+	*phase_var += (*speed_var + kp * delta_theta) * dt;
+	utils_norm_angle_rad((float*)phase_var);
+	*speed_var += ki * delta_theta * dt;
+}
+
+/**
+ * Run the current control loop.
+ *
+ * @param state_m
+ * The motor state.
+ *
+ * Parameters that shall be set before calling this function:
+ * id_target
+ * iq_target
+ * max_duty
+ * phase
+ * i_alpha
+ * i_beta
+ * v_bus
+ * speed_rad_s (only used for decoupling)
+ *
+ * Parameters that will be updated in this function:
+ * i_bus
+ * i_abs
+ * i_abs_filter
+ * v_alpha
+ * v_beta
+ * mod_d
+ * mod_q
+ * id
+ * iq
+ * id_filter
+ * iq_filter
+ * vd
+ * vq
+ * vd_int
+ * vq_int
+ *
+ * @param conf
+ * The motor configuration.
+ *
+ * @param params
+ * The derived parameters, see foc_derived_params_update.
+ *
+ * @param dt
+ * The time step in seconds.
+ *
+ * @param mod_alpha
+ * The alpha component of the resulting modulation vector, to be passed to the SVM.
+ *
+ * @param mod_beta
+ * The beta component of the resulting modulation vector, to be passed to the SVM.
+ */
+void foc_control_current(volatile motor_state_t *state_m, volatile mc_configuration *conf,
+		volatile foc_derived_params_t *params, float dt, float *mod_alpha, float *mod_beta) {
+	float c,s;
+	FOC_SINCOS(state_m->phase, &s, &c);
+
+	float max_duty = fabsf(state_m->max_duty);
+	utils_truncate_number(&max_duty, 0.0, conf->l_max_duty);
+
+	state_m->id = c * state_m->i_alpha + s * state_m->i_beta;
+	state_m->iq = c * state_m->i_beta  - s * state_m->i_alpha;
+	state_m->id_filter = filter_biquad_run(&params->filter_current, &state_m->id_filter_state, state_m->id);
+	state_m->iq_filter = filter_biquad_run(&params->filter_current, &state_m->iq_filter_state, state_m->iq);
+
+	float Ierr_d = state_m->id_target - state_m->id;
+	float Ierr_q = state_m->iq_target - state_m->iq;
+
+	// Feedforward of the cross coupling and back-EMF terms, so that the
+	// integrators don't have to track them at high speed. The cross coupling
+	// uses the targets rather than the measured currents. With the delay of
+	// the measurement it would be a feedback path with a gain of speed * L,
+	// which becomes unstable at high speed.
+	float dec_vd = 0.0;
+	float dec_vq = 0.0;
+	float dec_bemf = 0.0;
+
+	switch (conf->foc_cc_decoupling) {
+	case FOC_CC_DECOUPLING_CROSS:
+		dec_vd = state_m->iq_target * state_m->speed_rad_s * params->l_obs;
+		dec_vq = state_m->id_target * state_m->speed_rad_s * params->l_obs;
+		break;
+
+	case FOC_CC_DECOUPLING_BEMF:
+		dec_bemf = state_m->speed_rad_s * params->lambda;
+		break;
+
+	case FOC_CC_DECOUPLING_CROSS_BEMF:
+		dec_vd = state_m->iq_target * state_m->speed_rad_s * params->l_obs;
+		dec_vq = state_m->id_target * state_m->speed_rad_s * params->l_obs;
+		dec_bemf = state_m->speed_rad_s * params->lambda;
+		break;
+
+	default:
+		break;
+	}
+
+	state_m->vd = state_m->vd_int + Ierr_d * conf->foc_current_kp - dec_vd;
+	state_m->vq = state_m->vq_int + Ierr_q * conf->foc_current_kp + dec_vq + dec_bemf;
+
+	const float ki_dt = params->current_ki * dt;
+	state_m->vd_int += Ierr_d * ki_dt;
+	state_m->vq_int += Ierr_q * ki_dt;
+
+	const float two_third_v_bus = (2.0 / 3.0) * state_m->v_bus;	
+	const float max_duty_v_bus = two_third_v_bus * max_duty * SQRT3_BY_2;
+
+	// Saturation
+	utils_saturate_vector_2d((float*)&state_m->vd, (float*)&state_m->vq, max_duty_v_bus);
+	
+	state_m->mod_d = state_m->vd / two_third_v_bus;
+	state_m->mod_q = state_m->vq / two_third_v_bus;
+
+	// Windup protection
+//	utils_saturate_vector_2d((float*)&state_m->vd_int, (float*)&state_m->vq_int, max_duty_v_bus);
+	utils_truncate_number_abs((float*)&state_m->vd_int, max_duty_v_bus);
+	utils_truncate_number_abs((float*)&state_m->vq_int, max_duty_v_bus);
+
+	// TODO: Have a look at this?
+	state_m->i_bus = state_m->mod_d * state_m->id + state_m->mod_q * state_m->iq;
+	state_m->i_abs = sqrtf(SQ(state_m->id) + SQ(state_m->iq));
+	state_m->i_abs_filter = sqrtf(SQ(state_m->id_filter) + SQ(state_m->iq_filter));
+
+	*mod_alpha = c * state_m->mod_d - s * state_m->mod_q;
+	*mod_beta  = c * state_m->mod_q + s * state_m->mod_d;
+
+	// Deadtime compensation
+	const float i_alpha_filter = c * state_m->id_target - s * state_m->iq_target;
+	const float i_beta_filter = c * state_m->iq_target + s * state_m->id_target;
+	const float ia_filter = i_alpha_filter;
+	const float ib_filter = -0.5 * i_alpha_filter + SQRT3_BY_2 * i_beta_filter;
+	const float ic_filter = -0.5 * i_alpha_filter - SQRT3_BY_2 * i_beta_filter;
+	const float band_inv = params->dt_comp_band_inv;
+	const float ia_sgn = deadtime_comp_shape(ia_filter, band_inv);
+	const float ib_sgn = deadtime_comp_shape(ib_filter, band_inv);
+	const float ic_sgn = deadtime_comp_shape(ic_filter, band_inv);
+	const float mod_alpha_filter_sgn = (2.0 / 3.0) * ia_sgn - (1.0 / 3.0) * ib_sgn - (1.0 / 3.0) * ic_sgn;
+	const float mod_beta_filter_sgn = ONE_BY_SQRT3 * ib_sgn - ONE_BY_SQRT3 * ic_sgn;
+	const float mod_alpha_comp = mod_alpha_filter_sgn * params->mod_comp_fact;
+	const float mod_beta_comp = mod_beta_filter_sgn * params->mod_comp_fact;
+
+	// Apply compensation here so that 0 duty cycle has no glitches.
+	state_m->v_alpha = (*mod_alpha - mod_alpha_comp) * two_third_v_bus;
+	state_m->v_beta = (*mod_beta - mod_beta_comp) * two_third_v_bus;
+}
+
+/**
+ * Field weakening. Calculates the negative d-axis current to apply when the
+ * duty cycle gets close to the maximum, so that the back-EMF can exceed the
+ * available voltage. The current is ramped towards its target.
+ *
+ * @param current_now
+ * The field weakening current from the previous call.
+ *
+ * @param duty_abs
+ * The magnitude of the current duty cycle.
+ *
+ * @param conf
+ * The motor configuration.
+ *
+ * @param params
+ * The derived parameters, see foc_derived_params_update.
+ *
+ * @return
+ * The new field weakening current. It is positive and should be subtracted
+ * from the d-axis current target.
+ */
+float foc_field_weakening(float current_now, float duty_abs,
+		volatile mc_configuration *conf, volatile foc_derived_params_t *params) {
+	float target = 0.0;
+
+	if (conf->foc_fw_current_max > 0.0) {
+		const float duty_start = conf->foc_fw_duty_start * conf->l_max_duty;
+
+		if (duty_abs > duty_start && conf->l_max_duty > duty_start) {
+			target = utils_map(duty_abs, duty_start, conf->l_max_duty,
+					0.0, conf->foc_fw_current_max);
+			utils_truncate_number(&target, 0.0, conf->foc_fw_current_max);
+		}
+	}
+
+	utils_step_towards(&current_now, target, params->fw_ramp_step);
+	return current_now;
+}
+
+/**
+ * Build the maximum torque per amp lookup table. For a motor with Lq > Ld
+ * the reluctance torque is used by splitting the current between the d and q
+ * axis. The optimal d axis current for a current magnitude is is
+ *
+ * id = (lambda - sqrt(lambda^2 + 8 * (Lq - Ld)^2 * is^2)) / (4 * (Lq - Ld))
+ *
+ * where Ld and Lq are the phase inductances. Like foc_motor_l, foc_motor_ld
+ * and foc_motor_lq are 2/3 of them, see l_obs.
+ *
+ * @param table
+ * The table to fill, with FOC_MTPA_TABLE_LEN entries of d axis current for
+ * current magnitudes from 0 to l_current_max.
+ *
+ * @param conf
+ * The motor configuration.
+ *
+ * @return
+ * True if MTPA should be used with this configuration, false otherwise. The
+ * table is filled with zeros when false is returned.
+ */
+bool foc_mtpa_build_table(float *table, volatile mc_configuration *conf) {
+	const float ld_lq_diff = 1.5 * (conf->foc_motor_lq - conf->foc_motor_ld);
+	const float lambda = conf->foc_motor_flux_linkage;
+	const bool enabled = conf->foc_mtpa_enable && ld_lq_diff > 1e-9;
+
+	for (int i = 0;i < FOC_MTPA_TABLE_LEN;i++) {
+		if (enabled) {
+			const float is = conf->l_current_max * (float)i / (float)(FOC_MTPA_TABLE_LEN - 1);
+			table[i] = (lambda - sqrtf(SQ(lambda) + 8.0 * SQ(ld_lq_diff) * SQ(is))) /
+					(4.0 * ld_lq_diff);
+		} else {
+			table[i] = 0.0;
+		}
+	}
+
+	return enabled;
+}
+
+/**
+ * Split a q axis current request between the d and q axis using the MTPA
+ * table. The magnitude of the request is kept.
+ *
+ * @param table
+ * The table from foc_mtpa_build_table.
+ *
+ * @param conf
+ * The motor configuration.
+ *
+ * @param id
+ * The d axis current. The MTPA d axis current is added to it.
+ *
+ * @param iq
+ * The q axis current request, will be replaced by the q axis part.
+ */
+void foc_mtpa_apply(const float *table, volatile mc_configuration *conf, float *id, float *iq) {
+	const float is = fabsf(*iq);
+	float pos = is / conf->l_current_max * (float)(FOC_MTPA_TABLE_LEN - 1);
+	utils_truncate_number(&pos, 0.0, (float)(FOC_MTPA_TABLE_LEN - 1));
+
+	int ind = (int)pos;
+	if (ind >= (FOC_MTPA_TABLE_LEN - 1)) {
+		ind = FOC_MTPA_TABLE_LEN - 2;
+	}
+	const float frac = pos - (float)ind;
+
+	float id_mtpa = table[ind] + (table[ind + 1] - table[ind]) * frac;
+	if (-id_mtpa > is) {
+		id_mtpa = -is;
+	}
+
+	*id += id_mtpa;
+	*iq = SIGN(*iq) * sqrtf(SQ(is) - SQ(id_mtpa));
+}
+
+/**
+ * Reset the high frequency injection state.
+ *
+ * @param hfi
+ * The HFI state.
+ *
+ * @param phase
+ * The phase to start tracking from.
+ *
+ * @param speed
+ * The speed to start tracking with in rad/s.
+ *
+ * @param polarity_known
+ * True if the phase is known to have the right polarity, e.g. because it
+ * comes from a running observer. False to run the polarity detection.
+ */
+void foc_hfi_reset(volatile foc_hfi_t *hfi, float phase, float speed, bool polarity_known) {
+	hfi->state = polarity_known ? FOC_HFI_STATE_RUN : FOC_HFI_STATE_SETTLE;
+	hfi->timer = 0.0;
+	hfi->skip = 2;
+	hfi->i_alpha_last = 0.0;
+	hfi->i_beta_last = 0.0;
+	hfi->di_alpha_last = 0.0;
+	hfi->di_beta_last = 0.0;
+	hfi->inj_sign = 1.0;
+	hfi->phase = phase;
+	hfi->speed = speed;
+	hfi->pol_resp_pos = 0.0;
+	hfi->pol_resp_neg = 0.0;
+	hfi->id_bias = 0.0;
+}
+
+/**
+ * Track the rotor angle with square wave high frequency injection on the d
+ * axis. The injection voltage alternates sign every control loop iteration,
+ * and the rotor saliency makes the current response leak into the estimated
+ * q axis when the estimated angle is off. Taking the ratio between the q and
+ * d axis responses makes the error independent of the injection amplitude
+ * and of the delay between setting the voltage and sampling the current.
+ *
+ * The saliency only gives the angle modulo pi, so the polarity is detected
+ * after the tracking has settled. A positive and then a negative d axis bias
+ * current is applied, and the direction where the d axis saturates more
+ * (larger response) is the direction of the magnet flux.
+ *
+ * @param hfi
+ * The HFI state.
+ *
+ * @param i_alpha
+ * The measured alpha current.
+ *
+ * @param i_beta
+ * The measured beta current.
+ *
+ * @param conf
+ * The motor configuration.
+ *
+ * @param params
+ * The derived parameters, see foc_derived_params_update.
+ *
+ * @param dt
+ * The control loop time step.
+ *
+ * @return
+ * The d axis voltage to inject in the next control loop iteration.
+ */
+float foc_hfi_run(volatile foc_hfi_t *hfi, float i_alpha, float i_beta,
+		volatile mc_configuration *conf, volatile foc_derived_params_t *params, float dt) {
+	const float di_alpha = i_alpha - hfi->i_alpha_last;
+	const float di_beta = i_beta - hfi->i_beta_last;
+	hfi->i_alpha_last = i_alpha;
+	hfi->i_beta_last = i_beta;
+
+	// Half the difference between consecutive current changes is the response
+	// to the injection. The change caused by the fundamental voltage cancels.
+	const float hf_alpha = 0.5 * (di_alpha - hfi->di_alpha_last);
+	const float hf_beta = 0.5 * (di_beta - hfi->di_beta_last);
+	hfi->di_alpha_last = di_alpha;
+	hfi->di_beta_last = di_beta;
+
+	float s, c;
+	FOC_SINCOS(hfi->phase, &s, &c);
+	const float hf_d = c * hf_alpha + s * hf_beta;
+	const float hf_q = c * hf_beta - s * hf_alpha;
+
+	float err = 0.0;
+	if (hfi->skip > 0) {
+		hfi->skip--;
+	} else if (fabsf(hf_d) > params->hfi_resp_min) {
+		err = hf_q / hf_d * params->hfi_err_gain;
+		utils_truncate_number_abs(&err, 1.0);
+	}
+
+	hfi->phase += (hfi->speed + FOC_HFI_PLL_KP * err) * dt;
+	hfi->speed += FOC_HFI_PLL_KI * err * dt;
+	UTILS_NAN_ZERO(hfi->phase);
+	UTILS_NAN_ZERO(hfi->speed);
+
+	// Polarity detection. Only the second half of each bias period is used, so
+	// that the current has settled.
+	const float pol_current = FOC_HFI_POL_CURRENT * conf->l_current_max;
+	hfi->timer += dt;
+
+	switch (hfi->state) {
+	case FOC_HFI_STATE_SETTLE:
+		hfi->id_bias = 0.0;
+		if (hfi->timer >= FOC_HFI_SETTLE_TIME) {
+			hfi->state = FOC_HFI_STATE_POL_POS;
+			hfi->timer = 0.0;
+		}
+		break;
+
+	case FOC_HFI_STATE_POL_POS:
+		hfi->id_bias = pol_current;
+		if (hfi->timer >= (FOC_HFI_POL_TIME / 2.0)) {
+			hfi->pol_resp_pos += fabsf(hf_d);
+		}
+		if (hfi->timer >= FOC_HFI_POL_TIME) {
+			hfi->state = FOC_HFI_STATE_POL_NEG;
+			hfi->timer = 0.0;
+		}
+		break;
+
+	case FOC_HFI_STATE_POL_NEG:
+		hfi->id_bias = -pol_current;
+		if (hfi->timer >= (FOC_HFI_POL_TIME / 2.0)) {
+			hfi->pol_resp_neg += fabsf(hf_d);
+		}
+		if (hfi->timer >= FOC_HFI_POL_TIME) {
+			if (hfi->pol_resp_neg > hfi->pol_resp_pos) {
+				hfi->phase += M_PI;
+			}
+			hfi->state = FOC_HFI_STATE_RUN;
+			hfi->id_bias = 0.0;
+		}
+		break;
+
+	case FOC_HFI_STATE_RUN:
+	default:
+		hfi->id_bias = 0.0;
+		break;
+	}
+
+	float phase = hfi->phase;
+	utils_norm_angle_rad(&phase);
+	hfi->phase = phase;
+
+	hfi->inj_sign = -hfi->inj_sign;
+	return hfi->inj_sign * conf->foc_hfi_voltage;
+}
+
+/**
+ * Calculate how much the observer should be used instead of HFI. The angle
+ * is blended from HFI to the observer between FOC_HFI_BLEND_START *
+ * foc_hfi_erpm and foc_hfi_erpm, and the injection should be scaled down
+ * with the same factor.
+ *
+ * @param speed
+ * The electrical speed in rad/s.
+ *
+ * @param conf
+ * The motor configuration.
+ *
+ * @return
+ * The observer weight, 0.0 for HFI only and 1.0 for the observer only.
+ */
+float foc_hfi_observer_weight(float speed, volatile mc_configuration *conf) {
+	const float erpm = fabsf(speed) * (60.0 / (2.0 * M_PI));
+	const float erpm_start = FOC_HFI_BLEND_START * conf->foc_hfi_erpm;
+
+	if (conf->foc_hfi_erpm < 1.0 || erpm <= erpm_start) {
+		return 0.0;
+	}
+
+	float weight = utils_map(erpm, erpm_start, conf->foc_hfi_erpm, 0.0, 1.0);
+	utils_truncate_number(&weight, 0.0, 1.0);
+	return weight;
+}
+
+/**
+ * Reset the online parameter estimation.
+ *
+ * @param rls
+ * The estimator state.
+ *
+ * @param r_nom
+ * The nominal resistance, as used by the observer.
+ *
+ * @param lambda_nom
+ * The nominal flux linkage.
+ */
+void foc_rls_reset(foc_rls_t *rls, float r_nom, float lambda_nom) {
+	rls->theta[0] = 1.0;
+	rls->theta[1] = 1.0;
+	rls->p[0][0] = FOC_RLS_P0;
+	rls->p[0][1] = 0.0;
+	rls->p[1][0] = 0.0;
+	rls->p[1][1] = FOC_RLS_P0;
+	rls->r_nom = r_nom;
+	rls->lambda_nom = lambda_nom;
+	rls->updates = 0;
+}
+
+/**
+ * Run one recursive least squares step on the steady state q axis voltage
+ * equation
+ *
+ * vq - w * L * id = R * iq + w * lambda
+ *
+ * to estimate the resistance and the flux linkage. The inputs should be
+ * averaged over some control loop iterations, so that the derivative terms
+ * can be neglected. The parameters are estimated relative to their nominal
+ * values and kept inside the FOC_RLS_ bounds.
+ *
+ * @param rls
+ * The estimator state.
+ *
+ * @param vq
+ * The q axis voltage.
+ *
+ * @param id
+ * The d axis current.
+ *
+ * @param iq
+ * The q axis current.
+ *
+ * @param speed
+ * The electrical speed in rad/s.
+ *
+ * @param l
+ * The inductance, as used by the observer.
+ *
+ * @return
+ * True if the estimate was updated, false if the back-EMF was too low.
+ */
+bool foc_rls_update(foc_rls_t *rls, float vq, float id, float iq, float speed, float l) {
+	const float phi0 = iq * rls->r_nom;
+	const float phi1 = speed * rls->lambda_nom;
+
+	if (fabsf(phi1) < FOC_RLS_BEMF_MIN) {
+		return false;
+	}
+
+	const float y = vq - speed * l * id;
+	const float err = y - (phi0 * rls->theta[0] + phi1 * rls->theta[1]);
+
+	// Gain
+	const float p_phi0 = rls->p[0][0] * phi0 + rls->p[0][1] * phi1;
+	const float p_phi1 = rls->p[1][0] * phi0 + rls->p[1][1] * phi1;
+	const float den = FOC_RLS_FORGET + phi0 * p_phi0 + phi1 * p_phi1;
+	const float k0 = p_phi0 / den;
+	const float k1 = p_phi1 / den;
+
+	rls->theta[0] += k0 * err;
+	rls->theta[1] += k1 * err;
+	utils_truncate_number(&rls->theta[0], FOC_RLS_R_MIN, FOC_RLS_R_MAX);
+	utils_truncate_number(&rls->theta[1], FOC_RLS_LAMBDA_MIN, FOC_RLS_LAMBDA_MAX);
+
+	// Covariance, kept symmetric
+	const float p00 = (rls->p[0][0] - k0 * p_phi0) / FOC_RLS_FORGET;
+	const float p01 = (rls->p[0][1] - k0 * p_phi1) / FOC_RLS_FORGET;
+	const float p11 = (rls->p[1][1] - k1 * p_phi1) / FOC_RLS_FORGET;
+	rls->p[0][0] = p00;
+	rls->p[0][1] = p01;
+	rls->p[1][0] = p01;
+	rls->p[1][1] = p11;
+	utils_truncate_number(&rls->p[0][0], 0.0, FOC_RLS_P_MAX);
+	utils_truncate_number(&rls->p[1][1], 0.0, FOC_RLS_P_MAX);
+	utils_truncate_number_abs(&rls->p[0][1], FOC_RLS_P_MAX);
+	utils_truncate_number_abs(&rls->p[1][0], FOC_RLS_P_MAX);
+
+	if (UTILS_IS_NAN(rls->theta[0]) || UTILS_IS_NAN(rls->theta[1]) ||
+			UTILS_IS_NAN(rls->p[0][0]) || UTILS_IS_NAN(rls->p[0][1]) ||
+			UTILS_IS_NAN(rls->p[1][1])) {
+		foc_rls_reset(rls, rls->r_nom, rls->lambda_nom);
+		return false;
+	}
+
+	rls->updates++;
+	return true;
+}
+
+/**
+ * Get the estimated resistance.
+ *
+ * @param rls
+ * The estimator state.
+ *
+ * @return
+ * The resistance, with the same scaling as the nominal value.
+ */
+float foc_rls_get_r(foc_rls_t *rls) {
+	return rls->theta[0] * rls->r_nom;
+}
+
+/**
+ * Get the estimated flux linkage.
+ *
+ * @param rls
+ * The estimator state.
+ *
+ * @return
+ * The flux linkage.
+ */
+float foc_rls_get_lambda(foc_rls_t *rls) {
+	return rls->theta[1] * rls->lambda_nom;
+}
+
+/**
+ * Find the nominal angle of a hall sensor transition and which edge it is.
+ * The nominal angle is halfway between the sector centers in the hall
+ * table. The same physical edge is passed in both directions, so it is
+ * identified by the state on its forward side.
+ *
+ * @param hall_table
+ * The hall table, with sector centers from 0 to 200 per revolution and 255
+ * for invalid states.
+ *
+ * @param hall_prev
+ * The previous hall state.
+ *
+ * @param hall_now
+ * The new hall state.
+ *
+ * @param angle
+ * The nominal transition angle in radians.
+ *
+ * @param edge
+ * The edge index, 0 to 7.
+ *
+ * @return
+ * True if both states are valid, false otherwise.
+ */
+bool foc_hall_edge(const volatile uint8_t *hall_table, int hall_prev, int hall_now,
+		float *angle, int *edge) {
+	if (hall_prev < 0 || hall_prev > 7 || hall_now < 0 || hall_now > 7) {
+		return false;
+	}
+
+	const int ang_prev = hall_table[hall_prev];
+	const int ang_now = hall_table[hall_now];
+
+	if (ang_prev > 200 || ang_now > 200) {
+		return false;
+	}
+
+	const float rad_prev = ((float)ang_prev / 200.0) * 2.0 * M_PI;
+	const float rad_now = ((float)ang_now / 200.0) * 2.0 * M_PI;
+	const float diff = utils_angle_difference_rad(rad_now, rad_prev);
+
+	float ang = rad_prev + diff / 2.0;
+	utils_norm_angle_rad(&ang);
+	*angle = ang;
+	*edge = diff > 0.0 ? hall_now : hall_prev;
+
+	return true;
+}
+
+/**
+ * Calculate the sector of each hall sensor state from the hall table and the
+ * learned transition angle corrections. Each sector spans from the corrected
+ * edge with its previous state to the corrected edge with its next state, so
+ * that skewed sensors get sectors of different widths.
+ *
+ * @param sectors
+ * The sectors to update.
+ *
+ * @param hall_table
+ * The hall table, see foc_hall_edge.
+ *
+ * @param edge_corr
+ * The transition angle corrections in 0.1 degree, indexed by edge.
+ */
+void foc_hall_sectors_update(foc_hall_sectors_t *sectors, const volatile uint8_t *hall_table,
+		const volatile int8_t *edge_corr) {
+	for (int s = 0;s < 8;s++) {
+		sectors->centre[s] = 0.0;
+		sectors->width[s] = 0.0;
+
+		if (hall_table[s] > 200) {
+			continue;
+		}
+
+		// The neighbours are the valid states with the closest centres on either side
+		const float ang = ((float)hall_table[s] / 200.0) * 2.0 * M_PI;
+		int prev = -1;
+		int next = -1;
+		float diff_prev = 0.0;
+		float diff_next = 0.0;
+
+		for (int i = 0;i < 8;i++) {
+			if (i == s || hall_table[i] > 200) {
+				continue;
+			}
+
+			const float diff = utils_angle_difference_rad(((float)hall_table[i] / 200.0) * 2.0 * M_PI, ang);
+			if (diff > 0.0 && (next < 0 || diff < diff_next)) {
+				next = i;
+				diff_next = diff;
+			} else if (diff < 0.0 && (prev < 0 || diff > diff_prev)) {
+				prev = i;
+				diff_prev = diff;
+			}
+		}
+
+		float start, end;
+		int edge;
+		if (!foc_hall_edge(hall_table, prev, s, &start, &edge)) {
+			continue;
+		}
+		start += (float)edge_corr[edge] * (0.1 * M_PI / 180.0);
+
+		if (!foc_hall_edge(hall_table, s, next, &end, &edge)) {
+			continue;
+		}
+		end += (float)edge_corr[edge] * (0.1 * M_PI / 180.0);
+
+		const float width = utils_angle_difference_rad(end, start);
+		if (width <= 0.0) {
+			continue;
+		}
+
+		float centre = start + 0.5 * width;
+		utils_norm_angle_rad(&centre);
+		sectors->centre[s] = centre;
+		sectors->width[s] = width;
+	}
+}
+
+/**
+ * Interpolate the rotor angle between hall sensor transitions. The angle is
+ * advanced and then kept inside the sector of the present state, so that it
+ * stops at the next edge when the speed estimate is too high.
+ *
+ * @param sectors
+ * The sectors, see foc_hall_sectors_update.
+ *
+ * @param hall
+ * The present hall state.
+ *
+ * @param angle
+ * The previous angle in radians.
+ *
+ * @param step
+ * The angle to advance, e.g. speed * dt.
+ *
+ * @return
+ * The new angle.
+ */
+float foc_hall_track(const foc_hall_sectors_t *sectors, int hall, float angle, float step) {
+	angle += step;
+
+	if (hall >= 0 && hall <= 7 && sectors->width[hall] > 0.0) {
+		const float half_width = 0.5 * sectors->width[hall];
+		float diff = utils_angle_difference_rad(angle, sectors->centre[hall]);
+		utils_truncate_number(&diff, -half_width, half_width);
+		angle = sectors->centre[hall] + diff;
+	}
+
+	utils_norm_angle_rad(&angle);
+	return angle;
+}
+
+/**
+ * Look up a value in a compensation table with linear interpolation. The
+ * table covers one period of the position and wraps around.
+ *
+ * @param table
+ * The table, with FOC_COMP_TABLE_LEN entries.
+ *
+ * @param scale
+ * The value of one table step.
+ *
+ * @param pos
+ * The position, as a fraction of the period from 0.0 to 1.0.
+ *
+ * @return
+ * The interpolated value.
+ */
+float foc_comp_table_lookup(const volatile int8_t *table, float scale, float pos) {
+	pos -= floorf(pos);
+	pos *= (float)FOC_COMP_TABLE_LEN;
+
+	int ind = (int)pos;
+	utils_truncate_number_int(&ind, 0, FOC_COMP_TABLE_LEN - 1);
+	const int ind_next = (ind + 1) % FOC_COMP_TABLE_LEN;
+	const float frac = pos - (float)ind;
+
+	return ((float)table[ind] + ((float)table[ind_next] - (float)table[ind]) * frac) * scale;
+}
+
+/**
+ * Quantize measured values into a compensation table.
+ *
+ * @param values
+ * The values, FOC_COMP_TABLE_LEN of them.
+ *
+ * @param table
+ * The table to fill.
+ *
+ * @return
+ * The scale to use with foc_comp_table_lookup, so that the largest value
+ * uses the full int8 range.
+ */
+float foc_comp_table_build(const float *values, int8_t *table) {
+	float max_abs = 0.0;
+	for (int i = 0;i < FOC_COMP_TABLE_LEN;i++) {
+		if (fabsf(values[i]) > max_abs) {
+			max_abs = fabsf(values[i]);
+		}
+	}
+
+	const float scale = max_abs / 127.0;
+
+	for (int i = 0;i < FOC_COMP_TABLE_LEN;i++) {
+		if (scale > 0.0) {
+			table[i] = (int8_t)roundf(values[i] / scale);
+		} else {
+			table[i] = 0;
+		}
+	}
+
+	return scale;
+}
+
+/**
+ * Plan a jerk limited move from rest to rest. The velocity and acceleration
+ * limits are lowered for moves that are too short to reach them.
+ *
+ * @param traj
+ * The trajectory to plan. The time is reset and the trajectory is set active.
+ *
+ * @param start
+ * The start position.
+ *
+ * @param dist
+ * The signed distance to move.
+ *
+ * @param v_max
+ * Maximum velocity, in position units per second.
+ *
+ * @param a_max
+ * Maximum acceleration, in position units per second^2.
+ *
+ * @param j_max
+ * Maximum jerk, in position units per second^3.
+ *
+ * @return
+ * True for success, false if a limit is not positive.
+ */
+bool foc_traj_plan(foc_traj_t *traj, float start, float dist,
+		float v_max, float a_max, float j_max) {
+	if (v_max <= 0.0 || a_max <= 0.0 || j_max <= 0.0) {
+		return false;
+	}
+
+	const float d = fabsf(dist);
+	float v = v_max;
+
+	// The acceleration from 0 to v and the deceleration back to 0 are point
+	// symmetric, so together they move v * t_a.
+	float t_j = v * j_max < SQ(a_max) ? sqrtf(v / j_max) : a_max / j_max;
+	float t_a = v * j_max < SQ(a_max) ? 2.0 * t_j : v / a_max + t_j;
+
+	if (v * t_a > d) {
+		// Highest velocity where the move still fits, first with the full
+		// acceleration and then without a constant acceleration phase.
+		const float a_j = SQ(a_max) / j_max;
+		v = 0.5 * (-a_j + sqrtf(SQ(a_j) + 4.0 * a_max * d));
+
+		if (v >= a_j) {
+			t_j = a_max / j_max;
+			t_a = v / a_max + t_j;
+		} else {
+			v = cbrtf(SQ(d) * j_max / 4.0);
+			t_j = sqrtf(v / j_max);
+			t_a = 2.0 * t_j;
+		}
+	}
+
+	traj->start = start;
+	traj->dir = dist < 0.0 ? -1.0 : 1.0;
+	traj->dist = d;
+	traj->jerk = j_max;
+	traj->time = 0.0;
+	traj->active = true;
+
+	if (v > 0.0) {
+		traj->v_peak = v;
+		traj->a_peak = j_max * t_j;
+		traj->t_j = t_j;
+		traj->t_a = t_a;
+		traj->t_v = d / v - t_a;
+		if (traj->t_v < 0.0) {
+			traj->t_v = 0.0;
+		}
+	} else {
+		traj->v_peak = 0.0;
+		traj->a_peak = 0.0;
+		traj->t_j = 0.0;
+		traj->t_a = 0.0;
+		traj->t_v = 0.0;
+	}
+
+	traj->t_tot = 2.0 * traj->t_a + traj->t_v;
+
+	return true;
+}
+
+// Position, velocity and acceleration a time tau into the acceleration phase
+static void traj_accel(const foc_traj_t *traj, float tau, float *pos, float *vel, float *acc) {
+	const float j = traj->jerk;
+	const float t_j = traj->t_j;
+	const float t_a = traj->t_a;
+	const float v_peak = traj->v_peak;
+
+	if (tau < t_j) {
+		*acc = j * tau;
+		*vel = 0.5 * j * SQ(tau);
+		*pos = j * tau * SQ(tau) / 6.0;
+	} else if (tau < (t_a - t_j)) {
+		const float v1 = 0.5 * j * SQ(t_j);
+		const float p1 = j * t_j * SQ(t_j) / 6.0;
+		const float t = tau - t_j;
+		*acc = traj->a_peak;
+		*vel = v1 + traj->a_peak * t;
+		*pos = p1 + v1 * t + 0.5 * traj->a_peak * SQ(t);
+	} else {
+		const float s = t_a - tau;
+		*acc = j * s;
+		*vel = v_peak - 0.5 * j * SQ(s);
+		*pos = 0.5 * v_peak * t_a - v_peak * s + j * s * SQ(s) / 6.0;
+	}
+}
+
+/**
+ * Sample a planned trajectory.
+ *
+ * @param traj
+ * The trajectory.
+ *
+ * @param time
+ * The time since the start of the move. It is truncated to the duration of the move.
+ *
+ * @param pos
+ * The position, not normalized.
+ *
+ * @param vel
+ * The velocity feedforward.
+ *
+ * @param acc
+ * The acceleration feedforward.
+ */
+void foc_traj_sample(const foc_traj_t *traj, float time, float *pos, float *vel, float *acc) {
+	float p, v, a;
+
+	utils_truncate_number(&time, 0.0, traj->t_tot);
+
+	if (time < traj->t_a) {
+		traj_accel(traj, time, &p, &v, &a);
+	} else if (time < (traj->t_a + traj->t_v)) {
+		p = 0.5 * traj->v_peak * traj->t_a + traj->v_peak * (time - traj->t_a);
+		v = traj->v_peak;
+		a = 0.0;
+	} else {
+		traj_accel(traj, traj->t_tot - time, &p, &v, &a);
+		p = traj->dist - p;
+		a = -a;
+	}
+
+	*pos = traj->start + traj->dir * p;
+	*vel = traj->dir * v;
+	*acc = traj->dir * a;
+}
+
+static bool svm_clamp_low(float alpha, float beta, mc_foc_modulation_mode mode) {
+	if (mode != FOC_MODULATION_DPWM1) {
+		return mode == FOC_MODULATION_DPWMMIN;
+	}
+
+	// Clamp the phase with the highest voltage magnitude, which is the phase
+	// with the highest current around the power factor 1 operating point. A
+	// positive input gives a low compare value.
+	const float va = alpha;
+	const float vb = -0.5 * alpha + SQRT3_BY_2 * beta;
+	const float vc = -0.5 * alpha - SQRT3_BY_2 * beta;
+	float v_max = va;
+	if (fabsf(vb) > fabsf(v_max)) {
+		v_max = vb;
+	}
+	if (fabsf(vc) > fabsf(v_max)) {
+		v_max = vc;
+	}
+	return v_max > 0.0;
+}
+
+// Magnitude must not be larger than sqrt(3)/2, or 0.866
+//
+// With the discontinuous modes all legs are shifted by the same amount so
+// that one leg is clamped to a rail. That does not change the line to line
+// voltages, but the clamped leg does not switch. A compare value of
+// PWMHalfPeriod + 1 keeps the leg high for the whole period.
+void foc_svm(float alpha, float beta, uint32_t PWMHalfPeriod, mc_foc_modulation_mode mode,
+		uint32_t* tAout, uint32_t* tBout, uint32_t* tCout, uint32_t *svm_sector) {
+	uint32_t sector;
+
+	if (beta >= 0.0f) {
+		if (alpha >= 0.0f) {
+			//quadrant I
+			if (ONE_BY_SQRT3 * beta > alpha) {
+				sector = 2;
+			} else {
+				sector = 1;
+			}
+		} else {
+			//quadrant II
+			if (-ONE_BY_SQRT3 * beta > alpha) {
+				sector = 3;
+			} else {
+				sector = 2;
+			}
+		}
+	} else {
+		if (alpha >= 0.0f) {
+			//quadrant IV5
+			if (-ONE_BY_SQRT3 * beta > alpha) {
+				sector = 5;
+			} else {
+				sector = 6;
+			}
+		} else {
+			//quadrant III
+			if (ONE_BY_SQRT3 * beta > alpha) {
+				sector = 4;
+			} else {
+				sector = 5;
+			}
+		}
+	}
+
+	// PWM timings
+	uint32_t tA, tB, tC;
+
+	switch (sector) {
+
+	// sector 1-2
+	case 1: {
+		// Vector on-times
+		uint32_t t1 = (alpha - ONE_BY_SQRT3 * beta) * PWMHalfPeriod;
+		uint32_t t2 = (TWO_BY_SQRT3 * beta) * PWMHalfPeriod;
+
+		// PWM timings
+		tA = (PWMHalfPeriod - t1 - t2) / 2;
+		tB = tA + t1;
+		tC = tB + t2;
+
+		break;
+	}
+
+	// sector 2-3
+	case 2: {
+		// Vector on-times
+		uint32_t t2 = (alpha + ONE_BY_SQRT3 * beta) * PWMHalfPeriod;
+		uint32_t t3 = (-alpha + ONE_BY_SQRT3 * beta) * PWMHalfPeriod;
+
+		// PWM timings
+		tB = (PWMHalfPeriod - t2 - t3) / 2;
+		tA = tB + t3;
+		tC = tA + t2;
+
+		break;
+	}
+
+	// sector 3-4
+	case 3: {
+		// Vector on-times
+		uint32_t t3 = (TWO_BY_SQRT3 * beta) * PWMHalfPeriod;
+		uint32_t t4 = (-alpha - ONE_BY_SQRT3 * beta) * PWMHalfPeriod;
+
+		// PWM timings
+		tB = (PWMHalfPeriod - t3 - t4) / 2;
+		tC = tB + t3;
+		tA = tC + t4;
+
+		break;
+	}
+
+	// sector 4-5
+	case 4: {
+		// Vector on-times
+		uint32_t t4 = (-alpha + ONE_BY_SQRT3 * beta) * PWMHalfPeriod;
+		uint32_t t5 = (-TWO_BY_SQRT3 * beta) * PWMHalfPeriod;
+
+		// PWM timings
+		tC = (PWMHalfPeriod - t4 - t5) / 2;
+		tB = tC + t5;
+		tA = tB + t4;
+
+		break;
+	}
+
+	// sector 5-6
+	case 5: {
+		// Vector on-times
+		uint32_t t5 = (-alpha - ONE_BY_SQRT3 * beta) * PWMHalfPeriod;
+		uint32_t t6 = (alpha - ONE_BY_SQRT3 * beta) * PWMHalfPeriod;
+
+		// PWM timings
+		tC = (PWMHalfPeriod - t5 - t6) / 2;
+		tA = tC + t5;
+		tB = tA + t6;
+
+		break;
+	}
+
+	// sector 6-1
+	case 6: {
+		// Vector on-times
+		uint32_t t6 = (-TWO_BY_SQRT3 * beta) * PWMHalfPeriod;
+		uint32_t t1 = (alpha + ONE_BY_SQRT3 * beta) * PWMHalfPeriod;
+
+		// PWM timings
+		tA = (PWMHalfPeriod - t6 - t1) / 2;
+		tC = tA + t1;
+		tB = tC + t6;
+
+		break;
+	}
+	}
+
+	if (mode != FOC_MODULATION_SVPWM) {
+		uint32_t t_min = tA;
+		uint32_t t_max = tA;
+		if (tB < t_min) {
+			t_min = tB;
+		}
+		if (tC < t_min) {
+			t_min = tC;
+		}
+		if (tB > t_max) {
+			t_max = tB;
+		}
+		if (tC > t_max) {
+			t_max = tC;
+		}
+
+		if (svm_clamp_low(alpha, beta, mode)) {
+			tA -= t_min;
+			tB -= t_min;
+			tC -= t_min;
+		} else {
+			const uint32_t shift = PWMHalfPeriod - t_max;
+			tA = tA == t_max ? PWMHalfPeriod + 1 : tA + shift;
+			tB = tB == t_max ? PWMHalfPeriod + 1 : tB + shift;
+			tC = tC == t_max ? PWMHalfPeriod + 1 : tC + shift;
+		}
+	}
+
+	*tAout = tA;
+	*tBout = tB;
+	*tCout = tC;
+	*svm_sector = sector;
+}
+
+/**
+ * Choose the modulation for the next PWM period. The discontinuous modes
+ * fall back to SVPWM at low modulation, where they save little switching
+ * loss and the same leg stays clamped for long at the low speeds that come
+ * with it. A leg that is clamped high never turns its low side on, so its
+ * bootstrap capacitor does not recharge. When the same leg has been clamped
+ * high for FOC_DPWM_HIGH_TIME_MAX, SVPWM is used for FOC_DPWM_RECHARGE_TIME.
+ *
+ * @param dpwm
+ * The clamp state, zero it before the first call.
+ *
+ * @param mode
+ * The configured modulation mode.
+ *
+ * @param alpha
+ * The alpha input of foc_svm.
+ *
+ * @param beta
+ * The beta input of foc_svm.
+ *
+ * @param dt
+ * The PWM period in seconds.
+ *
+ * @return
+ * The mode to pass to foc_svm.
+ */
+mc_foc_modulation_mode foc_dpwm_select(foc_dpwm_t *dpwm, mc_foc_modulation_mode mode,
+		float alpha, float beta, float dt) {
+	if (mode == FOC_MODULATION_SVPWM || (SQ(alpha) + SQ(beta)) < SQ(FOC_DPWM_MOD_MIN)) {
+		dpwm->clamp_leg = -1;
+		dpwm->time = 0.0;
+		return FOC_MODULATION_SVPWM;
+	}
+
+	if (svm_clamp_low(alpha, beta, mode)) {
+		dpwm->clamp_leg = -1;
+		dpwm->time = 0.0;
+		return mode;
+	}
+
+	// The leg with the most negative input has the highest compare value
+	const float v[3] = {
+			alpha,
+			-0.5 * alpha + SQRT3_BY_2 * beta,
+			-0.5 * alpha - SQRT3_BY_2 * beta
+	};
+	int leg = 0;
+	if (v[1] < v[leg]) {
+		leg = 1;
+	}
+	if (v[2] < v[leg]) {
+		leg = 2;
+	}
+
+	if (leg != dpwm->clamp_leg) {
+		dpwm->clamp_leg = leg;
+		dpwm->time = 0.0;
+	}
+
+	dpwm->time += dt;
+	if (dpwm->time > FOC_DPWM_HIGH_TIME_MAX) {
+		if (dpwm->time > (FOC_DPWM_HIGH_TIME_MAX + FOC_DPWM_RECHARGE_TIME)) {
+			dpwm->time = 0.0;
+		}
+		return FOC_MODULATION_SVPWM;
+	}
+
+	return mode;
+}
+
+/**
+ * Choose the phase current that is calculated from the other two with phase
+ * shunts. That is the leg with the shortest time between its switching edge
+ * and the sampling point. Legs that the discontinuous modulation clamps to a
+ * rail do not switch, so their samples are always good and they are never
+ * chosen.
+ *
+ * @param duty
+ * The compare values of the three legs.
+ *
+ * @param top
+ * The timer top value.
+ *
+ * @param sample_v7
+ * True when sampling in V7, at the start of the period. The leg with the
+ * lowest compare value is chosen then, otherwise the one with the highest.
+ *
+ * @return
+ * The phase index, or -1 to use all three samples.
+ */
+int foc_shunt_reconstruct_phase(const uint32_t *duty, uint32_t top, bool sample_v7) {
+	int phase = -1;
+	bool tie = false;
+
+	for (int i = 0;i < 3;i++) {
+		if (duty[i] == 0 || duty[i] > top) {
+			continue;
+		}
+
+		if (phase < 0 || (sample_v7 ? duty[i] < duty[phase] : duty[i] > duty[phase])) {
+			phase = i;
+			tie = false;
+		} else if (duty[i] == duty[phase]) {
+			tie = true;
+		}
+	}
+
+	return tie ? -1 : phase;
+}
+
+/**
+ * Sine and cosine based on a lookup table with linear interpolation. More
+ * accurate than utils_fast_sincos_better, with a maximum error of about 1e-4,
+ * and the execution time does not depend on the angle.
+ *
+ * @param angle
+ * The angle in radians
+ * WARNING: Don't use too large angles.
+ *
+ * @param sin
+ * A pointer to store the sine value.
+ *
+ * @param cos
+ * A pointer to store the cosine value.
+ */
+void foc_lut_sincos(float angle, float *sin, float *cos) {
+	const float pos = angle * ((float)LUT_SIN_SIZE / (2.0 * M_PI));
+	int ind = (int)pos;
+	if (pos < 0.0) {
+		ind--;
+	}
+	const float frac = pos - (float)ind;
+
+	const unsigned int s0 = (unsigned int)ind & LUT_SIN_MASK;
+	const unsigned int s1 = (s0 + 1) & LUT_SIN_MASK;
+	const unsigned int c0 = (s0 + LUT_SIN_SIZE / 4) & LUT_SIN_MASK;
+	const unsigned int c1 = (c0 + 1) & LUT_SIN_MASK;
+
+	*sin = lut_sin[s0] + (lut_sin[s1] - lut_sin[s0]) * frac;
+	*cos = lut_sin[c0] + (lut_sin[c1] - lut_sin[c0]) * frac;
+}
+
+/**
+ * atan2 based on a lookup table with linear interpolation. The maximum
+ * error is about 1e-5 radians, compared to about 1e-2 radians for
+ * utils_fast_atan2.
+ *
+ * @param y
+ * y
+ *
+ * @param x
+ * x
+ *
+ * @return
+ * The angle in radians
+ */
+float foc_lut_atan2(float y, float x) {
+	const float abs_x = fabsf(x);
+	const float abs_y = fabsf(y);
+
+	if (abs_x < 1e-20 && abs_y < 1e-20) {
+		return 0.0;
+	}
+
+	// Reduce to the first octant so that the table argument is in [0, 1]
+	const bool swap = abs_y > abs_x;
+	const float ratio = swap ? (abs_x / abs_y) : (abs_y / abs_x);
+	const float pos = ratio * (float)LUT_ATAN_SIZE;
+	int ind = (int)pos;
+	if (ind >= LUT_ATAN_SIZE) {
+		ind = LUT_ATAN_SIZE - 1;
+	}
+	const float frac = pos - (float)ind;
+
+	float angle = lut_atan[ind] + (lut_atan[ind + 1] - lut_atan[ind]) * frac;
+
+	if (swap) {
+		angle = (M_PI / 2.0) - angle;
+	}
+
+	if (x < 0.0) {
+		angle = M_PI - angle;
+	}
+
+	if (y < 0.0) {
+		return -angle;
+	} else {
+		return angle;
+	}
+}
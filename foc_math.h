@@ -0,0 +1,245 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef FOC_MATH_H_
+#define FOC_MATH_H_
+
+#include "datatypes.h"
+#include "conf_general.h"
+#include "utils.h"
+#include "digital_filter.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * The functions in this file contain the math of the FOC implementation without
+ * any access to timers, ADCs or the RTOS. Everything they need is passed as
+ * arguments, so that they can be called from mcpwm_foc as well as from code
+ * that runs them against a motor model.
+ */
+
+// Trigonometry used by the control loop, see FOC_TRIG_USE_LUT
+#if FOC_TRIG_USE_LUT
+#define FOC_SINCOS(angle, sin, cos)		foc_lut_sincos(angle, sin, cos)
+#define FOC_ATAN2(y, x)					foc_lut_atan2(y, x)
+#else
+#define FOC_SINCOS(angle, sin, cos)		utils_fast_sincos_better(angle, sin, cos)
+#define FOC_ATAN2(y, x)					utils_fast_atan2(y, x)
+#endif
+
+// Observer integration
+#define FOC_OBSERVER_ITERATIONS_MAX		6 // Maximum number of Euler sub-steps per control loop iteration
+#define FOC_OBSERVER_STEP_ANGLE_MAX		0.1 // Maximum electrical phase advance per sub-step in radians
+
+// MTPA
+#define FOC_MTPA_TABLE_LEN				32 // Number of points from 0 to l_current_max
+
+// High frequency injection
+#define FOC_HFI_SETTLE_TIME				0.05 // Angle tracking time before the polarity detection in seconds
+#define FOC_HFI_POL_TIME				0.02 // Time with each d axis bias during the polarity detection in seconds
+#define FOC_HFI_POL_CURRENT				0.3 // D axis bias for the polarity detection, as a fraction of l_current_max
+#define FOC_HFI_PLL_KP					1000.0 // Angle tracking proportional gain
+#define FOC_HFI_PLL_KI					200000.0 // Angle tracking integral gain
+#define FOC_HFI_BLEND_START				0.7 // Fraction of foc_hfi_erpm where the blend to the observer starts
+
+// Online parameter estimation
+#define FOC_RLS_FORGET					0.999 // Forgetting factor per update
+#define FOC_RLS_P0						10.0 // Initial covariance of the normalized parameters
+#define FOC_RLS_P_MAX					100.0 // Covariance limit, prevents windup without excitation
+#define FOC_RLS_BEMF_MIN				1.0 // Minimum back-EMF in volts for the estimation to run
+#define FOC_RLS_R_MIN					0.5 // Resistance bounds relative to the configured value
+#define FOC_RLS_R_MAX					2.0
+#define FOC_RLS_LAMBDA_MIN				0.7 // Flux linkage bounds relative to the configured value
+#define FOC_RLS_LAMBDA_MAX				1.2
+
+// Discontinuous modulation
+#define FOC_DPWM_MOD_MIN				0.2 // Modulation below which SVPWM is used
+#define FOC_DPWM_HIGH_TIME_MAX			0.002 // Time a leg may stay clamped high in seconds
+#define FOC_DPWM_RECHARGE_TIME			0.0005 // SVPWM time after that for the bootstrap capacitor to recharge
+
+// Signal filters. The cutoff frequencies are the ones the previous fixed filter
+// constants had at the default control loop rate, FOC_FILTER_REF_RATE.
+#define FOC_FILTER_REF_RATE				10000.0 // Control loop rate with the default configuration
+#define FOC_FILTER_V_BUS_FREQ			167.7 // Input voltage
+#define FOC_FILTER_V_DQ_FREQ			355.1 // D and q axis voltage while undriven
+#define FOC_FILTER_DUTY_FREQ			167.7 // Duty cycle for the brake mode detection
+
+// Types
+typedef enum {
+	FOC_HFI_STATE_SETTLE = 0,
+	FOC_HFI_STATE_POL_POS,
+	FOC_HFI_STATE_POL_NEG,
+	FOC_HFI_STATE_RUN
+} foc_hfi_state;
+
+typedef struct {
+	foc_hfi_state state;
+	float timer;
+	int skip; // Samples to skip before the current history is valid
+	float i_alpha_last;
+	float i_beta_last;
+	float di_alpha_last;
+	float di_beta_last;
+	float inj_sign;
+	float phase;
+	float speed;
+	float pol_resp_pos;
+	float pol_resp_neg;
+	float id_bias; // D axis current to add during the polarity detection
+} foc_hfi_t;
+
+typedef struct {
+	float theta[2]; // Resistance and flux linkage relative to the nominal values
+	float p[2][2];
+	float r_nom;
+	float lambda_nom;
+	int updates;
+} foc_rls_t;
+
+/*
+ * Jerk limited point to point move from rest to rest. The acceleration and
+ * the deceleration are symmetric, each with a jerk phase, an optional constant
+ * acceleration phase and a second jerk phase. A constant velocity phase is
+ * between them when the move is long enough to reach the velocity limit.
+ */
+typedef struct {
+	float start;
+	float dir; // 1 or -1
+	float dist; // Absolute distance
+	float v_peak;
+	float a_peak;
+	float jerk;
+	float t_j; // Duration of each jerk phase
+	float t_a; // Duration of the acceleration
+	float t_v; // Duration of the constant velocity phase
+	float t_tot;
+	float time; // Time since the start of the move
+	bool active;
+} foc_traj_t;
+
+typedef struct {
+	float centre[8]; // Sector centre of each hall state
+	float width[8]; // Sector width of each hall state, 0 for invalid states
+} foc_hall_sectors_t;
+
+typedef struct {
+	int clamp_leg; // Leg that is clamped high, -1 for none
+	float time; // Time that leg has been clamped high
+} foc_dpwm_t;
+
+typedef struct {
+	float id_target;
+	float iq_target;
+	float max_duty;
+	float duty_now;
+	float phase;
+	float i_alpha;
+	float i_beta;
+	float i_abs;
+	float i_abs_filter;
+	float i_bus;
+	float v_bus;
+	float v_alpha;
+	float v_beta;
+	float mod_d;
+	float mod_q;
+	float id;
+	float iq;
+	float id_filter;
+	float iq_filter;
+	float vd;
+	float vq;
+	float vd_int;
+	float vq_int;
+	float speed_rad_s;
+	uint32_t svm_sector;
+	filter_biquad_state_t id_filter_state;
+	filter_biquad_state_t iq_filter_state;
+} motor_state_t;
+
+/*
+ * Terms that only depend on the configuration and on slowly changing values
+ * such as the motor temperature. They are updated when the configuration
+ * changes and from the 1 kHz timer thread, so that the control loop only has
+ * to read them.
+ */
+typedef struct {
+	float dt; // Control loop time step in seconds
+	float l_obs; // 1.5 * foc_motor_l
+	float r_obs; // 1.5 * foc_motor_r, temperature compensated
+	float lambda; // Flux linkage
+	float lambda_2; // Squared flux linkage
+	float sat_comp_fact; // foc_sat_comp / l_current_max
+	float current_ki; // Current controller KI, temperature compensated
+	float mod_comp_fact; // Dead time compensation modulation
+	float dt_comp_band_inv; // 1 / foc_dt_comp_band, 0 for the sign of the current
+	float fw_ramp_step; // Field weakening current change per control loop iteration
+	float hfi_err_gain; // Converts the HFI response ratio to an angle error, 0 without saliency
+	float hfi_resp_min; // Smallest d axis HFI response that is used for tracking
+	filter_biquad_coeffs_t filter_current; // id_filter and iq_filter
+	filter_biquad_coeffs_t filter_v_bus;
+	filter_biquad_coeffs_t filter_v_dq;
+	filter_biquad_coeffs_t filter_duty;
+} foc_derived_params_t;
+
+// Functions
+void foc_derived_params_update(volatile foc_derived_params_t *params,
+		volatile mc_configuration *conf, float temp_motor, bool sample_v0_v7);
+void foc_filters_update(volatile foc_derived_params_t *params,
+		volatile mc_configuration *conf);
+int foc_observer_iterations(float speed, float dt);
+void foc_observer_update(float v_alpha, float v_beta, float i_alpha, float i_beta,
+		float dt, float gamma, int iterations, volatile motor_state_t *state_m,
+		volatile foc_derived_params_t *params, volatile float *x1, volatile float *x2,
+		volatile float *phase);
+void foc_pll_run(float phase, float dt, float kp, float ki,
+		volatile float *phase_var, volatile float *speed_var);
+void foc_control_current(volatile motor_state_t *state_m, volatile mc_configuration *conf,
+		volatile foc_derived_params_t *params, float dt, float *mod_alpha, float *mod_beta);
+float foc_field_weakening(float current_now, float duty_abs,
+		volatile mc_configuration *conf, volatile foc_derived_params_t *params);
+bool foc_mtpa_build_table(float *table, volatile mc_configuration *conf);
+void foc_mtpa_apply(const float *table, volatile mc_configuration *conf, float *id, float *iq);
+void foc_hfi_reset(volatile foc_hfi_t *hfi, float phase, float speed, bool polarity_known);
+float foc_hfi_run(volatile foc_hfi_t *hfi, float i_alpha, float i_beta,
+		volatile mc_configuration *conf, volatile foc_derived_params_t *params, float dt);
+float foc_hfi_observer_weight(float speed, volatile mc_configuration *conf);
+void foc_rls_reset(foc_rls_t *rls, float r_nom, float lambda_nom);
+bool foc_rls_update(foc_rls_t *rls, float vq, float id, float iq, float speed, float l);
+float foc_rls_get_r(foc_rls_t *rls);
+float foc_rls_get_lambda(foc_rls_t *rls);
+bool foc_hall_edge(const volatile uint8_t *hall_table, int hall_prev, int hall_now,
+		float *angle, int *edge);
+void foc_hall_sectors_update(foc_hall_sectors_t *sectors, const volatile uint8_t *hall_table,
+		const volatile int8_t *edge_corr);
+float foc_hall_track(const foc_hall_sectors_t *sectors, int hall, float angle, float step);
+float foc_comp_table_lookup(const volatile int8_t *table, float scale, float pos);
+float foc_comp_table_build(const float *values, int8_t *table);
+bool foc_traj_plan(foc_traj_t *traj, float start, float dist,
+		float v_max, float a_max, float j_max);
+void foc_traj_sample(const foc_traj_t *traj, float time, float *pos, float *vel, float *acc);
+void foc_lut_sincos(float angle, float *sin, float *cos);
+float foc_lut_atan2(float y, float x);
+void foc_svm(float alpha, float beta, uint32_t PWMHalfPeriod, mc_foc_modulation_mode mode,
+		uint32_t* tAout, uint32_t* tBout, uint32_t* tCout, uint32_t *svm_sector);
+mc_foc_modulation_mode foc_dpwm_select(foc_dpwm_t *dpwm, mc_foc_modulation_mode mode,
+		float alpha, float beta, float dt);
+int foc_shunt_reconstruct_phase(const uint32_t *duty, uint32_t top, bool sample_v7);
+
+#endif /* FOC_MATH_H_ */
@@ -0,0 +1,227 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "foc_observer.h"
+#include "utils.h"
+#include <math.h>
+#include <string.h>
+
+// Private functions
+static void observer_init(volatile foc_observer_state_t *obs);
+static float observer_get_phase(volatile foc_observer_state_t *obs);
+static float observer_get_speed(volatile foc_observer_state_t *obs);
+static void flux_update(volatile foc_observer_state_t *obs, const foc_observer_input_t *in);
+static void smo_update(volatile foc_observer_state_t *obs, const foc_observer_input_t *in);
+static void mras_update(volatile foc_observer_state_t *obs, const foc_observer_input_t *in);
+
+// Observers
+static const foc_observer_t observer_flux = {
+		observer_init,
+		flux_update,
+		observer_get_phase,
+		observer_get_speed,
+		false
+};
+
+static const foc_observer_t observer_smo = {
+		observer_init,
+		smo_update,
+		observer_get_phase,
+		observer_get_speed,
+		false
+};
+
+static const foc_observer_t observer_mras = {
+		observer_init,
+		mras_update,
+		observer_get_phase,
+		observer_get_speed,
+		true
+};
+
+/**
+ * Get the observer implementation for an observer type.
+ *
+ * @param type
+ * The observer type.
+ *
+ * @return
+ * The observer. The flux observer is returned for unknown types.
+ */
+const foc_observer_t *foc_observer_get(mc_foc_observer_type type) {
+	switch (type) {
+	case FOC_OBSERVER_TYPE_SMO:
+		return &observer_smo;
+
+	case FOC_OBSERVER_TYPE_MRAS:
+		return &observer_mras;
+
+	case FOC_OBSERVER_TYPE_FLUX:
+	default:
+		return &observer_flux;
+	}
+}
+
+static void observer_init(volatile foc_observer_state_t *obs) {
+	memset((void*)obs, 0, sizeof(foc_observer_state_t));
+}
+
+static float observer_get_phase(volatile foc_observer_state_t *obs) {
+	return obs->phase;
+}
+
+static float observer_get_speed(volatile foc_observer_state_t *obs) {
+	return obs->speed;
+}
+
+/*
+ * The flux linkage observer in foc_math. It does not estimate the speed, the
+ * PLL of the control loop does that.
+ */
+static void flux_update(volatile foc_observer_state_t *obs, const foc_observer_input_t *in) {
+	foc_observer_update(in->v_alpha, in->v_beta, in->i_alpha, in->i_beta,
+			in->dt, in->gamma, in->iterations, in->state_m, in->params,
+			&obs->x1, &obs->x2, &obs->phase);
+	obs->speed = in->speed;
+}
+
+/*
+ * Sliding mode observer. A current model is driven towards the measured
+ * current with a saturated switching function, and the low pass filtered
+ * switching signal is the back-EMF estimate. A boundary layer is used instead
+ * of the sign function to reduce chattering. The phase lag of the current
+ * model and of the back-EMF filter is compensated based on the speed from the
+ * PLL of the control loop.
+ */
+static void smo_update(volatile foc_observer_state_t *obs, const foc_observer_input_t *in) {
+	obs->speed = in->speed;
+
+	const float dt = in->dt;
+	const float L = in->params->l_obs;
+	const float R = in->params->r_obs;
+	const float k = in->state_m->v_bus;
+
+	// The boundary layer has to be wide enough for the discrete switching
+	// function not to overshoot in one time step.
+	float boundary = FOC_SMO_BOUNDARY * in->conf->l_current_max;
+	const float boundary_min = 2.0 * k * dt / L;
+	if (boundary < boundary_min) {
+		boundary = boundary_min;
+	}
+
+	float z_alpha = (obs->smo_i_alpha - in->i_alpha) / boundary;
+	float z_beta = (obs->smo_i_beta - in->i_beta) / boundary;
+	utils_truncate_number(&z_alpha, -1.0, 1.0);
+	utils_truncate_number(&z_beta, -1.0, 1.0);
+	z_alpha *= k;
+	z_beta *= k;
+
+	obs->smo_i_alpha += (in->v_alpha - R * obs->smo_i_alpha - z_alpha) * (dt / L);
+	obs->smo_i_beta += (in->v_beta - R * obs->smo_i_beta - z_beta) * (dt / L);
+
+	const float speed_abs = fabsf(obs->speed);
+	float wc = speed_abs * FOC_SMO_LPF_SPEED_FACTOR;
+	if (wc < FOC_SMO_LPF_MIN) {
+		wc = FOC_SMO_LPF_MIN;
+	}
+	float filter_const = wc * dt;
+	utils_truncate_number(&filter_const, 0.0, 1.0);
+	UTILS_LP_FAST(obs->smo_e_alpha, z_alpha, filter_const);
+	UTILS_LP_FAST(obs->smo_e_beta, z_beta, filter_const);
+
+	UTILS_NAN_ZERO(obs->smo_i_alpha);
+	UTILS_NAN_ZERO(obs->smo_i_beta);
+	UTILS_NAN_ZERO(obs->smo_e_alpha);
+	UTILS_NAN_ZERO(obs->smo_e_beta);
+
+	// The back-EMF leads the flux by 90 degrees in the direction of rotation
+	const float dir = obs->speed < 0.0 ? -1.0 : 1.0;
+	float phase = FOC_ATAN2(-obs->smo_e_alpha * dir, obs->smo_e_beta * dir);
+
+	// Compensate the phase lag at the present speed. Inside the boundary layer
+	// the switching function is linear, so the current model is a first order
+	// discrete system with its pole at pole_model, followed by the filter. The
+	// back-EMF it sees is the average over the last period, which is another
+	// half period behind.
+	const float step_angle = obs->speed * dt;
+	const float pole_filter = 1.0 - filter_const;
+	const float pole_model = 1.0 - (R + k / boundary) * (dt / L);
+	float s, c;
+	FOC_SINCOS(step_angle, &s, &c);
+	phase += FOC_ATAN2(pole_filter * s, 1.0 - pole_filter * c);
+	phase += FOC_ATAN2(s, c - pole_model) + 0.5 * step_angle;
+	utils_norm_angle_rad(&phase);
+	obs->phase = phase;
+}
+
+/*
+ * Model reference adaptive system. The measured currents are the reference
+ * model and the motor current equations in the estimated rotor frame are the
+ * adjustable model. The speed is adapted with a PI controller on the Popov
+ * error of the two models, and the phase is the integral of the speed. The
+ * speed is used by the control loop instead of the PLL. The error gets small
+ * with the back-EMF, so it does not track well at low speed.
+ */
+static void mras_update(volatile foc_observer_state_t *obs, const foc_observer_input_t *in) {
+	const float dt = in->dt;
+	const float L = in->params->l_obs;
+	const float R = in->params->r_obs;
+	const float lambda_by_l = in->params->lambda / L;
+
+	const float speed = obs->speed;
+
+	// Advance the adjustable model over the last period with the voltage that
+	// was applied in it, in the frame at the middle of the period. The model
+	// has the d-axis current offset by the flux linkage.
+	float s, c;
+	FOC_SINCOS(obs->phase + 0.5 * speed * dt, &s, &c);
+	const float vd = c * in->v_alpha + s * in->v_beta;
+	const float vq = c * in->v_beta - s * in->v_alpha;
+
+	const float id_p_hat = obs->mras_id;
+	const float iq_hat = obs->mras_iq;
+	obs->mras_id += (-R * id_p_hat + speed * L * iq_hat + vd + R * lambda_by_l) * (dt / L);
+	obs->mras_iq += (-R * iq_hat - speed * L * id_p_hat + vq) * (dt / L);
+
+	float phase = obs->phase + speed * dt;
+	utils_norm_angle_rad(&phase);
+
+	// The measured current in the frame at the end of the period
+	FOC_SINCOS(phase, &s, &c);
+	const float id = c * in->i_alpha + s * in->i_beta;
+	const float iq = c * in->i_beta - s * in->i_alpha;
+
+	// Popov error, normalized with the magnitude of the offset current vector
+	// so that the adaptation gains don't depend on the motor. It is limited so
+	// that the speed can't run away while the models disagree.
+	const float id_p = id + lambda_by_l;
+	float err = (id_p * obs->mras_iq - iq * obs->mras_id) /
+			(SQ(id_p) + SQ(iq) + 1e-6);
+	utils_truncate_number(&err, -1.0, 1.0);
+
+	obs->mras_speed_int += FOC_MRAS_KI * err * dt;
+	obs->speed = obs->mras_speed_int + FOC_MRAS_KP * err;
+
+	UTILS_NAN_ZERO(obs->mras_id);
+	UTILS_NAN_ZERO(obs->mras_iq);
+	UTILS_NAN_ZERO(obs->mras_speed_int);
+	UTILS_NAN_ZERO(obs->speed);
+
+	obs->phase = phase;
+}
@@ -0,0 +1,84 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef FOC_OBSERVER_H_
+#define FOC_OBSERVER_H_
+
+#include "datatypes.h"
+#include "foc_math.h"
+
+/*
+ * Sensorless position observers. They are selected with foc_observer_type in
+ * mc_configuration and have the same interface, so that mcpwm_foc does not
+ * have to know which one is running. Like foc_math, they don't access any
+ * hardware.
+ */
+
+// Settings
+#define FOC_SMO_BOUNDARY			0.05	// Boundary layer of the SMO switching function, as a fraction of l_current_max
+#define FOC_SMO_LPF_MIN				500.0	// Minimum cutoff of the SMO back-EMF filter in rad/s
+#define FOC_SMO_LPF_SPEED_FACTOR	2.0		// SMO back-EMF filter cutoff relative to the electrical speed
+#define FOC_MRAS_KP					2000.0	// MRAS speed adaptation gain
+#define FOC_MRAS_KI					200000.0 // MRAS speed adaptation integral gain
+
+// Types
+typedef struct {
+	// Flux observer
+	float x1;
+	float x2;
+	// Sliding mode observer
+	float smo_i_alpha;
+	float smo_i_beta;
+	float smo_e_alpha;
+	float smo_e_beta;
+	// MRAS
+	float mras_id;
+	float mras_iq;
+	float mras_speed_int;
+	// Outputs
+	float phase;
+	float speed;
+} foc_observer_state_t;
+
+typedef struct {
+	float v_alpha;
+	float v_beta;
+	float i_alpha;
+	float i_beta;
+	float dt;
+	float gamma; // Flux observer gain
+	int iterations; // Flux observer integration steps, see foc_observer_iterations
+	float speed; // Speed from the PLL of the control loop
+	volatile motor_state_t *state_m;
+	volatile foc_derived_params_t *params;
+	volatile mc_configuration *conf;
+} foc_observer_input_t;
+
+typedef struct {
+	void (*init)(volatile foc_observer_state_t *obs);
+	void (*update)(volatile foc_observer_state_t *obs, const foc_observer_input_t *in);
+	float (*get_phase)(volatile foc_observer_state_t *obs);
+	float (*get_speed)(volatile foc_observer_state_t *obs);
+	bool estimates_speed; // False if get_speed only returns the input speed
+} foc_observer_t;
+
+// Functions
+const foc_observer_t *foc_observer_get(mc_foc_observer_type type);
+
+#endif /* FOC_OBSERVER_H_ */
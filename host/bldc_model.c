@@ -0,0 +1,254 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "bldc_model.h"
+#include <math.h>
+#include <string.h>
+
+// Leg states
+#define LEG_PWM			0
+#define LEG_LOW			1
+#define LEG_OFF			2
+
+// The floating phase for each commutation step, see bldc_math.c
+static const int m_float_phase[6] = {0, 1, 2, 0, 1, 2};
+
+// Trapezoid with 120 degrees flat top that crosses zero upwards at angle 0
+static float trapezoid(float angle) {
+	const float x = fmodf(angle, 2.0 * M_PI) * (float)(6.0 / M_PI);
+
+	if (x < 1.0) {
+		return x;
+	} else if (x < 5.0) {
+		return 1.0;
+	} else if (x < 7.0) {
+		return 6.0 - x;
+	} else if (x < 11.0) {
+		return -1.0;
+	}
+
+	return x - 12.0;
+}
+
+static float phase_angle(float angle, int phase) {
+	// Phase 1 leads and phase 2 lags phase 0 by 120 degrees
+	static const float offset[3] = {0.0, 2.0 * M_PI / 3.0, 4.0 * M_PI / 3.0};
+	return angle + offset[phase];
+}
+
+static void get_legs(int comm_step, int *leg) {
+	const int f = m_float_phase[comm_step - 1];
+	const float centre = (float)(comm_step - 1) * (M_PI / 3.0);
+
+	for (int i = 0;i < 3;i++) {
+		if (i == f) {
+			leg[i] = LEG_OFF;
+		} else {
+			// The phase with positive back-EMF is switched for positive torque
+			leg[i] = trapezoid(phase_angle(centre, i)) > 0.0 ? LEG_PWM : LEG_LOW;
+		}
+	}
+}
+
+/**
+ * Initialize a motor model at zero angle without current. Set the speed
+ * in the struct.
+ *
+ * @param m
+ * The model.
+ *
+ * @param r
+ * Phase resistance.
+ *
+ * @param l
+ * Phase inductance.
+ *
+ * @param lambda
+ * Flux linkage.
+ *
+ * @param v_bus
+ * Bus voltage.
+ */
+void bldc_model_init(bldc_model_t *m, float r, float l, float lambda, float v_bus) {
+	memset(m, 0, sizeof(bldc_model_t));
+	m->r = r;
+	m->l = l;
+	m->lambda = lambda;
+	m->v_bus = v_bus;
+}
+
+/**
+ * Run the model for one PWM period.
+ *
+ * @param m
+ * The model.
+ *
+ * @param comm_step
+ * The commutation step, 1 to 6, with the phases in the order of rotation.
+ *
+ * @param duty
+ * The duty cycle of the switched phase, 0 to 1.
+ *
+ * @param dt
+ * The PWM period in seconds.
+ */
+void bldc_model_step(bldc_model_t *m, int comm_step, float duty, float dt) {
+	int leg[3];
+	get_legs(comm_step, leg);
+
+	const double h = dt / (double)BLDC_MODEL_SUBSTEPS;
+	double i[3] = {m->i[0], m->i[1], m->i[2]};
+	double phase = m->phase;
+
+	for (int s = 0;s < BLDC_MODEL_SUBSTEPS;s++) {
+		double e[3], v[3];
+		bool conducting[3];
+		int n_cond = 0;
+		double v_sum = 0.0, e_sum = 0.0;
+
+		for (int k = 0;k < 3;k++) {
+			e[k] = m->lambda * m->speed * trapezoid(phase_angle(phase, k));
+
+			if (leg[k] == LEG_PWM) {
+				v[k] = duty * m->v_bus;
+			} else if (leg[k] == LEG_LOW) {
+				v[k] = 0.0;
+			} else {
+				// Freewheeling diode
+				v[k] = i[k] > 0.0 ? 0.0 : m->v_bus;
+			}
+
+			conducting[k] = leg[k] != LEG_OFF || i[k] != 0.0;
+			if (conducting[k]) {
+				v_sum += v[k];
+				e_sum += e[k];
+				n_cond++;
+			}
+		}
+
+		const double v_n = (v_sum - e_sum) / (double)n_cond;
+		double i_sum = 0.0;
+		int last = -1;
+
+		for (int k = 0;k < 3;k++) {
+			if (!conducting[k]) {
+				continue;
+			}
+
+			const double i_new = i[k] + (v[k] - v_n - e[k] - m->r * i[k]) / m->l * h;
+
+			if (leg[k] == LEG_OFF && (i_new > 0.0) != (i[k] > 0.0)) {
+				// The diode blocks once the current has decayed
+				i[k] = 0.0;
+			} else {
+				i[k] = i_new;
+			}
+
+			if (leg[k] != LEG_OFF) {
+				last = k;
+			}
+			i_sum += i[k];
+		}
+
+		// Keep the sum of the currents at zero
+		if (last >= 0) {
+			i[last] -= i_sum;
+		}
+
+		phase += m->speed * h;
+		if (phase >= 2.0 * M_PI) {
+			phase -= 2.0 * M_PI;
+		}
+	}
+
+	for (int k = 0;k < 3;k++) {
+		m->i[k] = i[k];
+	}
+	m->phase = phase;
+}
+
+/**
+ * Get the phase voltages as the ADC samples them during the on time.
+ *
+ * @param m
+ * The model.
+ *
+ * @param comm_step
+ * The commutation step, 1 to 6.
+ *
+ * @param v_ph
+ * The three phase voltages relative to ground.
+ */
+void bldc_model_sample(const bldc_model_t *m, int comm_step, float *v_ph) {
+	int leg[3];
+	get_legs(comm_step, leg);
+
+	double v_sum = 0.0, e_sum = 0.0;
+	int f = 0;
+
+	for (int k = 0;k < 3;k++) {
+		if (leg[k] == LEG_OFF) {
+			f = k;
+			continue;
+		}
+
+		v_ph[k] = leg[k] == LEG_PWM ? m->v_bus : 0.0;
+		v_sum += v_ph[k];
+		e_sum += bldc_model_bemf(m, k);
+	}
+
+	if (m->i[f] > 0.0) {
+		v_ph[f] = 0.0;
+	} else if (m->i[f] < 0.0) {
+		v_ph[f] = m->v_bus;
+	} else {
+		v_ph[f] = (v_sum - e_sum) / 2.0 + bldc_model_bemf(m, f);
+	}
+}
+
+/**
+ * Get the commutation step that the rotor angle is in, i.e. the step that
+ * an ideal commutation would use now.
+ *
+ * @param m
+ * The model.
+ *
+ * @return
+ * The commutation step, 1 to 6.
+ */
+int bldc_model_comm_step(const bldc_model_t *m) {
+	const int sector = (int)floorf((m->phase + M_PI / 6.0) / (M_PI / 3.0));
+	return sector % 6 + 1;
+}
+
+/**
+ * Get the back-EMF of a phase.
+ *
+ * @param m
+ * The model.
+ *
+ * @param phase
+ * The phase, 0 to 2.
+ *
+ * @return
+ * The back-EMF in volts.
+ */
+float bldc_model_bemf(const bldc_model_t *m, int phase) {
+	return m->lambda * m->speed * trapezoid(phase_angle(m->phase, phase));
+}
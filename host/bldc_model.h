@@ -0,0 +1,61 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef BLDC_MODEL_H_
+#define BLDC_MODEL_H_
+
+#include <stdbool.h>
+
+/*
+ * Model of a BLDC motor with trapezoidal back-EMF, driven with six step
+ * commutation like mcpwm does it in BLDC mode, for running the sensorless
+ * commutation code on the host. The speed is locked, like on a dynamometer.
+ * In every commutation step one phase is switched with the duty cycle, one is
+ * kept low and the third one floats. The switched phase is averaged over each
+ * PWM period. After a commutation the current of the phase that became
+ * floating freewheels through one of its diodes until it reaches zero, which
+ * clamps the phase to a rail. The phase voltages are sampled during the on
+ * time, like the ADC does it in BLDC mode.
+ */
+
+// Settings
+#define BLDC_MODEL_SUBSTEPS			20 // Integration steps per PWM period
+
+// Types
+typedef struct {
+	// Parameters
+	float r; // Phase resistance
+	float l; // Phase inductance
+	float lambda; // Flux linkage, the flat top of the back-EMF is lambda * speed
+	float v_bus;
+	float speed; // Electrical speed in rad/s
+
+	// State
+	float i[3]; // Phase currents, positive into the motor
+	float phase; // Electrical angle in rad, 0 to 2 * pi
+} bldc_model_t;
+
+// Functions
+void bldc_model_init(bldc_model_t *m, float r, float l, float lambda, float v_bus);
+void bldc_model_step(bldc_model_t *m, int comm_step, float duty, float dt);
+void bldc_model_sample(const bldc_model_t *m, int comm_step, float *v_ph);
+int bldc_model_comm_step(const bldc_model_t *m);
+float bldc_model_bemf(const bldc_model_t *m, int phase);
+
+#endif /* BLDC_MODEL_H_ */
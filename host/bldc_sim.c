@@ -0,0 +1,409 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Runs the sensorless BLDC commutation of mcpwm against the BLDC model at a
+ * set of locked speeds and reports:
+ * - The commutation timing error relative to the ideal commutation 30 degrees
+ *   after the zero crossing of the back-EMF, in electrical degrees.
+ * - Missed commutations, and the commutations forced because the motor
+ *   looked stuck.
+ * - The time bldc_floating_phase and bldc_sl_update take per PWM cycle on
+ *   the host, replayed from the recorded samples.
+ *
+ * The PWM interrupt and the 1 kHz rpm thread of mcpwm are emulated here with
+ * the same order of operations. The cycle integrator limit and the back-EMF
+ * coupling are detected in delay mode first, the same way as
+ * conf_general_detect_motor_param does it. The exit status is the number of
+ * failed checks.
+ */
+
+#include "bldc_math.h"
+#include "bldc_model.h"
+#include "digital_filter.h"
+#include "sim_conf.h"
+#include "sim_util.h"
+#include "utils.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+// Settings
+#define SIM_V_BUS				24.0
+#define SIM_R					0.05
+#define SIM_L					20e-6
+#define SIM_LAMBDA				1.6e-3
+#define SIM_CURRENT				10.0 // Motor current the duty cycle is set for
+#define SIM_SETTLE_TIME			0.2
+#define SIM_MEASURE_TIME		0.2
+#define SIM_RPM_RATE			1000.0 // Rate of the rpm thread in Hz, MCPWM_RPM_RATE
+#define SIM_RPM_FILTER_FREQ		16.8 // MCPWM_RPM_FILTER_FREQ
+#define SIM_DETECT_ERPM_HIGH	40000.0
+#define SIM_DETECT_ERPM_LOW		15000.0
+#define SIM_RECORD_LEN			10000
+#define SIM_ERR_MAX				6.0 // Largest mean timing error in degrees
+#define SIM_ERR_ERPM_MIN		20000.0 // Below this the back-EMF is close to BLDC_BEMF_NOISE_MIN
+
+// ADC scaling of hw_410
+#define SIM_V_REG				3.3
+#define SIM_VIN_R1				39000.0
+#define SIM_VIN_R2				2200.0
+#define SIM_ADC_PER_VOLT		((4095.0 / SIM_V_REG) * (SIM_VIN_R2 / (SIM_VIN_R1 + SIM_VIN_R2)))
+#define SIM_VDIV_CORR			((SIM_VIN_R2 / (SIM_VIN_R2 + SIM_VIN_R1)) / (2.2 / (2.2 + 33.0)))
+
+// Types
+typedef struct {
+	int ph[3];
+	int ph_raw[3];
+	bldc_sl_input_t in;
+} sim_record_t;
+
+typedef struct {
+	mc_configuration conf;
+	mc_rpm_dep_struct rpm_dep;
+	bldc_sl_state_t sl;
+	bldc_model_t motor;
+
+	// mcpwm state
+	int comm_step;
+	float duty;
+	float f_sw;
+	float pwm_cycles_sum;
+	float last_pwm_cycles_sum;
+	int pwm_cycles;
+	bool has_commutated;
+	float rpm_now;
+	filter_biquad_coeffs_t rpm_filter_coeffs;
+	filter_biquad_state_t rpm_filter;
+	double time_last_comm;
+	float cycle_integrator_sum;
+	float cycle_integrator_iterations;
+
+	// Results
+	bool measure;
+	int steps; // Steps commutated while measuring
+	int forced; // Forced commutations while measuring
+	int timed; // Commutations with a timing error
+	double err_sum;
+	double err_abs_max;
+} sim_bldc_t;
+
+typedef struct {
+	float err_mean;
+	float err_max;
+	int missed;
+	int forced;
+	float isr_ns;
+} sim_result_t;
+
+// Private variables
+static sim_record_t m_record[SIM_RECORD_LEN];
+static int m_record_len;
+static volatile float m_sink;
+
+static float erpm_to_rad_s(float erpm) {
+	return erpm / 60.0 * 2.0 * M_PI;
+}
+
+static void commutate(sim_bldc_t *s, int steps, double time) {
+	if (s->measure && steps == 1) {
+		// The step that was left should have ended 30 degrees after its zero crossing
+		const float boundary = ((float)(s->comm_step - 1) + 0.5) * (M_PI / 3.0);
+		float err = s->motor.phase - boundary;
+		utils_norm_angle_rad(&err);
+		err *= (float)(180.0 / M_PI);
+
+		s->err_sum += err;
+		if (fabs(err) > s->err_abs_max) {
+			s->err_abs_max = fabs(err);
+		}
+		s->timed++;
+	}
+
+	if (s->measure) {
+		s->steps += steps;
+		if (steps > 1) {
+			s->forced++;
+		}
+	}
+
+	s->last_pwm_cycles_sum = s->pwm_cycles_sum;
+	s->pwm_cycles_sum = 0;
+	s->pwm_cycles = 0;
+
+	s->comm_step += steps;
+	while (s->comm_step > 6) {
+		s->comm_step -= 6;
+	}
+
+	s->rpm_dep.comms += steps;
+	s->rpm_dep.time_at_comm += (uint32_t)((time - s->time_last_comm) * 1e6);
+	s->time_last_comm = time;
+	s->has_commutated = true;
+}
+
+// The sensorless part of mcpwm_adc_int_handler, with the samples of the last PWM cycle
+static void pwm_isr(sim_bldc_t *s, double time) {
+	float v[3];
+	bldc_model_sample(&s->motor, s->comm_step, v);
+
+	int ph_raw[3];
+	for (int i = 0;i < 3;i++) {
+		ph_raw[i] = (int)(v[i] * SIM_ADC_PER_VOLT);
+	}
+	const int v_in_raw = (int)(s->motor.v_bus * SIM_ADC_PER_VOLT);
+
+	int vzero;
+	if (s->has_commutated && fabsf(s->duty) > 0.2) {
+		vzero = v_in_raw / 2;
+	} else {
+		vzero = (ph_raw[0] + ph_raw[1] + ph_raw[2]) / 3;
+	}
+
+	int ph[3];
+	for (int i = 0;i < 3;i++) {
+		ph[i] = ph_raw[i] - vzero;
+	}
+
+	if (s->pwm_cycles_sum >= s->rpm_dep.comm_time_sum_min_rpm) {
+		if (s->conf.comm_mode == COMM_MODE_INTEGRATE) {
+			commutate(s, 2, time);
+		} else if (s->conf.comm_mode == COMM_MODE_DELAY) {
+			commutate(s, 1, time);
+		}
+
+		s->sl.cycle_integrator = 0.0;
+	}
+
+	if (s->pwm_cycles >= 2) {
+		sim_record_t r;
+		memcpy(r.ph, ph, sizeof(ph));
+		memcpy(r.ph_raw, ph_raw, sizeof(ph_raw));
+		r.in.v_in_raw = v_in_raw;
+		r.in.duty_abs = fabsf(s->duty);
+		r.in.rpm_abs = fabsf(s->rpm_now);
+		r.in.f_sw = s->f_sw;
+		r.in.pwm_cycles_sum = s->pwm_cycles_sum;
+		r.in.last_pwm_cycles_sum = s->last_pwm_cycles_sum;
+		r.in.has_commutated = s->has_commutated;
+		bldc_floating_phase(s->comm_step, ph, ph_raw, &r.in.v_diff, &r.in.ph_now_raw);
+
+		if (s->measure && m_record_len < SIM_RECORD_LEN) {
+			m_record[m_record_len++] = r;
+		}
+
+		if (bldc_sl_update(&s->sl, &r.in, &s->conf, &s->rpm_dep)) {
+			commutate(s, 1, time);
+
+			if (s->conf.comm_mode == COMM_MODE_DELAY) {
+				s->cycle_integrator_sum += s->sl.integrator_at_comm * (1.0 / s->sl.int_scale);
+				s->cycle_integrator_iterations += 1.0;
+			}
+		}
+	} else {
+		s->sl.cycle_integrator = 0.0;
+	}
+
+	s->pwm_cycles_sum += s->conf.m_bldc_f_sw_max / s->f_sw;
+	s->pwm_cycles++;
+}
+
+// The rpm thread of mcpwm, with the rpm timer in microseconds
+static void rpm_thread(sim_bldc_t *s) {
+	if (s->rpm_dep.comms != 0) {
+		s->rpm_now = ((float)s->rpm_dep.comms * 1e6 * 60.0) / ((float)s->rpm_dep.time_at_comm * 6.0);
+		s->rpm_dep.comms = 0;
+		s->rpm_dep.time_at_comm = 0;
+	}
+
+	s->rpm_now = filter_biquad_run(&s->rpm_filter_coeffs, &s->rpm_filter, s->rpm_now);
+
+	bldc_update_rpm_dep(&s->rpm_dep, &s->conf, fabsf(s->rpm_now),
+			(float)(int)(s->motor.v_bus * SIM_ADC_PER_VOLT));
+}
+
+/*
+ * Run the motor at a locked speed, starting in the right commutation step
+ * with the speed estimate that the spin up would leave. Only the time after the settling time is
+ * measured.
+ */
+static void run_speed(sim_bldc_t *s, const mc_configuration *conf, float erpm) {
+	memset(s, 0, sizeof(sim_bldc_t));
+	s->conf = *conf;
+	s->sl.int_scale = 0.0005 * SIM_VDIV_CORR;
+	bldc_sl_reset(&s->sl);
+
+	bldc_model_init(&s->motor, SIM_R, SIM_L, SIM_LAMBDA, SIM_V_BUS);
+	s->motor.speed = erpm_to_rad_s(erpm);
+	s->motor.phase = M_PI / 12.0;
+
+	// Two phases in series against the flat top of the back-EMF
+	s->duty = (2.0 * SIM_LAMBDA * s->motor.speed + 2.0 * SIM_R * SIM_CURRENT) / SIM_V_BUS;
+	utils_truncate_number(&s->duty, 0.0, conf->l_max_duty);
+	s->f_sw = conf->m_bldc_f_sw_min * (1.0 - s->duty) + conf->m_bldc_f_sw_max * s->duty;
+	s->comm_step = bldc_model_comm_step(&s->motor);
+
+	// As after the spin up
+	s->rpm_now = erpm;
+	filter_biquad_lowpass_1st(&s->rpm_filter_coeffs, SIM_RPM_FILTER_FREQ, SIM_RPM_RATE);
+	filter_biquad_reset(&s->rpm_filter_coeffs, &s->rpm_filter, erpm);
+	bldc_update_rpm_dep(&s->rpm_dep, &s->conf, erpm, (float)(int)(SIM_V_BUS * SIM_ADC_PER_VOLT));
+
+	const double dt = 1.0 / s->f_sw;
+	double time = 0.0;
+	double time_rpm = 0.0;
+	bool started = false;
+	float start_phase = 0.0;
+	double angle = 0.0;
+	m_record_len = 0;
+
+	while (time < (SIM_SETTLE_TIME + SIM_MEASURE_TIME)) {
+		if (!s->measure && time >= SIM_SETTLE_TIME) {
+			s->measure = true;
+			start_phase = s->motor.phase;
+			started = true;
+		}
+
+		bldc_model_step(&s->motor, s->comm_step, s->duty, dt);
+		time += dt;
+		if (started) {
+			angle += s->motor.speed * dt;
+		}
+
+		pwm_isr(s, time);
+
+		if (time >= time_rpm) {
+			rpm_thread(s);
+			time_rpm += 1.0 / SIM_RPM_RATE;
+		}
+	}
+
+	// Commutation steps the rotor has passed while measuring
+	const float start_step = (start_phase + M_PI / 6.0) / (M_PI / 3.0);
+	const int passed = (int)floor(start_step + angle / (M_PI / 3.0)) - (int)floor(start_step);
+	s->steps -= passed;
+}
+
+static float bench_isr(const bldc_sl_state_t *sl_start, const mc_configuration *conf,
+		const mc_rpm_dep_struct *rpm_dep) {
+	double best = 1e12;
+
+	for (int run = 0;run < SIM_BENCH_RUNS;run++) {
+		bldc_sl_state_t sl = *sl_start;
+		mc_configuration c = *conf;
+		mc_rpm_dep_struct r = *rpm_dep;
+		int comm_step = 1;
+		int comms = 0;
+
+		const double start = sim_time_ns();
+		for (int i = 0;i < m_record_len;i++) {
+			bldc_sl_input_t in = m_record[i].in;
+			bldc_floating_phase(comm_step, m_record[i].ph, m_record[i].ph_raw, &in.v_diff, &in.ph_now_raw);
+			if (bldc_sl_update(&sl, &in, &c, &r)) {
+				comm_step = comm_step % 6 + 1;
+				comms++;
+			}
+		}
+		const double t = sim_time_ns() - start;
+
+		m_sink = (float)comms;
+		if (t < best) {
+			best = t;
+		}
+	}
+
+	return best / (double)(m_record_len > 0 ? m_record_len : 1);
+}
+
+static void run_detect(mc_configuration *conf) {
+	static sim_bldc_t s;
+	mc_configuration c = *conf;
+	c.comm_mode = COMM_MODE_DELAY;
+
+	run_speed(&s, &c, SIM_DETECT_ERPM_HIGH);
+	const float int_limit = s.cycle_integrator_sum / s.cycle_integrator_iterations;
+
+	run_speed(&s, &c, SIM_DETECT_ERPM_LOW);
+	float avg_running = s.cycle_integrator_sum / s.cycle_integrator_iterations;
+	avg_running -= int_limit;
+	avg_running /= (float)(int)(SIM_V_BUS * SIM_ADC_PER_VOLT);
+	avg_running *= s.rpm_now;
+
+	conf->sl_cycle_int_limit = int_limit;
+	conf->sl_bemf_coupling_k = avg_running;
+
+	printf("Detected cycle integrator limit %.1f, back-EMF coupling %.1f\n",
+			(double)conf->sl_cycle_int_limit, (double)conf->sl_bemf_coupling_k);
+	sim_check(s.cycle_integrator_iterations > 0.0 && int_limit > 0.0,
+			"cycle integrator limit detected");
+}
+
+static void run_sweep_speed(const mc_configuration *conf, float erpm, sim_result_t *res) {
+	static sim_bldc_t s;
+	mc_configuration c = *conf;
+	run_speed(&s, &c, erpm);
+
+	res->err_mean = s.timed > 0 ? s.err_sum / (double)s.timed : 0.0;
+	res->err_max = s.err_abs_max;
+	res->missed = -s.steps;
+	res->forced = s.forced;
+
+	// Replay from the state at the start of the measurement
+	bldc_sl_state_t sl;
+	memset(&sl, 0, sizeof(sl));
+	sl.int_scale = s.sl.int_scale;
+	res->isr_ns = bench_isr(&sl, &c, &s.rpm_dep);
+}
+
+static void report_sweep(const mc_configuration *conf, mc_comm_mode mode, const char *name) {
+	static const float erpms[] = {2000.0, 5000.0, 10000.0, 20000.0, 30000.0, 45000.0, 60000.0};
+	mc_configuration c = *conf;
+	c.comm_mode = mode;
+
+	printf("\n%s mode\n", name);
+	printf("%-8s %10s %10s %8s %8s %10s\n", "ERPM", "err mean", "err max", "missed", "forced", "ns/ISR");
+
+	for (unsigned int i = 0;i < sizeof(erpms) / sizeof(erpms[0]);i++) {
+		sim_result_t res;
+		run_sweep_speed(&c, erpms[i], &res);
+		printf("%-8.0f %10.2f %10.2f %8d %8d %10.1f\n",
+				(double)erpms[i], (double)res.err_mean, (double)res.err_max,
+				res.missed, res.forced, (double)res.isr_ns);
+
+		sim_check(res.missed == 0 && res.forced == 0,
+				"%s mode at %.0f ERPM keeps up with the motor", name, (double)erpms[i]);
+		if (erpms[i] >= SIM_ERR_ERPM_MIN) {
+			sim_check(fabsf(res.err_mean) < SIM_ERR_MAX,
+					"%s mode at %.0f ERPM commutates within %.0f degrees",
+					name, (double)erpms[i], SIM_ERR_MAX);
+		}
+	}
+}
+
+int main(void) {
+	mc_configuration conf;
+	sim_conf_default(&conf);
+	conf.motor_type = MOTOR_TYPE_BLDC;
+
+	run_detect(&conf);
+	report_sweep(&conf, COMM_MODE_INTEGRATE, "Integrate");
+	report_sweep(&conf, COMM_MODE_DELAY, "Delay");
+
+	return sim_failures();
+}
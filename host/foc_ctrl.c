@@ -0,0 +1,144 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+
+#include "foc_ctrl.h"
+#include "conf_general.h"
+#include "utils.h"
+#include <math.h>
+#include <string.h>
+
+/**
+ * Initialize the controller at standstill with the outputs at 50 %.
+ *
+ * @param ctrl
+ * The controller.
+ *
+ * @param conf
+ * The motor configuration to run with. It is copied.
+ *
+ * @param v_bus
+ * The initial bus voltage.
+ */
+void foc_ctrl_init(foc_ctrl_t *ctrl, const mc_configuration *conf, float v_bus) {
+	memset(ctrl, 0, sizeof(foc_ctrl_t));
+	ctrl->conf = *conf;
+	ctrl->top = SYSTEM_CORE_CLOCK / (uint32_t)conf->foc_f_sw;
+
+	foc_ctrl_update_params(ctrl);
+
+	ctrl->observer = foc_observer_get(conf->foc_observer_type);
+	ctrl->observer->init(&ctrl->observer_state);
+
+	filter_biquad_reset(&ctrl->params.filter_v_bus, &ctrl->v_bus_filter, v_bus);
+	ctrl->state.v_bus = v_bus;
+	ctrl->gamma = conf->foc_observer_gain * conf->foc_observer_gain_slow;
+
+	for (int i = 0;i < 3;i++) {
+		ctrl->duty[i] = ctrl->top / 2;
+	}
+}
+
+/**
+ * Recalculate the derived parameters, as update_derived_params does in
+ * mcpwm_foc. Has to be called after changing ctrl->conf.
+ *
+ * @param ctrl
+ * The controller.
+ */
+void foc_ctrl_update_params(foc_ctrl_t *ctrl) {
+	foc_derived_params_update(&ctrl->params, &ctrl->conf, 25.0, false);
+	foc_filters_update(&ctrl->params, &ctrl->conf);
+}
+
+/**
+ * Run one control loop iteration in the running state.
+ *
+ * @param ctrl
+ * The controller. Set state.id_target and state.iq_target before calling.
+ *
+ * @param i_alpha
+ * The sampled alpha current.
+ *
+ * @param i_beta
+ * The sampled beta current.
+ *
+ * @param v_bus
+ * The sampled bus voltage.
+ *
+ * @param phase_sensor
+ * The rotor angle to use when ctrl->sensored is set.
+ */
+void foc_ctrl_isr(foc_ctrl_t *ctrl, float i_alpha, float i_beta, float v_bus, float phase_sensor) {
+	motor_state_t *state = &ctrl->state;
+
+	if (ctrl->params_every_isr) {
+		foc_derived_params_update(&ctrl->params, &ctrl->conf, 25.0, false);
+	}
+
+	const float dt = ctrl->params.dt;
+
+	state->v_bus = filter_biquad_run(&ctrl->params.filter_v_bus, &ctrl->v_bus_filter, v_bus);
+	state->i_alpha = i_alpha;
+	state->i_beta = i_beta;
+	state->max_duty = ctrl->conf.l_max_duty;
+
+	// Run observer
+	foc_observer_input_t input;
+	input.v_alpha = state->v_alpha;
+	input.v_beta = state->v_beta;
+	input.i_alpha = i_alpha;
+	input.i_beta = i_beta;
+	input.dt = dt;
+	input.gamma = ctrl->gamma;
+	input.iterations = foc_observer_iterations(ctrl->pll_speed, dt);
+	input.speed = ctrl->pll_speed;
+	input.state_m = state;
+	input.params = &ctrl->params;
+	input.conf = &ctrl->conf;
+	ctrl->observer->update(&ctrl->observer_state, &input);
+	ctrl->phase_observer = ctrl->observer->get_phase(&ctrl->observer_state);
+
+	state->phase = ctrl->sensored ? phase_sensor : ctrl->phase_observer;
+	state->speed_rad_s = ctrl->pll_speed;
+
+	float mod_alpha, mod_beta;
+	foc_control_current(state, &ctrl->conf, &ctrl->params, dt, &mod_alpha, &mod_beta);
+	foc_svm(-mod_alpha, -mod_beta, ctrl->top, ctrl->conf.foc_modulation_mode,
+			&ctrl->duty[0], &ctrl->duty[1], &ctrl->duty[2], &state->svm_sector);
+
+	// Calculate duty cycle
+	state->duty_now = SIGN(state->vq) *
+			sqrtf(state->mod_d * state->mod_d + state->mod_q * state->mod_q) / SQRT3_BY_2;
+
+	// Run PLL for speed estimation. Observers that estimate the speed replace
+	// it when they provide the phase.
+	if (!ctrl->sensored && ctrl->observer->estimates_speed) {
+		ctrl->pll_phase = state->phase;
+		ctrl->pll_speed = ctrl->observer->get_speed(&ctrl->observer_state);
+	} else {
+		foc_pll_run(state->phase, dt, ctrl->conf.foc_pll_kp, ctrl->conf.foc_pll_ki,
+				&ctrl->pll_phase, &ctrl->pll_speed);
+	}
+
+	// Observer gain, task_observer_gain in mcpwm_foc
+	ctrl->gamma = utils_map(fabsf(state->duty_now), 0.0, 1.0,
+			ctrl->conf.foc_observer_gain * ctrl->conf.foc_observer_gain_slow,
+			ctrl->conf.foc_observer_gain);
+}
@@ -0,0 +1,60 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+
+#ifndef FOC_CTRL_H_
+#define FOC_CTRL_H_
+
+#include "datatypes.h"
+#include "foc_math.h"
+#include "foc_observer.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * The running part of the mcpwm_foc ADC interrupt handler for the host, built
+ * from the same foc_math and foc_observer functions and called in the same
+ * order. Everything that touches the hardware is replaced by arguments, and
+ * the compare values end up in duty instead of TIM1.
+ */
+
+// Types
+typedef struct {
+	mc_configuration conf;
+	foc_derived_params_t params;
+	motor_state_t state;
+	const foc_observer_t *observer;
+	foc_observer_state_t observer_state;
+	filter_biquad_state_t v_bus_filter;
+	float phase_observer;
+	float pll_phase;
+	float pll_speed;
+	float gamma;
+	bool sensored; // Control with the sensor angle instead of the observer, like with an encoder
+	bool params_every_isr; // Recalculate the derived parameters in every iteration, as before they were cached
+	uint32_t top;
+	uint32_t duty[3];
+} foc_ctrl_t;
+
+// Functions
+void foc_ctrl_init(foc_ctrl_t *ctrl, const mc_configuration *conf, float v_bus);
+void foc_ctrl_update_params(foc_ctrl_t *ctrl);
+void foc_ctrl_isr(foc_ctrl_t *ctrl, float i_alpha, float i_beta, float v_bus, float phase_sensor);
+
+#endif /* FOC_CTRL_H_ */
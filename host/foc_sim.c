@@ -0,0 +1,469 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+
+/*
+ * Runs the FOC control loop against the PMSM model and reports:
+ * - The time one control loop iteration takes on the host.
+ * - The step response of the current controller.
+ * - The angle error of the observer at a set of speeds.
+ *
+ * The time on the host is not the time on the STM32F4, but the relative
+ * difference between two versions of the code usually is similar. The exit
+ * status is the number of failed checks.
+ */
+
+#include "foc_ctrl.h"
+#include "pmsm_model.h"
+#include "sim_conf.h"
+#include "sim_util.h"
+#include "utils.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+// Settings
+#define SIM_V_BUS				36.0
+#define SIM_POLE_PAIRS			7.0
+#define SIM_STEP_CURRENT		20.0
+#define SIM_OBS_CURRENT			10.0
+#define SIM_OBS_TIME			0.3 // Simulated time per speed
+#define SIM_OBS_SETTLE_TIME		0.15 // Time before the errors are recorded
+#define SIM_BENCH_SAMPLES		20000
+#define SIM_BENCH_ERPM			20000.0
+#define SIM_DEC_ERPM			60000.0
+#define SIM_DT_ERPM				3000.0 // 50 Hz electrical, a whole number of samples per period
+#define SIM_DT_CURRENT			3.0
+#define SIM_DT_DEAD_TIME		0.3e-6 // Dead time of the inverter model in seconds
+#define SIM_DT_BAND				2.0 // Current band of the dead time error in the inverter model
+#define SIM_DT_PERIODS			10 // Electrical periods for the THD
+#define SIM_DT_HARMONICS		40
+
+// Types
+typedef struct {
+	float i_alpha;
+	float i_beta;
+	float phase;
+} sim_sample_t;
+
+typedef struct {
+	float rise; // 10 % to 90 % in seconds
+	float overshoot; // Percent
+	float settle; // Time until the current stays within 5 % in seconds
+	float id_max; // Largest d axis current during the step
+} sim_step_result_t;
+
+// Private variables
+static sim_sample_t m_bench_samples[SIM_BENCH_SAMPLES];
+
+static const char *observer_name(mc_foc_observer_type type) {
+	switch (type) {
+	case FOC_OBSERVER_TYPE_FLUX: return "Flux";
+	case FOC_OBSERVER_TYPE_SMO: return "SMO";
+	case FOC_OBSERVER_TYPE_MRAS: return "MRAS";
+	default: return "?";
+	}
+}
+
+static float erpm_to_rad_s(float erpm) {
+	return erpm * (2.0 * M_PI / 60.0);
+}
+
+static void sim_init(foc_ctrl_t *ctrl, pmsm_model_t *motor, const mc_configuration *conf, float erpm) {
+	foc_ctrl_init(ctrl, conf, SIM_V_BUS);
+	pmsm_init(motor, 1.5 * conf->foc_motor_r, 1.5 * conf->foc_motor_l,
+			conf->foc_motor_flux_linkage, SIM_POLE_PAIRS, SIM_V_BUS);
+	motor->speed = erpm_to_rad_s(erpm);
+
+	// Start at the right speed, as if the motor had been accelerated to it.
+	// The PLL takes long to get there from 0 with the default gains, and the
+	// MRAS does not pull in from far away at all.
+	ctrl->pll_speed = motor->speed;
+	ctrl->observer_state.speed = motor->speed;
+	ctrl->observer_state.mras_speed_int = motor->speed;
+}
+
+/*
+ * One control loop iteration: sample the currents, run the control loop and
+ * apply the new compare values for one period. Returns the rotor angle at the
+ * sampling point, which is the angle the observer estimates.
+ */
+static float sim_step(foc_ctrl_t *ctrl, pmsm_model_t *motor) {
+	float i_alpha, i_beta;
+	pmsm_get_i_ab(motor, &i_alpha, &i_beta);
+	const float phase = motor->phase;
+	foc_ctrl_isr(ctrl, i_alpha, i_beta, motor->v_bus, phase);
+	pmsm_step(motor, ctrl->duty, ctrl->top, ctrl->params.dt);
+	return phase;
+}
+
+/*
+ * Step the q axis current from 0 to SIM_STEP_CURRENT at a locked speed with
+ * the sensor angle, and measure the response of the motor current.
+ */
+static void run_step(const mc_configuration *conf, float erpm, sim_step_result_t *res) {
+	foc_ctrl_t ctrl;
+	pmsm_model_t motor;
+	sim_init(&ctrl, &motor, conf, erpm);
+	ctrl.sensored = true;
+
+	const float dt = ctrl.params.dt;
+
+	// Let the PLL lock before the step
+	for (int i = 0;i < (int)(0.05 / dt);i++) {
+		sim_step(&ctrl, &motor);
+	}
+
+	ctrl.state.iq_target = SIM_STEP_CURRENT;
+
+	const int samples = (int)(0.02 / dt);
+	float t_10 = -1.0, t_90 = -1.0, t_settle = 0.0;
+	float iq_max = 0.0, id_max = 0.0;
+
+	for (int i = 0;i < samples;i++) {
+		sim_step(&ctrl, &motor);
+		const float t = (float)(i + 1) * dt;
+
+		if (t_10 < 0.0 && motor.iq >= 0.1 * SIM_STEP_CURRENT) {
+			t_10 = t;
+		}
+		if (t_90 < 0.0 && motor.iq >= 0.9 * SIM_STEP_CURRENT) {
+			t_90 = t;
+		}
+		if (fabsf(motor.iq - SIM_STEP_CURRENT) > 0.05 * SIM_STEP_CURRENT) {
+			t_settle = t;
+		}
+
+		iq_max = fmaxf(iq_max, motor.iq);
+		id_max = fmaxf(id_max, fabsf(motor.id));
+	}
+
+	res->rise = (t_10 >= 0.0 && t_90 >= 0.0) ? (t_90 - t_10) : 1.0;
+	res->overshoot = 100.0 * (iq_max - SIM_STEP_CURRENT) / SIM_STEP_CURRENT;
+	res->settle = t_settle;
+	res->id_max = id_max;
+}
+
+static void print_step(const char *name, const sim_step_result_t *res) {
+	printf("%-30s rise %.2f ms, overshoot %5.1f %%, settling %5.2f ms, max |id| %5.2f A\n",
+			name, (double)(res->rise * 1e3), (double)res->overshoot,
+			(double)(res->settle * 1e3), (double)res->id_max);
+}
+
+static void report_step(const mc_configuration *conf, float erpm) {
+	sim_step_result_t res;
+	run_step(conf, erpm, &res);
+
+	char name[64];
+	snprintf(name, sizeof(name), "0 -> %.0f A at %.0f ERPM:", (double)SIM_STEP_CURRENT, (double)erpm);
+	print_step(name, &res);
+
+	sim_check(res.rise < 2e-3, "current rise time below 2 ms");
+	sim_check(res.overshoot < 25.0, "current overshoot below 25 %%");
+	sim_check(res.settle < 10e-3, "current settles within 10 ms");
+}
+
+/*
+ * The same current step at high speed with each decoupling mode. Without
+ * decoupling the cross coupling terms disturb the d axis current during the
+ * step, and the integrator has to take up the back-EMF.
+ */
+static void report_decoupling(const mc_configuration *conf_default, float erpm) {
+	const char *names[] = {"Disabled:", "Cross:", "BEMF:", "Cross and BEMF:"};
+	sim_step_result_t res[4];
+	float start_max[4];
+	mc_configuration conf = *conf_default;
+
+	for (int mode = FOC_CC_DECOUPLING_DISABLED;mode <= FOC_CC_DECOUPLING_CROSS_BEMF;mode++) {
+		conf.foc_cc_decoupling = mode;
+		run_step(&conf, erpm, &res[mode]);
+		print_step(names[mode], &res[mode]);
+	}
+
+	// Starting the controller on a motor that is already spinning, e.g. when
+	// the throttle is applied again while coasting. The integrators start at
+	// 0, so without the back-EMF feedforward the output voltage starts far
+	// below the back-EMF.
+	for (int mode = FOC_CC_DECOUPLING_DISABLED;mode <= FOC_CC_DECOUPLING_CROSS_BEMF;mode++) {
+		foc_ctrl_t ctrl;
+		pmsm_model_t motor;
+		conf.foc_cc_decoupling = mode;
+		sim_init(&ctrl, &motor, &conf, erpm);
+		ctrl.sensored = true;
+
+		start_max[mode] = 0.0;
+		for (int i = 0;i < (int)(0.02 / ctrl.params.dt);i++) {
+			sim_step(&ctrl, &motor);
+			start_max[mode] = fmaxf(start_max[mode], sqrtf(SQ(motor.id) + SQ(motor.iq)));
+		}
+
+		printf("%-30s max current after starting at 0 A: %.1f A\n", names[mode], (double)start_max[mode]);
+	}
+
+
+	const sim_step_result_t *off = &res[FOC_CC_DECOUPLING_DISABLED];
+	const sim_step_result_t *full = &res[FOC_CC_DECOUPLING_CROSS_BEMF];
+	sim_check(full->id_max < 0.5 * off->id_max,
+			"decoupling at least halves the d axis disturbance");
+	sim_check(full->settle <= off->settle, "decoupling does not slow down the settling");
+	sim_check(full->overshoot < 25.0, "current overshoot with decoupling below 25 %%");
+	sim_check(start_max[FOC_CC_DECOUPLING_CROSS_BEMF] < 0.5 * start_max[FOC_CC_DECOUPLING_DISABLED],
+			"back-EMF feedforward at least halves the start current transient");
+}
+
+static void report_observer(const mc_configuration *conf_default, float erpm, bool sensored) {
+	foc_ctrl_t ctrl;
+	pmsm_model_t motor;
+	sim_init(&ctrl, &motor, conf_default, erpm);
+	ctrl.sensored = true;
+	ctrl.state.iq_target = SIM_OBS_CURRENT;
+
+	const float dt = ctrl.params.dt;
+	const int samples = (int)(SIM_OBS_TIME / dt);
+	const int settle = (int)(SIM_OBS_SETTLE_TIME / dt);
+
+	double err_sum = 0.0, err_sq_sum = 0.0, err_max = 0.0, speed_err_sum = 0.0;
+	int n = 0;
+
+	for (int i = 0;i < samples;i++) {
+		// Start with the sensor so that the observer can converge while the
+		// current is under control, like after a sensored start.
+		if (i == settle / 2) {
+			ctrl.sensored = sensored;
+		}
+
+		const float phase = sim_step(&ctrl, &motor);
+
+		if (i >= settle) {
+			const double err = utils_angle_difference_rad(ctrl.phase_observer, phase) * (180.0 / M_PI);
+			err_sum += err;
+			err_sq_sum += err * err;
+			err_max = fmax(err_max, fabs(err));
+			speed_err_sum += ctrl.pll_speed - motor.speed;
+			n++;
+		}
+	}
+
+	const double err_mean = err_sum / n;
+	const double err_rms = sqrt(err_sq_sum / n);
+	const double speed_err = 100.0 * (speed_err_sum / n) / motor.speed;
+
+	printf("%-4s at %5.0f ERPM: angle error mean %6.2f deg, max %6.2f deg, rms %6.2f deg, "
+			"speed error %6.3f %%\n",
+			observer_name(conf_default->foc_observer_type), (double)erpm,
+			err_mean, err_max, err_rms, speed_err);
+
+	// The MRAS adapts the speed from the back-EMF only, and does not track
+	// well at low speed.
+	if (conf_default->foc_observer_type != FOC_OBSERVER_TYPE_MRAS || erpm >= 10000.0) {
+		sim_check(err_max < 10.0, "%s angle error at %.0f ERPM below 10 deg",
+				observer_name(conf_default->foc_observer_type), (double)erpm);
+	}
+}
+
+/*
+ * Current THD and observer angle error with the inverter dead time. The dead
+ * time compensation only corrects the voltage the observer gets, so it changes
+ * the current through the angle estimate in sensorless operation. The sensored
+ * case is the reference where the current controller alone works against the
+ * dead time.
+ */
+static void run_deadtime(const mc_configuration *conf, bool sensored, double *thd, double *err_rms) {
+	foc_ctrl_t ctrl;
+	pmsm_model_t motor;
+	sim_init(&ctrl, &motor, conf, SIM_DT_ERPM);
+	motor.t_dead = SIM_DT_DEAD_TIME;
+	motor.i_dead_band = SIM_DT_BAND;
+	ctrl.sensored = true;
+	ctrl.state.iq_target = SIM_DT_CURRENT;
+
+	const float dt = ctrl.params.dt;
+	const double freq = SIM_DT_ERPM / 60.0;
+	const int settle = (int)(SIM_OBS_SETTLE_TIME / dt);
+	const int samples = (int)round(SIM_DT_PERIODS / (freq * dt));
+	double re[SIM_DT_HARMONICS + 1], im[SIM_DT_HARMONICS + 1];
+	double err_sq_sum = 0.0;
+
+	memset(re, 0, sizeof(re));
+	memset(im, 0, sizeof(im));
+
+	for (int i = 0;i < (settle + samples);i++) {
+		if (i == settle / 2) {
+			ctrl.sensored = sensored;
+		}
+
+		const float phase = sim_step(&ctrl, &motor);
+
+		if (i >= settle) {
+			float i_alpha, i_beta;
+			pmsm_get_i_ab(&motor, &i_alpha, &i_beta);
+			const double t = (double)(i - settle) * dt;
+			for (int k = 1;k <= SIM_DT_HARMONICS;k++) {
+				re[k] += i_alpha * cos(2.0 * M_PI * k * freq * t);
+				im[k] += i_alpha * sin(2.0 * M_PI * k * freq * t);
+			}
+
+			const double err = utils_angle_difference_rad(ctrl.phase_observer, phase) * (180.0 / M_PI);
+			err_sq_sum += err * err;
+		}
+	}
+
+	double harm_sq_sum = 0.0;
+	for (int k = 2;k <= SIM_DT_HARMONICS;k++) {
+		harm_sq_sum += SQ(re[k]) + SQ(im[k]);
+	}
+
+	*thd = 100.0 * sqrt(harm_sq_sum / (SQ(re[1]) + SQ(im[1])));
+	*err_rms = sqrt(err_sq_sum / samples);
+}
+
+static void report_deadtime(const mc_configuration *conf_default) {
+	mc_configuration conf = *conf_default;
+	double thd_ref, thd_none, thd_sign, thd_band, err_ref, err_none, err_sign, err_band;
+
+	// The compensation is foc_dt_us * f_sw in modulation, which is 4/3 of the
+	// error of one delayed edge per period the model has.
+	conf.foc_dt_us = 0.75 * SIM_DT_DEAD_TIME * 1e6;
+	conf.foc_dt_comp_band = 0.0;
+	run_deadtime(&conf, true, &thd_ref, &err_ref);
+	run_deadtime(&conf, false, &thd_sign, &err_sign);
+	conf.foc_dt_comp_band = SIM_DT_BAND;
+	run_deadtime(&conf, false, &thd_band, &err_band);
+	conf.foc_dt_us = 0.0;
+	run_deadtime(&conf, false, &thd_none, &err_none);
+
+	printf("%-28s THD %5.2f %%\n", "Sensored", thd_ref);
+	printf("%-28s THD %5.2f %%, observer angle error rms %6.2f deg\n",
+			"Sensorless, no compensation", thd_none, err_none);
+	printf("%-28s THD %5.2f %%, observer angle error rms %6.2f deg\n",
+			"Sensorless, sign", thd_sign, err_sign);
+	printf("%-28s THD %5.2f %%, observer angle error rms %6.2f deg\n",
+			"Sensorless, band", thd_band, err_band);
+
+	sim_check(err_sign < err_none, "sign compensation reduces the observer angle error");
+	sim_check(err_band < err_sign, "band compensation reduces the observer angle error further");
+	sim_check(thd_band < thd_sign, "band compensation gives lower current THD than the sign");
+}
+
+static double bench_isr(const foc_ctrl_t *ctrl_start) {
+	foc_ctrl_t ctrl;
+	double best = 1e30;
+
+	for (int run = 0;run < SIM_BENCH_RUNS;run++) {
+		ctrl = *ctrl_start;
+		const double start = sim_time_ns();
+		for (int i = 0;i < SIM_BENCH_SAMPLES;i++) {
+			const sim_sample_t *s = &m_bench_samples[i];
+			foc_ctrl_isr(&ctrl, s->i_alpha, s->i_beta, SIM_V_BUS, s->phase);
+		}
+		const double ns = (sim_time_ns() - start) / SIM_BENCH_SAMPLES;
+		if (ns < best) {
+			best = ns;
+		}
+	}
+
+	sim_check(isfinite(ctrl.state.iq) && fabsf(ctrl.state.iq - SIM_OBS_CURRENT) < 2.0,
+			"replayed control loop tracks the current");
+
+	return best;
+}
+
+/*
+ * Record the inputs of a closed loop run for bench_isr and get the
+ * controller state at the start of the recording.
+ */
+static void bench_record(const mc_configuration *conf, foc_ctrl_t *ctrl_start) {
+	foc_ctrl_t ctrl;
+	pmsm_model_t motor;
+	sim_init(&ctrl, &motor, conf, SIM_BENCH_ERPM);
+	ctrl.sensored = true;
+	ctrl.state.iq_target = SIM_OBS_CURRENT;
+
+	for (int i = 0;i < (int)(0.1 / ctrl.params.dt);i++) {
+		sim_step(&ctrl, &motor);
+	}
+
+	*ctrl_start = ctrl;
+	for (int i = 0;i < SIM_BENCH_SAMPLES;i++) {
+		sim_sample_t *s = &m_bench_samples[i];
+		pmsm_get_i_ab(&motor, &s->i_alpha, &s->i_beta);
+		s->phase = sim_step(&ctrl, &motor);
+	}
+}
+
+static void report_bench_params(const mc_configuration *conf) {
+	foc_ctrl_t ctrl_start;
+	bench_record(conf, &ctrl_start);
+
+	const double ns = bench_isr(&ctrl_start);
+	printf("Control loop iteration: %.1f ns\n", ns);
+
+	// The derived parameters used to be calculated from the configuration
+	// in every iteration.
+	ctrl_start.params_every_isr = true;
+	const double ns_uncached = bench_isr(&ctrl_start);
+	printf("Control loop iteration with the derived parameters updated every time: %.1f ns "
+			"(%.1f ns or %.0f %% saved by caching)\n",
+			ns_uncached, ns_uncached - ns, 100.0 * (ns_uncached - ns) / ns_uncached);
+}
+
+static void report_bench_observer(const mc_configuration *conf) {
+	foc_ctrl_t ctrl_start;
+	bench_record(conf, &ctrl_start);
+	printf("Control loop iteration with the %s observer: %.1f ns\n",
+			observer_name(conf->foc_observer_type), bench_isr(&ctrl_start));
+}
+
+int main(void) {
+	mc_configuration conf;
+	sim_conf_default(&conf);
+
+	printf("=== ISR cost ===\n");
+	report_bench_params(&conf);
+	for (int type = FOC_OBSERVER_TYPE_FLUX;type <= FOC_OBSERVER_TYPE_MRAS;type++) {
+		conf.foc_observer_type = type;
+		report_bench_observer(&conf);
+	}
+	sim_conf_default(&conf);
+
+	printf("\n=== Current controller step response ===\n");
+	report_step(&conf, 0.0);
+	report_step(&conf, 20000.0);
+
+	printf("\n=== Current step at %.0f ERPM with each decoupling mode ===\n", (double)SIM_DEC_ERPM);
+	report_decoupling(&conf, SIM_DEC_ERPM);
+
+	printf("\n=== Dead time of %.1f us at %.0f ERPM and %.0f A, %.0f A current band ===\n",
+			SIM_DT_DEAD_TIME * 1e6, SIM_DT_ERPM, SIM_DT_CURRENT, SIM_DT_BAND);
+	report_deadtime(&conf);
+
+	const float erpms[] = {2000.0, 5000.0, 10000.0, 20000.0, 40000.0, 60000.0};
+	for (int sensored = 1;sensored >= 0;sensored--) {
+		printf("\n=== Observer angle error, %s control at %.0f A ===\n",
+				sensored ? "sensored" : "sensorless", (double)SIM_OBS_CURRENT);
+		for (int type = FOC_OBSERVER_TYPE_FLUX;type <= FOC_OBSERVER_TYPE_MRAS;type++) {
+			conf.foc_observer_type = type;
+			for (unsigned int i = 0;i < sizeof(erpms) / sizeof(erpms[0]);i++) {
+				report_observer(&conf, erpms[i], sensored);
+			}
+		}
+	}
+
+	return sim_failures();
+}
@@ -0,0 +1,168 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "pmsm_model.h"
+#include <math.h>
+#include <string.h>
+
+/**
+ * Initialize a motor model at standstill with an ideal inverter, a locked
+ * speed and no load. Change the parameters in the struct for anything else.
+ *
+ * @param m
+ * The model.
+ *
+ * @param r
+ * Phase resistance.
+ *
+ * @param l
+ * Phase inductance, used for both axes.
+ *
+ * @param lambda
+ * Flux linkage.
+ *
+ * @param pole_pairs
+ * Number of pole pairs.
+ *
+ * @param v_bus
+ * Bus voltage.
+ */
+void pmsm_init(pmsm_model_t *m, float r, float l, float lambda, float pole_pairs, float v_bus) {
+	memset(m, 0, sizeof(pmsm_model_t));
+	m->r = r;
+	m->ld = l;
+	m->lq = l;
+	m->lambda = lambda;
+	m->pole_pairs = pole_pairs;
+	m->j = 1e-4;
+	m->b = 1e-5;
+	m->v_bus = v_bus;
+	m->speed_locked = true;
+}
+
+/**
+ * Run the model for one PWM period.
+ *
+ * @param m
+ * The model.
+ *
+ * @param duty
+ * The compare values of the three legs, as written to TIM1 by the firmware.
+ *
+ * @param top
+ * The timer top value. Compare values above it keep the high side on.
+ *
+ * @param dt
+ * The PWM period in seconds.
+ */
+void pmsm_step(pmsm_model_t *m, const uint32_t *duty, uint32_t top, float dt) {
+	float i_alpha, i_beta;
+	pmsm_get_i_ab(m, &i_alpha, &i_beta);
+	const double i_ph[3] = {
+			i_alpha,
+			-0.5 * i_alpha + (sqrt(3.0) / 2.0) * i_beta,
+			-0.5 * i_alpha - (sqrt(3.0) / 2.0) * i_beta
+	};
+
+	double v_leg[3];
+	for (int i = 0;i < 3;i++) {
+		const bool clamped = duty[i] == 0 || duty[i] >= top;
+		double d = (double)(duty[i] > top ? top : duty[i]) / (double)top;
+
+		// While both switches are off the diode of the side the current flows
+		// towards conducts, which delays one edge per period.
+		if (!clamped && m->t_dead > 0.0) {
+			double err = i_ph[i] > 0.0 ? 1.0 : -1.0;
+			if (m->i_dead_band > 0.0 && fabs(i_ph[i]) < m->i_dead_band) {
+				err = i_ph[i] / m->i_dead_band;
+			}
+			d -= err * m->t_dead / dt;
+			if (d < 0.0) {
+				d = 0.0;
+			} else if (d > 1.0) {
+				d = 1.0;
+			}
+		}
+
+		v_leg[i] = d * m->v_bus;
+	}
+
+	const double v_alpha = (2.0 * v_leg[0] - v_leg[1] - v_leg[2]) / 3.0;
+	const double v_beta = (v_leg[1] - v_leg[2]) / sqrt(3.0);
+
+	double id = m->id;
+	double iq = m->iq;
+	double speed = m->speed;
+	double phase = m->phase;
+	double torque = 0.0;
+	const double h = dt / (double)PMSM_SUBSTEPS;
+
+	for (int i = 0;i < PMSM_SUBSTEPS;i++) {
+		const double c = cos(phase);
+		const double s = sin(phase);
+		const double vd = c * v_alpha + s * v_beta;
+		const double vq = c * v_beta - s * v_alpha;
+
+		const double did = (vd - m->r * id + speed * m->lq * iq) / m->ld;
+		const double diq = (vq - m->r * iq - speed * m->ld * id - speed * m->lambda) / m->lq;
+		id += did * h;
+		iq += diq * h;
+
+		torque = 1.5 * m->pole_pairs * (m->lambda * iq + (m->ld - m->lq) * id * iq);
+
+		if (!m->speed_locked) {
+			const double speed_mech = speed / m->pole_pairs;
+			const double acc = (torque - m->b * speed_mech - m->load) / m->j;
+			speed += acc * m->pole_pairs * h;
+		}
+
+		phase += speed * h;
+		if (phase > M_PI) {
+			phase -= 2.0 * M_PI;
+		} else if (phase < -M_PI) {
+			phase += 2.0 * M_PI;
+		}
+	}
+
+	m->id = id;
+	m->iq = iq;
+	m->speed = speed;
+	m->phase = phase;
+	m->torque = torque;
+}
+
+/**
+ * Get the stator current in the stationary frame, as the firmware gets it
+ * from the Clarke transform of the phase currents.
+ *
+ * @param m
+ * The model.
+ *
+ * @param i_alpha
+ * The alpha current.
+ *
+ * @param i_beta
+ * The beta current.
+ */
+void pmsm_get_i_ab(const pmsm_model_t *m, float *i_alpha, float *i_beta) {
+	const float c = cosf(m->phase);
+	const float s = sinf(m->phase);
+	*i_alpha = c * m->id - s * m->iq;
+	*i_beta = s * m->id + c * m->iq;
+}
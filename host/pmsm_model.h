@@ -0,0 +1,70 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef PMSM_MODEL_H_
+#define PMSM_MODEL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Electrical and mechanical model of a PMSM driven by a three phase inverter,
+ * for running the FOC code on the host. The inverter is averaged over each
+ * PWM period: the leg voltages follow from the compare values the same way
+ * as with TIM1 in PWM mode 1 (high side on while the counter is below the
+ * compare value), with an optional dead time voltage error. At low current the
+ * switch node capacitance is not fully recharged during the dead time, so the
+ * error can be made to ramp up through i_dead_band. The electrical
+ * model is in the rotor frame with amplitude invariant transforms, so R and
+ * L are the phase values, i.e. 1.5 * foc_motor_r and 1.5 * foc_motor_l.
+ */
+
+// Settings
+#define PMSM_SUBSTEPS				20 // Integration steps per PWM period
+
+// Types
+typedef struct {
+	// Parameters
+	float r; // Phase resistance
+	float ld; // D axis inductance
+	float lq; // Q axis inductance
+	float lambda; // Flux linkage
+	float pole_pairs;
+	float j; // Inertia in kg*m^2
+	float b; // Viscous friction in Nm/(rad/s)
+	float load; // Load torque in Nm
+	float v_bus;
+	float t_dead; // Dead time in seconds, 0 for an ideal inverter
+	float i_dead_band; // Current where the dead time error is fully developed, 0 for a step at zero current
+	bool speed_locked; // Keep the speed constant, like on a dynamometer
+
+	// State
+	float id;
+	float iq;
+	float speed; // Electrical speed in rad/s
+	float phase; // Electrical angle in rad, -pi to pi
+	float torque;
+} pmsm_model_t;
+
+// Functions
+void pmsm_init(pmsm_model_t *m, float r, float l, float lambda, float pole_pairs, float v_bus);
+void pmsm_step(pmsm_model_t *m, const uint32_t *duty, uint32_t top, float dt);
+void pmsm_get_i_ab(const pmsm_model_t *m, float *i_alpha, float *i_beta);
+
+#endif /* PMSM_MODEL_H_ */
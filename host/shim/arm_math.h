@@ -0,0 +1,67 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef ARM_MATH_H_
+#define ARM_MATH_H_
+
+/*
+ * Stand-in for the CMSIS DSP header on the host, with a plain C version of
+ * arm_fir_f32 that has the same interface and state layout as the library.
+ * It is only used to build filter_fir_process_block with
+ * FILTER_FIR_USE_CMSIS, see test_fir.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+typedef float float32_t;
+
+typedef struct {
+	uint16_t numTaps;
+	float32_t *pState; // numTaps - 1 previous samples followed by the block
+	float32_t *pCoeffs; // The first coefficient is applied to the newest sample
+} arm_fir_instance_f32;
+
+static inline void arm_fir_init_f32(arm_fir_instance_f32 *S, uint16_t numTaps,
+		float32_t *pCoeffs, float32_t *pState, uint32_t blockSize) {
+	S->numTaps = numTaps;
+	S->pCoeffs = pCoeffs;
+	S->pState = pState;
+	memset(pState, 0, sizeof(float32_t) * (numTaps + blockSize - 1));
+}
+
+static inline void arm_fir_f32(const arm_fir_instance_f32 *S, float32_t *pSrc,
+		float32_t *pDst, uint32_t blockSize) {
+	const int taps = S->numTaps;
+	float32_t *state = S->pState;
+
+	for (uint32_t n = 0;n < blockSize;n++) {
+		state[taps - 1 + n] = pSrc[n];
+
+		float32_t acc = 0.0;
+		for (int k = 0;k < taps;k++) {
+			acc += S->pCoeffs[k] * state[taps - 1 + n - k];
+		}
+		pDst[n] = acc;
+	}
+
+	memmove(state, state + blockSize, sizeof(float32_t) * (taps - 1));
+}
+
+#endif /* ARM_MATH_H_ */
@@ -0,0 +1,42 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef CH_H_
+#define CH_H_
+
+/*
+ * Minimal stand-in for the ChibiOS kernel header, so that the hardware
+ * independent modules (utils, digital_filter, foc_math, foc_observer,
+ * bldc_math, speed_pid, derate) can be compiled on the host. Only what these
+ * modules use is provided. There are no threads or interrupts on the host, so
+ * locking does nothing.
+ */
+
+#include <stdint.h>
+
+typedef uint32_t systime_t;
+
+#define CH_CFG_ST_FREQUENCY			10000
+
+static inline void chSysLock(void) {}
+static inline void chSysUnlock(void) {}
+static inline systime_t chVTGetSystemTimeX(void) { return 0; }
+static inline systime_t chVTTimeElapsedSinceX(systime_t start) { (void)start; return 0; }
+
+#endif /* CH_H_ */
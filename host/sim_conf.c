@@ -0,0 +1,187 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "sim_conf.h"
+#include "mcconf_default.h"
+#include <string.h>
+
+/**
+ * Get the default motor configuration, the same way as
+ * conf_general_get_default_mc_configuration does it on the hardware but
+ * without the hardware specific overrides.
+ *
+ * @param conf
+ * The configuration to fill.
+ */
+void sim_conf_default(mc_configuration *conf) {
+	memset(conf, 0, sizeof(mc_configuration));
+	conf->pwm_mode = MCCONF_PWM_MODE;
+	conf->comm_mode = MCCONF_COMM_MODE;
+	conf->motor_type = MCCONF_DEFAULT_MOTOR_TYPE;
+	conf->sensor_mode = MCCONF_SENSOR_MODE;
+
+	conf->l_current_max = MCCONF_L_CURRENT_MAX;
+	conf->l_current_min = MCCONF_L_CURRENT_MIN;
+	conf->l_in_current_max = MCCONF_L_IN_CURRENT_MAX;
+	conf->l_in_current_min = MCCONF_L_IN_CURRENT_MIN;
+	conf->l_abs_current_max = MCCONF_L_MAX_ABS_CURRENT;
+	conf->l_min_erpm = MCCONF_L_RPM_MIN;
+	conf->l_max_erpm = MCCONF_L_RPM_MAX;
+	conf->l_erpm_start = MCCONF_L_RPM_START;
+	conf->l_max_erpm_fbrake = MCCONF_L_CURR_MAX_RPM_FBRAKE;
+	conf->l_max_erpm_fbrake_cc = MCCONF_L_CURR_MAX_RPM_FBRAKE_CC;
+	conf->l_min_vin = MCCONF_L_MIN_VOLTAGE;
+	conf->l_max_vin = MCCONF_L_MAX_VOLTAGE;
+	conf->l_battery_cut_start = MCCONF_L_BATTERY_CUT_START;
+	conf->l_battery_cut_end = MCCONF_L_BATTERY_CUT_END;
+	conf->l_slow_abs_current = MCCONF_L_SLOW_ABS_OVERCURRENT;
+	conf->l_temp_fet_start = MCCONF_L_LIM_TEMP_FET_START;
+	conf->l_temp_fet_end = MCCONF_L_LIM_TEMP_FET_END;
+	conf->l_temp_motor_start = MCCONF_L_LIM_TEMP_MOTOR_START;
+	conf->l_temp_motor_end = MCCONF_L_LIM_TEMP_MOTOR_END;
+	conf->l_temp_accel_dec = MCCONF_L_LIM_TEMP_ACCEL_DEC;
+	conf->l_min_duty = MCCONF_L_MIN_DUTY;
+	conf->l_max_duty = MCCONF_L_MAX_DUTY;
+	conf->l_watt_max = MCCONF_L_WATT_MAX;
+	conf->l_watt_min = MCCONF_L_WATT_MIN;
+
+	conf->lo_current_max = conf->l_current_max;
+	conf->lo_current_min = conf->l_current_min;
+	conf->lo_in_current_max = conf->l_in_current_max;
+	conf->lo_in_current_min = conf->l_in_current_min;
+	conf->lo_current_motor_max_now = conf->l_current_max;
+	conf->lo_current_motor_min_now = conf->l_current_min;
+
+	conf->sl_min_erpm = MCCONF_SL_MIN_RPM;
+	conf->sl_max_fullbreak_current_dir_change = MCCONF_SL_MAX_FB_CURR_DIR_CHANGE;
+	conf->sl_min_erpm_cycle_int_limit = MCCONF_SL_MIN_ERPM_CYCLE_INT_LIMIT;
+	conf->sl_cycle_int_limit = MCCONF_SL_CYCLE_INT_LIMIT;
+	conf->sl_phase_advance_at_br = MCCONF_SL_PHASE_ADVANCE_AT_BR;
+	conf->sl_cycle_int_rpm_br = MCCONF_SL_CYCLE_INT_BR;
+	conf->sl_bemf_coupling_k = MCCONF_SL_BEMF_COUPLING_K;
+
+	conf->hall_table[0] = MCCONF_HALL_TAB_0;
+	conf->hall_table[1] = MCCONF_HALL_TAB_1;
+	conf->hall_table[2] = MCCONF_HALL_TAB_2;
+	conf->hall_table[3] = MCCONF_HALL_TAB_3;
+	conf->hall_table[4] = MCCONF_HALL_TAB_4;
+	conf->hall_table[5] = MCCONF_HALL_TAB_5;
+	conf->hall_table[6] = MCCONF_HALL_TAB_6;
+	conf->hall_table[7] = MCCONF_HALL_TAB_7;
+	conf->hall_sl_erpm = MCCONF_HALL_ERPM;
+
+	conf->foc_current_kp = MCCONF_FOC_CURRENT_KP;
+	conf->foc_current_ki = MCCONF_FOC_CURRENT_KI;
+	conf->foc_f_sw = MCCONF_FOC_F_SW;
+	conf->foc_dt_us = MCCONF_FOC_DT_US;
+	conf->foc_encoder_inverted = MCCONF_FOC_ENCODER_INVERTED;
+	conf->foc_encoder_offset = MCCONF_FOC_ENCODER_OFFSET;
+	conf->foc_encoder_ratio = MCCONF_FOC_ENCODER_RATIO;
+	conf->foc_sensor_mode = MCCONF_FOC_SENSOR_MODE;
+	conf->foc_pll_kp = MCCONF_FOC_PLL_KP;
+	conf->foc_pll_ki = MCCONF_FOC_PLL_KI;
+	conf->foc_motor_l = MCCONF_FOC_MOTOR_L;
+	conf->foc_motor_r = MCCONF_FOC_MOTOR_R;
+	conf->foc_motor_flux_linkage = MCCONF_FOC_MOTOR_FLUX_LINKAGE;
+	conf->foc_observer_gain = MCCONF_FOC_OBSERVER_GAIN;
+	conf->foc_observer_gain_slow = MCCONF_FOC_OBSERVER_GAIN_SLOW;
+	conf->foc_duty_dowmramp_kp = MCCONF_FOC_DUTY_DOWNRAMP_KP;
+	conf->foc_duty_dowmramp_ki = MCCONF_FOC_DUTY_DOWNRAMP_KI;
+	conf->foc_openloop_rpm = MCCONF_FOC_OPENLOOP_RPM;
+	conf->foc_sl_openloop_hyst = MCCONF_FOC_SL_OPENLOOP_HYST;
+	conf->foc_sl_openloop_time = MCCONF_FOC_SL_OPENLOOP_TIME;
+	conf->foc_sl_d_current_duty = MCCONF_FOC_SL_D_CURRENT_DUTY;
+	conf->foc_sl_d_current_factor = MCCONF_FOC_SL_D_CURRENT_FACTOR;
+	conf->foc_hall_table[0] = MCCONF_FOC_HALL_TAB_0;
+	conf->foc_hall_table[1] = MCCONF_FOC_HALL_TAB_1;
+	conf->foc_hall_table[2] = MCCONF_FOC_HALL_TAB_2;
+	conf->foc_hall_table[3] = MCCONF_FOC_HALL_TAB_3;
+	conf->foc_hall_table[4] = MCCONF_FOC_HALL_TAB_4;
+	conf->foc_hall_table[5] = MCCONF_FOC_HALL_TAB_5;
+	conf->foc_hall_table[6] = MCCONF_FOC_HALL_TAB_6;
+	conf->foc_hall_table[7] = MCCONF_FOC_HALL_TAB_7;
+	memset(conf->foc_hall_edge_corr, 0, sizeof(conf->foc_hall_edge_corr));
+	conf->foc_sl_erpm = MCCONF_FOC_SL_ERPM;
+	conf->foc_sample_v0_v7 = MCCONF_FOC_SAMPLE_V0_V7;
+	conf->foc_sample_high_current = MCCONF_FOC_SAMPLE_HIGH_CURRENT;
+	conf->foc_sat_comp = MCCONF_FOC_SAT_COMP;
+	conf->foc_temp_comp = MCCONF_FOC_TEMP_COMP;
+	conf->foc_temp_comp_base_temp = MCCONF_FOC_TEMP_COMP_BASE_TEMP;
+	conf->foc_current_filter_const = MCCONF_FOC_CURRENT_FILTER_CONST;
+	conf->foc_observer_type = MCCONF_FOC_OBSERVER_TYPE;
+	conf->foc_fw_current_max = MCCONF_FOC_FW_CURRENT_MAX;
+	conf->foc_fw_duty_start = MCCONF_FOC_FW_DUTY_START;
+	conf->foc_fw_ramp_time = MCCONF_FOC_FW_RAMP_TIME;
+	conf->foc_motor_ld = MCCONF_FOC_MOTOR_LD;
+	conf->foc_motor_lq = MCCONF_FOC_MOTOR_LQ;
+	conf->foc_mtpa_enable = MCCONF_FOC_MTPA_ENABLE;
+	conf->foc_cc_decoupling = MCCONF_FOC_CC_DECOUPLING;
+	conf->foc_modulation_mode = MCCONF_FOC_MODULATION_MODE;
+	conf->foc_dt_comp_band = MCCONF_FOC_DT_COMP_BAND;
+	conf->foc_hfi_voltage = MCCONF_FOC_HFI_VOLTAGE;
+	conf->foc_hfi_erpm = MCCONF_FOC_HFI_ERPM;
+	conf->foc_rls_enable = MCCONF_FOC_RLS_ENABLE;
+	conf->foc_encoder_comp_enable = MCCONF_FOC_ENCODER_COMP_ENABLE;
+	conf->foc_cogging_comp_enable = MCCONF_FOC_COGGING_COMP_ENABLE;
+	conf->foc_encoder_comp_scale = 0.0;
+	conf->foc_cogging_comp_scale = 0.0;
+	memset(conf->foc_encoder_comp_table, 0, sizeof(conf->foc_encoder_comp_table));
+	memset(conf->foc_cogging_comp_table, 0, sizeof(conf->foc_cogging_comp_table));
+
+	conf->s_pid_kp = MCCONF_S_PID_KP;
+	conf->s_pid_ki = MCCONF_S_PID_KI;
+	conf->s_pid_kd = MCCONF_S_PID_KD;
+	conf->s_pid_kd_filter = MCCONF_S_PID_KD_FILTER;
+	conf->s_pid_min_erpm = MCCONF_S_PID_MIN_RPM;
+	conf->s_pid_allow_braking = MCCONF_S_PID_ALLOW_BRAKING;
+	conf->s_pid_ff_acc = MCCONF_S_PID_FF_ACC;
+	conf->s_pid_sched_points = MCCONF_S_PID_SCHED_POINTS;
+	for (int i = 0;i < S_PID_SCHED_LEN;i++) {
+		conf->s_pid_sched_erpm[i] = 0.0;
+		conf->s_pid_sched_kp[i] = 1.0;
+		conf->s_pid_sched_ki[i] = 1.0;
+		conf->s_pid_sched_kd[i] = 1.0;
+	}
+
+	conf->p_pid_kp = MCCONF_P_PID_KP;
+	conf->p_pid_ki = MCCONF_P_PID_KI;
+	conf->p_pid_kd = MCCONF_P_PID_KD;
+	conf->p_pid_kd_filter = MCCONF_P_PID_KD_FILTER;
+	conf->p_pid_ang_div = MCCONF_P_PID_ANG_DIV;
+	conf->p_pid_ff_vel = MCCONF_P_PID_FF_VEL;
+	conf->p_pid_ff_acc = MCCONF_P_PID_FF_ACC;
+
+	conf->cc_startup_boost_duty = MCCONF_CC_STARTUP_BOOST_DUTY;
+	conf->cc_min_current = MCCONF_CC_MIN_CURRENT;
+	conf->cc_gain = MCCONF_CC_GAIN;
+	conf->cc_ramp_step_max = MCCONF_CC_RAMP_STEP;
+
+	conf->m_fault_stop_time_ms = MCCONF_M_FAULT_STOP_TIME;
+	conf->m_duty_ramp_step = MCCONF_M_RAMP_STEP;
+	conf->m_current_backoff_gain = MCCONF_M_CURRENT_BACKOFF_GAIN;
+	conf->m_encoder_counts = MCCONF_M_ENCODER_COUNTS;
+	conf->m_sensor_port_mode = MCCONF_M_SENSOR_PORT_MODE;
+	conf->m_invert_direction = MCCONF_M_INVERT_DIRECTION;
+	conf->m_drv8301_oc_mode = MCCONF_M_DRV8301_OC_MODE;
+	conf->m_drv8301_oc_adj = MCCONF_M_DRV8301_OC_ADJ;
+	conf->m_bldc_f_sw_min = MCCONF_M_BLDC_F_SW_MIN;
+	conf->m_bldc_f_sw_max = MCCONF_M_BLDC_F_SW_MAX;
+	conf->m_dc_f_sw = MCCONF_M_DC_F_SW;
+	conf->m_ntc_motor_beta = MCCONF_M_NTC_MOTOR_BETA;
+}
@@ -0,0 +1,70 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "sim_util.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+
+// Private variables
+static int m_failures = 0;
+
+/**
+ * Get a monotonic time stamp.
+ *
+ * @return
+ * The time in nanoseconds.
+ */
+double sim_time_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+/**
+ * Print the result of a check and count it if it failed.
+ *
+ * @param ok
+ * True if the check passed.
+ *
+ * @param fmt
+ * printf style description of the check.
+ */
+void sim_check(bool ok, const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	printf("%s ", ok ? "PASS" : "FAIL");
+	vprintf(fmt, args);
+	printf("\n");
+	va_end(args);
+
+	if (!ok) {
+		m_failures++;
+	}
+}
+
+/**
+ * Get the number of failed checks, to be returned from main.
+ *
+ * @return
+ * The number of failed checks.
+ */
+int sim_failures(void) {
+	return m_failures;
+}
@@ -0,0 +1,38 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef SIM_UTIL_H_
+#define SIM_UTIL_H_
+
+#include <stdbool.h>
+
+/*
+ * Helpers shared by the host programs: timing, and reporting of the checks so
+ * that the programs can be used as tests.
+ */
+
+// Settings
+#define SIM_BENCH_RUNS				15 // Repetitions of each benchmark, the fastest one is reported
+
+// Functions
+double sim_time_ns(void);
+void sim_check(bool ok, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+int sim_failures(void);
+
+#endif /* SIM_UTIL_H_ */
@@ -0,0 +1,203 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Frequency response of the biquad low pass designs in digital_filter. Sines
+ * are run through filter_biquad_run and the gain after settling is compared
+ * with the response of the design: the bilinear transform of a second order
+ * low pass for filter_biquad_lowpass, and a single matched pole for
+ * filter_biquad_lowpass_1st. Both are checked to be -3 dB at the cutoff, and
+ * the first order design against UTILS_LP_FAST with the same constant.
+ */
+
+#include "digital_filter.h"
+#include "utils.h"
+#include "sim_util.h"
+#include <stdio.h>
+#include <math.h>
+
+// Settings
+#define BQ_Q					0.7071
+#define BQ_MEASURE_SAMPLES		20000 // Minimum samples the gain is measured over
+#define BQ_SETTLE_TAU			20.0 // Time constants to wait before measuring
+#define BQ_GAIN_ERR_MAX			0.02 // dB
+#define BQ_CUT_ERR_MAX			0.05 // dB, -3 dB at the cutoff
+#define BQ_CUT_1ST_RATIO_MAX	0.01 // Largest f_cut / f_s where the first order design is checked at the cutoff
+#define BQ_LP_FAST_ERR_MAX		1e-5
+#define BQ_BENCH_SAMPLES		100000
+#define BQ_RESET_VALUE			3.0
+#define BQ_RESET_ERR_MAX		1e-4 // Relative, the DC gain is 1 within the float precision of the coefficients
+
+// Private variables
+static volatile float m_sink;
+
+static double db(double gain) {
+	return 20.0 * log10(gain);
+}
+
+// Gain of a sine at f after the response has settled
+static double measure_gain(const filter_biquad_coeffs_t *c, float f, float f_s, float f_cut) {
+	filter_biquad_state_t st;
+	filter_biquad_reset(c, &st, 0.0);
+
+	const double w = 2.0 * M_PI * (double)f / (double)f_s;
+	const int settle = (int)(BQ_SETTLE_TAU * f_s / (2.0 * M_PI * f_cut));
+	const double periods = ceil((double)BQ_MEASURE_SAMPLES * w / (2.0 * M_PI));
+	const int len = (int)round(periods * 2.0 * M_PI / w);
+
+	double sum_s = 0.0, sum_c = 0.0;
+	for (int i = 0;i < settle + len;i++) {
+		const double y = filter_biquad_run(c, &st, (float)sin(w * (double)i));
+		if (i >= settle) {
+			sum_s += y * sin(w * (double)i);
+			sum_c += y * cos(w * (double)i);
+		}
+	}
+
+	return 2.0 * sqrt(sum_s * sum_s + sum_c * sum_c) / (double)len;
+}
+
+static double design_gain_2nd(float f, float f_s, float f_cut) {
+	// The bilinear transform maps the analog response at tan(pi * f / f_s)
+	const double k = tan(M_PI * (double)f / (double)f_s) / tan(M_PI * (double)f_cut / (double)f_s);
+	const double re = 1.0 - k * k;
+	const double im = k / BQ_Q;
+	return 1.0 / sqrt(re * re + im * im);
+}
+
+static double design_gain_1st(float f, float f_s, float f_cut) {
+	const double k = 1.0 - exp(-2.0 * M_PI * (double)f_cut / (double)f_s);
+	const double w = 2.0 * M_PI * (double)f / (double)f_s;
+	const double re = 1.0 - (1.0 - k) * cos(w);
+	const double im = (1.0 - k) * sin(w);
+	return k / sqrt(re * re + im * im);
+}
+
+static void report_response(float f_s, float f_cut) {
+	static const float ratios[] = {0.1, 0.5, 1.0, 2.0, 5.0};
+	filter_biquad_coeffs_t c2, c1;
+	filter_biquad_lowpass(&c2, f_cut, f_s, BQ_Q);
+	filter_biquad_lowpass_1st(&c1, f_cut, f_s);
+
+	double err2 = 0.0, err1 = 0.0;
+	double cut2 = 0.0, cut1 = 0.0;
+
+	printf("f_s %6.0f Hz, f_cut %7.1f Hz:", (double)f_s, (double)f_cut);
+	for (unsigned int i = 0;i < sizeof(ratios) / sizeof(ratios[0]);i++) {
+		const float f = ratios[i] * f_cut;
+		if (f >= 0.45 * f_s) {
+			continue;
+		}
+
+		const double g2 = measure_gain(&c2, f, f_s, f_cut);
+		const double g1 = measure_gain(&c1, f, f_s, f_cut);
+		err2 = fmax(err2, fabs(db(g2) - db(design_gain_2nd(f, f_s, f_cut))));
+		err1 = fmax(err1, fabs(db(g1) - db(design_gain_1st(f, f_s, f_cut))));
+
+		if (ratios[i] == 1.0) {
+			cut2 = db(g2);
+			cut1 = db(g1);
+		}
+
+		printf(" %5.2f/%5.2f", db(g2), db(g1));
+	}
+	printf(" dB\n");
+
+	sim_check(err2 < BQ_GAIN_ERR_MAX && err1 < BQ_GAIN_ERR_MAX,
+			"f_s %.0f Hz, f_cut %.1f Hz follows the design within %.2f dB (%.3f, %.3f)",
+			(double)f_s, (double)f_cut, BQ_GAIN_ERR_MAX, err2, err1);
+	sim_check(fabs(cut2 + 10.0 * log10(2.0)) < BQ_CUT_ERR_MAX,
+			"f_s %.0f Hz, f_cut %.1f Hz second order -3 dB at the cutoff (%.3f)",
+			(double)f_s, (double)f_cut, cut2);
+
+	if (f_cut <= BQ_CUT_1ST_RATIO_MAX * f_s) {
+		sim_check(fabs(cut1 + 10.0 * log10(2.0)) < BQ_CUT_ERR_MAX,
+				"f_s %.0f Hz, f_cut %.1f Hz first order -3 dB at the cutoff (%.3f)",
+				(double)f_s, (double)f_cut, cut1);
+	}
+}
+
+static void report_lp_fast(float filter_const, float f_s) {
+	filter_biquad_coeffs_t c;
+	filter_biquad_state_t st;
+	filter_biquad_lowpass_1st(&c, filter_lp_const_to_freq(filter_const, f_s), f_s);
+	filter_biquad_reset(&c, &st, 0.0);
+
+	float lp = 0.0;
+	double err = 0.0;
+	for (int i = 0;i < BQ_BENCH_SAMPLES;i++) {
+		const float x = (i / 500) % 2 ? 1.0 : -1.0;
+		UTILS_LP_FAST(lp, x, filter_const);
+		err = fmax(err, fabs((double)filter_biquad_run(&c, &st, x) - (double)lp));
+	}
+
+	double best_lp = 1e30, best_bq = 1e30;
+	for (int run = 0;run < SIM_BENCH_RUNS;run++) {
+		double start = sim_time_ns();
+		for (int i = 0;i < BQ_BENCH_SAMPLES;i++) {
+			UTILS_LP_FAST(lp, (float)(i & 1), filter_const);
+		}
+		best_lp = fmin(best_lp, (sim_time_ns() - start) / BQ_BENCH_SAMPLES);
+		m_sink = lp;
+
+		start = sim_time_ns();
+		for (int i = 0;i < BQ_BENCH_SAMPLES;i++) {
+			m_sink = filter_biquad_run(&c, &st, (float)(i & 1));
+		}
+		best_bq = fmin(best_bq, (sim_time_ns() - start) / BQ_BENCH_SAMPLES);
+	}
+
+	printf("UTILS_LP_FAST(%.2f) at %.0f Hz: max difference %.1e, %.1f ns against %.1f ns\n",
+			(double)filter_const, (double)f_s, err, best_bq, best_lp);
+	sim_check(err < BQ_LP_FAST_ERR_MAX, "first order design matches UTILS_LP_FAST(%.2f) at %.0f Hz",
+			(double)filter_const, (double)f_s);
+}
+
+static void report_reset(void) {
+	filter_biquad_coeffs_t c;
+	filter_biquad_state_t st;
+	filter_biquad_lowpass(&c, 100.0, 10000.0, BQ_Q);
+	filter_biquad_reset(&c, &st, BQ_RESET_VALUE);
+
+	double err = 0.0;
+	for (int i = 0;i < 1000;i++) {
+		err = fmax(err, fabs((double)filter_biquad_run(&c, &st, BQ_RESET_VALUE) - BQ_RESET_VALUE));
+	}
+	err /= BQ_RESET_VALUE;
+
+	sim_check(err < BQ_RESET_ERR_MAX, "filter_biquad_reset starts without a transient (%.1e)", err);
+}
+
+int main(void) {
+	printf("=== Gain at 0.1, 0.5, 1, 2 and 5 times the cutoff, second/first order ===\n");
+	report_response(1000.0, 16.8); // The mcpwm speed and MOSFET temperature filters
+	report_response(1000.0, 1.6);
+	report_response(10000.0, 100.0);
+	report_response(10000.0, 1000.0);
+	report_response(20000.0, 200.0);
+	report_response(40000.0, 4000.0);
+
+	printf("\n=== First order against UTILS_LP_FAST ===\n");
+	report_lp_fast(0.1, 1000.0);
+	report_lp_fast(0.01, 10000.0);
+
+	report_reset();
+
+	return sim_failures();
+}
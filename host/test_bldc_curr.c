@@ -0,0 +1,197 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Compares the bus current shunt selection of BLDC mode in bldc_math with
+ * the nested switch statements that mcpwm_adc_inj_int_handler used before,
+ * for both shunt layouts, and reports the time per sample of both. The
+ * samples are a sequence of commutations in both directions with random
+ * phase currents.
+ */
+
+#include "bldc_math.h"
+#include "sim_util.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// Settings
+#define CURR_POINTS				100000
+
+// Types
+typedef struct {
+	int direction;
+	int comm_step;
+	int curr[3];
+} curr_point_t;
+
+// Private variables
+static curr_point_t m_points[CURR_POINTS];
+static int m_switch_comm_step_prev;
+static float m_switch_prev_tot_sample;
+static volatile float m_sink;
+
+/*
+ * The shunt selection as it was in mcpwm, with HW_HAS_3_SHUNTS as an
+ * argument.
+ */
+static float curr_switch(bool three_shunts, int direction, int comm_step, const volatile int *curr_norm) {
+	float curr_tot_sample = 0.0;
+
+	if (three_shunts) {
+		if (direction) {
+			switch (comm_step) {
+			case 1: curr_tot_sample = -(float)curr_norm[2]; break;
+			case 2: curr_tot_sample = -(float)curr_norm[2]; break;
+			case 3: curr_tot_sample = -(float)curr_norm[1]; break;
+			case 4: curr_tot_sample = -(float)curr_norm[1]; break;
+			case 5: curr_tot_sample = -(float)curr_norm[0]; break;
+			case 6: curr_tot_sample = -(float)curr_norm[0]; break;
+			default: break;
+			}
+		} else {
+			switch (comm_step) {
+			case 1: curr_tot_sample = -(float)curr_norm[1]; break;
+			case 2: curr_tot_sample = -(float)curr_norm[1]; break;
+			case 3: curr_tot_sample = -(float)curr_norm[2]; break;
+			case 4: curr_tot_sample = -(float)curr_norm[2]; break;
+			case 5: curr_tot_sample = -(float)curr_norm[0]; break;
+			case 6: curr_tot_sample = -(float)curr_norm[0]; break;
+			default: break;
+			}
+		}
+	} else {
+		if (direction) {
+			switch (comm_step) {
+			case 1: curr_tot_sample = -(float)curr_norm[1]; break;
+			case 2: curr_tot_sample = -(float)curr_norm[1]; break;
+			case 3: curr_tot_sample = (float)curr_norm[0]; break;
+			case 4: curr_tot_sample = (float)curr_norm[1]; break;
+			case 5: curr_tot_sample = -(float)curr_norm[0]; break;
+			case 6: curr_tot_sample = -(float)curr_norm[0]; break;
+			default: break;
+			}
+		} else {
+			switch (comm_step) {
+			case 1: curr_tot_sample = (float)curr_norm[1]; break;
+			case 2: curr_tot_sample = (float)curr_norm[0]; break;
+			case 3: curr_tot_sample = -(float)curr_norm[1]; break;
+			case 4: curr_tot_sample = -(float)curr_norm[1]; break;
+			case 5: curr_tot_sample = -(float)curr_norm[0]; break;
+			case 6: curr_tot_sample = -(float)curr_norm[0]; break;
+			default: break;
+			}
+		}
+	}
+
+	const float tot_sample_tmp = curr_tot_sample;
+	if (comm_step != m_switch_comm_step_prev) {
+		curr_tot_sample = m_switch_prev_tot_sample;
+	}
+	m_switch_comm_step_prev = comm_step;
+	m_switch_prev_tot_sample = tot_sample_tmp;
+
+	return curr_tot_sample;
+}
+
+static void switch_reset(void) {
+	m_switch_comm_step_prev = 1;
+	m_switch_prev_tot_sample = 0.0;
+}
+
+static void report_layout(const char *name, bool three_shunts) {
+	bldc_curr_state_t cs;
+	bldc_curr_init(&cs, three_shunts);
+	switch_reset();
+
+	int diff = 0;
+	for (int i = 0;i < CURR_POINTS;i++) {
+		const curr_point_t *p = &m_points[i];
+		const float a = curr_switch(three_shunts, p->direction, p->comm_step, p->curr);
+		const float b = bldc_curr_update(&cs, p->direction, p->comm_step, p->curr);
+		if (a != b) {
+			diff++;
+		}
+	}
+
+	double best_switch = 1e30, best_table = 1e30;
+	for (int run = 0;run < SIM_BENCH_RUNS;run++) {
+		float sum = 0.0;
+		switch_reset();
+		double start = sim_time_ns();
+		for (int i = 0;i < CURR_POINTS;i++) {
+			sum += curr_switch(three_shunts, m_points[i].direction, m_points[i].comm_step, m_points[i].curr);
+		}
+		double ns = (sim_time_ns() - start) / CURR_POINTS;
+		m_sink = sum;
+		if (ns < best_switch) {
+			best_switch = ns;
+		}
+
+		sum = 0.0;
+		bldc_curr_init(&cs, three_shunts);
+		start = sim_time_ns();
+		for (int i = 0;i < CURR_POINTS;i++) {
+			sum += bldc_curr_update(&cs, m_points[i].direction, m_points[i].comm_step, m_points[i].curr);
+		}
+		ns = (sim_time_ns() - start) / CURR_POINTS;
+		m_sink = sum;
+		if (ns < best_table) {
+			best_table = ns;
+		}
+	}
+
+	printf("%-12s %d differences, switch %5.1f ns, table %5.1f ns\n",
+			name, diff, best_switch, best_table);
+	sim_check(diff == 0, "%s table gives the same samples as the switch statements", name);
+}
+
+int main(void) {
+	// A few PWM cycles per commutation step, one or two steps at a time, with
+	// a direction change now and then.
+	srand(1);
+	int direction = 1;
+	int comm_step = 1;
+	int cycles = 0;
+
+	for (int i = 0;i < CURR_POINTS;i++) {
+		if (cycles <= 0) {
+			if ((rand() % 50) == 0) {
+				direction = !direction;
+			}
+			comm_step += 1 + ((rand() % 10) == 0);
+			while (comm_step > 6) {
+				comm_step -= 6;
+			}
+			cycles = 1 + rand() % 8;
+		}
+		cycles--;
+
+		m_points[i].direction = direction;
+		m_points[i].comm_step = comm_step;
+		for (int j = 0;j < 3;j++) {
+			m_points[i].curr[j] = rand() % 4096 - 2048;
+		}
+	}
+
+	printf("=== BLDC bus current shunt selection ===\n");
+	report_layout("two shunts", false);
+	report_layout("three shunts", true);
+
+	return sim_failures();
+}
@@ -0,0 +1,418 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+
+/*
+ * Checks of the derating of the current limits against the utils_map and
+ * utils_min_abs chain that update_override_limits in mc_interface used before
+ * the derate module, for random configurations and inputs. Configurations
+ * with inverted and coinciding breakpoints are included. The previous chain
+ * divides by zero exactly at coinciding temperature and speed breakpoints, so
+ * there the derate module is only checked for stepping to the limit of the
+ * upper side.
+ */
+
+#include "derate.h"
+#include "sim_conf.h"
+#include "utils.h"
+#include "sim_util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+// Settings
+#define DERATE_CONFS			2000
+#define DERATE_INPUTS			100 // Inputs per configuration, run in sequence on the same state
+#define DERATE_TOL				1e-3 // Allowed difference in A
+#define DERATE_BENCH_UPDATES	10000
+
+// Private variables
+static float m_temp_fet[DERATE_BENCH_UPDATES];
+static float m_temp_motor[DERATE_BENCH_UPDATES];
+static float m_rpm[DERATE_BENCH_UPDATES];
+static float m_v_in[DERATE_BENCH_UPDATES];
+static volatile float m_sink;
+
+static float rand_range(float min, float max) {
+	return min + (max - min) * ((float)rand() / (float)RAND_MAX);
+}
+
+/*
+ * The previous update of the override limits, without the filtering of the
+ * temperatures and the fault stops.
+ */
+static void ref_update(volatile mc_configuration *conf, float temp_fet, float temp_motor,
+		float rpm_now, float v_in, float duty_abs) {
+	// Temperature MOSFET
+	float lo_max_mos = 0.0;
+	float lo_min_mos = 0.0;
+	if (temp_fet < conf->l_temp_fet_start) {
+		lo_min_mos = conf->l_current_min;
+		lo_max_mos = conf->l_current_max;
+	} else if (temp_fet > conf->l_temp_fet_end) {
+		lo_min_mos = 0.0;
+		lo_max_mos = 0.0;
+	} else {
+		lo_min_mos = SIGN(conf->l_current_min) * utils_map(temp_fet, conf->l_temp_fet_start, conf->l_temp_fet_end, fabsf(conf->l_current_min), 0.0);
+		lo_max_mos = SIGN(conf->l_current_max) * utils_map(temp_fet, conf->l_temp_fet_start, conf->l_temp_fet_end, fabsf(conf->l_current_max), 0.0);
+	}
+
+	// Temperature MOTOR
+	float lo_max_mot = 0.0;
+	float lo_min_mot = 0.0;
+	if (temp_motor < conf->l_temp_motor_start) {
+		lo_min_mot = conf->l_current_min;
+		lo_max_mot = conf->l_current_max;
+	} else if (temp_motor > conf->l_temp_motor_end) {
+		lo_min_mot = 0.0;
+		lo_max_mot = 0.0;
+	} else {
+		lo_min_mot = SIGN(conf->l_current_min) * utils_map(temp_motor, conf->l_temp_motor_start, conf->l_temp_motor_end, fabsf(conf->l_current_min), 0.0);
+		lo_max_mot = SIGN(conf->l_current_max) * utils_map(temp_motor, conf->l_temp_motor_start, conf->l_temp_motor_end, fabsf(conf->l_current_max), 0.0);
+	}
+
+	// Decreased temperatures during acceleration
+	// in order to still have braking torque available
+	const float temp_fet_accel_start = utils_map(conf->l_temp_accel_dec, 0.0, 1.0, conf->l_temp_fet_start, 25.0);
+	const float temp_fet_accel_end = utils_map(conf->l_temp_accel_dec, 0.0, 1.0, conf->l_temp_fet_end, 25.0);
+	const float temp_motor_accel_start = utils_map(conf->l_temp_accel_dec, 0.0, 1.0, conf->l_temp_motor_start, 25.0);
+	const float temp_motor_accel_end = utils_map(conf->l_temp_accel_dec, 0.0, 1.0, conf->l_temp_motor_end, 25.0);
+
+	float lo_fet_temp_accel = 0.0;
+	if (temp_fet < temp_fet_accel_start) {
+		lo_fet_temp_accel = conf->l_current_max;
+	} else if (temp_fet > temp_fet_accel_end) {
+		lo_fet_temp_accel = 0.0;
+	} else {
+		lo_fet_temp_accel = utils_map(temp_fet, temp_fet_accel_start,
+				temp_fet_accel_end, conf->l_current_max, 0.0);
+	}
+
+	float lo_motor_temp_accel = 0.0;
+	if (temp_motor < temp_motor_accel_start) {
+		lo_motor_temp_accel = conf->l_current_max;
+	} else if (temp_motor > temp_motor_accel_end) {
+		lo_motor_temp_accel = 0.0;
+	} else {
+		lo_motor_temp_accel = utils_map(temp_motor, temp_motor_accel_start,
+				temp_motor_accel_end, conf->l_current_max, 0.0);
+	}
+
+	// RPM max
+	float lo_max_rpm = 0.0;
+	const float rpm_pos_cut_start = conf->l_max_erpm * conf->l_erpm_start;
+	const float rpm_pos_cut_end = conf->l_max_erpm;
+	if (rpm_now < rpm_pos_cut_start) {
+		lo_max_rpm = conf->l_current_max;
+	} else if (rpm_now > rpm_pos_cut_end) {
+		lo_max_rpm = 0.0;
+	} else {
+		lo_max_rpm = utils_map(rpm_now, rpm_pos_cut_start, rpm_pos_cut_end, conf->l_current_max, 0.0);
+	}
+
+	// RPM min
+	float lo_min_rpm = 0.0;
+	const float rpm_neg_cut_start = conf->l_min_erpm * conf->l_erpm_start;
+	const float rpm_neg_cut_end = conf->l_min_erpm;
+	if (rpm_now > rpm_neg_cut_start) {
+		lo_min_rpm = conf->l_current_max;
+	} else if (rpm_now < rpm_neg_cut_end) {
+		lo_min_rpm = 0.0;
+	} else {
+		lo_min_rpm = utils_map(rpm_now, rpm_neg_cut_start, rpm_neg_cut_end, conf->l_current_max, 0.0);
+	}
+
+	float lo_max = utils_min_abs(lo_max_mos, lo_max_mot);
+	float lo_min = utils_min_abs(lo_min_mos, lo_min_mot);
+
+	lo_max = utils_min_abs(lo_max, lo_max_rpm);
+	lo_max = utils_min_abs(lo_max, lo_min_rpm);
+	lo_max = utils_min_abs(lo_max, lo_fet_temp_accel);
+	lo_max = utils_min_abs(lo_max, lo_motor_temp_accel);
+
+	if (lo_max < conf->cc_min_current) {
+		lo_max = conf->cc_min_current;
+	}
+
+	if (lo_min > -conf->cc_min_current) {
+		lo_min = -conf->cc_min_current;
+	}
+
+	conf->lo_current_max = lo_max;
+	conf->lo_current_min = lo_min;
+
+	// Battery cutoff
+	float lo_in_max_batt = conf->l_in_current_max;
+	if (v_in < conf->l_battery_cut_end) {
+		lo_in_max_batt = 0.0;
+	} else if (v_in < conf->l_battery_cut_start) {
+		lo_in_max_batt = utils_map(v_in, conf->l_battery_cut_start,
+				conf->l_battery_cut_end, conf->l_in_current_max, 0.0);
+	}
+
+	// Battery max voltage
+	float lo_in_min_batt = conf->l_in_current_min;
+	if (v_in > conf->l_max_vin) {
+		lo_in_min_batt = -0.001;
+	} else if (v_in > conf->l_max_vin - 1.0) {
+		lo_in_min_batt = utils_map(v_in, conf->l_max_vin - 1.0,
+				conf->l_max_vin, conf->l_in_current_min, -0.001);
+	}
+
+	// Wattage limits
+	const float lo_in_max_watt = conf->l_watt_max / v_in;
+	const float lo_in_min_watt = conf->l_watt_min / v_in;
+
+	const float lo_in_max = utils_min_abs(lo_in_max_watt, lo_in_max_batt);
+	const float lo_in_min = utils_min_abs(lo_in_min_watt, lo_in_min_batt);
+
+	conf->lo_in_current_max = utils_min_abs(conf->l_in_current_max, lo_in_max);
+	conf->lo_in_current_min = utils_min_abs(conf->l_in_current_min, lo_in_min);
+
+	// Maximum current right now
+	if (duty_abs > 0.001) {
+		conf->lo_current_motor_max_now = utils_min_abs(conf->lo_current_max, conf->lo_in_current_max / duty_abs);
+	} else {
+		conf->lo_current_motor_max_now = conf->lo_current_max;
+	}
+
+	conf->lo_current_motor_min_now = conf->lo_current_min;
+}
+
+/*
+ * Start and end of a derating range. One in four ranges is inverted and one
+ * in eight has coinciding breakpoints.
+ */
+static void rand_breakpoints(float start, float len, float *bp_start, float *bp_end) {
+	const int type = rand() % 8;
+	*bp_start = start;
+
+	if (type == 0) {
+		*bp_end = start;
+	} else if (type <= 2) {
+		*bp_end = start - rand_range(0.1, 1.0) * len;
+	} else {
+		*bp_end = start + rand_range(0.1, 1.0) * len;
+	}
+}
+
+static void rand_conf(mc_configuration *conf) {
+	sim_conf_default(conf);
+
+	conf->l_current_max = rand_range(5.0, 150.0);
+	conf->l_current_min = -rand_range(5.0, 150.0);
+	conf->l_in_current_max = rand_range(5.0, 100.0);
+	conf->l_in_current_min = -rand_range(5.0, 100.0);
+	conf->cc_min_current = rand_range(0.0, 0.5);
+
+	rand_breakpoints(rand_range(60.0, 100.0), 30.0, &conf->l_temp_fet_start, &conf->l_temp_fet_end);
+	rand_breakpoints(rand_range(60.0, 120.0), 30.0, &conf->l_temp_motor_start, &conf->l_temp_motor_end);
+	conf->l_temp_accel_dec = (rand() % 8) == 0 ? 0.0 : rand_range(0.0, 1.0);
+
+	conf->l_max_erpm = rand_range(10000.0, 100000.0);
+	conf->l_min_erpm = -rand_range(10000.0, 100000.0);
+	conf->l_erpm_start = (rand() % 8) == 0 ? 1.0 : rand_range(0.3, 1.0);
+
+	rand_breakpoints(rand_range(20.0, 40.0), 8.0, &conf->l_battery_cut_end, &conf->l_battery_cut_start);
+	conf->l_max_vin = rand_range(45.0, 60.0);
+	conf->l_watt_max = rand_range(100.0, 5000.0);
+	conf->l_watt_min = -rand_range(100.0, 5000.0);
+}
+
+/*
+ * Largest difference of the limits in two configurations.
+ */
+static float limit_diff(mc_configuration *a, mc_configuration *b) {
+	float diff = fabsf(a->lo_current_max - b->lo_current_max);
+	diff = fmaxf(diff, fabsf(a->lo_current_min - b->lo_current_min));
+	diff = fmaxf(diff, fabsf(a->lo_in_current_max - b->lo_in_current_max));
+	diff = fmaxf(diff, fabsf(a->lo_in_current_min - b->lo_in_current_min));
+	diff = fmaxf(diff, fabsf(a->lo_current_motor_max_now - b->lo_current_motor_max_now));
+	diff = fmaxf(diff, fabsf(a->lo_current_motor_min_now - b->lo_current_motor_min_now));
+	return diff;
+}
+
+static void report_random(void) {
+	double diff_max = 0.0;
+	int updates = 0;
+	int limited = 0;
+
+	srand(1);
+	for (int c = 0;c < DERATE_CONFS;c++) {
+		mc_configuration conf, conf_ref;
+		rand_conf(&conf);
+		conf_ref = conf;
+
+		derate_t d;
+		derate_build(&d, &conf);
+
+		for (int i = 0;i < DERATE_INPUTS;i++) {
+			// Repeat inputs now and then to use the cached results
+			float temp_fet = conf.l_temp_fet_start + rand_range(-40.0, 40.0);
+			float temp_motor = conf.l_temp_motor_start + rand_range(-40.0, 40.0);
+			float rpm = rand_range(1.2 * conf.l_min_erpm, 1.2 * conf.l_max_erpm);
+			float v_in = rand_range(conf.l_battery_cut_end - 5.0, conf.l_max_vin + 2.0);
+			const float duty = (rand() % 8) == 0 ? 0.0 : rand_range(0.0, 1.0);
+
+			if (i > 0 && (rand() % 4) == 0) {
+				temp_fet = d.temp_fet.in_last;
+				temp_motor = d.temp_motor.in_last;
+				v_in = d.watt_v_in_last;
+			}
+
+			derate_update(&d, &conf, temp_fet, temp_motor, rpm, v_in, duty);
+			ref_update(&conf_ref, temp_fet, temp_motor, rpm, v_in, duty);
+
+			diff_max = fmax(diff_max, limit_diff(&conf, &conf_ref));
+			updates++;
+			if (d.sources != 0) {
+				limited++;
+			}
+		}
+	}
+
+	printf("=== %d random configurations, %d updates ===\n", DERATE_CONFS, updates);
+	printf("Largest difference to the previous limits: %.2e A, limited in %.0f %% of the updates\n",
+			diff_max, 100.0 * (double)limited / (double)updates);
+
+	sim_check(diff_max < DERATE_TOL, "same limits as the previous code");
+	sim_check(limited > updates / 4 && limited < updates, "limited and unlimited updates covered");
+}
+
+static void report_breakpoints(void) {
+	mc_configuration conf, conf_ref;
+	derate_t d;
+
+	printf("=== Inverted and coinciding breakpoints ===\n");
+
+	// Inverted temperature range: full current below the start, none above it
+	sim_conf_default(&conf);
+	conf.l_temp_fet_start = 90.0;
+	conf.l_temp_fet_end = 80.0;
+	conf.l_temp_accel_dec = 0.0;
+	conf_ref = conf;
+	derate_build(&d, &conf);
+
+	bool same = true;
+	for (float temp = 70.0;temp < 100.0;temp += 0.25) {
+		derate_update(&d, &conf, temp, 25.0, 0.0, 40.0, 0.5);
+		ref_update(&conf_ref, temp, 25.0, 0.0, 40.0, 0.5);
+		same = same && limit_diff(&conf, &conf_ref) < DERATE_TOL;
+	}
+	sim_check(same, "inverted temperature range same as the previous code");
+
+	derate_update(&d, &conf, 89.99, 25.0, 0.0, 40.0, 0.5);
+	const float below = conf.lo_current_max;
+	derate_update(&d, &conf, 90.0, 25.0, 0.0, 40.0, 0.5);
+	sim_check(below == conf.l_current_max && conf.lo_current_max == conf.cc_min_current,
+			"inverted temperature range steps at the start");
+
+	// Inverted battery cutoff
+	sim_conf_default(&conf);
+	conf.l_battery_cut_start = 30.0;
+	conf.l_battery_cut_end = 34.0;
+	conf_ref = conf;
+	derate_build(&d, &conf);
+
+	same = true;
+	for (float v_in = 25.0;v_in < 40.0;v_in += 0.125) {
+		derate_update(&d, &conf, 25.0, 25.0, 0.0, v_in, 0.5);
+		ref_update(&conf_ref, 25.0, 25.0, 0.0, v_in, 0.5);
+		same = same && limit_diff(&conf, &conf_ref) < DERATE_TOL;
+	}
+	sim_check(same, "inverted battery cutoff same as the previous code");
+
+	// Coinciding breakpoints, where the previous code divided by zero
+	sim_conf_default(&conf);
+	conf.l_temp_motor_start = 100.0;
+	conf.l_temp_motor_end = 100.0;
+	conf.l_erpm_start = 1.0;
+	conf.l_battery_cut_start = 32.0;
+	conf.l_battery_cut_end = 32.0;
+	conf.l_temp_accel_dec = 0.0;
+	conf_ref = conf;
+	derate_build(&d, &conf);
+
+	same = true;
+	for (int i = -1;i <= 1;i += 2) {
+		const float temp = 100.0 + 0.01 * (float)i;
+		const float rpm = conf.l_max_erpm * (1.0 + 0.001 * (float)i);
+		const float v_in = 32.0 + 0.01 * (float)i;
+		derate_update(&d, &conf, 25.0, temp, rpm, v_in, 0.5);
+		ref_update(&conf_ref, 25.0, temp, rpm, v_in, 0.5);
+		same = same && limit_diff(&conf, &conf_ref) < DERATE_TOL;
+	}
+	sim_check(same, "coinciding breakpoints same as the previous code next to them");
+
+	derate_update(&d, &conf, 25.0, 100.0, 0.0, 40.0, 0.5);
+	const float lo_temp = conf.lo_current_max;
+	derate_update(&d, &conf, 25.0, 25.0, conf.l_max_erpm, 40.0, 0.5);
+	const float lo_rpm = conf.lo_current_max;
+	derate_update(&d, &conf, 25.0, 25.0, 0.0, 32.0, 0.5);
+	const float lo_batt = conf.lo_in_current_max;
+	sim_check(lo_temp == conf.cc_min_current && lo_rpm == conf.cc_min_current && lo_batt == conf.l_in_current_max,
+			"coinciding breakpoints step to the upper side");
+}
+
+static void report_bench(void) {
+	mc_configuration conf, conf_ref;
+	sim_conf_default(&conf);
+	conf_ref = conf;
+
+	derate_t d;
+	derate_build(&d, &conf);
+
+	srand(2);
+	for (int i = 0;i < DERATE_BENCH_UPDATES;i++) {
+		m_temp_fet[i] = rand_range(20.0, 100.0);
+		m_temp_motor[i] = rand_range(20.0, 120.0);
+		m_rpm[i] = rand_range(-1.2, 1.2) * conf.l_max_erpm;
+		m_v_in[i] = rand_range(conf.l_battery_cut_end - 2.0, conf.l_max_vin);
+	}
+
+	double best = 1e30, best_ref = 1e30;
+	for (int run = 0;run < SIM_BENCH_RUNS;run++) {
+		float sum = 0.0;
+		double start = sim_time_ns();
+		for (int i = 0;i < DERATE_BENCH_UPDATES;i++) {
+			derate_update(&d, &conf, m_temp_fet[i], m_temp_motor[i], m_rpm[i], m_v_in[i], 0.5);
+			sum += conf.lo_current_motor_max_now;
+		}
+		best = fmin(best, (sim_time_ns() - start) / DERATE_BENCH_UPDATES);
+
+		start = sim_time_ns();
+		for (int i = 0;i < DERATE_BENCH_UPDATES;i++) {
+			ref_update(&conf_ref, m_temp_fet[i], m_temp_motor[i], m_rpm[i], m_v_in[i], 0.5);
+			sum += conf_ref.lo_current_motor_max_now;
+		}
+		best_ref = fmin(best_ref, (sim_time_ns() - start) / DERATE_BENCH_UPDATES);
+		m_sink = sum;
+	}
+
+	printf("=== Update time with changing inputs ===\n");
+	printf("derate_update %6.1f ns, previous code %6.1f ns\n", best, best_ref);
+}
+
+int main(void) {
+	report_random();
+	report_breakpoints();
+	report_bench();
+
+	return sim_failures();
+}
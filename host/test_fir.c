@@ -0,0 +1,145 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Output and execution time of the FIR filter in digital_filter for the
+ * filters that mcpwm uses. filter_fir_process and filter_fir_process_block
+ * are compared with the masked circular buffer of filter_add_sample and
+ * filter_run_fir_iteration. Built twice, the second time with
+ * FILTER_FIR_USE_CMSIS and the reference arm_fir_f32 in shim/arm_math.h.
+ */
+
+#include "digital_filter.h"
+#include "sim_util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+// Settings
+#define FIR_POINTS				100000
+#define FIR_CHUNK				100 // Samples per filter_fir_process_block call
+#define FIR_CHUNK_SINGLE		3 // Samples per chunk added one at a time before the block
+#define FIR_TAPS_BITS_MAX		7
+
+#if FILTER_FIR_USE_CMSIS
+#define FIR_BLOCK_ERR_MAX		1e-5 // The sum is in a different order
+#else
+#define FIR_BLOCK_ERR_MAX		0.0
+#endif
+
+// Private variables
+static float m_in[FIR_POINTS];
+static float m_out_ref[FIR_POINTS];
+static float m_out[FIR_POINTS];
+static float m_coeffs[1 << FIR_TAPS_BITS_MAX];
+static float m_samples[1 << FIR_TAPS_BITS_MAX];
+static float m_buffer[FILTER_FIR_BUFFER_LEN(1 << FIR_TAPS_BITS_MAX)];
+static volatile float m_sink;
+
+static void run_masked(int bits) {
+	uint32_t offset = 0;
+	for (int i = 0;i < (1 << bits);i++) {
+		m_samples[i] = 0.0;
+	}
+
+	for (int i = 0;i < FIR_POINTS;i++) {
+		filter_add_sample(m_samples, m_in[i], bits, &offset);
+		m_out_ref[i] = filter_run_fir_iteration(m_samples, m_coeffs, bits, offset);
+	}
+}
+
+static void run_process(filter_fir_t *fir, int bits) {
+	filter_fir_init(fir, m_coeffs, m_buffer, 1 << bits);
+	for (int i = 0;i < FIR_POINTS;i++) {
+		m_out[i] = filter_fir_process(fir, m_in[i]);
+	}
+}
+
+static void run_block(filter_fir_t *fir, int bits, int single) {
+	filter_fir_init(fir, m_coeffs, m_buffer, 1 << bits);
+	for (int i = 0;i < FIR_POINTS;i += FIR_CHUNK) {
+		for (int j = 0;j < single;j++) {
+			m_out[i + j] = filter_fir_process(fir, m_in[i + j]);
+		}
+		filter_fir_process_block(fir, m_in + i + single, m_out + i + single, FIR_CHUNK - single);
+	}
+}
+
+static double max_diff(void) {
+	double diff = 0.0;
+	for (int i = 0;i < FIR_POINTS;i++) {
+		diff = fmax(diff, fabs((double)m_out[i] - (double)m_out_ref[i]));
+	}
+	return diff;
+}
+
+static void report_filter(const char *name, int bits, float f_cut) {
+	filter_fir_t fir;
+	filter_create_fir_lowpass(m_coeffs, f_cut, bits, 1);
+	run_masked(bits);
+
+	run_process(&fir, bits);
+	const double diff_process = max_diff();
+
+	// Samples added one at a time before each block have to end up in the block state
+	run_block(&fir, bits, FIR_CHUNK_SINGLE);
+	const double diff_block = max_diff();
+
+	double best_masked = 1e30, best_process = 1e30, best_block = 1e30;
+	for (int run = 0;run < SIM_BENCH_RUNS;run++) {
+		double start = sim_time_ns();
+		run_masked(bits);
+		best_masked = fmin(best_masked, (sim_time_ns() - start) / FIR_POINTS);
+
+		start = sim_time_ns();
+		run_process(&fir, bits);
+		best_process = fmin(best_process, (sim_time_ns() - start) / FIR_POINTS);
+
+		start = sim_time_ns();
+		run_block(&fir, bits, 0);
+		best_block = fmin(best_block, (sim_time_ns() - start) / FIR_POINTS);
+
+		m_sink = m_out[FIR_POINTS - 1] + m_out_ref[FIR_POINTS - 1];
+	}
+
+	printf("%-10s %3d taps  masked %6.1f ns, process %6.1f ns, block %6.1f ns\n",
+			name, 1 << bits, best_masked, best_process, best_block);
+	sim_check(diff_process == 0.0, "%s filter_fir_process gives the same output as the masked buffer", name);
+	sim_check(diff_block <= FIR_BLOCK_ERR_MAX,
+			"%s filter_fir_process_block within %.0e of the masked buffer (%.1e)",
+			name, FIR_BLOCK_ERR_MAX, diff_block);
+}
+
+int main(void) {
+	// A slow sine with noise on top, like the amplitude samples
+	srand(1);
+	for (int i = 0;i < FIR_POINTS;i++) {
+		m_in[i] = sinf(0.01 * (float)i) + 0.3 * ((float)(rand() % 2001) / 1000.0 - 1.0);
+	}
+
+#if FILTER_FIR_USE_CMSIS
+	printf("=== FIR filters, arm_fir_f32 block path ===\n");
+#else
+	printf("=== FIR filters ===\n");
+#endif
+	report_filter("amplitude", 7, 0.02);
+	report_filter("current", 4, 0.15);
+
+	return sim_failures();
+}
@@ -0,0 +1,208 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Hall sensor angle tracking with skewed sensors. The transitions are learned
+ * the same way mcpwm_foc does it with the observer as reference, and the
+ * angle error is compared between the nominal hall table, the corrected edges
+ * with the nominal 60 degree sectors, and the corrected edges with the learned
+ * sectors.
+ */
+
+#include "foc_math.h"
+#include "utils.h"
+#include "sim_util.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+// Settings
+#define HALL_DT					1e-4
+#define HALL_REVS				20 // Electrical revolutions per run
+#define HALL_LEARN_ERPM			500.0 // Low, so that the transitions are sampled accurately
+#define HALL_ERR_MAX			0.5 // Allowed error in degrees with the learned sectors, on top of the rotation in one sample
+
+// Private variables
+static const int m_order[6] = {1, 3, 2, 6, 4, 5}; // States in the forward direction
+static const float m_skew_deg[8] = {0.0, 8.0, -6.0, 12.0, -10.0, 5.0, -3.0, 0.0}; // By edge
+static uint8_t m_table[8];
+static float m_edge_true[8]; // Real transition angles, by edge
+
+static float deg_to_rad(float deg) {
+	return deg * (M_PI / 180.0);
+}
+
+static void hall_init(void) {
+	memset(m_table, 255, sizeof(m_table));
+	for (int i = 0;i < 6;i++) {
+		m_table[m_order[i]] = (uint8_t)roundf((float)i * 200.0 / 6.0);
+	}
+
+	for (int i = 0;i < 6;i++) {
+		float ang;
+		int edge;
+		foc_hall_edge(m_table, m_order[(i + 5) % 6], m_order[i], &ang, &edge);
+		ang += deg_to_rad(m_skew_deg[edge]);
+		utils_norm_angle_rad(&ang);
+		m_edge_true[edge] = ang;
+	}
+}
+
+static int hall_read(float angle) {
+	for (int i = 0;i < 6;i++) {
+		const float start = m_edge_true[m_order[i]];
+		float width = utils_angle_difference_rad(m_edge_true[m_order[(i + 1) % 6]], start);
+		const float pos = utils_angle_difference_rad(angle, start);
+		if (pos >= 0.0 && pos < width) {
+			return m_order[i];
+		}
+	}
+	return 0;
+}
+
+/*
+ * Learn the corrections like mcpwm_foc_hall_learn_stop, with the real angle
+ * in place of the observer.
+ */
+static void hall_learn(float erpm, int8_t *edge_corr) {
+	float sum[8] = {0.0};
+	int cnt[8] = {0};
+	const float speed = erpm * (2.0 * M_PI / 60.0);
+	const int steps = (int)(HALL_REVS * 2.0 * M_PI / (fabsf(speed) * HALL_DT));
+	float angle = 0.0;
+	int hall_prev = hall_read(angle);
+
+	for (int i = 0;i < steps;i++) {
+		angle += speed * HALL_DT;
+		utils_norm_angle_rad(&angle);
+		const int hall_now = hall_read(angle);
+
+		float ang_edge;
+		int edge;
+		if (hall_now != hall_prev && foc_hall_edge(m_table, hall_prev, hall_now, &ang_edge, &edge)) {
+			sum[edge] += utils_angle_difference_rad(angle, ang_edge);
+			cnt[edge]++;
+		}
+		hall_prev = hall_now;
+	}
+
+	for (int i = 0;i < 8;i++) {
+		edge_corr[i] = 0;
+		if (cnt[i] > 0) {
+			float corr = (sum[i] / (float)cnt[i]) * (1800.0 / M_PI);
+			utils_truncate_number(&corr, -127.0, 127.0);
+			edge_corr[i] = (int8_t)roundf(corr);
+		}
+	}
+}
+
+/*
+ * Track the angle the way correct_hall does it and return the largest error
+ * in degrees, from the first transition on.
+ */
+static float hall_run(const int8_t *edge_corr, const foc_hall_sectors_t *sectors,
+		float erpm, float speed_est_fact) {
+	const float speed = erpm * (2.0 * M_PI / 60.0);
+	const int steps = (int)(HALL_REVS * 2.0 * M_PI / (fabsf(speed) * HALL_DT));
+	float angle = 0.0;
+	int hall_prev = hall_read(angle);
+	float ang_hall = sectors->centre[hall_prev];
+	bool edge_seen = false;
+	float err_max = 0.0;
+
+	for (int i = 0;i < steps;i++) {
+		angle += speed * HALL_DT;
+		utils_norm_angle_rad(&angle);
+		const int hall_now = hall_read(angle);
+
+		float ang_edge;
+		int edge;
+		if (hall_now != hall_prev && foc_hall_edge(m_table, hall_prev, hall_now, &ang_edge, &edge)) {
+			ang_hall = ang_edge + (float)edge_corr[edge] * (0.1 * M_PI / 180.0);
+			utils_norm_angle_rad(&ang_hall);
+			edge_seen = true;
+		} else {
+			ang_hall = foc_hall_track(sectors, hall_now, ang_hall, speed * speed_est_fact * HALL_DT);
+		}
+		hall_prev = hall_now;
+
+		if (edge_seen) {
+			err_max = fmaxf(err_max, fabsf(utils_angle_difference_rad(ang_hall, angle)));
+		}
+	}
+
+	return err_max * (180.0 / M_PI);
+}
+
+int main(void) {
+	hall_init();
+
+	int8_t corr_zero[8], corr_learned[8];
+	memset(corr_zero, 0, sizeof(corr_zero));
+	hall_learn(HALL_LEARN_ERPM, corr_learned);
+
+	printf("=== Learned corrections ===\n");
+	bool corr_ok = true;
+	for (int i = 0;i < 6;i++) {
+		const int edge = m_order[i];
+		printf("Edge %d: skew %5.1f deg, learned %5.1f deg\n",
+				edge, m_skew_deg[edge], corr_learned[edge] / 10.0);
+		corr_ok = corr_ok && fabsf(corr_learned[edge] / 10.0 - m_skew_deg[edge]) < 1.0;
+	}
+	sim_check(corr_ok, "learned corrections within 1 deg of the skew");
+
+	foc_hall_sectors_t sectors_nominal, sectors_learned;
+	foc_hall_sectors_update(&sectors_nominal, m_table, corr_zero);
+	foc_hall_sectors_update(&sectors_learned, m_table, corr_learned);
+
+	printf("\n=== Sectors ===\n");
+	for (int i = 0;i < 6;i++) {
+		const int s = m_order[i];
+		printf("State %d: nominal centre %6.1f width %5.1f, learned centre %6.1f width %5.1f deg\n",
+				s, sectors_nominal.centre[s] * (180.0 / M_PI), sectors_nominal.width[s] * (180.0 / M_PI),
+				sectors_learned.centre[s] * (180.0 / M_PI), sectors_learned.width[s] * (180.0 / M_PI));
+	}
+
+	printf("\n=== Largest angle error in degrees ===\n");
+	printf("%8s %10s %10s %12s %10s\n", "ERPM", "speed est", "nominal", "edges only", "learned");
+
+	static const float erpms[] = {1000.0, 2000.0, -2000.0};
+	static const float speed_facts[] = {1.0, 1.1, 0.9};
+	for (unsigned int i = 0;i < sizeof(erpms) / sizeof(erpms[0]);i++) {
+		for (unsigned int j = 0;j < sizeof(speed_facts) / sizeof(speed_facts[0]);j++) {
+			const float err_nominal = hall_run(corr_zero, &sectors_nominal, erpms[i], speed_facts[j]);
+			const float err_edges = hall_run(corr_learned, &sectors_nominal, erpms[i], speed_facts[j]);
+			const float err_learned = hall_run(corr_learned, &sectors_learned, erpms[i], speed_facts[j]);
+
+			printf("%8.0f %9.0f%% %10.2f %12.2f %10.2f\n", erpms[i], speed_facts[j] * 100.0,
+					err_nominal, err_edges, err_learned);
+
+			if (speed_facts[j] == 1.0) {
+				const float step = fabsf(erpms[i]) * (360.0 / 60.0) * HALL_DT;
+				sim_check(err_learned < (step + HALL_ERR_MAX),
+						"learned sectors at %.0f ERPM below %.1f deg", erpms[i], step + HALL_ERR_MAX);
+			}
+			sim_check(err_learned <= err_edges && err_learned < err_nominal,
+					"learned sectors best at %.0f ERPM and %.0f %% speed",
+					erpms[i], speed_facts[j] * 100.0);
+		}
+	}
+
+	return sim_failures();
+}
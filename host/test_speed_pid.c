@@ -0,0 +1,266 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+
+/*
+ * Checks of the speed controller shared by mcpwm and mcpwm_foc: the gain
+ * schedule, the back-calculation anti-windup against a controller that only
+ * clamps the integral term, the reset, and braking disabled.
+ */
+
+#include "speed_pid.h"
+#include "sim_conf.h"
+#include "utils.h"
+#include "sim_util.h"
+#include <stdio.h>
+#include <math.h>
+
+// Settings
+#define PID_DT					0.001 // Control loop period in seconds
+#define PID_KD_FILTER			0.2
+#define PID_TOL					1e-5
+#define PLANT_ACC				20000.0 // ERPM/s at full current
+#define STEP_RPM				10000.0
+#define STEP_TIME				3.0 // Seconds simulated after the step
+
+static bool close(float a, float b) {
+	return fabsf(a - b) < PID_TOL * fmaxf(1.0, fabsf(b));
+}
+
+static bool gains_are(mc_configuration *conf, float rpm, float f_kp, float f_ki, float f_kd) {
+	float kp, ki, kd;
+	speed_pid_get_gains(conf, rpm, &kp, &ki, &kd);
+	return close(kp, conf->s_pid_kp * f_kp) &&
+			close(ki, conf->s_pid_ki * f_ki) &&
+			close(kd, conf->s_pid_kd * f_kd);
+}
+
+static void set_point(mc_configuration *conf, int i, float erpm, float f_kp, float f_ki, float f_kd) {
+	conf->s_pid_sched_erpm[i] = erpm;
+	conf->s_pid_sched_kp[i] = f_kp;
+	conf->s_pid_sched_ki[i] = f_ki;
+	conf->s_pid_sched_kd[i] = f_kd;
+}
+
+static void report_schedule(void) {
+	mc_configuration conf;
+	sim_conf_default(&conf);
+	conf.s_pid_kp = 0.004;
+	conf.s_pid_ki = 0.02;
+	conf.s_pid_kd = 0.0001;
+
+	set_point(&conf, 0, 1000.0, 1.0, 1.0, 1.0);
+	set_point(&conf, 1, 3000.0, 2.0, 0.5, 3.0);
+	set_point(&conf, 2, 5000.0, 4.0, 0.25, 1.0);
+	set_point(&conf, 3, 7000.0, 8.0, 0.1, 0.0);
+
+	printf("=== Gain schedule ===\n");
+
+	conf.s_pid_sched_points = 0;
+	sim_check(gains_are(&conf, 4000.0, 1.0, 1.0, 1.0), "no breakpoints uses the configured gains");
+
+	conf.s_pid_sched_points = 3;
+	sim_check(gains_are(&conf, 0.0, 1.0, 1.0, 1.0) && gains_are(&conf, 1000.0, 1.0, 1.0, 1.0),
+			"first factors held below the first breakpoint");
+	sim_check(gains_are(&conf, 2000.0, 1.5, 0.75, 2.0) && gains_are(&conf, 4500.0, 3.5, 0.3125, 1.5),
+			"factors interpolated between the breakpoints");
+	sim_check(gains_are(&conf, 5000.0, 4.0, 0.25, 1.0) && gains_are(&conf, 9000.0, 4.0, 0.25, 1.0),
+			"last factors held above the last breakpoint");
+	sim_check(gains_are(&conf, -2000.0, 1.5, 0.75, 2.0) && gains_are(&conf, -9000.0, 4.0, 0.25, 1.0),
+			"sign of the speed ignored");
+
+	conf.s_pid_sched_points = 1;
+	sim_check(gains_are(&conf, 0.0, 1.0, 1.0, 1.0) && gains_are(&conf, 9000.0, 1.0, 1.0, 1.0),
+			"one breakpoint gives constant factors");
+
+	conf.s_pid_sched_points = S_PID_SCHED_LEN + 5;
+	sim_check(gains_are(&conf, 6000.0, 6.0, 0.175, 0.5) && gains_are(&conf, 20000.0, 8.0, 0.1, 0.0),
+			"breakpoints in use clamped to %d", S_PID_SCHED_LEN);
+
+	// Two breakpoints at the same speed make a step in the factors
+	conf.s_pid_sched_points = 3;
+	set_point(&conf, 1, 1000.0, 2.0, 0.5, 3.0);
+	sim_check(gains_are(&conf, 1000.0, 1.0, 1.0, 1.0) && gains_are(&conf, 1000.001, 2.0, 0.5, 3.0) &&
+			gains_are(&conf, 3000.0, 3.0, 0.375, 2.0), "equal breakpoints step the factors");
+}
+
+/*
+ * Speed controller that only clamps the integral term, as before the
+ * back-calculation was added.
+ */
+static float run_clamp_only(float *i_term, mc_configuration *conf, float rpm_set, float rpm) {
+	const float error = rpm_set - rpm;
+	*i_term += error * (conf->s_pid_ki * PID_DT) * SPEED_PID_SCALE;
+	utils_truncate_number(i_term, -1.0, 1.0);
+	float output = error * conf->s_pid_kp * SPEED_PID_SCALE + *i_term;
+	utils_truncate_number(&output, -1.0, 1.0);
+	return output;
+}
+
+static void report_windup(void) {
+	mc_configuration conf;
+	sim_conf_default(&conf);
+	conf.s_pid_kp = 0.02;
+	conf.s_pid_ki = 0.05;
+	conf.s_pid_min_erpm = 0.0;
+
+	speed_pid_state_t pid;
+	speed_pid_reset(&pid, 0.0);
+	float i_clamp = 0.0;
+	float rpm = 0.0, rpm_clamp = 0.0;
+	float peak = 0.0, peak_clamp = 0.0;
+	float i_sat_max = 0.0;
+	int sat_samples = 0;
+
+	const int samples = (int)(STEP_TIME / PID_DT);
+	for (int i = 0;i < samples;i++) {
+		const float out = speed_pid_run(&pid, &conf, STEP_RPM, rpm,
+				CRUISE_CONTROL_MOTOR_SETTINGS, PID_KD_FILTER, PID_DT);
+		const float out_clamp = run_clamp_only(&i_clamp, &conf, STEP_RPM, rpm_clamp);
+
+		if (out >= 1.0) {
+			sat_samples++;
+			i_sat_max = fmaxf(i_sat_max, pid.i_term);
+		}
+
+		// Motor without load that accelerates in proportion to the current
+		rpm += out * PLANT_ACC * PID_DT;
+		rpm_clamp += out_clamp * PLANT_ACC * PID_DT;
+		peak = fmaxf(peak, rpm);
+		peak_clamp = fmaxf(peak_clamp, rpm_clamp);
+	}
+
+	const float over = fmaxf(peak - STEP_RPM, 0.0) / STEP_RPM;
+	const float over_clamp = fmaxf(peak_clamp - STEP_RPM, 0.0) / STEP_RPM;
+
+	printf("=== Step of %.0f ERPM with the output saturated ===\n", STEP_RPM);
+	printf("Back-calculation: overshoot %5.1f %%, integral term at most %.3f while saturated\n",
+			(double)(100.0 * over), (double)i_sat_max);
+	printf("Clamp only:       overshoot %5.1f %%\n", (double)(100.0 * over_clamp));
+
+	sim_check(sat_samples > 100, "output saturated after the step");
+	sim_check(i_sat_max < 0.9, "integral term does not wind up to its limit");
+	sim_check(over < 0.5 * over_clamp, "overshoot at most half of the clamp only controller");
+	sim_check(fabsf(rpm - STEP_RPM) < 0.01 * STEP_RPM, "speed settles at the set point");
+}
+
+static void report_reset(void) {
+	mc_configuration conf;
+	sim_conf_default(&conf);
+	conf.s_pid_kp = 0.004;
+	conf.s_pid_ki = 0.02;
+	conf.s_pid_kd = 0.0001;
+	conf.s_pid_ff_acc = 0.001;
+
+	printf("=== Reset ===\n");
+
+	speed_pid_state_t pid;
+	speed_pid_run(&pid, &conf, 5000.0, 3000.0, CRUISE_CONTROL_MOTOR_SETTINGS, PID_KD_FILTER, PID_DT);
+	speed_pid_reset(&pid, 0.3);
+	sim_check(pid.i_term == 0.3 && pid.prev_error == 0.0 && pid.d_filter == 0.0 &&
+			!pid.prev_set_valid && pid.acc_filter == 0.0, "reset clears the state and sets the integral term");
+
+	// No feedforward from the jump of the set point after the reset
+	float out = speed_pid_run(&pid, &conf, 4000.0, 4000.0, CRUISE_CONTROL_MOTOR_SETTINGS, PID_KD_FILTER, PID_DT);
+	sim_check(close(out, 0.3), "output continues from the integral term after the reset");
+
+	speed_pid_run(&pid, &conf, 5000.0, 3000.0, CRUISE_CONTROL_MOTOR_SETTINGS, PID_KD_FILTER, PID_DT);
+	out = speed_pid_run(&pid, &conf, 0.5 * conf.s_pid_min_erpm, 3000.0,
+			CRUISE_CONTROL_MOTOR_SETTINGS, PID_KD_FILTER, PID_DT);
+	sim_check(out == 0.0 && pid.i_term == 0.0 && pid.d_filter == 0.0 && !pid.prev_set_valid,
+			"set point below the minimum speed resets the controller");
+}
+
+static void report_feedforward(void) {
+	mc_configuration conf;
+	sim_conf_default(&conf);
+	conf.s_pid_kp = 0.0;
+	conf.s_pid_ki = 0.0;
+	conf.s_pid_ff_acc = 0.0001;
+
+	printf("=== Acceleration feedforward ===\n");
+
+	speed_pid_state_t pid_a, pid_b;
+	speed_pid_reset(&pid_a, 0.0);
+	speed_pid_reset(&pid_b, 0.0);
+	bool same = true;
+	float out = 0.0;
+
+	for (int i = 0;i < 200;i++) {
+		const float set = 1000.0 + 1000.0 * PID_DT * (float)i;
+		conf.s_pid_kd_filter = 0.05;
+		out = speed_pid_run(&pid_a, &conf, set, set, CRUISE_CONTROL_MOTOR_SETTINGS, 0.05, PID_DT);
+		conf.s_pid_kd_filter = 1.0;
+		const float out_b = speed_pid_run(&pid_b, &conf, set, set, CRUISE_CONTROL_MOTOR_SETTINGS, 1.0, PID_DT);
+		same = same && out == out_b;
+	}
+
+	sim_check(close(out, 1000.0 * conf.s_pid_ff_acc), "feedforward follows the set point slope");
+	sim_check(same, "feedforward independent of the D filter");
+}
+
+static void report_braking(void) {
+	mc_configuration conf;
+	sim_conf_default(&conf);
+	conf.s_pid_kp = 0.004;
+	conf.s_pid_ki = 0.02;
+
+	printf("=== Braking disabled ===\n");
+
+	speed_pid_state_t pid;
+	float out;
+
+	conf.s_pid_allow_braking = true;
+	speed_pid_reset(&pid, 0.0);
+	out = speed_pid_run(&pid, &conf, 3000.0, 5000.0, CRUISE_CONTROL_MOTOR_SETTINGS, PID_KD_FILTER, PID_DT);
+	sim_check(out < 0.0, "brakes when braking is allowed");
+
+	conf.s_pid_allow_braking = false;
+	speed_pid_reset(&pid, 0.0);
+	out = speed_pid_run(&pid, &conf, 3000.0, 5000.0, CRUISE_CONTROL_MOTOR_SETTINGS, PID_KD_FILTER, PID_DT);
+	sim_check(out == 0.0 && pid.i_term == 0.0 && pid.prev_error == 0.0 && pid.d_filter == 0.0,
+			"no braking forwards and the state is cleared");
+
+	speed_pid_reset(&pid, 0.0);
+	out = speed_pid_run(&pid, &conf, -3000.0, -5000.0, CRUISE_CONTROL_MOTOR_SETTINGS, PID_KD_FILTER, PID_DT);
+	sim_check(out == 0.0 && pid.i_term == 0.0, "no braking backwards");
+
+	speed_pid_reset(&pid, 0.0);
+	out = speed_pid_run(&pid, &conf, 5000.0, 3000.0, CRUISE_CONTROL_MOTOR_SETTINGS, PID_KD_FILTER, PID_DT);
+	sim_check(out > 0.0, "still drives towards the set point");
+
+	conf.s_pid_allow_braking = true;
+	speed_pid_reset(&pid, 0.0);
+	out = speed_pid_run(&pid, &conf, 3000.0, 5000.0, CRUISE_CONTROL_BRAKING_DISABLED, PID_KD_FILTER, PID_DT);
+	sim_check(out == 0.0, "cruise control without braking overrides the setting");
+
+	speed_pid_reset(&pid, 0.0);
+	out = speed_pid_run(&pid, &conf, 3000.0, 5000.0, CRUISE_CONTROL_BRAKING_ENABLED, PID_KD_FILTER, PID_DT);
+	sim_check(out < 0.0, "cruise control with braking brakes");
+}
+
+int main(void) {
+	report_schedule();
+	report_windup();
+	report_reset();
+	report_feedforward();
+	report_braking();
+
+	return sim_failures();
+}
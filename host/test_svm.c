@@ -0,0 +1,234 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Checks of the modulation: the discontinuous modes must give the same line
+ * to line volt-seconds as SVPWM with one leg clamped to a rail, the clamp
+ * high time must stay limited for the bootstrap supplies, and the current
+ * reconstruction must not use a clamped leg.
+ */
+
+#include "foc_math.h"
+#include "utils.h"
+#include "sim_util.h"
+#include <stdio.h>
+#include <math.h>
+
+// Settings
+#define SVM_TOP					8400 // SYSTEM_CORE_CLOCK / foc_f_sw with the defaults
+#define SVM_DT					1e-4
+#define SVM_ANGLES				3600
+
+// Private variables
+static const mc_foc_modulation_mode m_modes[] = {
+		FOC_MODULATION_SVPWM,
+		FOC_MODULATION_DPWMMIN,
+		FOC_MODULATION_DPWMMAX,
+		FOC_MODULATION_DPWM1
+};
+
+static const char *mode_name(mc_foc_modulation_mode mode) {
+	switch (mode) {
+	case FOC_MODULATION_SVPWM: return "SVPWM";
+	case FOC_MODULATION_DPWMMIN: return "DPWMMIN";
+	case FOC_MODULATION_DPWMMAX: return "DPWMMAX";
+	case FOC_MODULATION_DPWM1: return "DPWM1";
+	default: return "?";
+	}
+}
+
+static double leg_duty(uint32_t ccr) {
+	return (double)(ccr > SVM_TOP ? SVM_TOP : ccr) / (double)SVM_TOP;
+}
+
+static void svm(float alpha, float beta, mc_foc_modulation_mode mode, uint32_t *duty) {
+	uint32_t sector;
+	foc_svm(alpha, beta, SVM_TOP, mode, &duty[0], &duty[1], &duty[2], &sector);
+}
+
+static void report_patterns(mc_foc_modulation_mode mode) {
+	static const float mods[] = {0.05, 0.3, 0.6, 0.85};
+	double ab_err_max = 0.0, ll_err_max = 0.0;
+	int bad_clamp = 0;
+
+	for (unsigned int m = 0;m < sizeof(mods) / sizeof(mods[0]);m++) {
+		for (int i = 0;i < SVM_ANGLES;i++) {
+			const float angle = 2.0 * M_PI * (float)i / (float)SVM_ANGLES;
+			const float alpha = mods[m] * cosf(angle);
+			const float beta = mods[m] * sinf(angle);
+
+			uint32_t ref[3], duty[3];
+			svm(alpha, beta, FOC_MODULATION_SVPWM, ref);
+			svm(alpha, beta, mode, duty);
+
+			// Average output voltage vector relative to 2/3 of the bus
+			// voltage. A positive input gives a low compare value.
+			const double d[3] = {leg_duty(duty[0]), leg_duty(duty[1]), leg_duty(duty[2])};
+			const double out_alpha = (2.0 * d[0] - d[1] - d[2]) / 2.0;
+			const double out_beta = (sqrt(3.0) / 2.0) * (d[1] - d[2]);
+			ab_err_max = fmax(ab_err_max, fmax(fabs(out_alpha + alpha), fabs(out_beta + beta)));
+
+			// Line to line volt-seconds compared to SVPWM
+			for (int k = 0;k < 3;k++) {
+				const int n = (k + 1) % 3;
+				const double ll = d[k] - d[n];
+				const double ll_ref = leg_duty(ref[k]) - leg_duty(ref[n]);
+				ll_err_max = fmax(ll_err_max, fabs(ll - ll_ref));
+			}
+
+			// A clamped leg at the rail the mode asks for. On the sector
+			// borders two legs have the same compare value and both are clamped.
+			if (mode != FOC_MODULATION_SVPWM) {
+				int low = 0, high = 0;
+				for (int k = 0;k < 3;k++) {
+					low += duty[k] == 0;
+					high += duty[k] == SVM_TOP + 1;
+				}
+
+				bool ok = false;
+				if (mode == FOC_MODULATION_DPWMMIN) {
+					ok = low > 0 && high == 0;
+				} else if (mode == FOC_MODULATION_DPWMMAX) {
+					ok = high > 0 && low == 0;
+				} else {
+					// DPWM1 clamps the phase with the highest voltage magnitude
+					const float v[3] = {
+							alpha,
+							-0.5 * alpha + SQRT3_BY_2 * beta,
+							-0.5 * alpha - SQRT3_BY_2 * beta
+					};
+					int k_max = 0;
+					for (int k = 1;k < 3;k++) {
+						if (fabsf(v[k]) > fabsf(v[k_max])) {
+							k_max = k;
+						}
+					}
+					ok = (low == 0 || high == 0) &&
+							duty[k_max] == (v[k_max] > 0.0 ? 0 : SVM_TOP + 1);
+				}
+
+				bad_clamp += !ok;
+			}
+		}
+	}
+
+	printf("%-8s vector error %.1e, line to line error %.1e, bad clamps %d\n",
+			mode_name(mode), ab_err_max, ll_err_max, bad_clamp);
+	sim_check(ab_err_max < 3.0 / SVM_TOP, "%s output vector within 3 counts", mode_name(mode));
+	sim_check(ll_err_max < 3.0 / SVM_TOP, "%s volt-seconds equal to SVPWM", mode_name(mode));
+	if (mode != FOC_MODULATION_SVPWM) {
+		sim_check(bad_clamp == 0, "%s clamps a leg to the right rail", mode_name(mode));
+	}
+}
+
+static void report_high_time(mc_foc_modulation_mode mode, float mod, float freq) {
+	foc_dpwm_t dpwm = {-1, 0.0};
+	float high_time[3] = {0.0, 0.0, 0.0};
+	float high_time_max = 0.0;
+	int dpwm_periods = 0;
+	const int periods = (int)(1.0 / SVM_DT);
+
+	for (int i = 0;i < periods;i++) {
+		const float angle = 2.0 * M_PI * freq * (float)i * SVM_DT;
+		const float alpha = mod * cosf(angle);
+		const float beta = mod * sinf(angle);
+		const mc_foc_modulation_mode used = foc_dpwm_select(&dpwm, mode, alpha, beta, SVM_DT);
+		dpwm_periods += used != FOC_MODULATION_SVPWM;
+
+		uint32_t duty[3];
+		svm(alpha, beta, used, duty);
+		for (int k = 0;k < 3;k++) {
+			high_time[k] = duty[k] > SVM_TOP ? high_time[k] + SVM_DT : 0.0;
+			high_time_max = fmaxf(high_time_max, high_time[k]);
+		}
+	}
+
+	printf("%-8s mod %.2f %6.1f Hz: discontinuous %5.1f %%, longest high clamp %5.2f ms\n",
+			mode_name(mode), mod, freq, 100.0 * dpwm_periods / periods, high_time_max * 1e3);
+	sim_check(high_time_max < (FOC_DPWM_HIGH_TIME_MAX + 1.5 * SVM_DT),
+			"%s high clamp time limited at %.1f Hz", mode_name(mode), freq);
+
+	if (mod < FOC_DPWM_MOD_MIN) {
+		sim_check(dpwm_periods == 0, "%s falls back to SVPWM at modulation %.2f",
+				mode_name(mode), mod);
+	} else if (freq > (1.0 / (3.0 * FOC_DPWM_HIGH_TIME_MAX))) {
+		// A leg is clamped high for at most a third of the period
+		sim_check(dpwm_periods == periods, "%s stays discontinuous at %.1f Hz",
+				mode_name(mode), freq);
+	}
+}
+
+static void report_shunts(void) {
+	typedef struct {
+		uint32_t duty[3];
+		bool sample_v7;
+		int phase;
+	} shunt_case_t;
+
+	static const shunt_case_t cases[] = {
+			// Continuous: the same legs as before
+			{{1000, 4000, 7000}, false, 2},
+			{{1000, 4000, 7000}, true, 0},
+			{{4200, 4200, 4200}, false, -1},
+			// Clamped low: the sample of that leg is good in V7 as well
+			{{0, 3000, 6000}, true, 1},
+			{{0, 3000, 6000}, false, 2},
+			// Clamped high
+			{{SVM_TOP + 1, 2000, 5000}, false, 2},
+			{{SVM_TOP + 1, 2000, 5000}, true, 1},
+			{{2000, SVM_TOP + 1, 2000}, false, -1},
+	};
+
+	int wrong = 0;
+	for (unsigned int i = 0;i < sizeof(cases) / sizeof(cases[0]);i++) {
+		const shunt_case_t *c = &cases[i];
+		const int phase = foc_shunt_reconstruct_phase(c->duty, SVM_TOP, c->sample_v7);
+		if (phase != c->phase) {
+			printf("duty %u %u %u %s: phase %d, expected %d\n",
+					(unsigned int)c->duty[0], (unsigned int)c->duty[1], (unsigned int)c->duty[2],
+					c->sample_v7 ? "V7" : "V0", phase, c->phase);
+			wrong++;
+		}
+	}
+
+	printf("%d of %d cases right\n", (int)(sizeof(cases) / sizeof(cases[0])) - wrong,
+			(int)(sizeof(cases) / sizeof(cases[0])));
+	sim_check(wrong == 0, "reconstructed phase never a clamped leg");
+}
+
+int main(void) {
+	printf("=== Duty patterns ===\n");
+	for (unsigned int i = 0;i < sizeof(m_modes) / sizeof(m_modes[0]);i++) {
+		report_patterns(m_modes[i]);
+	}
+
+	printf("\n=== Clamp high time, %.1f ms limit ===\n", FOC_DPWM_HIGH_TIME_MAX * 1e3);
+	static const float freqs[] = {2.0, 20.0, 100.0, 500.0};
+	for (unsigned int i = 0;i < sizeof(freqs) / sizeof(freqs[0]);i++) {
+		report_high_time(FOC_MODULATION_DPWMMAX, 0.6, freqs[i]);
+		report_high_time(FOC_MODULATION_DPWM1, 0.6, freqs[i]);
+	}
+	report_high_time(FOC_MODULATION_DPWMMAX, 0.1, 20.0);
+	report_high_time(FOC_MODULATION_DPWMMIN, 0.1, 20.0);
+
+	printf("\n=== Current reconstruction with phase shunts ===\n");
+	report_shunts();
+
+	return sim_failures();
+}
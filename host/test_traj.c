@@ -0,0 +1,132 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/*
+ * Checks of the jerk limited point to point trajectories used by the position
+ * control: the moves have to end at the target at rest, stay within the
+ * limits, and the position, velocity and acceleration have to be consistent
+ * with each other.
+ */
+
+#include "foc_math.h"
+#include "utils.h"
+#include "sim_util.h"
+#include <stdio.h>
+#include <math.h>
+
+// Settings
+#define TRAJ_SAMPLES			20000
+#define TRAJ_V_MAX				3600.0 // Degrees per second
+#define TRAJ_A_MAX				36000.0
+#define TRAJ_J_MAX				720000.0
+#define TRAJ_TOL_LIMIT			1e-4 // Allowed relative overshoot of the limits
+#define TRAJ_TOL_POS			1e-4 // Allowed position error relative to the distance
+#define TRAJ_TOL_INT			2e-3 // Allowed integration error relative to the distance
+
+static void report_move(const char *name, float start, float dist) {
+	foc_traj_t traj;
+	const bool ok_plan = foc_traj_plan(&traj, start, dist, TRAJ_V_MAX, TRAJ_A_MAX, TRAJ_J_MAX);
+	sim_check(ok_plan, "%s planned", name);
+	if (!ok_plan) {
+		return;
+	}
+
+	const double h = traj.t_tot / TRAJ_SAMPLES;
+	const double d_abs = fabs(dist);
+	double v_max = 0.0, a_max = 0.0, j_max = 0.0;
+	double int_pos_err = 0.0, int_vel_err = 0.0, back = 0.0;
+	double pos_int = start, vel_int = 0.0;
+	float pos_prev = 0.0, vel_prev = 0.0, acc_prev = 0.0;
+
+	for (int i = 0;i <= TRAJ_SAMPLES;i++) {
+		float pos, vel, acc;
+		foc_traj_sample(&traj, (float)(i * h), &pos, &vel, &acc);
+
+		v_max = fmax(v_max, fabs(vel));
+		a_max = fmax(a_max, fabs(acc));
+		back = fmax(back, -traj.dir * vel);
+
+		if (i > 0) {
+			// The jerk is the slope of the piecewise linear acceleration
+			j_max = fmax(j_max, fabs(acc - acc_prev) / h);
+
+			pos_int += 0.5 * (vel + vel_prev) * h;
+			vel_int += 0.5 * (acc + acc_prev) * h;
+			int_pos_err = fmax(int_pos_err, fabs(pos_int - pos));
+			int_vel_err = fmax(int_vel_err, fabs(vel_int - vel));
+		}
+
+		pos_prev = pos;
+		vel_prev = vel;
+		acc_prev = acc;
+	}
+
+	// Past the end the trajectory has to stay at the target
+	float pos_end, vel_end, acc_end;
+	foc_traj_sample(&traj, traj.t_tot + 1.0, &pos_end, &vel_end, &acc_end);
+	const double end_err = fmax(fabs(pos_prev - (start + dist)), fabs(pos_end - (start + dist)));
+	const double tol_pos = TRAJ_TOL_POS * d_abs + 1e-3;
+	const double tol_int = TRAJ_TOL_INT * d_abs + 1e-3;
+
+	printf("%-14s dist %8.2f: time %6.4f s, v %7.1f, a %8.0f, j %8.0f, end error %.1e, "
+			"integration error pos %.1e vel %.1e\n",
+			name, (double)dist, (double)traj.t_tot, v_max, a_max, j_max,
+			end_err, int_pos_err, int_vel_err);
+
+	sim_check(end_err < tol_pos, "%s ends at the target", name);
+	sim_check(fabs(vel_prev) < 1e-3 * TRAJ_V_MAX && fabs(vel_end) < 1e-3 * TRAJ_V_MAX &&
+			fabs(acc_end) < 1e-3 * TRAJ_A_MAX, "%s ends at rest", name);
+	sim_check(v_max <= TRAJ_V_MAX * (1.0 + TRAJ_TOL_LIMIT) &&
+			a_max <= TRAJ_A_MAX * (1.0 + TRAJ_TOL_LIMIT) &&
+			j_max <= TRAJ_J_MAX * (1.0 + 1e-2), "%s within the limits", name);
+	sim_check(back < 1e-3 * TRAJ_V_MAX, "%s never moves backwards", name);
+	sim_check(int_pos_err < tol_int && int_vel_err < TRAJ_TOL_INT * TRAJ_V_MAX,
+			"%s position, velocity and acceleration consistent", name);
+}
+
+int main(void) {
+	// Distances where the move reaches both limits, only the acceleration
+	// limit, and neither of them.
+	const float d_jerk = 2.0 * TRAJ_A_MAX * SQ(TRAJ_A_MAX) / SQ(TRAJ_J_MAX);
+	printf("=== Moves with v %.0f, a %.0f, j %.0f ===\n", TRAJ_V_MAX, TRAJ_A_MAX, TRAJ_J_MAX);
+	report_move("long", 10.0, 3600.0);
+	report_move("long reverse", 10.0, -3600.0);
+	report_move("medium", -20.0, 200.0);
+	report_move("short", 0.0, 0.5 * d_jerk);
+	report_move("very short", 100.0, -0.01);
+	report_move("zero", 45.0, 0.0);
+
+	foc_traj_t traj;
+	sim_check(!foc_traj_plan(&traj, 0.0, 10.0, 0.0, TRAJ_A_MAX, TRAJ_J_MAX) &&
+			!foc_traj_plan(&traj, 0.0, 10.0, TRAJ_V_MAX, -1.0, TRAJ_J_MAX),
+			"limits that are not positive rejected");
+
+	// The peaks tell which phases the moves have
+	foc_traj_plan(&traj, 0.0, 3600.0, TRAJ_V_MAX, TRAJ_A_MAX, TRAJ_J_MAX);
+	sim_check(fabsf(traj.v_peak - TRAJ_V_MAX) < 1e-3 * TRAJ_V_MAX && traj.t_v > 0.0,
+			"long move reaches the velocity limit");
+	foc_traj_plan(&traj, 0.0, 200.0, TRAJ_V_MAX, TRAJ_A_MAX, TRAJ_J_MAX);
+	sim_check(traj.v_peak < TRAJ_V_MAX && fabsf(traj.a_peak - TRAJ_A_MAX) < 1e-3 * TRAJ_A_MAX,
+			"medium move reaches only the acceleration limit");
+	foc_traj_plan(&traj, 0.0, 0.5 * d_jerk, TRAJ_V_MAX, TRAJ_A_MAX, TRAJ_J_MAX);
+	sim_check(traj.a_peak < TRAJ_A_MAX * 0.999 && traj.t_v == 0.0,
+			"short move reaches neither limit");
+
+	return sim_failures();
+}
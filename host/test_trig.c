@@ -0,0 +1,144 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+
+/*
+ * Accuracy and execution time of the sine, cosine and atan2 variants that
+ * the FOC control loop can use, see FOC_TRIG_USE_LUT. The reference is the
+ * double precision C library.
+ */
+
+#include "foc_math.h"
+#include "utils.h"
+#include "sim_util.h"
+#include <stdio.h>
+#include <math.h>
+
+// Settings
+#define TRIG_POINTS				100000
+
+// Types
+typedef void (*sincos_func_t)(float angle, float *sin, float *cos);
+typedef float (*atan2_func_t)(float y, float x);
+
+// Private variables
+static float m_in_a[TRIG_POINTS];
+static float m_in_b[TRIG_POINTS];
+static volatile float m_sink;
+
+static void libm_sincos(float angle, float *sin, float *cos) {
+	*sin = sinf(angle);
+	*cos = cosf(angle);
+}
+
+static float libm_atan2(float y, float x) {
+	return atan2f(y, x);
+}
+
+static void report_sincos(const char *name, sincos_func_t func, double err_limit) {
+	double err_max = 0.0, err_sq_sum = 0.0;
+
+	for (int i = 0;i < TRIG_POINTS;i++) {
+		float s, c;
+		func(m_in_a[i], &s, &c);
+		const double es = fabs((double)s - sin((double)m_in_a[i]));
+		const double ec = fabs((double)c - cos((double)m_in_a[i]));
+		err_max = fmax(err_max, fmax(es, ec));
+		err_sq_sum += es * es + ec * ec;
+	}
+
+	double best = 1e30;
+	for (int run = 0;run < SIM_BENCH_RUNS;run++) {
+		float sum = 0.0;
+		const double start = sim_time_ns();
+		for (int i = 0;i < TRIG_POINTS;i++) {
+			float s, c;
+			func(m_in_a[i], &s, &c);
+			sum += s + c;
+		}
+		const double ns = (sim_time_ns() - start) / TRIG_POINTS;
+		m_sink = sum;
+		if (ns < best) {
+			best = ns;
+		}
+	}
+
+	printf("%-26s max error %.2e, rms error %.2e, %5.1f ns\n",
+			name, err_max, sqrt(err_sq_sum / (2.0 * TRIG_POINTS)), best);
+	sim_check(err_max < err_limit, "%s max error below %.0e", name, err_limit);
+}
+
+static void report_atan2(const char *name, atan2_func_t func, double err_limit) {
+	double err_max = 0.0, err_sq_sum = 0.0;
+
+	for (int i = 0;i < TRIG_POINTS;i++) {
+		const float a = func(m_in_a[i], m_in_b[i]);
+		const double e = fabs(utils_angle_difference_rad(a,
+				atan2((double)m_in_a[i], (double)m_in_b[i])));
+		err_max = fmax(err_max, e);
+		err_sq_sum += e * e;
+	}
+
+	double best = 1e30;
+	for (int run = 0;run < SIM_BENCH_RUNS;run++) {
+		float sum = 0.0;
+		const double start = sim_time_ns();
+		for (int i = 0;i < TRIG_POINTS;i++) {
+			sum += func(m_in_a[i], m_in_b[i]);
+		}
+		const double ns = (sim_time_ns() - start) / TRIG_POINTS;
+		m_sink = sum;
+		if (ns < best) {
+			best = ns;
+		}
+	}
+
+	printf("%-26s max error %.2e, rms error %.2e, %5.1f ns\n",
+			name, err_max, sqrt(err_sq_sum / TRIG_POINTS), best);
+	sim_check(err_max < err_limit, "%s max error below %.0e", name, err_limit);
+}
+
+int main(void) {
+	// Angles over the range the control loop uses
+	for (int i = 0;i < TRIG_POINTS;i++) {
+		m_in_a[i] = -M_PI + 2.0 * M_PI * ((float)i + 0.5) / (float)TRIG_POINTS;
+	}
+
+	printf("=== sin and cos, -pi to pi ===\n");
+	report_sincos("sinf + cosf", libm_sincos, 1e-6);
+	report_sincos("utils_fast_sincos", utils_fast_sincos, 1e-1);
+	report_sincos("utils_fast_sincos_better", utils_fast_sincos_better, 2e-3);
+	report_sincos("foc_lut_sincos", foc_lut_sincos, 1e-4);
+
+	// Points on circles with radii over several decades, like the flux
+	// linkage and current vectors the loop passes to atan2.
+	for (int i = 0;i < TRIG_POINTS;i++) {
+		const float angle = -M_PI + 2.0 * M_PI * ((float)i + 0.5) / (float)TRIG_POINTS;
+		const float r = powf(10.0, (float)(i % 7) - 4.0);
+		m_in_a[i] = r * sinf(angle);
+		m_in_b[i] = r * cosf(angle);
+	}
+
+	printf("\n=== atan2 ===\n");
+	report_atan2("atan2f", libm_atan2, 1e-6);
+	report_atan2("utils_fast_atan2", utils_fast_atan2, 2e-2);
+	report_atan2("foc_lut_atan2", foc_lut_atan2, 1e-5);
+
+	return sim_failures();
+}
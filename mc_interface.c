@@ -34,6 +34,8 @@
 #include "drv8301.h"
 #include "drv8320.h"
 #include "buffer.h"
+#include "digital_filter.h"
+#include "derate.h"
 #include <math.h>
 
 // Macros
@@ -65,11 +67,15 @@ static volatile float m_watt_seconds_charged;
 static volatile float m_position_set;
 static volatile float m_temp_fet;
 static volatile float m_temp_motor;
+static filter_biquad_coeffs_t m_temp_fet_filter_coeffs;
+static filter_biquad_coeffs_t m_temp_motor_filter_coeffs;
+static filter_biquad_state_t m_temp_fet_filter;
+static filter_biquad_state_t m_temp_motor_filter;
+static derate_t m_derate;
 // new
 static volatile ppm_cruise cruise_control_status;
 
 // Sampling variables
-#define ADC_SAMPLE_MAX_LEN		2000
 __attribute__((section(".ram4"))) static volatile int16_t m_curr0_samples[ADC_SAMPLE_MAX_LEN];
 __attribute__((section(".ram4"))) static volatile int16_t m_curr1_samples[ADC_SAMPLE_MAX_LEN];
 __attribute__((section(".ram4"))) static volatile int16_t m_ph1_samples[ADC_SAMPLE_MAX_LEN];
@@ -124,6 +130,11 @@ void mc_interface_init(mc_configuration *configuration) {
 	m_last_adc_duration_sample = 0.0;
 	m_temp_fet = 0.0;
 	m_temp_motor = 0.0;
+	filter_biquad_lowpass_1st(&m_temp_fet_filter_coeffs, MCIF_TEMP_FET_FILTER_FREQ, MCIF_LIMIT_RATE);
+	filter_biquad_lowpass_1st(&m_temp_motor_filter_coeffs, MCIF_TEMP_MOTOR_FILTER_FREQ, MCIF_LIMIT_RATE);
+	filter_biquad_reset(&m_temp_fet_filter_coeffs, &m_temp_fet_filter, 0.0);
+	filter_biquad_reset(&m_temp_motor_filter_coeffs, &m_temp_motor_filter, 0.0);
+	derate_build(&m_derate, &m_conf);
 	cruise_control_status = CRUISE_CONTROL_INACTIVE;
 
 	m_sample_len = 1000;
@@ -226,6 +237,10 @@ void mc_interface_set_configuration(mc_configuration *configuration) {
 		m_conf = *configuration;
 	}
 
+	utils_sys_lock_cnt();
+	derate_build(&m_derate, &m_conf);
+	utils_sys_unlock_cnt();
+
 	update_override_limits(&m_conf);
 
 	switch (m_conf.motor_type) {
@@ -310,6 +325,23 @@ const char* mc_interface_fault_to_string(mc_fault_code fault) {
 	}
 }
 
+const char* mc_interface_limit_source_to_string(mc_limit_source source) {
+	switch (source) {
+	case LIMIT_SOURCE_TEMP_FET: return "LIMIT_SOURCE_TEMP_FET"; break;
+	case LIMIT_SOURCE_TEMP_MOTOR: return "LIMIT_SOURCE_TEMP_MOTOR"; break;
+	case LIMIT_SOURCE_TEMP_FET_ACCEL: return "LIMIT_SOURCE_TEMP_FET_ACCEL"; break;
+	case LIMIT_SOURCE_TEMP_MOTOR_ACCEL: return "LIMIT_SOURCE_TEMP_MOTOR_ACCEL"; break;
+	case LIMIT_SOURCE_RPM_MAX: return "LIMIT_SOURCE_RPM_MAX"; break;
+	case LIMIT_SOURCE_RPM_MIN: return "LIMIT_SOURCE_RPM_MIN"; break;
+	case LIMIT_SOURCE_BATT_CUT: return "LIMIT_SOURCE_BATT_CUT"; break;
+	case LIMIT_SOURCE_VIN_MAX: return "LIMIT_SOURCE_VIN_MAX"; break;
+	case LIMIT_SOURCE_WATT_MAX: return "LIMIT_SOURCE_WATT_MAX"; break;
+	case LIMIT_SOURCE_WATT_MIN: return "LIMIT_SOURCE_WATT_MIN"; break;
+	case LIMIT_SOURCE_IN_CURRENT: return "LIMIT_SOURCE_IN_CURRENT"; break;
+	default: return "LIMIT_SOURCE_UNKNOWN"; break;
+	}
+}
+
 mc_state mc_interface_get_state(void) {
 	mc_state ret = MC_STATE_OFF;
 	switch (m_conf.motor_type) {
@@ -443,6 +475,47 @@ void mc_interface_set_pid_pos(float pos) {
 	}
 }
 
+/**
+ * Move to a position with a jerk limited trajectory. Only FOC has a trajectory
+ * generator, the other motor types go directly to the position.
+ *
+ * @param pos
+ * The goal position in degrees.
+ *
+ * @param vel
+ * Maximum velocity in degrees per second.
+ *
+ * @param acc
+ * Maximum acceleration in degrees per second^2.
+ *
+ * @param jerk
+ * Maximum jerk in degrees per second^3.
+ */
+void mc_interface_set_pid_pos_move(float pos, float vel, float acc, float jerk) {
+	if (mc_interface_try_input()) {
+		return;
+	}
+
+	m_position_set = pos;
+
+	pos *= DIR_MULT;
+	utils_norm_angle(&pos);
+
+	switch (m_conf.motor_type) {
+	case MOTOR_TYPE_BLDC:
+	case MOTOR_TYPE_DC:
+		mcpwm_set_pid_pos(pos);
+		break;
+
+	case MOTOR_TYPE_FOC:
+		mcpwm_foc_set_pid_pos_move(pos, vel, acc, jerk);
+		break;
+
+	default:
+		break;
+	}
+}
+
 void mc_interface_set_current(float current) {
 	if (mc_interface_try_input()) {
 		return;
@@ -981,6 +1054,52 @@ void mc_interface_sample_print_data(debug_sampling_mode mode, uint16_t len, uint
 	}
 }
 
+/**
+ * Store a pair of values in the first two sample buffers, e.g. the input and
+ * the output of a measurement. Debug sampling should be off while the buffers
+ * are used for this.
+ *
+ * @param index
+ * The sample index, 0 to ADC_SAMPLE_MAX_LEN - 1.
+ *
+ * @param a
+ * The first value.
+ *
+ * @param b
+ * The second value.
+ */
+void mc_interface_sample_set_pair(int index, int16_t a, int16_t b) {
+	if (index < 0 || index >= ADC_SAMPLE_MAX_LEN) {
+		return;
+	}
+
+	m_curr0_samples[index] = a;
+	m_curr1_samples[index] = b;
+}
+
+/**
+ * Read a pair of values stored with mc_interface_sample_set_pair.
+ *
+ * @param index
+ * The sample index, 0 to ADC_SAMPLE_MAX_LEN - 1.
+ *
+ * @param a
+ * The first value.
+ *
+ * @param b
+ * The second value.
+ */
+void mc_interface_sample_get_pair(int index, int16_t *a, int16_t *b) {
+	if (index < 0 || index >= ADC_SAMPLE_MAX_LEN) {
+		*a = 0;
+		*b = 0;
+		return;
+	}
+
+	*a = m_curr0_samples[index];
+	*b = m_curr1_samples[index];
+}
+
 /**
  * Get filtered MOSFET temperature. The temperature is pre-calculated, so this
  * functions is fast.
@@ -1003,6 +1122,18 @@ float mc_interface_temp_motor_filtered(void) {
 	return m_temp_motor;
 }
 
+/**
+ * Get the sources that limited the current in the latest override limit
+ * update.
+ *
+ * @return
+ * Bitmask with (1 << source) set for each limiting mc_limit_source. 0 when
+ * the configured limits apply.
+ */
+uint32_t mc_interface_get_limit_sources(void) {
+	return m_derate.sources;
+}
+
 // MC implementation functions
 
 /**
@@ -1369,139 +1500,19 @@ static void update_override_limits(volatile mc_configuration *conf) {
 	const float v_in = GET_INPUT_VOLTAGE();
 	const float rpm_now = mc_interface_get_rpm();
 
-	UTILS_LP_FAST(m_temp_fet, NTC_TEMP(ADC_IND_TEMP_MOS), 0.1);
-	UTILS_LP_FAST(m_temp_motor, NTC_TEMP_MOTOR(conf->m_ntc_motor_beta), 0.01);
-
-	// Temperature MOSFET
-	float lo_max_mos = 0.0;
-	float lo_min_mos = 0.0;
-	if (m_temp_fet < conf->l_temp_fet_start) {
-		lo_min_mos = conf->l_current_min;
-		lo_max_mos = conf->l_current_max;
-	} else if (m_temp_fet > conf->l_temp_fet_end) {
-		lo_min_mos = 0.0;
-		lo_max_mos = 0.0;
-		mc_interface_fault_stop(FAULT_CODE_OVER_TEMP_FET);
-	} else {
-		lo_min_mos = SIGN(conf->l_current_min) * utils_map(m_temp_fet, conf->l_temp_fet_start, conf->l_temp_fet_end, fabsf(conf->l_current_min), 0.0);
-		lo_max_mos = SIGN(conf->l_current_max) * utils_map(m_temp_fet, conf->l_temp_fet_start, conf->l_temp_fet_end, fabsf(conf->l_current_max), 0.0);
-	}
-
-	// Temperature MOTOR
-	float lo_max_mot = 0.0;
-	float lo_min_mot = 0.0;
-	if (m_temp_motor < conf->l_temp_motor_start) {
-		lo_min_mot = conf->l_current_min;
-		lo_max_mot = conf->l_current_max;
-	} else if (m_temp_motor > conf->l_temp_motor_end) {
-		lo_min_mot = 0.0;
-		lo_max_mot = 0.0;
-		mc_interface_fault_stop(FAULT_CODE_OVER_TEMP_MOTOR);
-	} else {
-		lo_min_mot = SIGN(conf->l_current_min) * utils_map(m_temp_motor, conf->l_temp_motor_start, conf->l_temp_motor_end, fabsf(conf->l_current_min), 0.0);
-		lo_max_mot = SIGN(conf->l_current_max) * utils_map(m_temp_motor, conf->l_temp_motor_start, conf->l_temp_motor_end, fabsf(conf->l_current_max), 0.0);
-	}
-
-	// Decreased temperatures during acceleration
-	// in order to still have braking torque available
-	const float temp_fet_accel_start = utils_map(conf->l_temp_accel_dec, 0.0, 1.0, conf->l_temp_fet_start, 25.0);
-	const float temp_fet_accel_end = utils_map(conf->l_temp_accel_dec, 0.0, 1.0, conf->l_temp_fet_end, 25.0);
-	const float temp_motor_accel_start = utils_map(conf->l_temp_accel_dec, 0.0, 1.0, conf->l_temp_motor_start, 25.0);
-	const float temp_motor_accel_end = utils_map(conf->l_temp_accel_dec, 0.0, 1.0, conf->l_temp_motor_end, 25.0);
-
-	float lo_fet_temp_accel = 0.0;
-	if (m_temp_fet < temp_fet_accel_start) {
-		lo_fet_temp_accel = conf->l_current_max;
-	} else if (m_temp_fet > temp_fet_accel_end) {
-		lo_fet_temp_accel = 0.0;
-	} else {
-		lo_fet_temp_accel = utils_map(m_temp_fet, temp_fet_accel_start,
-				temp_fet_accel_end, conf->l_current_max, 0.0);
-	}
-
-	float lo_motor_temp_accel = 0.0;
-	if (m_temp_motor < temp_motor_accel_start) {
-		lo_motor_temp_accel = conf->l_current_max;
-	} else if (m_temp_motor > temp_motor_accel_end) {
-		lo_motor_temp_accel = 0.0;
-	} else {
-		lo_motor_temp_accel = utils_map(m_temp_motor, temp_motor_accel_start,
-				temp_motor_accel_end, conf->l_current_max, 0.0);
-	}
-
-	// RPM max
-	float lo_max_rpm = 0.0;
-	const float rpm_pos_cut_start = conf->l_max_erpm * conf->l_erpm_start;
-	const float rpm_pos_cut_end = conf->l_max_erpm;
-	if (rpm_now < rpm_pos_cut_start) {
-		lo_max_rpm = conf->l_current_max;
-	} else if (rpm_now > rpm_pos_cut_end) {
-		lo_max_rpm = 0.0;
-	} else {
-		lo_max_rpm = utils_map(rpm_now, rpm_pos_cut_start, rpm_pos_cut_end, conf->l_current_max, 0.0);
-	}
-
-	// RPM min
-	float lo_min_rpm = 0.0;
-	const float rpm_neg_cut_start = conf->l_min_erpm * conf->l_erpm_start;
-	const float rpm_neg_cut_end = conf->l_min_erpm;
-	if (rpm_now > rpm_neg_cut_start) {
-		lo_min_rpm = conf->l_current_max;
-	} else if (rpm_now < rpm_neg_cut_end) {
-		lo_min_rpm = 0.0;
-	} else {
-		lo_min_rpm = utils_map(rpm_now, rpm_neg_cut_start, rpm_neg_cut_end, conf->l_current_max, 0.0);
-	}
-
-	float lo_max = utils_min_abs(lo_max_mos, lo_max_mot);
-	float lo_min = utils_min_abs(lo_min_mos, lo_min_mot);
-
-	lo_max = utils_min_abs(lo_max, lo_max_rpm);
-	lo_max = utils_min_abs(lo_max, lo_min_rpm);
-	lo_max = utils_min_abs(lo_max, lo_fet_temp_accel);
-	lo_max = utils_min_abs(lo_max, lo_motor_temp_accel);
+	m_temp_fet = filter_biquad_run(&m_temp_fet_filter_coeffs,
+			&m_temp_fet_filter, NTC_TEMP(ADC_IND_TEMP_MOS));
+	m_temp_motor = filter_biquad_run(&m_temp_motor_filter_coeffs,
+			&m_temp_motor_filter, NTC_TEMP_MOTOR(conf->m_ntc_motor_beta));
 
-	if (lo_max < conf->cc_min_current) {
-		lo_max = conf->cc_min_current;
-	}
-
-	if (lo_min > -conf->cc_min_current) {
-		lo_min = -conf->cc_min_current;
+	if (m_temp_fet > conf->l_temp_fet_end) {
+		mc_interface_fault_stop(FAULT_CODE_OVER_TEMP_FET);
 	}
 
-	conf->lo_current_max = lo_max;
-	conf->lo_current_min = lo_min;
-
-	// Battery cutoff
-	float lo_in_max_batt = conf->l_in_current_max;		
-	if (v_in < conf->l_battery_cut_end) {
-		lo_in_max_batt = 0.0;
-	} else if (v_in < conf->l_battery_cut_start){
-		lo_in_max_batt = utils_map(v_in, conf->l_battery_cut_start,
-				conf->l_battery_cut_end, conf->l_in_current_max, 0.0);
-	}
-	
-	//Battery max voltage
-	float lo_in_min_batt = conf->l_in_current_min;
-	if (v_in > conf->l_max_vin) {
-		lo_in_min_batt = -0.001;
-	}else if (v_in > conf->l_max_vin - 1.0) {
-		lo_in_min_batt = utils_map(v_in, conf->l_max_vin - 1.0,
-				conf->l_max_vin, conf->l_in_current_min, -0.001);
+	if (m_temp_motor > conf->l_temp_motor_end) {
+		mc_interface_fault_stop(FAULT_CODE_OVER_TEMP_MOTOR);
 	}
-	
-	// Wattage limits
-	const float lo_in_max_watt = conf->l_watt_max / v_in;
-	const float lo_in_min_watt = conf->l_watt_min / v_in;
-
-	const float lo_in_max = utils_min_abs(lo_in_max_watt, lo_in_max_batt);
-	const float lo_in_min = utils_min_abs(lo_in_min_watt, lo_in_min_batt);
-	//const float lo_in_min = lo_in_min_watt;
-
-	conf->lo_in_current_max = utils_min_abs(conf->l_in_current_max, lo_in_max);
-	conf->lo_in_current_min = utils_min_abs(conf->l_in_current_min, lo_in_min);
 
-	// Maximum current right now
 	float duty_abs = fabsf(mc_interface_get_duty_cycle_now());
 
 	// TODO: This is not an elegant solution.
@@ -1509,13 +1520,7 @@ static void update_override_limits(volatile mc_configuration *conf) {
 		duty_abs *= SQRT3_BY_2;
 	}
 
-	if (duty_abs > 0.001) {
-		conf->lo_current_motor_max_now = utils_min_abs(conf->lo_current_max, conf->lo_in_current_max / duty_abs);
-	} else {
-		conf->lo_current_motor_max_now = conf->lo_current_max;
-	}
-	
-	conf->lo_current_motor_min_now = conf->lo_current_min;
+	derate_update(&m_derate, conf, m_temp_fet, m_temp_motor, rpm_now, v_in, duty_abs);
 }
 
 static THD_FUNCTION(timer_thread, arg) {
@@ -34,6 +34,7 @@ void mc_interface_unlock(void);
 void mc_interface_lock_override_once(void);
 mc_fault_code mc_interface_get_fault(void);
 const char* mc_interface_fault_to_string(mc_fault_code fault);
+const char* mc_interface_limit_source_to_string(mc_limit_source source);
 mc_state mc_interface_get_state(void);
 void mc_interface_set_duty(float dutyCycle);
 void mc_interface_set_duty_noramp(float dutyCycle);
@@ -42,6 +43,7 @@ void mc_interface_set_pid_speed_with_cruise_status(float rpm, ppm_cruise cruise_
 ppm_cruise mc_interface_get_cruise_control_status(void);
 void mc_interface_set_cruise_control_status(ppm_cruise status); // 1 = active 0 = inactive
 void mc_interface_set_pid_pos(float pos);
+void mc_interface_set_pid_pos_move(float pos, float vel, float acc, float jerk);
 void mc_interface_set_current(float current);
 void mc_interface_set_brake_current(float current);
 void mc_interface_set_current_rel(float val);
@@ -75,8 +77,11 @@ float mc_interface_get_pid_pos_set(void);
 float mc_interface_get_pid_pos_now(void);
 float mc_interface_get_last_sample_adc_isr_duration(void);
 void mc_interface_sample_print_data(debug_sampling_mode mode, uint16_t len, uint8_t decimation);
+void mc_interface_sample_set_pair(int index, int16_t a, int16_t b);
+void mc_interface_sample_get_pair(int index, int16_t *a, int16_t *b);
 float mc_interface_temp_fet_filtered(void);
 float mc_interface_temp_motor_filtered(void);
+uint32_t mc_interface_get_limit_sources(void);
 
 // MC implementation functions
 void mc_interface_fault_stop(mc_fault_code fault);
@@ -91,6 +96,11 @@ extern volatile uint16_t ADC_Value[];
 extern volatile int ADC_curr_norm_value[];
 
 // Common fixed parameters
+#define ADC_SAMPLE_MAX_LEN				2000 // Length of the debug sample buffers
+#define MCIF_LIMIT_RATE					1000.0 // Rate of the override limit update in Hz
+#define MCIF_TEMP_FET_FILTER_FREQ		16.8 // MOSFET temperature filter cutoff in Hz
+#define MCIF_TEMP_MOTOR_FILTER_FREQ		1.6 // Motor temperature filter cutoff in Hz
+
 #ifndef HW_DEAD_TIME_VALUE
 #define HW_DEAD_TIME_VALUE				60 // Dead time
 #endif
@@ -128,6 +128,12 @@
 #ifndef MCCONF_S_PID_ALLOW_BRAKING
 #define MCCONF_S_PID_ALLOW_BRAKING		true	// Allow braking in speed control mode
 #endif
+#ifndef MCCONF_S_PID_FF_ACC
+#define MCCONF_S_PID_FF_ACC				0.0		// Set point acceleration feedforward gain
+#endif
+#ifndef MCCONF_S_PID_SCHED_POINTS
+#define MCCONF_S_PID_SCHED_POINTS		0		// Gain scheduling breakpoints in use, 0 disables the scheduling
+#endif
 
 // Position PID parameters
 #ifndef MCCONF_P_PID_KP
@@ -145,6 +151,12 @@
 #ifndef MCCONF_P_PID_ANG_DIV
 #define MCCONF_P_PID_ANG_DIV			1.0		// Divide angle by this value
 #endif
+#ifndef MCCONF_P_PID_FF_VEL
+#define MCCONF_P_PID_FF_VEL				0.0		// Trajectory velocity feedforward gain
+#endif
+#ifndef MCCONF_P_PID_FF_ACC
+#define MCCONF_P_PID_FF_ACC				0.0		// Trajectory acceleration feedforward gain
+#endif
 
 // Current control parameters
 #ifndef MCCONF_CC_GAIN
@@ -322,7 +334,52 @@
 #define MCCONF_FOC_TEMP_COMP_BASE_TEMP	25.0	// Motor temperature compensation base temperature
 #endif
 #ifndef MCCONF_FOC_CURRENT_FILTER_CONST
-#define MCCONF_FOC_CURRENT_FILTER_CONST	0.1		// Filter constant for the filtered currents
+#define MCCONF_FOC_CURRENT_FILTER_CONST	0.1		// Filter constant for the filtered currents at a 10 kHz control loop rate
+#endif
+#ifndef MCCONF_FOC_OBSERVER_TYPE
+#define MCCONF_FOC_OBSERVER_TYPE		FOC_OBSERVER_TYPE_FLUX	// Sensorless position observer
+#endif
+#ifndef MCCONF_FOC_FW_CURRENT_MAX
+#define MCCONF_FOC_FW_CURRENT_MAX		0.0		// Maximum field weakening current, 0 disables field weakening
+#endif
+#ifndef MCCONF_FOC_FW_DUTY_START
+#define MCCONF_FOC_FW_DUTY_START		0.9		// Start field weakening at this fraction of the maximum duty cycle
+#endif
+#ifndef MCCONF_FOC_FW_RAMP_TIME
+#define MCCONF_FOC_FW_RAMP_TIME			0.2		// Time to ramp the field weakening current from 0 to maximum (s)
+#endif
+#ifndef MCCONF_FOC_MOTOR_LD
+#define MCCONF_FOC_MOTOR_LD				MCCONF_FOC_MOTOR_L	// D axis inductance
+#endif
+#ifndef MCCONF_FOC_MOTOR_LQ
+#define MCCONF_FOC_MOTOR_LQ				MCCONF_FOC_MOTOR_L	// Q axis inductance
+#endif
+#ifndef MCCONF_FOC_MTPA_ENABLE
+#define MCCONF_FOC_MTPA_ENABLE			false	// Maximum torque per amp for motors with LQ > LD
+#endif
+#ifndef MCCONF_FOC_CC_DECOUPLING
+#define MCCONF_FOC_CC_DECOUPLING		FOC_CC_DECOUPLING_DISABLED // Current controller decoupling feedforward
+#endif
+#ifndef MCCONF_FOC_MODULATION_MODE
+#define MCCONF_FOC_MODULATION_MODE		FOC_MODULATION_SVPWM // Continuous or discontinuous space vector modulation
+#endif
+#ifndef MCCONF_FOC_DT_COMP_BAND
+#define MCCONF_FOC_DT_COMP_BAND			0.0 // Current band around zero where the dead time compensation is ramped. 0 uses the sign of the current.
+#endif
+#ifndef MCCONF_FOC_HFI_VOLTAGE
+#define MCCONF_FOC_HFI_VOLTAGE			2.0 // D axis injection voltage in the HFI sensor mode
+#endif
+#ifndef MCCONF_FOC_HFI_ERPM
+#define MCCONF_FOC_HFI_ERPM				3000.0 // ERPM where the HFI sensor mode has blended into the observer
+#endif
+#ifndef MCCONF_FOC_RLS_ENABLE
+#define MCCONF_FOC_RLS_ENABLE			false // Estimate the resistance and flux linkage while running
+#endif
+#ifndef MCCONF_FOC_ENCODER_COMP_ENABLE
+#define MCCONF_FOC_ENCODER_COMP_ENABLE	false // Correct the encoder angle with the calibrated table
+#endif
+#ifndef MCCONF_FOC_COGGING_COMP_ENABLE
+#define MCCONF_FOC_COGGING_COMP_ENABLE	false // Add the calibrated cogging current as feedforward
 #endif
 
 // Misc
@@ -34,6 +34,8 @@
 #include "ledpwm.h"
 #include "terminal.h"
 #include "encoder.h"
+#include "speed_pid.h"
+#include "bldc_math.h"
 
 // Structs
 typedef struct {
@@ -57,6 +59,7 @@ static volatile float dutycycle_now;
 static volatile float rpm_now;
 static volatile float speed_pid_set_rpm;
 static volatile ppm_cruise speed_pid_cruise_control_type;
+static speed_pid_state_t speed_pid;
 static volatile float pos_pid_set_pos;
 static volatile float current_set;
 static volatile int tachometer;
@@ -74,6 +77,8 @@ static volatile float last_current_sample_filtered;
 static volatile float mcpwm_detect_currents_avg[6];
 static volatile float mcpwm_detect_avg_samples[6];
 static volatile float switching_frequency_now;
+static filter_biquad_coeffs_t rpm_filter_coeffs;
+static filter_biquad_state_t rpm_filter;
 static volatile int ignore_iterations;
 static volatile mc_timer_struct timer_struct;
 static volatile int curr_samp_volt; // Use the voltage-synchronized samples for this current sample
@@ -83,6 +88,8 @@ static volatile int has_commutated;
 static volatile mc_rpm_dep_struct rpm_dep;
 static volatile float cycle_integrator_sum;
 static volatile float cycle_integrator_iterations;
+static bldc_sl_state_t sl_state;
+static bldc_curr_state_t curr_state;
 static volatile mc_configuration *conf;
 static volatile float pwm_cycles_sum;
 static volatile int pwm_cycles;
@@ -105,25 +112,25 @@ static volatile int curr2_offset;
 #define KV_FIR_TAPS_BITS		7
 #define KV_FIR_LEN				(1 << KV_FIR_TAPS_BITS)
 #define KV_FIR_FCUT				0.02
-static volatile float kv_fir_coeffs[KV_FIR_LEN];
-static volatile float kv_fir_samples[KV_FIR_LEN];
-static volatile int kv_fir_index = 0;
+static float kv_fir_coeffs[KV_FIR_LEN];
+static float kv_fir_history[FILTER_FIR_BUFFER_LEN(KV_FIR_LEN)];
+static filter_fir_t kv_fir;
 
 // Amplitude FIR filter
 #define AMP_FIR_TAPS_BITS		7
 #define AMP_FIR_LEN				(1 << AMP_FIR_TAPS_BITS)
 #define AMP_FIR_FCUT			0.02
-static volatile float amp_fir_coeffs[AMP_FIR_LEN];
-static volatile float amp_fir_samples[AMP_FIR_LEN];
-static volatile int amp_fir_index = 0;
+static float amp_fir_coeffs[AMP_FIR_LEN];
+static float amp_fir_history[FILTER_FIR_BUFFER_LEN(AMP_FIR_LEN)];
+static filter_fir_t amp_fir;
 
 // Current FIR filter
 #define CURR_FIR_TAPS_BITS		4
 #define CURR_FIR_LEN			(1 << CURR_FIR_TAPS_BITS)
 #define CURR_FIR_FCUT			0.15
-static volatile float current_fir_coeffs[CURR_FIR_LEN];
-static volatile float current_fir_samples[CURR_FIR_LEN];
-static volatile int current_fir_index = 0;
+static float current_fir_coeffs[CURR_FIR_LEN];
+static float current_fir_history[FILTER_FIR_BUFFER_LEN(CURR_FIR_LEN)];
+static filter_fir_t current_fir;
 
 static volatile float last_adc_isr_duration;
 static volatile float last_inj_adc_isr_duration;
@@ -185,6 +192,7 @@ void mcpwm_init(volatile mc_configuration *configuration) {
 	dutycycle_set = 0.0;
 	dutycycle_now = 0.0;
 	speed_pid_set_rpm = 0.0;
+	speed_pid_reset(&speed_pid, 0.0);
 	speed_pid_cruise_control_type = CRUISE_CONTROL_MOTOR_SETTINGS;
 	pos_pid_set_pos = 0.0;
 	current_set = 0.0;
@@ -203,6 +211,13 @@ void mcpwm_init(volatile mc_configuration *configuration) {
 	memset((void*)&rpm_dep, 0, sizeof(rpm_dep));
 	cycle_integrator_sum = 0.0;
 	cycle_integrator_iterations = 0.0;
+	memset(&sl_state, 0, sizeof(sl_state));
+	sl_state.int_scale = 0.0005 * VDIV_CORR;
+#ifdef HW_HAS_3_SHUNTS
+	bldc_curr_init(&curr_state, true);
+#else
+	bldc_curr_init(&curr_state, false);
+#endif
 	pwm_cycles_sum = 0.0;
 	pwm_cycles = 0;
 	last_pwm_cycles_sum = 0.0;
@@ -215,13 +230,20 @@ void mcpwm_init(volatile mc_configuration *configuration) {
 	mcpwm_init_hall_table((int8_t*)conf->hall_table);
 
 	// Create KV FIR filter
-	filter_create_fir_lowpass((float*)kv_fir_coeffs, KV_FIR_FCUT, KV_FIR_TAPS_BITS, 1);
+	filter_create_fir_lowpass(kv_fir_coeffs, KV_FIR_FCUT, KV_FIR_TAPS_BITS, 1);
+	filter_fir_init(&kv_fir, kv_fir_coeffs, kv_fir_history, KV_FIR_LEN);
 
 	// Create amplitude FIR filter
-	filter_create_fir_lowpass((float*)amp_fir_coeffs, AMP_FIR_FCUT, AMP_FIR_TAPS_BITS, 1);
+	filter_create_fir_lowpass(amp_fir_coeffs, AMP_FIR_FCUT, AMP_FIR_TAPS_BITS, 1);
+	filter_fir_init(&amp_fir, amp_fir_coeffs, amp_fir_history, AMP_FIR_LEN);
 
 	// Create current FIR filter
-	filter_create_fir_lowpass((float*)current_fir_coeffs, CURR_FIR_FCUT, CURR_FIR_TAPS_BITS, 1);
+	filter_create_fir_lowpass(current_fir_coeffs, CURR_FIR_FCUT, CURR_FIR_TAPS_BITS, 1);
+	filter_fir_init(&current_fir, current_fir_coeffs, current_fir_history, CURR_FIR_LEN);
+
+	// Create speed filter
+	filter_biquad_lowpass_1st(&rpm_filter_coeffs, MCPWM_RPM_FILTER_FREQ, MCPWM_RPM_RATE);
+	filter_biquad_reset(&rpm_filter_coeffs, &rpm_filter, 0.0);
 
 	TIM_DeInit(TIM1);
 	TIM_DeInit(TIM8);
@@ -784,10 +806,7 @@ float mcpwm_get_kv(void) {
  * The filtered KV value.
  */
 float mcpwm_get_kv_filtered(void) {
-	float value = filter_run_fir_iteration((float*)kv_fir_samples,
-			(float*)kv_fir_coeffs, KV_FIR_TAPS_BITS, kv_fir_index);
-
-	return value;
+	return filter_fir_run(&kv_fir);
 }
 
 /**
@@ -1141,61 +1160,22 @@ static void set_duty_cycle_hw(float dutyCycle) {
 }
 
 static void run_pid_control_speed(void) {
-	static float i_term = 0;
-	static float prev_error = 0;
-	static float d_filter = 0.0;
-		// PID is off. Return.
+	// PID is off. Return.
 	if (control_mode != CONTROL_MODE_SPEED) {
-	    i_term = mcpwm_get_tot_current_directional_filtered() / conf->lo_current_max;
-		prev_error = 0.0;
-		d_filter = 0.0;
+		speed_pid_reset(&speed_pid, mcpwm_get_tot_current_directional_filtered() / conf->lo_current_max);
 		return;
 	}
 
-	const float rpm = mcpwm_get_rpm();
-	float error = speed_pid_set_rpm - rpm;
-
-	// Too low RPM set. Reset state and return.
-	if (fabsf(speed_pid_set_rpm) <conf->s_pid_min_erpm) {
-		i_term = 0.0;
-		prev_error = error;
-		d_filter = 0.0;
-		current_set = 0.0;
-		return;
-	}
-
-	// Compute parameters
-	float p_term = error * conf->s_pid_kp * 0.025; // 1.0 / 40.0
-	i_term += error * (conf->s_pid_ki * MCPWM_PID_TIME_K) * 0.025; // 1.0 / 40.0
-	float d_term = (error - prev_error) * (conf->s_pid_kd / MCPWM_PID_TIME_K) * 0.025; // 1.0 / 40.0
-
-	// Filter D
-	UTILS_LP_FAST(d_filter, d_term, conf->p_pid_kd_filter);
-	d_term = d_filter;
-
-	// I-term wind-up protection
-	utils_truncate_number(&i_term, -1.0, 1.0);
-
-	// Store previous error
-	prev_error = error;
+	const float output = speed_pid_run(&speed_pid, conf, speed_pid_set_rpm,
+			mcpwm_get_rpm(), speed_pid_cruise_control_type, conf->p_pid_kd_filter, MCPWM_PID_TIME_K);
 
-	// Calculate output
-	float output = p_term + i_term + d_term;
-	utils_truncate_number(&output, -1.0, 1.0);
-
-	// Optionally disable braking
-	if ((speed_pid_cruise_control_type == CRUISE_CONTROL_MOTOR_SETTINGS && !conf->s_pid_allow_braking) || speed_pid_cruise_control_type == CRUISE_CONTROL_BRAKING_DISABLED) {
-		if((rpm > 0.0 && output < 0.0) || (rpm < 0.0 && output > 0.0)){
-			output = 0.0;
-			i_term = 0.0;
-			prev_error = 0;
-			d_filter = 0.0;
-		}
+	current_set = output * conf->lo_current_max;
 
+	// Too low RPM set
+	if (fabsf(speed_pid_set_rpm) < conf->s_pid_min_erpm) {
+		return;
 	}
 
-	current_set = output * conf->lo_current_max;
-
 	if (state != MC_STATE_RUNNING) {
 		set_duty_cycle_hl(SIGN(output) * conf->l_min_duty);
 	}
@@ -1270,31 +1250,11 @@ static THD_FUNCTION(rpm_thread, arg) {
 		}
 
 		// Some low-pass filtering
-		static float rpm_filtered = 0.0;
-		UTILS_LP_FAST(rpm_filtered, rpm_now, 0.1);
-		rpm_now = rpm_filtered;
+		rpm_now = filter_biquad_run(&rpm_filter_coeffs, &rpm_filter, rpm_now);
 		const float rpm_abs = fabsf(rpm_now);
 
 		// Update the cycle integrator limit
-		rpm_dep.cycle_int_limit = conf->sl_cycle_int_limit;
-		rpm_dep.cycle_int_limit_running = rpm_dep.cycle_int_limit + (float)ADC_Value[ADC_IND_VIN_SENS] *
-				conf->sl_bemf_coupling_k / (rpm_abs > conf->sl_min_erpm ? rpm_abs : conf->sl_min_erpm);
-		rpm_dep.cycle_int_limit_running = utils_map(rpm_abs, 0,
-				conf->sl_cycle_int_rpm_br, rpm_dep.cycle_int_limit_running,
-				rpm_dep.cycle_int_limit_running * conf->sl_phase_advance_at_br);
-		rpm_dep.cycle_int_limit_max = rpm_dep.cycle_int_limit + (float)ADC_Value[ADC_IND_VIN_SENS] *
-				conf->sl_bemf_coupling_k / conf->sl_min_erpm_cycle_int_limit;
-
-		if (rpm_dep.cycle_int_limit_running < 1.0) {
-			rpm_dep.cycle_int_limit_running = 1.0;
-		}
-
-		if (rpm_dep.cycle_int_limit_running > rpm_dep.cycle_int_limit_max) {
-			rpm_dep.cycle_int_limit_running = rpm_dep.cycle_int_limit_max;
-		}
-
-		rpm_dep.comm_time_sum = conf->m_bldc_f_sw_max / ((rpm_abs / 60.0) * 6.0);
-		rpm_dep.comm_time_sum_min_rpm = conf->m_bldc_f_sw_max / ((conf->sl_min_erpm / 60.0) * 6.0);
+		bldc_update_rpm_dep(&rpm_dep, conf, rpm_abs, (float)ADC_Value[ADC_IND_VIN_SENS]);
 
 		run_pid_control_speed();
 
@@ -1320,8 +1280,7 @@ static THD_FUNCTION(timer_thread, arg) {
 		if (state == MC_STATE_OFF) {
 			// Track the motor back-emf and follow it with dutycycle_now. Also track
 			// the direction of the motor.
-			amp = filter_run_fir_iteration((float*)amp_fir_samples,
-					(float*)amp_fir_coeffs, AMP_FIR_TAPS_BITS, amp_fir_index);
+			amp = filter_fir_run(&amp_fir);
 
 			// Direction tracking
 			if (conf->motor_type == MOTOR_TYPE_DC) {
@@ -1398,12 +1357,10 @@ static THD_FUNCTION(timer_thread, arg) {
 		if (cnt_tmp >= 10) {
 			cnt_tmp = 0;
 			if (state == MC_STATE_RUNNING) {
-				filter_add_sample((float*)kv_fir_samples, mcpwm_get_kv(),
-						KV_FIR_TAPS_BITS, (uint32_t*)&kv_fir_index);
+				filter_fir_add_sample(&kv_fir, mcpwm_get_kv());
 			} else if (state == MC_STATE_OFF) {
 				if (dutycycle_now >= conf->l_min_duty) {
-					filter_add_sample((float*)kv_fir_samples, mcpwm_get_kv(),
-							KV_FIR_TAPS_BITS, (uint32_t*)&kv_fir_index);
+					filter_fir_add_sample(&kv_fir, mcpwm_get_kv());
 				}
 			}
 		}
@@ -1545,60 +1502,7 @@ void mcpwm_adc_inj_int_handler(void) {
 			float c2 = (float)ADC_curr_norm_value[2];
 			curr_tot_sample = sqrtf((c0*c0 + c1*c1 + c2*c2) / 1.5);
 		} else {
-#ifdef HW_HAS_3_SHUNTS
-			if (direction) {
-				switch (comm_step) {
-				case 1: curr_tot_sample = -(float)ADC_curr_norm_value[2]; break;
-				case 2: curr_tot_sample = -(float)ADC_curr_norm_value[2]; break;
-				case 3: curr_tot_sample = -(float)ADC_curr_norm_value[1]; break;
-				case 4: curr_tot_sample = -(float)ADC_curr_norm_value[1]; break;
-				case 5: curr_tot_sample = -(float)ADC_curr_norm_value[0]; break;
-				case 6: curr_tot_sample = -(float)ADC_curr_norm_value[0]; break;
-				default: break;
-				}
-			} else {
-				switch (comm_step) {
-				case 1: curr_tot_sample = -(float)ADC_curr_norm_value[1]; break;
-				case 2: curr_tot_sample = -(float)ADC_curr_norm_value[1]; break;
-				case 3: curr_tot_sample = -(float)ADC_curr_norm_value[2]; break;
-				case 4: curr_tot_sample = -(float)ADC_curr_norm_value[2]; break;
-				case 5: curr_tot_sample = -(float)ADC_curr_norm_value[0]; break;
-				case 6: curr_tot_sample = -(float)ADC_curr_norm_value[0]; break;
-				default: break;
-				}
-			}
-#else
-			if (direction) {
-				switch (comm_step) {
-				case 1: curr_tot_sample = -(float)ADC_curr_norm_value[1]; break;
-				case 2: curr_tot_sample = -(float)ADC_curr_norm_value[1]; break;
-				case 3: curr_tot_sample = (float)ADC_curr_norm_value[0]; break;
-				case 4: curr_tot_sample = (float)ADC_curr_norm_value[1]; break;
-				case 5: curr_tot_sample = -(float)ADC_curr_norm_value[0]; break;
-				case 6: curr_tot_sample = -(float)ADC_curr_norm_value[0]; break;
-				default: break;
-				}
-			} else {
-				switch (comm_step) {
-				case 1: curr_tot_sample = (float)ADC_curr_norm_value[1]; break;
-				case 2: curr_tot_sample = (float)ADC_curr_norm_value[0]; break;
-				case 3: curr_tot_sample = -(float)ADC_curr_norm_value[1]; break;
-				case 4: curr_tot_sample = -(float)ADC_curr_norm_value[1]; break;
-				case 5: curr_tot_sample = -(float)ADC_curr_norm_value[0]; break;
-				case 6: curr_tot_sample = -(float)ADC_curr_norm_value[0]; break;
-				default: break;
-				}
-			}
-#endif
-
-			const float tot_sample_tmp = curr_tot_sample;
-			static int comm_step_prev = 1;
-			static float prev_tot_sample = 0.0;
-			if (comm_step != comm_step_prev) {
-				curr_tot_sample = prev_tot_sample;
-			}
-			comm_step_prev = comm_step;
-			prev_tot_sample = tot_sample_tmp;
+			curr_tot_sample = bldc_curr_update(&curr_state, direction, comm_step, ADC_curr_norm_value);
 		}
 
 		if (detect_now == 4) {
@@ -1676,11 +1580,7 @@ void mcpwm_adc_inj_int_handler(void) {
 		last_current_sample = SIGN(last_current_sample) * conf->l_abs_current_max * 1.2;
 	}
 
-	filter_add_sample((float*) current_fir_samples, last_current_sample,
-			CURR_FIR_TAPS_BITS, (uint32_t*) &current_fir_index);
-	last_current_sample_filtered = filter_run_fir_iteration(
-			(float*) current_fir_samples, (float*) current_fir_coeffs,
-			CURR_FIR_TAPS_BITS, current_fir_index);
+	last_current_sample_filtered = filter_fir_process(&current_fir, last_current_sample);
 
 	last_inj_adc_isr_duration = (float) TIM12->CNT / 10000000.0;
 }
@@ -1748,12 +1648,9 @@ void mcpwm_adc_int_handler(void *p, uint32_t flags) {
 		}
 
 		// Fill the amplitude FIR filter
-		filter_add_sample((float*)amp_fir_samples, amp,
-				AMP_FIR_TAPS_BITS, (uint32_t*)&amp_fir_index);
+		filter_fir_add_sample(&amp_fir, amp);
 
 		if (sensorless_now) {
-			static float cycle_integrator = 0;
-
 			if (pwm_cycles_sum >= rpm_dep.comm_time_sum_min_rpm) {
 				if (state == MC_STATE_RUNNING) {
 					if (conf->comm_mode == COMM_MODE_INTEGRATE) {
@@ -1765,105 +1662,41 @@ void mcpwm_adc_int_handler(void *p, uint32_t flags) {
 						commutate(1);
 					}
 
-					cycle_integrator = 0.0;
+					sl_state.cycle_integrator = 0.0;
 				}
 			}
 
 			if ((state == MC_STATE_RUNNING && pwm_cycles >= 2) || state == MC_STATE_OFF) {
-				int v_diff = 0;
-				int ph_now_raw = 0;
-
-				switch (comm_step) {
-				case 1:
-					v_diff = ph1;
-					ph_now_raw = ph1_raw;
-					break;
-				case 2:
-					v_diff = -ph2;
-					ph_now_raw = ph2_raw;
-					break;
-				case 3:
-					v_diff = ph3;
-					ph_now_raw = ph3_raw;
-					break;
-				case 4:
-					v_diff = -ph1;
-					ph_now_raw = ph1_raw;
-					break;
-				case 5:
-					v_diff = ph2;
-					ph_now_raw = ph2_raw;
-					break;
-				case 6:
-					v_diff = -ph3;
-					ph_now_raw = ph3_raw;
-					break;
-				default:
-					break;
-				}
+				const int ph[3] = {ph1, ph2, ph3};
+				const int ph_raw[3] = {ph1_raw, ph2_raw, ph3_raw};
+				bldc_sl_input_t sl_in;
+				bldc_floating_phase(comm_step, ph, ph_raw, &sl_in.v_diff, &sl_in.ph_now_raw);
 
 				// Collect hall sensor samples in the first half of the commutation cycle. This is
 				// because positive timing is much better than negative timing in case they are
 				// mis-aligned.
-				if (v_diff < 50) {
+				if (sl_in.v_diff < 50) {
 					hall_detect_table[read_hall()][comm_step]++;
 				}
 
-				// Don't commutate while the motor is standing still and the signal only consists
-				// of weak noise.
-				if (abs(v_diff) < 10) {
-					v_diff = 0;
-				}
-
-				if (v_diff > 0) {
-					// TODO!
-					//					const int min = 100;
-					int min = (int)((1.0 - fabsf(dutycycle_now)) * (float)ADC_Value[ADC_IND_VIN_SENS] * 0.3);
-					if (min > ADC_Value[ADC_IND_VIN_SENS] / 4) {
-						min = ADC_Value[ADC_IND_VIN_SENS] / 4;
-					}
+				sl_in.v_in_raw = ADC_Value[ADC_IND_VIN_SENS];
+				sl_in.duty_abs = fabsf(dutycycle_now);
+				sl_in.rpm_abs = fabsf(rpm_now);
+				sl_in.f_sw = switching_frequency_now;
+				sl_in.pwm_cycles_sum = pwm_cycles_sum;
+				sl_in.last_pwm_cycles_sum = last_pwm_cycles_sum;
+				sl_in.has_commutated = has_commutated;
 
-					if (pwm_cycles_sum > (last_pwm_cycles_sum / 2.0) ||
-							!has_commutated || (ph_now_raw > min && ph_now_raw < (ADC_Value[ADC_IND_VIN_SENS] - min))) {
-						cycle_integrator += (float)v_diff / switching_frequency_now;
-					}
-				}
-
-				static float cycle_sum = 0.0;
-				if (conf->comm_mode == COMM_MODE_INTEGRATE) {
-					float limit;
-					if (has_commutated) {
-						limit = rpm_dep.cycle_int_limit_running * (0.0005 * VDIV_CORR);
-					} else {
-						limit = rpm_dep.cycle_int_limit * (0.0005 * VDIV_CORR);
-					}
+				if (bldc_sl_update(&sl_state, &sl_in, conf, &rpm_dep)) {
+					commutate(1);
 
-					if (cycle_integrator >= (rpm_dep.cycle_int_limit_max * (0.0005 * VDIV_CORR)) ||
-							cycle_integrator >= limit) {
-						commutate(1);
-						cycle_integrator = 0.0;
-						cycle_sum = 0.0;
-					}
-				} else if (conf->comm_mode == COMM_MODE_DELAY) {
-					if (v_diff > 0) {
-						cycle_sum += conf->m_bldc_f_sw_max / switching_frequency_now;
-
-						if (cycle_sum >= utils_map(fabsf(rpm_now), 0,
-								conf->sl_cycle_int_rpm_br, rpm_dep.comm_time_sum / 2.0,
-								(rpm_dep.comm_time_sum / 2.0) * conf->sl_phase_advance_at_br)) {
-							commutate(1);
-							cycle_integrator_sum += cycle_integrator * (1.0 / (0.0005 * VDIV_CORR));
-							cycle_integrator_iterations += 1.0;
-							cycle_integrator = 0.0;
-							cycle_sum = 0.0;
-						}
-					} else {
-						cycle_integrator = 0.0;
-						cycle_sum = 0.0;
+					if (conf->comm_mode == COMM_MODE_DELAY) {
+						cycle_integrator_sum += sl_state.integrator_at_comm * (1.0 / sl_state.int_scale);
+						cycle_integrator_iterations += 1.0;
 					}
 				}
 			} else {
-				cycle_integrator = 0.0;
+				sl_state.cycle_integrator = 0.0;
 			}
 
 			pwm_cycles_sum += conf->m_bldc_f_sw_max / switching_frequency_now;
@@ -1894,8 +1727,7 @@ void mcpwm_adc_int_handler(void *p, uint32_t flags) {
 		}
 
 		// Fill the amplitude FIR filter
-		filter_add_sample((float*)amp_fir_samples, amp,
-				AMP_FIR_TAPS_BITS, (uint32_t*)&amp_fir_index);
+		filter_fir_add_sample(&amp_fir, amp);
 
 		if (state == MC_STATE_RUNNING && !has_commutated) {
 			set_next_comm_step(comm_step);
@@ -83,6 +83,8 @@ extern volatile int mcpwm_vzero;
  * Fixed parameters
  */
 #define MCPWM_RPM_TIMER_FREQ			1000000.0	// Frequency of the RPM measurement timer
+#define MCPWM_RPM_RATE					1000.0	// Rate of the speed estimate update in the rpm timer thread in Hz
+#define MCPWM_RPM_FILTER_FREQ			16.8	// Speed estimate filter cutoff in Hz
 #define MCPWM_CMD_STOP_TIME				0		// Ignore commands for this duration in msec after a stop has been sent
 #define MCPWM_DETECT_STOP_TIME			500		// Ignore commands for this duration in msec after a detect command
 
@@ -38,46 +38,89 @@
 #include "encoder.h"
 #include "commands.h"
 #include "timeout.h"
+#include "foc_math.h"
+#include "foc_observer.h"
+#include "speed_pid.h"
 #include <math.h>
 #include <string.h>
 #include <stdlib.h>
 
 // Private types
-typedef struct {
-	float id_target;
-	float iq_target;
-	float max_duty;
-	float duty_now;
-	float phase;
-	float i_alpha;
-	float i_beta;
-	float i_abs;
-	float i_abs_filter;
-	float i_bus;
-	float v_bus;
-	float v_alpha;
-	float v_beta;
-	float mod_d;
-	float mod_q;
-	float id;
-	float iq;
-	float id_filter;
-	float iq_filter;
-	float vd;
-	float vq;
-	float vd_int;
-	float vq_int;
-	uint32_t svm_sector;
-} motor_state_t;
-
 typedef struct {
 	int sample_num;
+	float sample_time; // Time since the last resistance sample
 	float avg_current_tot;
 	float avg_voltage_tot;
+	bool measure_res_now;
 	bool measure_inductance_now;
-	float measure_inductance_duty;
 } mc_sample_t;
 
+/*
+ * Inductance measurement pulse pattern for one axis: the outputs that are
+ * switched high during the pulse, and the phase current that is sampled at
+ * its end together with the sign that makes that current positive.
+ */
+typedef struct {
+	bool high[3];
+	int curr;
+	int sign;
+} ind_axis_t;
+
+typedef enum {
+	IND_STEP_START = 0,
+	IND_STEP_OFF,
+	IND_STEP_DECAY,
+	IND_STEP_PULSE,
+	IND_STEP_SAMPLE,
+	IND_STEP_DONE
+} ind_step_t;
+
+/*
+ * A batch of inductance measurement pulses. The interrupt handler pulses every
+ * axis reps times at each duty cycle level, lowest level first, and only sums
+ * up the samples. A level whose average current reaches i_max ends the batch.
+ */
+typedef struct {
+	float duty[MCPWM_FOC_IND_LEVELS_MAX];
+	int levels;
+	int reps;
+	float i_max; // 0 for no limit
+	int level;
+	int rep;
+	int axis;
+	ind_step_t step;
+	float curr_sum[MCPWM_FOC_IND_LEVELS_MAX][3];
+	float volt_sum[MCPWM_FOC_IND_LEVELS_MAX][3];
+	int cnt[MCPWM_FOC_IND_LEVELS_MAX][3];
+} ind_batch_t;
+
+typedef struct {
+	bool active;
+	freq_resp_target target;
+	float amp;
+	float freq;
+	float freq_mult; // Frequency change per control loop iteration
+	float phase;
+	float time;
+	float time_end;
+	float u; // Injected value
+	float scale; // Units per sample LSB
+	int dec;
+	int dec_cnt;
+	int samples;
+} freq_resp_t;
+
+// Inductance measurement axes, in the order they are pulsed
+static const ind_axis_t m_ind_axes[3] = {
+		{{false, true, true}, 0, -1},
+		{{true, false, true}, 1, -1},
+#ifdef HW_HAS_3_SHUNTS
+		{{true, true, false}, 2, -1}
+#else
+		{{false, false, true}, 2, 1}
+#endif
+};
+
 // Private variables
 static volatile mc_configuration *m_conf;
 static volatile mc_state m_state;
@@ -104,17 +147,50 @@ static volatile float m_phase_now_observer_override;
 static volatile bool m_phase_observer_override;
 static volatile float m_phase_now_encoder;
 static volatile float m_phase_now_encoder_no_index;
-static volatile float m_observer_x1;
-static volatile float m_observer_x2;
+static volatile foc_observer_state_t m_observer_state;
+static const foc_observer_t *m_observer;
 static volatile float m_pll_phase;
 static volatile float m_pll_speed;
 static volatile mc_sample_t m_samples;
+static volatile ind_batch_t m_ind_batch;
+static volatile filter_biquad_state_t m_v_bus_filter;
+static volatile filter_biquad_state_t m_vd_filter;
+static volatile filter_biquad_state_t m_vq_filter;
+static volatile bool m_vdq_filter_valid;
 static volatile int m_tachometer;
 static volatile int m_tachometer_abs;
 static volatile float last_inj_adc_isr_duration;
 static volatile float m_pos_pid_now;
 static volatile bool m_init_done;
 static volatile float m_gamma_now;
+static volatile foc_derived_params_t m_params;
+static foc_dpwm_t m_dpwm;
+static volatile int m_observer_iterations;
+static volatile float m_fw_current_now;
+static float m_mtpa_table[FOC_MTPA_TABLE_LEN];
+static volatile bool m_mtpa_enabled;
+static volatile foc_hfi_t m_hfi;
+static volatile float m_hfi_voltage;
+static foc_rls_t m_rls;
+static volatile float m_rls_vq_sum;
+static volatile float m_rls_id_sum;
+static volatile float m_rls_iq_sum;
+static volatile float m_rls_speed_sum;
+static volatile int m_rls_samples;
+static float m_comp_sum[FOC_COMP_TABLE_LEN];
+static volatile bool m_hall_learn;
+static volatile float m_hall_learn_sum[8];
+static volatile int m_hall_learn_cnt[8];
+static volatile int m_hall_prev;
+static foc_hall_sectors_t m_hall_sectors;
+static volatile float m_duty_pid_set;
+static volatile bool m_duty_pid_active;
+static volatile float m_duty_pid_iq;
+static volatile foc_traj_t m_traj;
+static volatile float m_pos_vel_set;
+static volatile float m_pos_acc_set;
+static speed_pid_state_t m_speed_pid;
+static volatile freq_resp_t m_freq_resp;
 
 #ifdef HW_HAS_3_SHUNTS
 static volatile int m_curr2_sum;
@@ -123,15 +199,27 @@ static volatile int m_curr2_offset;
 
 // Private functions
 static void do_dc_cal(void);
-void observer_update(float v_alpha, float v_beta, float i_alpha, float i_beta,
-		float dt, volatile float *x1, volatile float *x2, volatile float *phase);
-static void pll_run(float phase, float dt, volatile float *phase_var,
-		volatile float *speed_var);
+static void observer_update(float v_alpha, float v_beta, float i_alpha, float i_beta,
+		float dt, volatile float *phase);
 static void control_current(volatile motor_state_t *state_m, float dt);
-static void svm(float alpha, float beta, uint32_t PWMHalfPeriod,
-		uint32_t* tAout, uint32_t* tBout, uint32_t* tCout, uint32_t *svm_sector);
-static void run_pid_control_pos(float angle_now, float angle_set, float dt);
+static void update_derived_params(void);
+static void reset_rls(void);
+static void run_rls(void);
+static void comp_move_override(float target);
+static float inductance_pulse_time(float duty);
+static void run_inductance_pulses(const int *curr);
+static int measure_inductance_batch(const float *duty, int levels, int reps, float i_max,
+		float curr[][3], float volt[][3]);
+static float measure_inductance_axes(float duty, int samples, float *curr, float *l_axis);
+static void run_pid_control_pos(float angle_now, float angle_set,
+		float vel_set, float acc_set, float dt);
 static void run_pid_control_speed(float dt);
+static void run_tasks(float dt);
+static void run_freq_resp(float dt);
+static void task_speed(float dt);
+static void task_pos(float dt);
+static void task_duty(float dt);
+static void task_observer_gain(float dt);
 static void stop_pwm_hw(void);
 static void start_pwm_hw(void);
 static int read_hall(void);
@@ -143,6 +231,33 @@ static THD_WORKING_AREA(timer_thread_wa, 2048);
 static THD_FUNCTION(timer_thread, arg);
 static volatile bool timer_thd_stop;
 
+/*
+ * Control loops that run from the end of the ADC interrupt every div:th
+ * iteration with a fixed time step, so that they don't get the jitter of a
+ * thread. div is derived from the target rate and the control loop rate in
+ * update_derived_params, so that the rates don't change with foc_f_sw. The
+ * phase offsets spread them over different iterations. The time they take is
+ * measured with TIM12 in 0.1 us ticks.
+ */
+typedef struct {
+	const char *name;
+	void (*func)(float dt);
+	float rate; // Target rate in Hz, 0 for every iteration
+	int div;
+	int cnt;
+	volatile uint32_t time_last;
+	volatile uint32_t time_max;
+} foc_task_t;
+
+static foc_task_t m_tasks[] = {
+		{"speed", task_speed, MCPWM_FOC_RATE_SPEED, 1, 0, 0, 0},
+		{"position", task_pos, MCPWM_FOC_RATE_POS, 1, 1, 0, 0},
+		{"duty", task_duty, MCPWM_FOC_RATE_DUTY, 1, 2, 0, 0},
+		{"observer gain", task_observer_gain, MCPWM_FOC_RATE_OBSERVER_GAIN, 1, 3, 0, 0}
+};
+
+#define TASK_NUM		(sizeof(m_tasks) / sizeof(m_tasks[0]))
+
 // Macros
 #ifdef HW_HAS_3_SHUNTS
 #define TIMER_UPDATE_DUTY(duty1, duty2, duty3) \
@@ -227,8 +342,8 @@ void mcpwm_foc_init(volatile mc_configuration *configuration) {
 	m_phase_observer_override = false;
 	m_phase_now_encoder = 0.0;
 	m_phase_now_encoder_no_index = 0.0;
-	m_observer_x1 = 0.0;
-	m_observer_x2 = 0.0;
+	m_observer = foc_observer_get(m_conf->foc_observer_type);
+	m_observer->init(&m_observer_state);
 	m_pll_phase = 0.0;
 	m_pll_speed = 0.0;
 	m_tachometer = 0;
@@ -236,8 +351,26 @@ void mcpwm_foc_init(volatile mc_configuration *configuration) {
 	last_inj_adc_isr_duration = 0;
 	m_pos_pid_now = 0.0;
 	m_gamma_now = 0.0;
+	m_duty_pid_set = 0.0;
+	m_duty_pid_active = false;
+	m_duty_pid_iq = 0.0;
+	memset((void*)&m_traj, 0, sizeof(m_traj));
+	m_pos_vel_set = 0.0;
+	m_pos_acc_set = 0.0;
+	speed_pid_reset(&m_speed_pid, 0.0);
+	memset((void*)&m_freq_resp, 0, sizeof(m_freq_resp));
+	m_observer_iterations = FOC_OBSERVER_ITERATIONS_MAX;
+	m_fw_current_now = 0.0;
+	m_mtpa_enabled = foc_mtpa_build_table(m_mtpa_table, m_conf);
+	foc_hfi_reset(&m_hfi, 0.0, 0.0, false);
+	m_hfi_voltage = 0.0;
+	reset_rls();
+	m_hall_learn = false;
+	m_hall_prev = -1;
+	foc_hall_sectors_update(&m_hall_sectors, m_conf->foc_hall_table, m_conf->foc_hall_edge_corr);
 	memset((void*)&m_motor_state, 0, sizeof(motor_state_t));
 	memset((void*)&m_samples, 0, sizeof(mc_sample_t));
+	update_derived_params();
 
 #ifdef HW_HAS_3_SHUNTS
 	m_curr2_sum = 0;
@@ -487,6 +620,28 @@ bool mcpwm_foc_init_done(void) {
 
 void mcpwm_foc_set_configuration(volatile mc_configuration *configuration) {
 	m_conf = configuration;
+	reset_rls();
+	update_derived_params();
+
+	// Only restart the observer when the type changes, and not in the middle
+	// of an update from the control loop.
+	const foc_observer_t *observer = foc_observer_get(m_conf->foc_observer_type);
+	if (observer != m_observer) {
+		utils_sys_lock_cnt();
+		m_observer = observer;
+		m_observer->init(&m_observer_state);
+		utils_sys_unlock_cnt();
+	}
+
+	foc_hall_sectors_t hall_sectors;
+	foc_hall_sectors_update(&hall_sectors, m_conf->foc_hall_table, m_conf->foc_hall_edge_corr);
+	utils_sys_lock_cnt();
+	m_hall_sectors = hall_sectors;
+	utils_sys_unlock_cnt();
+
+	// Don't use the table from the control loop while it is rebuilt
+	m_mtpa_enabled = false;
+	m_mtpa_enabled = foc_mtpa_build_table(m_mtpa_table, m_conf);
 
 	m_control_mode = CONTROL_MODE_NONE;
 	m_state = MC_STATE_OFF;
@@ -576,8 +731,52 @@ void mcpwm_foc_set_pid_speed_with_cruise_status(float rpm, ppm_cruise cruise_sta
  * The desired position of the motor in degrees.
  */
 void mcpwm_foc_set_pid_pos(float pos) {
+	m_traj.active = false;
 	m_control_mode = CONTROL_MODE_POS;
 	m_pos_pid_set = pos;
+	m_pos_vel_set = 0.0;
+	m_pos_acc_set = 0.0;
+
+	if (m_state != MC_STATE_RUNNING) {
+		m_state = MC_STATE_RUNNING;
+	}
+}
+
+/**
+ * Move to a position with a jerk limited trajectory. The position PID follows
+ * the trajectory and the velocity and acceleration along it are used as
+ * feedforward, see p_pid_ff_vel and p_pid_ff_acc. The move starts from rest at
+ * the current position set point, or at the current position when position
+ * control was not active, and takes the shortest way around.
+ *
+ * @param pos
+ * The goal position in degrees.
+ *
+ * @param vel
+ * Maximum velocity in degrees per second.
+ *
+ * @param acc
+ * Maximum acceleration in degrees per second^2.
+ *
+ * @param jerk
+ * Maximum jerk in degrees per second^3.
+ */
+void mcpwm_foc_set_pid_pos_move(float pos, float vel, float acc, float jerk) {
+	const float start = m_control_mode == CONTROL_MODE_POS ? m_pos_pid_set : m_pos_pid_now;
+
+	foc_traj_t traj;
+	if (!foc_traj_plan(&traj, start, utils_angle_difference(pos, start), vel, acc, jerk)) {
+		mcpwm_foc_set_pid_pos(pos);
+		return;
+	}
+
+	utils_sys_lock_cnt();
+	m_traj = traj;
+	m_pos_pid_set = start;
+	m_pos_vel_set = 0.0;
+	m_pos_acc_set = 0.0;
+	m_control_mode = CONTROL_MODE_POS;
+	utils_sys_unlock_cnt();
 
 	if (m_state != MC_STATE_RUNNING) {
 		m_state = MC_STATE_RUNNING;
@@ -1170,6 +1369,208 @@ void mcpwm_foc_encoder_detect(float current, bool print, float *offset, float *r
 	mc_interface_unlock();
 }
 
+/**
+ * Calibrate the encoder nonlinearity and the cogging torque. The encoder
+ * offset, ratio and inversion must have been detected first, and the
+ * position PID has to be tuned.
+ *
+ * First the motor is locked with an open loop current at FOC_COMP_TABLE_LEN
+ * positions over one encoder revolution, in both directions, and the
+ * difference between the encoder and the locking angle is recorded. Then the
+ * corrected encoder is used to hold FOC_COMP_TABLE_LEN positions over one
+ * electrical revolution with position control, and the average q axis
+ * current needed is recorded. Friction cancels when averaging both
+ * directions.
+ *
+ * @param current
+ * The locking open loop current for the motor.
+ *
+ * @param print
+ * Print the progress.
+ *
+ * @param enc_table
+ * The encoder table, indexed by the encoder angle.
+ *
+ * @param enc_scale
+ * The encoder table scale, in encoder degrees per step.
+ *
+ * @param cog_table
+ * The cogging table, indexed by the electrical angle.
+ *
+ * @param cog_scale
+ * The cogging table scale, in amperes per step.
+ *
+ * @return
+ * True for success, false if the encoder is not configured.
+ */
+bool mcpwm_foc_encoder_comp_detect(float current, bool print, int8_t *enc_table,
+		float *enc_scale, int8_t *cog_table, float *cog_scale) {
+	if (!encoder_is_configured()) {
+		return false;
+	}
+
+	mc_interface_lock();
+
+	// Disable timeout
+	systime_t tout = timeout_get_timeout_msec();
+	float tout_c = timeout_get_brake_current();
+	timeout_reset();
+	timeout_configure(600000, 0.0);
+
+	// Save configuration
+	const mc_foc_sensor_mode sensor_mode_old = m_conf->foc_sensor_mode;
+	const bool enc_comp_old = m_conf->foc_encoder_comp_enable;
+	const bool cog_comp_old = m_conf->foc_cogging_comp_enable;
+	const float enc_scale_old = m_conf->foc_encoder_comp_scale;
+	int8_t enc_table_old[FOC_COMP_TABLE_LEN];
+	memcpy(enc_table_old, (int8_t*)m_conf->foc_encoder_comp_table, sizeof(enc_table_old));
+
+	m_conf->foc_encoder_comp_enable = false;
+	m_conf->foc_cogging_comp_enable = false;
+
+	const float ratio = m_conf->foc_encoder_ratio;
+	const float inv_sign = m_conf->foc_encoder_inverted ? -1.0 : 1.0;
+
+	// Encoder error
+	m_phase_override = true;
+	m_id_set = current;
+	m_iq_set = 0.0;
+	m_control_mode = CONTROL_MODE_CURRENT;
+	m_state = MC_STATE_RUNNING;
+
+	memset(m_comp_sum, 0, sizeof(m_comp_sum));
+
+	for (int dir = 0;dir < 2;dir++) {
+		for (int j = 0;j < FOC_COMP_TABLE_LEN;j++) {
+			const int i = dir == 0 ? j : (FOC_COMP_TABLE_LEN - 1 - j);
+			float enc_target = 360.0 * (float)i / (float)FOC_COMP_TABLE_LEN;
+			if (m_conf->foc_encoder_inverted) {
+				enc_target = 360.0 - enc_target;
+			}
+			float phase_target = enc_target * ratio - m_conf->foc_encoder_offset;
+			utils_norm_angle(&phase_target);
+
+			comp_move_override(phase_target * (M_PI / 180.0));
+			chThdSleepMilliseconds(100);
+
+			const float diff = utils_angle_difference_rad(m_phase_now_encoder, m_phase_now_override);
+			m_comp_sum[i] += 0.5 * inv_sign * diff * (180.0 / M_PI) / ratio;
+		}
+
+		if (print) {
+			commands_printf("Encoder pass %d done", dir + 1);
+		}
+	}
+
+	*enc_scale = foc_comp_table_build(m_comp_sum, enc_table);
+
+	// Cogging, with the new encoder table
+	memcpy((int8_t*)m_conf->foc_encoder_comp_table, enc_table, FOC_COMP_TABLE_LEN);
+	m_conf->foc_encoder_comp_scale = *enc_scale;
+	m_conf->foc_encoder_comp_enable = true;
+	m_conf->foc_sensor_mode = FOC_SENSOR_MODE_ENCODER;
+
+	m_id_set = 0.0;
+	m_phase_override = false;
+	memset(m_comp_sum, 0, sizeof(m_comp_sum));
+
+	for (int dir = 0;dir < 2;dir++) {
+		for (int j = 0;j < FOC_COMP_TABLE_LEN;j++) {
+			const int i = dir == 0 ? j : (FOC_COMP_TABLE_LEN - 1 - j);
+			float enc_target = (360.0 * (float)i / (float)FOC_COMP_TABLE_LEN +
+					m_conf->foc_encoder_offset) / ratio;
+			if (m_conf->foc_encoder_inverted) {
+				enc_target = 360.0 - enc_target;
+			}
+			utils_norm_angle(&enc_target);
+
+			mcpwm_foc_set_pid_pos(enc_target);
+			chThdSleepMilliseconds(250);
+
+			float iq_sum = 0.0;
+			for (int k = 0;k < 50;k++) {
+				iq_sum += m_motor_state.iq_filter;
+				chThdSleepMilliseconds(1);
+			}
+			m_comp_sum[i] += 0.5 * iq_sum / 50.0;
+		}
+
+		if (print) {
+			commands_printf("Cogging pass %d done", dir + 1);
+		}
+	}
+
+	*cog_scale = foc_comp_table_build(m_comp_sum, cog_table);
+
+	m_id_set = 0.0;
+	m_iq_set = 0.0;
+	m_phase_override = false;
+	m_control_mode = CONTROL_MODE_NONE;
+	m_state = MC_STATE_OFF;
+	stop_pwm_hw();
+
+	// Restore configuration
+	m_conf->foc_sensor_mode = sensor_mode_old;
+	m_conf->foc_encoder_comp_enable = enc_comp_old;
+	m_conf->foc_cogging_comp_enable = cog_comp_old;
+	m_conf->foc_encoder_comp_scale = enc_scale_old;
+	memcpy((int8_t*)m_conf->foc_encoder_comp_table, enc_table_old, sizeof(enc_table_old));
+
+	// Enable timeout
+	timeout_configure(tout, tout_c);
+
+	mc_interface_unlock();
+
+	return true;
+}
+
+/**
+ * Start learning the hall sensor transition angles. The motor has to run
+ * above foc_sl_erpm in hall sensor mode while learning, so that the observer
+ * can be used as reference.
+ */
+void mcpwm_foc_hall_learn_start(void) {
+	m_hall_learn = false;
+	m_hall_prev = -1;
+
+	for (int i = 0;i < 8;i++) {
+		m_hall_learn_sum[i] = 0.0;
+		m_hall_learn_cnt[i] = 0;
+	}
+
+	m_hall_learn = true;
+}
+
+/**
+ * Stop learning the hall sensor transition angles and calculate the
+ * corrections.
+ *
+ * @param edge_corr
+ * The transition angle corrections in 0.1 degree, for foc_hall_edge_corr.
+ * Edges that were not seen are set to 0.
+ *
+ * @return
+ * The number of edges that were seen at least MCPWM_FOC_HALL_LEARN_MIN
+ * times. That should be 6 for a complete result.
+ */
+int mcpwm_foc_hall_learn_stop(int8_t *edge_corr) {
+	m_hall_learn = false;
+
+	int edges = 0;
+	for (int i = 0;i < 8;i++) {
+		edge_corr[i] = 0;
+
+		if (m_hall_learn_cnt[i] >= MCPWM_FOC_HALL_LEARN_MIN) {
+			float corr = (m_hall_learn_sum[i] / (float)m_hall_learn_cnt[i]) * (1800.0 / M_PI);
+			utils_truncate_number(&corr, -127.0, 127.0);
+			edge_corr[i] = (int8_t)roundf(corr);
+			edges++;
+		}
+	}
+
+	return edges;
+}
+
 /**
  * Lock the motor with a current and sample the voiltage and current to
  * calculate the motor resistance.
@@ -1178,7 +1579,7 @@ void mcpwm_foc_encoder_detect(float current, bool print, float *offset, float *r
  * The locking current.
  *
  * @param samples
- * The number of samples to take.
+ * The number of samples to take, at MCPWM_FOC_RES_SAMPLE_RATE.
  *
  * @return
  * The calculated motor resistance.
@@ -1199,24 +1600,47 @@ float mcpwm_foc_measure_resistance(float current, int samples) {
 	timeout_reset();
 	timeout_configure(60000, 0.0);
 
-	// Wait for the current to rise and the motor to lock.
-	chThdSleepMilliseconds(500);
+	// Wait for the current to rise and the motor to lock. The rotor might have
+	// to turn to the locked position, so the voltage has to settle too.
+	float vq_last = 0.0;
+	int settled = 0;
+	for (int i = 0;i < (MCPWM_FOC_RES_SETTLE_MAX_MS / 5);i++) {
+		chThdSleepMilliseconds(5);
+
+		const float vq = m_motor_state.vq;
+		if (i >= (MCPWM_FOC_RES_SETTLE_MIN_MS / 5) &&
+				fabsf(m_motor_state.iq_filter - current) < (0.05 * current) &&
+				fabsf(vq - vq_last) < (0.02 * fabsf(vq) + 0.01)) {
+			settled++;
+			if (settled >= 4) {
+				break;
+			}
+		} else {
+			settled = 0;
+		}
+
+		vq_last = vq;
+	}
 
 	// Sample
 	m_samples.avg_current_tot = 0.0;
 	m_samples.avg_voltage_tot = 0.0;
+	m_samples.sample_time = 0.0;
 	m_samples.sample_num = 0;
+	m_samples.measure_res_now = true;
 
 	int cnt = 0;
 	while (m_samples.sample_num < samples) {
-		chThdSleepMilliseconds(1);
+		chThdSleepMicroseconds(500);
 		cnt++;
 		// Timeout
-		if (cnt > 10000) {
+		if (cnt > 20000) {
 			break;
 		}
 	}
 
+	m_samples.measure_res_now = false;
+
 	const float current_avg = m_samples.avg_current_tot / (float)m_samples.sample_num;
 	const float voltage_avg = m_samples.avg_voltage_tot / (float)m_samples.sample_num;
 
@@ -1252,51 +1676,108 @@ float mcpwm_foc_measure_resistance(float current, int samples) {
  * The average d and q axis inductance in microhenry.
  */
 float mcpwm_foc_measure_inductance(float duty, int samples, float *curr) {
-	m_samples.avg_current_tot = 0.0;
-	m_samples.avg_voltage_tot = 0.0;
-	m_samples.sample_num = 0;
-	m_samples.measure_inductance_duty = duty;
+	return measure_inductance_axes(duty, samples, curr, 0);
+}
 
-	// Disable timeout
-	systime_t tout = timeout_get_timeout_msec();
-	float tout_c = timeout_get_brake_current();
-	timeout_reset();
-	timeout_configure(60000, 0.0);
+/**
+ * Measure the d and q axis inductance with short voltage pulses. The pulses
+ * are applied along the three phase axes, and the inductance along an axis
+ * varies with twice the angle between that axis and the rotor. The average
+ * and the amplitude of that variation give Ld and Lq. The rotor should not
+ * move during the measurement.
+ *
+ * @param duty
+ * The duty cycle to use in the pulses.
+ *
+ * @param samples
+ * The number of samples to average over.
+ *
+ * @param ld
+ * The d axis inductance in microhenry.
+ *
+ * @param lq
+ * The q axis inductance in microhenry.
+ *
+ * @return
+ * The average d and q axis inductance in microhenry.
+ */
+float mcpwm_foc_measure_inductance_dq(float duty, int samples, float *ld, float *lq) {
+	float l_axes[3];
+	const float ind = measure_inductance_axes(duty, samples, 0, l_axes);
 
-	mc_interface_lock();
+	// The pulses are applied along the A, B and C axes, and the inductance
+	// has a period of 180 degrees, so only the axis angles matter.
+	const float axis_ang[3] = {0.0, 2.0 * M_PI / 3.0, 4.0 * M_PI / 3.0};
+	float l_avg = 0.0;
+	float l_re = 0.0;
+	float l_im = 0.0;
 
-	int to_cnt = 0;
-	for (int i = 0;i < samples;i++) {
-		m_samples.measure_inductance_now = true;
+	for (int i = 0;i < 3;i++) {
+		const float l_axis = l_axes[i];
+		l_avg += l_axis / 3.0;
+		l_re += l_axis * cosf(2.0 * axis_ang[i]);
+		l_im += l_axis * sinf(2.0 * axis_ang[i]);
+	}
 
-		do {
-			chThdSleepMicroseconds(100);
-			to_cnt++;
-			if (to_cnt > 50000) {
-				break;
-			}
-		} while (m_samples.measure_inductance_now);
+	const float l_diff_half = (2.0 / 3.0) * sqrtf(SQ(l_re) + SQ(l_im));
 
-		if (to_cnt > 50000) {
-			break;
-		}
-	}
+	*ld = l_avg - l_diff_half;
+	*lq = l_avg + l_diff_half;
 
-	// Enable timeout
-	timeout_configure(tout, tout_c);
+	return ind;
+}
 
-	mc_interface_unlock();
+/**
+ * Measure how the inductance drops with the current because of saturation.
+ * All duty cycle levels are measured in one batch of pulses, so that the
+ * rotor and the temperature are the same for every point.
+ *
+ * @param duty_max
+ * The duty cycle of the highest level. The levels are evenly spaced from
+ * duty_max / levels to duty_max.
+ *
+ * @param levels
+ * The number of levels, at most MCPWM_FOC_IND_LEVELS_MAX.
+ *
+ * @param samples
+ * The number of pulses per axis at each level.
+ *
+ * @param i_max
+ * The measurement stops after the first level whose average current
+ * reaches this. 0 for no limit.
+ *
+ * @param curr
+ * The average pulse current at each level.
+ *
+ * @param ind
+ * The average d and q axis inductance at each level in microhenry.
+ *
+ * @return
+ * The number of levels that were measured.
+ */
+int mcpwm_foc_measure_inductance_curve(float duty_max, int levels, int samples,
+		float i_max, float *curr, float *ind) {
+	if (levels > MCPWM_FOC_IND_LEVELS_MAX) {
+		levels = MCPWM_FOC_IND_LEVELS_MAX;
+	}
 
-	float avg_current = m_samples.avg_current_tot / (float)m_samples.sample_num;
-	float avg_voltage = m_samples.avg_voltage_tot / (float)m_samples.sample_num;
-	float t = (float)TIM1->ARR * m_samples.measure_inductance_duty / (float)SYSTEM_CORE_CLOCK -
-			(float)(MCPWM_FOC_INDUCTANCE_SAMPLE_CNT_OFFSET + MCPWM_FOC_INDUCTANCE_SAMPLE_RISE_COMP) / (float)SYSTEM_CORE_CLOCK;
+	float duty[MCPWM_FOC_IND_LEVELS_MAX];
+	for (int i = 0;i < levels;i++) {
+		duty[i] = duty_max * (float)(i + 1) / (float)levels;
+	}
 
-	if (curr) {
-		*curr = avg_current;
+	float c[MCPWM_FOC_IND_LEVELS_MAX][3];
+	float v[MCPWM_FOC_IND_LEVELS_MAX][3];
+	const int points = measure_inductance_batch(duty, levels, samples, i_max, c, v);
+
+	for (int i = 0;i < points;i++) {
+		const float i_avg = (c[i][0] + c[i][1] + c[i][2]) / 3.0;
+		const float v_avg = (v[i][0] + v[i][1] + v[i][2]) / 3.0;
+		curr[i] = i_avg;
+		ind[i] = ((v_avg * inductance_pulse_time(duty[i])) / i_avg) * 1e6 * (2.0 / 3.0);
 	}
 
-	return ((avg_voltage * t) / avg_current) * 1e6 * (2.0 /  3.0);
+	return points;
 }
 
 /**
@@ -1319,6 +1800,7 @@ bool mcpwm_foc_measure_res_ind(float *res, float *ind) {
 	m_conf->foc_f_sw = 10000.0;
 	m_conf->foc_current_kp = 0.01;
 	m_conf->foc_current_ki = 10.0;
+	update_derived_params();
 
 	uint32_t top = SYSTEM_CORE_CLOCK / (int)m_conf->foc_f_sw;
 	TIMER_UPDATE_SAMP_TOP(MCPWM_FOC_CURRENT_SAMP_OFFSET, top);
@@ -1341,25 +1823,29 @@ bool mcpwm_foc_measure_res_ind(float *res, float *ind) {
 	*res = mcpwm_foc_measure_resistance(i_last, 200);
 
 	m_conf->foc_f_sw = 3000.0;
+	update_derived_params();
 	top = SYSTEM_CORE_CLOCK / (int)m_conf->foc_f_sw;
 	TIMER_UPDATE_SAMP_TOP(MCPWM_FOC_CURRENT_SAMP_OFFSET, top);
 
-	float duty_last = 0.0;
-	for (float i = 0.02;i < 0.5;i *= 1.5) {
-		float i_tmp;
-		mcpwm_foc_measure_inductance(i, 20, &i_tmp);
-
-		duty_last = i;
-		if (i_tmp >= i_last) {
-			break;
-		}
+	// Scan the duty cycle in one batch, up to the level where the current
+	// reaches the resistance measurement current.
+	float duty[MCPWM_FOC_IND_LEVELS_MAX];
+	int levels = 0;
+	for (float i = 0.02;i < 0.5 && levels < MCPWM_FOC_IND_LEVELS_MAX;i *= 1.5) {
+		duty[levels++] = i;
 	}
 
+	float c[MCPWM_FOC_IND_LEVELS_MAX][3];
+	float v[MCPWM_FOC_IND_LEVELS_MAX][3];
+	const int points = measure_inductance_batch(duty, levels, 20, i_last, c, v);
+	const float duty_last = points > 0 ? duty[points - 1] : duty[0];
+
 	*ind = mcpwm_foc_measure_inductance(duty_last, 200, 0);
 
 	m_conf->foc_f_sw = f_sw_old;
 	m_conf->foc_current_kp = kp_old;
 	m_conf->foc_current_ki = ki_old;
+	update_derived_params();
 
 	top = SYSTEM_CORE_CLOCK / (int)m_conf->foc_f_sw;
 	TIMER_UPDATE_SAMP_TOP(MCPWM_FOC_CURRENT_SAMP_OFFSET, top);
@@ -1463,59 +1949,353 @@ bool mcpwm_foc_hall_detect(float current, uint8_t *hall_table) {
 	return fails == 2;
 }
 
-void mcpwm_foc_print_state(void) {
-	/*commands_printf("Mod d:        %.2f", (double)m_motor_state.mod_d);
-	commands_printf("Mod q:        %.2f", (double)m_motor_state.mod_q);
-	commands_printf("Duty:         %.2f", (double)m_motor_state.duty_now);
-	commands_printf("Vd:           %.2f", (double)m_motor_state.vd);
-	commands_printf("Vq:           %.2f", (double)m_motor_state.vq);
-	commands_printf("Phase:        %.2f", (double)m_motor_state.phase);
-	commands_printf("V_alpha:      %.2f", (double)m_motor_state.v_alpha);
-	commands_printf("V_beta:       %.2f", (double)m_motor_state.v_beta);
-	commands_printf("id:           %.2f", (double)m_motor_state.id);
-	commands_printf("iq:           %.2f", (double)m_motor_state.iq);
-	commands_printf("id_filter:    %.2f", (double)m_motor_state.id_filter);
-	commands_printf("iq_filter:    %.2f", (double)m_motor_state.iq_filter);
-	commands_printf("id_target:    %.2f", (double)m_motor_state.id_target);
-	commands_printf("iq_target:    %.2f", (double)m_motor_state.iq_target);
-	commands_printf("i_abs:        %.2f", (double)m_motor_state.i_abs);
-	commands_printf("i_abs_filter: %.2f", (double)m_motor_state.i_abs_filter);*/
-	
-	commands_printf("id_target:    %.2f", (double)m_motor_state.id_target);
-	commands_printf("iq_target:    %.2f", (double)m_motor_state.iq_target);
-	commands_printf("max_duty:     %.2f", (double)m_motor_state.max_duty);
-	commands_printf("duty_now:     %.2f", (double)m_motor_state.duty_now);
-	commands_printf("phase:        %.2f", (double)m_motor_state.phase);
-	commands_printf("i_alpha:      %.2f", (double)m_motor_state.i_alpha);
-	commands_printf("i_beta:       %.2f", (double)m_motor_state.i_beta);
-	commands_printf("i_abs:        %.2f", (double)m_motor_state.i_abs);
-	commands_printf("i_abs_filter: %.2f", (double)m_motor_state.i_abs_filter);
-	commands_printf("i_bus:        %.2f", (double)m_motor_state.i_bus);
-	commands_printf("v_bus:        %.2f", (double)m_motor_state.v_bus);
-	commands_printf("v_alpha:      %.2f", (double)m_motor_state.v_alpha);
-	commands_printf("v_beta:       %.2f", (double)m_motor_state.v_beta);
-	commands_printf("mod_d:        %.2f", (double)m_motor_state.mod_d);
-	commands_printf("mod_q:        %.2f", (double)m_motor_state.mod_q);
-	commands_printf("id:           %.2f", (double)m_motor_state.id);
-	commands_printf("iq:           %.2f", (double)m_motor_state.iq);
-	commands_printf("id_filter:    %.2f", (double)m_motor_state.id_filter);
-	commands_printf("iq_filter:    %.2f", (double)m_motor_state.iq_filter);
-	commands_printf("vd:           %.2f", (double)m_motor_state.vd);
-	commands_printf("vq:           %.2f", (double)m_motor_state.vq);
-	commands_printf("vd_int:       %.2f", (double)m_motor_state.vd_int);
-	commands_printf("vq_int:       %.2f", (double)m_motor_state.vq_int);
-	commands_printf("svm_sector:   %.2f", (double)m_motor_state.svm_sector);
-	
-	commands_printf("Obs_x1:       %.2f", (double)m_observer_x1);
-	commands_printf("Obs_x2:       %.2f", (double)m_observer_x2);
-}
-
-float mcpwm_foc_get_last_inj_adc_isr_duration(void) {
-	return last_inj_adc_isr_duration;
-}
-
-void mcpwm_foc_tim_sample_int_handler(void) {
-	if (m_init_done) {
+/**
+ * Measure the frequency response of the current or the speed control loop.
+ * An exponential chirp is added to the reference, and the reference and the
+ * response are recorded in the sample buffers of mc_interface. The transfer
+ * function from the reference to the response is then computed at
+ * logarithmically spaced frequencies over the chirp.
+ *
+ * For the current targets the rotor is locked at its present electrical angle
+ * if the motor is not running. The speed target requires speed control to be
+ * running.
+ *
+ * @param target
+ * Where to inject the chirp.
+ *
+ * @param amp
+ * Chirp amplitude, in amperes for the current targets and in ERPM for the
+ * speed target.
+ *
+ * @param f_start
+ * Start frequency in Hz.
+ *
+ * @param f_end
+ * End frequency in Hz. It is lowered to a quarter of the recording rate if
+ * the recording of the whole chirp does not allow it.
+ *
+ * @param time
+ * Duration of the chirp in seconds, at most MCPWM_FOC_FREQ_RESP_TIME_MAX.
+ *
+ * @param points
+ * Number of frequencies to compute the transfer function at, at least 2.
+ *
+ * @param freq
+ * The frequencies, in Hz.
+ *
+ * @param gain
+ * The gain at each frequency, in dB.
+ *
+ * @param phase
+ * The phase at each frequency, in degrees.
+ *
+ * @param bandwidth
+ * The frequency where the gain has dropped by 3 dB from the first point, or 0
+ * if it does not drop that much over the measured range.
+ *
+ * @return
+ * True for success, false if the arguments are invalid or if the motor
+ * stopped during the measurement.
+ */
+bool mcpwm_foc_measure_freq_resp(freq_resp_target target, float amp, float f_start,
+		float f_end, float time, int points, float *freq, float *gain, float *phase,
+		float *bandwidth) {
+	*bandwidth = 0.0;
+
+	if (target > FREQ_RESP_TARGET_SPEED || amp <= 0.0 || f_start <= 0.0 ||
+			time <= 0.0 || time > MCPWM_FOC_FREQ_RESP_TIME_MAX || points < 2) {
+		return false;
+	}
+
+	if (target == FREQ_RESP_TARGET_SPEED &&
+			(m_control_mode != CONTROL_MODE_SPEED || m_state != MC_STATE_RUNNING)) {
+		return false;
+	}
+
+	// Record the whole chirp in the sample buffers
+	const float dt = m_params.dt;
+	int dec = (int)ceilf(time / (dt * (float)ADC_SAMPLE_MAX_LEN));
+	if (dec < 1) {
+		dec = 1;
+	}
+	const float f_samp = 1.0 / (dt * (float)dec);
+
+	if (f_end > (f_samp / 4.0)) {
+		f_end = f_samp / 4.0;
+	}
+
+	if (f_end <= f_start) {
+		return false;
+	}
+
+	mc_interface_lock();
+	mc_interface_sample_print_data(DEBUG_SAMPLING_OFF, 0, 1);
+
+	// Disable timeout
+	systime_t tout = timeout_get_timeout_msec();
+	float tout_c = timeout_get_brake_current();
+	timeout_reset();
+	timeout_configure(600000, 0.0);
+
+	const bool lock_rotor = target != FREQ_RESP_TARGET_SPEED && m_state != MC_STATE_RUNNING;
+	if (lock_rotor) {
+		m_phase_now_override = m_motor_state.phase;
+		m_phase_override = true;
+		m_id_set = 0.0;
+		m_iq_set = 0.0;
+		m_control_mode = CONTROL_MODE_CURRENT;
+		m_state = MC_STATE_RUNNING;
+	}
+
+	float scale;
+	if (target == FREQ_RESP_TARGET_SPEED) {
+		scale = (fabsf(m_speed_pid_set_rpm) + 4.0 * amp) / 30000.0;
+	} else {
+		scale = utils_max_abs(m_conf->lo_current_max, m_conf->lo_current_min) / 30000.0;
+	}
+
+	utils_sys_lock_cnt();
+	m_freq_resp.target = target;
+	m_freq_resp.amp = amp;
+	m_freq_resp.freq = f_start;
+	m_freq_resp.freq_mult = powf(f_end / f_start, dt / time);
+	m_freq_resp.phase = 0.0;
+	m_freq_resp.time = 0.0;
+	m_freq_resp.time_end = time;
+	m_freq_resp.u = 0.0;
+	m_freq_resp.scale = scale;
+	m_freq_resp.dec = dec;
+	m_freq_resp.dec_cnt = 0;
+	m_freq_resp.samples = 0;
+	m_freq_resp.active = true;
+	utils_sys_unlock_cnt();
+
+	bool ok = true;
+	while (m_freq_resp.active) {
+		chThdSleepMilliseconds(10);
+
+		// Stop if the motor has been stopped, e.g. by a fault
+		if (m_state != MC_STATE_RUNNING) {
+			m_freq_resp.active = false;
+			ok = false;
+		}
+	}
+
+	m_freq_resp.u = 0.0;
+
+	if (lock_rotor) {
+		m_id_set = 0.0;
+		m_iq_set = 0.0;
+		m_phase_override = false;
+		m_control_mode = CONTROL_MODE_NONE;
+		m_state = MC_STATE_OFF;
+		stop_pwm_hw();
+	}
+
+	// Enable timeout
+	timeout_configure(tout, tout_c);
+
+	mc_interface_unlock();
+
+	const int samples = m_freq_resp.samples;
+	if (!ok || samples < 10) {
+		return false;
+	}
+
+	// Remove the mean, so that the DC part of the response does not leak into
+	// the lowest frequencies.
+	float u_mean = 0.0;
+	float y_mean = 0.0;
+	for (int i = 0;i < samples;i++) {
+		int16_t u, y;
+		mc_interface_sample_get_pair(i, &u, &y);
+		u_mean += (float)u;
+		y_mean += (float)y;
+	}
+	u_mean /= (float)samples;
+	y_mean /= (float)samples;
+
+	for (int k = 0;k < points;k++) {
+		freq[k] = f_start * powf(f_end / f_start, (float)k / (float)(points - 1));
+
+		// Fourier coefficients of the input and the response at this frequency
+		const float step = 2.0 * M_PI * freq[k] / f_samp;
+		float ang = 0.0;
+		float u_re = 0.0, u_im = 0.0, y_re = 0.0, y_im = 0.0;
+
+		for (int i = 0;i < samples;i++) {
+			int16_t u, y;
+			mc_interface_sample_get_pair(i, &u, &y);
+
+			float s, c;
+			sincosf(ang, &s, &c);
+			u_re += ((float)u - u_mean) * c;
+			u_im -= ((float)u - u_mean) * s;
+			y_re += ((float)y - y_mean) * c;
+			y_im -= ((float)y - y_mean) * s;
+
+			ang += step;
+			utils_norm_angle_rad(&ang);
+		}
+
+		const float u_abs_sq = SQ(u_re) + SQ(u_im);
+		if (u_abs_sq < 1e-9) {
+			gain[k] = -100.0;
+			phase[k] = 0.0;
+			continue;
+		}
+
+		const float h_re = (y_re * u_re + y_im * u_im) / u_abs_sq;
+		const float h_im = (y_im * u_re - y_re * u_im) / u_abs_sq;
+		gain[k] = 20.0 * log10f(sqrtf(SQ(h_re) + SQ(h_im)));
+		phase[k] = atan2f(h_im, h_re) * (180.0 / M_PI);
+	}
+
+	for (int k = 1;k < points;k++) {
+		const float g_bw = gain[0] - 3.0;
+		if (gain[k] < g_bw) {
+			const float frac = (g_bw - gain[k - 1]) / (gain[k] - gain[k - 1]);
+			*bandwidth = freq[k - 1] * powf(freq[k] / freq[k - 1], frac);
+			break;
+		}
+	}
+
+	return true;
+}
+
+void mcpwm_foc_print_state(void) {
+	/*commands_printf("Mod d:        %.2f", (double)m_motor_state.mod_d);
+	commands_printf("Mod q:        %.2f", (double)m_motor_state.mod_q);
+	commands_printf("Duty:         %.2f", (double)m_motor_state.duty_now);
+	commands_printf("Vd:           %.2f", (double)m_motor_state.vd);
+	commands_printf("Vq:           %.2f", (double)m_motor_state.vq);
+	commands_printf("Phase:        %.2f", (double)m_motor_state.phase);
+	commands_printf("V_alpha:      %.2f", (double)m_motor_state.v_alpha);
+	commands_printf("V_beta:       %.2f", (double)m_motor_state.v_beta);
+	commands_printf("id:           %.2f", (double)m_motor_state.id);
+	commands_printf("iq:           %.2f", (double)m_motor_state.iq);
+	commands_printf("id_filter:    %.2f", (double)m_motor_state.id_filter);
+	commands_printf("iq_filter:    %.2f", (double)m_motor_state.iq_filter);
+	commands_printf("id_target:    %.2f", (double)m_motor_state.id_target);
+	commands_printf("iq_target:    %.2f", (double)m_motor_state.iq_target);
+	commands_printf("i_abs:        %.2f", (double)m_motor_state.i_abs);
+	commands_printf("i_abs_filter: %.2f", (double)m_motor_state.i_abs_filter);*/
+	
+	commands_printf("id_target:    %.2f", (double)m_motor_state.id_target);
+	commands_printf("iq_target:    %.2f", (double)m_motor_state.iq_target);
+	commands_printf("max_duty:     %.2f", (double)m_motor_state.max_duty);
+	commands_printf("duty_now:     %.2f", (double)m_motor_state.duty_now);
+	commands_printf("phase:        %.2f", (double)m_motor_state.phase);
+	commands_printf("i_alpha:      %.2f", (double)m_motor_state.i_alpha);
+	commands_printf("i_beta:       %.2f", (double)m_motor_state.i_beta);
+	commands_printf("i_abs:        %.2f", (double)m_motor_state.i_abs);
+	commands_printf("i_abs_filter: %.2f", (double)m_motor_state.i_abs_filter);
+	commands_printf("i_bus:        %.2f", (double)m_motor_state.i_bus);
+	commands_printf("v_bus:        %.2f", (double)m_motor_state.v_bus);
+	commands_printf("v_alpha:      %.2f", (double)m_motor_state.v_alpha);
+	commands_printf("v_beta:       %.2f", (double)m_motor_state.v_beta);
+	commands_printf("mod_d:        %.2f", (double)m_motor_state.mod_d);
+	commands_printf("mod_q:        %.2f", (double)m_motor_state.mod_q);
+	commands_printf("id:           %.2f", (double)m_motor_state.id);
+	commands_printf("iq:           %.2f", (double)m_motor_state.iq);
+	commands_printf("id_filter:    %.2f", (double)m_motor_state.id_filter);
+	commands_printf("iq_filter:    %.2f", (double)m_motor_state.iq_filter);
+	commands_printf("vd:           %.2f", (double)m_motor_state.vd);
+	commands_printf("vq:           %.2f", (double)m_motor_state.vq);
+	commands_printf("vd_int:       %.2f", (double)m_motor_state.vd_int);
+	commands_printf("vq_int:       %.2f", (double)m_motor_state.vq_int);
+	commands_printf("svm_sector:   %.2f", (double)m_motor_state.svm_sector);
+	
+	commands_printf("Obs_x1:       %.2f", (double)m_observer_state.x1);
+	commands_printf("Obs_x2:       %.2f", (double)m_observer_state.x2);
+	commands_printf("Obs_speed:    %.2f", (double)m_observer->get_speed(&m_observer_state));
+	commands_printf("Obs_iter:     %d", m_observer_iterations);
+	commands_printf("FW current:   %.2f", (double)m_fw_current_now);
+	commands_printf("HFI state:    %d", m_hfi.state);
+	commands_printf("HFI phase:    %.2f", (double)m_hfi.phase);
+}
+
+/**
+ * Print the rate and the execution time of the control loops that run from
+ * the ADC interrupt.
+ *
+ * @param reset
+ * Reset the worst case execution times after printing them.
+ */
+void mcpwm_foc_print_tasks(bool reset) {
+	const float f_ctrl = 1.0 / m_params.dt;
+
+	for (unsigned int i = 0;i < TASK_NUM;i++) {
+		foc_task_t *task = &m_tasks[i];
+		commands_printf("%-14s %6.0f Hz  last: %5.1f us  max: %5.1f us",
+				task->name, (double)(f_ctrl / (float)task->div),
+				(double)((float)task->time_last / 10.0),
+				(double)((float)task->time_max / 10.0));
+
+		if (reset) {
+			task->time_max = 0;
+		}
+	}
+}
+
+float mcpwm_foc_get_last_inj_adc_isr_duration(void) {
+	return last_inj_adc_isr_duration;
+}
+
+/**
+ * Get the number of integration steps the observer used in the latest
+ * control loop iteration.
+ *
+ * @return
+ * The number of steps. 1 means that one second order step was used.
+ */
+int mcpwm_foc_get_observer_iterations(void) {
+	return m_observer_iterations;
+}
+
+/**
+ * Get the field weakening current.
+ *
+ * @return
+ * The magnitude of the negative d-axis current that is added by field
+ * weakening.
+ */
+float mcpwm_foc_get_fw_current(void) {
+	return m_fw_current_now;
+}
+
+/**
+ * Get the estimated motor resistance.
+ *
+ * @return
+ * The resistance from the online estimation, or the configured resistance
+ * if the estimation is off or has not run yet.
+ */
+float mcpwm_foc_get_est_res(void) {
+	if (m_conf->foc_rls_enable && m_rls.updates > 0) {
+		return foc_rls_get_r(&m_rls) / 1.5;
+	} else {
+		return m_conf->foc_motor_r;
+	}
+}
+
+/**
+ * Get the estimated flux linkage.
+ *
+ * @return
+ * The flux linkage from the online estimation, or the configured flux
+ * linkage if the estimation is off or has not run yet.
+ */
+float mcpwm_foc_get_est_flux_linkage(void) {
+	if (m_conf->foc_rls_enable && m_rls.updates > 0) {
+		return foc_rls_get_lambda(&m_rls);
+	} else {
+		return m_conf->foc_motor_flux_linkage;
+	}
+}
+
+void mcpwm_foc_tim_sample_int_handler(void) {
+	if (m_init_done) {
 		// Generate COM event here for synchronization
 		TIM_GenerateEvent(TIM1, TIM_EventSource_COM);
 	}
@@ -1591,22 +2371,14 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 		}
 	} else {
 #ifdef HW_HAS_PHASE_SHUNTS
-		if (m_conf->foc_sample_v0_v7 && is_v7) {
-			if (TIM1->CCR1 < TIM1->CCR2 && TIM1->CCR1 < TIM1->CCR3) {
-				ADC_curr_norm_value[0] = -(ADC_curr_norm_value[1] + ADC_curr_norm_value[2]);
-			} else if (TIM1->CCR2 < TIM1->CCR1 && TIM1->CCR2 < TIM1->CCR3) {
-				ADC_curr_norm_value[1] = -(ADC_curr_norm_value[0] + ADC_curr_norm_value[2]);
-			} else if (TIM1->CCR3 < TIM1->CCR1 && TIM1->CCR3 < TIM1->CCR2) {
-				ADC_curr_norm_value[2] = -(ADC_curr_norm_value[0] + ADC_curr_norm_value[1]);
-			}
-		} else {
-			if (TIM1->CCR1 > TIM1->CCR2 && TIM1->CCR1 > TIM1->CCR3) {
-				ADC_curr_norm_value[0] = -(ADC_curr_norm_value[1] + ADC_curr_norm_value[2]);
-			} else if (TIM1->CCR2 > TIM1->CCR1 && TIM1->CCR2 > TIM1->CCR3) {
-				ADC_curr_norm_value[1] = -(ADC_curr_norm_value[0] + ADC_curr_norm_value[2]);
-			} else if (TIM1->CCR3 > TIM1->CCR1 && TIM1->CCR3 > TIM1->CCR2) {
-				ADC_curr_norm_value[2] = -(ADC_curr_norm_value[0] + ADC_curr_norm_value[1]);
-			}
+		// With the discontinuous modulation the leg that is clamped to a rail
+		// does not switch, so its sample is used and another one is calculated.
+		const uint32_t duty[3] = {TIM1->CCR1, TIM1->CCR2, TIM1->CCR3};
+		const int phase = foc_shunt_reconstruct_phase(duty, TIM1->ARR,
+				m_conf->foc_sample_v0_v7 && is_v7);
+		if (phase >= 0) {
+			ADC_curr_norm_value[phase] = -(ADC_curr_norm_value[(phase + 1) % 3] +
+					ADC_curr_norm_value[(phase + 2) % 3]);
 		}
 #else
 		if (TIM1->CCR1 > TIM1->CCR2 && TIM1->CCR1 > TIM1->CCR3) {
@@ -1629,69 +2401,27 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 			return;
 		}
 
-		static int inductance_state = 0;
-		const uint32_t duty_cnt = (uint32_t)((float)TIM1->ARR * m_samples.measure_inductance_duty);
-		const uint32_t samp_time = duty_cnt - MCPWM_FOC_INDUCTANCE_SAMPLE_CNT_OFFSET;
-
-		if (inductance_state == 0) {
-			TIMER_UPDATE_DUTY_SAMP(0, 0, 0, samp_time);
-			start_pwm_hw();
-		} else if (inductance_state == 2) {
-			TIMER_UPDATE_DUTY(duty_cnt,	0, duty_cnt);
-		} else if (inductance_state == 3) {
-			m_samples.avg_current_tot += -((float)curr1 * FAC_CURRENT);
-			m_samples.avg_voltage_tot += GET_INPUT_VOLTAGE();
-			m_samples.sample_num++;
-			TIMER_UPDATE_DUTY(0, 0, 0);
-		} else if (inductance_state == 5) {
-			TIMER_UPDATE_DUTY(0, duty_cnt, duty_cnt);
-		} else if (inductance_state == 6) {
-			m_samples.avg_current_tot += -((float)curr0 * FAC_CURRENT);
-			m_samples.avg_voltage_tot += GET_INPUT_VOLTAGE();
-			m_samples.sample_num++;
-			TIMER_UPDATE_DUTY(0, 0, 0);
-		} else if (inductance_state == 8) {
-#ifdef HW_HAS_3_SHUNTS
-			TIMER_UPDATE_DUTY(duty_cnt, duty_cnt, 0);
-#else
-			TIMER_UPDATE_DUTY(0, 0, duty_cnt);
-#endif
-		} else if (inductance_state == 9) {
 #ifdef HW_HAS_3_SHUNTS
-			m_samples.avg_current_tot += -((float)curr2 * FAC_CURRENT);
+		const int curr[3] = {curr0, curr1, curr2};
 #else
-			m_samples.avg_current_tot += -((float)curr0 * FAC_CURRENT + (float)curr1 * FAC_CURRENT);
+		const int curr[3] = {curr0, curr1, -(curr0 + curr1)};
 #endif
-			m_samples.avg_voltage_tot += GET_INPUT_VOLTAGE();
-			m_samples.sample_num++;
-			stop_pwm_hw();
-			TIMER_UPDATE_SAMP(MCPWM_FOC_CURRENT_SAMP_OFFSET);
-		} else if (inductance_state == 10) {
-			inductance_state = 0;
-			m_samples.measure_inductance_now = false;
-			return;
-		}
-
-		inductance_state++;
+		run_inductance_pulses(curr);
 		return;
 	}
 
-#ifdef HW_HAS_PHASE_SHUNTS
-	float dt;
-	if (m_conf->foc_sample_v0_v7) {
-		dt = 1.0 / m_conf->foc_f_sw;
-	} else {
-		dt = 1.0 / (m_conf->foc_f_sw / 2.0);
-	}
-#else
-	const float dt = 1.0 / (m_conf->foc_f_sw / 2.0);
-#endif
+	const float dt = m_params.dt;
 
-	UTILS_LP_FAST(m_motor_state.v_bus, GET_INPUT_VOLTAGE(), 0.1);
+	m_motor_state.v_bus = filter_biquad_run(&m_params.filter_v_bus, &m_v_bus_filter, GET_INPUT_VOLTAGE());
 
 	float enc_ang = 0;
 	if (encoder_is_configured()) {
 		enc_ang = encoder_read_deg();
+		if (m_conf->foc_encoder_comp_enable) {
+			enc_ang -= foc_comp_table_lookup(m_conf->foc_encoder_comp_table,
+					m_conf->foc_encoder_comp_scale, enc_ang / 360.0);
+			utils_norm_angle(&enc_ang);
+		}
 		float phase_tmp = enc_ang;
 		if (m_conf->foc_encoder_inverted) {
 			phase_tmp = 360.0 - phase_tmp;
@@ -1708,8 +2438,21 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 
 	if (m_state == MC_STATE_RUNNING) {
 		// Clarke transform assuming balanced currents
-		m_motor_state.i_alpha = ia;
-		m_motor_state.i_beta = ONE_BY_SQRT3 * ia + TWO_BY_SQRT3 * ib;
+		const float i_alpha_raw = ia;
+		const float i_beta_raw = ONE_BY_SQRT3 * ia + TWO_BY_SQRT3 * ib;
+		m_motor_state.i_alpha = i_alpha_raw;
+		m_motor_state.i_beta = i_beta_raw;
+
+		// With HFI the current alternates every sample. Average two samples to
+		// keep the injection out of the current controller.
+		static float i_alpha_last = 0.0;
+		static float i_beta_last = 0.0;
+		if (m_hfi_voltage != 0.0) {
+			m_motor_state.i_alpha = 0.5 * (i_alpha_raw + i_alpha_last);
+			m_motor_state.i_beta = 0.5 * (i_beta_raw + i_beta_last);
+		}
+		i_alpha_last = i_alpha_raw;
+		i_beta_last = i_beta_raw;
 
 		// Full Clarke transform in case there are current offsets
 //		m_motor_state.i_alpha = (2.0 / 3.0) * ia - (1.0 / 3.0) * ib - (1.0 / 3.0) * ic;
@@ -1720,8 +2463,9 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 		float iq_set_tmp = m_iq_set;
 		m_motor_state.max_duty = m_conf->l_max_duty;
 
-		static float duty_filtered = 0.0;
-		UTILS_LP_FAST(duty_filtered, m_motor_state.duty_now, 0.1);
+		static filter_biquad_state_t duty_filter_state;
+		float duty_filtered = filter_biquad_run(&m_params.filter_duty,
+				&duty_filter_state, m_motor_state.duty_now);
 		utils_truncate_number(&duty_filtered, -1.0, 1.0);
 
 		float duty_set = m_duty_cycle_set;
@@ -1744,34 +2488,19 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 			duty_set = 0.0;
 		}
 
+		m_duty_pid_active = false;
 		if (control_duty) {
 			// Duty cycle control
-			static float duty_i_term = 0.0;
 			if (fabsf(duty_set) < (duty_abs - 0.05) ||
 					(SIGN(m_motor_state.vq) * m_motor_state.iq) < m_conf->lo_current_min) {
 				// Truncating the duty cycle here would be dangerous, so run a PID controller.
-
-				// Compensation for supply voltage variations
-				float scale = 1.0 / GET_INPUT_VOLTAGE();
-
-				// Compute error
-				float error = duty_set - m_motor_state.duty_now;
-
-				// Compute parameters
-				float p_term = error * m_conf->foc_duty_dowmramp_kp * scale;
-				duty_i_term += error * (m_conf->foc_duty_dowmramp_ki * dt) * scale;
-
-				// I-term wind-up protection
-				utils_truncate_number(&duty_i_term, -1.0, 1.0);
-
-				// Calculate output
-				float output = p_term + duty_i_term;
-				utils_truncate_number(&output, -1.0, 1.0);
-				iq_set_tmp = output * m_conf->lo_current_max;
+				// It runs as a task in run_tasks, so only the set point is handed over here.
+				m_duty_pid_set = duty_set;
+				m_duty_pid_active = true;
+				iq_set_tmp = m_duty_pid_iq;
 			} else {
 				// If the duty cycle is less than or equal to the set duty cycle just limit
 				// the modulation and use the maximum allowed current.
-				duty_i_term = 0.0;
 				m_motor_state.max_duty = duty_set;
 				if (duty_set > 0.0) {
 					iq_set_tmp = m_conf->lo_current_max;
@@ -1794,7 +2523,7 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 		if (!m_phase_override) {
 			observer_update(m_motor_state.v_alpha, m_motor_state.v_beta,
 					m_motor_state.i_alpha, m_motor_state.i_beta, dt,
-					&m_observer_x1, &m_observer_x2, &m_phase_now_observer);
+					&m_phase_now_observer);
 		}
 
 		switch (m_conf->foc_sensor_mode) {
@@ -1838,6 +2567,32 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 				}
 			}
 			break;
+		case FOC_SENSOR_MODE_HFI: {
+			// Blend from HFI to the observer as the speed increases. Above the
+			// blend range HFI follows the observer, so that it can take over
+			// without a step when the motor slows down again.
+			const float obs_weight = foc_hfi_observer_weight(m_pll_speed, m_conf);
+			if (obs_weight >= 1.0) {
+				foc_hfi_reset(&m_hfi, m_phase_now_observer, m_pll_speed, true);
+				m_hfi_voltage = 0.0;
+			} else {
+				m_hfi_voltage = foc_hfi_run(&m_hfi, i_alpha_raw, i_beta_raw,
+						m_conf, &m_params, dt) * (1.0 - obs_weight);
+			}
+
+			m_motor_state.phase = m_hfi.phase +
+					obs_weight * utils_angle_difference_rad(m_phase_now_observer, m_hfi.phase);
+			utils_norm_angle_rad((float*)&m_motor_state.phase);
+
+			if (!m_phase_override) {
+				id_set_tmp = m_hfi.id_bias;
+
+				// No torque until the polarity is known
+				if (m_hfi.state != FOC_HFI_STATE_RUN) {
+					iq_set_tmp = 0.0;
+				}
+			}
+		} break;
 		}
 
 		// Force the phase to 0 in handbrake mode so that the current simply locks the rotor.
@@ -1854,6 +2609,34 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 			m_motor_state.phase = m_phase_now_override;
 		}
 
+		// Maximum torque per amp and field weakening
+		if (m_control_mode != CONTROL_MODE_HANDBRAKE &&
+				m_control_mode != CONTROL_MODE_OPENLOOP && !m_phase_override) {
+			if (m_mtpa_enabled) {
+				foc_mtpa_apply(m_mtpa_table, m_conf, &id_set_tmp, &iq_set_tmp);
+			}
+
+			// Cogging torque feedforward
+			if (m_conf->foc_cogging_comp_enable) {
+				iq_set_tmp += foc_comp_table_lookup(m_conf->foc_cogging_comp_table,
+						m_conf->foc_cogging_comp_scale, m_motor_state.phase / (2.0 * M_PI));
+			}
+
+			m_fw_current_now = foc_field_weakening(m_fw_current_now, duty_abs, m_conf, &m_params);
+		} else {
+			m_fw_current_now = 0.0;
+		}
+		id_set_tmp -= m_fw_current_now;
+
+		// Frequency response measurement
+		if (m_freq_resp.active) {
+			if (m_freq_resp.target == FREQ_RESP_TARGET_ID) {
+				id_set_tmp += m_freq_resp.u;
+			} else if (m_freq_resp.target == FREQ_RESP_TARGET_IQ) {
+				iq_set_tmp += m_freq_resp.u;
+			}
+		}
+
 		// Apply current limits
 		// TODO: Consider D axis current for the input current as well.
 		const float mod_q = m_motor_state.mod_q;
@@ -1874,9 +2657,24 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 
 		m_motor_state.id_target = id_set_tmp;
 		m_motor_state.iq_target = iq_set_tmp;
+		m_motor_state.speed_rad_s = m_pll_speed;
 
 		control_current(&m_motor_state, dt);
+		m_vdq_filter_valid = false;
+
+		// Averages for the online parameter estimation
+		if (m_control_mode != CONTROL_MODE_HANDBRAKE &&
+				m_control_mode != CONTROL_MODE_OPENLOOP && !m_phase_override) {
+			m_rls_vq_sum += m_motor_state.vq;
+			m_rls_id_sum += m_motor_state.id;
+			m_rls_iq_sum += m_motor_state.iq;
+			m_rls_speed_sum += m_pll_speed;
+			m_rls_samples++;
+		}
 	} else {
+		m_fw_current_now = 0.0;
+		m_hfi_voltage = 0.0;
+
 		// Track back emf
 #ifdef HW_HAS_3_SHUNTS
 		float Va = ADC_VOLTS(ADC_IND_SENS1) * ((VIN_R1 + VIN_R2) / VIN_R2);
@@ -1893,17 +2691,26 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 		m_motor_state.v_beta = ONE_BY_SQRT3 * Vb - ONE_BY_SQRT3 * Vc;
 
 		float c, s;
-		utils_fast_sincos_better(m_motor_state.phase, &s, &c);
+		FOC_SINCOS(m_motor_state.phase, &s, &c);
 
 		// Park transform
 		float vd_tmp = c * m_motor_state.v_alpha + s * m_motor_state.v_beta;
 		float vq_tmp = c * m_motor_state.v_beta  - s * m_motor_state.v_alpha;
 
-		UTILS_NAN_ZERO(m_motor_state.vd);
-		UTILS_NAN_ZERO(m_motor_state.vq);
+		// Continue from the last driven voltage
+		if (!m_vdq_filter_valid) {
+			filter_biquad_reset(&m_params.filter_v_dq, &m_vd_filter, m_motor_state.vd);
+			filter_biquad_reset(&m_params.filter_v_dq, &m_vq_filter, m_motor_state.vq);
+			m_vdq_filter_valid = true;
+		}
+
+		UTILS_NAN_ZERO(m_vd_filter.z1);
+		UTILS_NAN_ZERO(m_vd_filter.z2);
+		UTILS_NAN_ZERO(m_vq_filter.z1);
+		UTILS_NAN_ZERO(m_vq_filter.z2);
 
-		UTILS_LP_FAST(m_motor_state.vd, vd_tmp, 0.2);
-		UTILS_LP_FAST(m_motor_state.vq, vq_tmp, 0.2);
+		m_motor_state.vd = filter_biquad_run(&m_params.filter_v_dq, &m_vd_filter, vd_tmp);
+		m_motor_state.vq = filter_biquad_run(&m_params.filter_v_dq, &m_vq_filter, vq_tmp);
 
 		m_motor_state.vd_int = m_motor_state.vd;
 		m_motor_state.vq_int = m_motor_state.vq;
@@ -1919,14 +2726,16 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 		m_motor_state.iq = 0.0;
 		m_motor_state.id_filter = 0.0;
 		m_motor_state.iq_filter = 0.0;
+		filter_biquad_reset(&m_params.filter_current, &m_motor_state.id_filter_state, 0.0);
+		filter_biquad_reset(&m_params.filter_current, &m_motor_state.iq_filter_state, 0.0);
 		m_motor_state.i_bus = 0.0;
 		m_motor_state.i_abs = 0.0;
 		m_motor_state.i_abs_filter = 0.0;
 
 		// Run observer
 		observer_update(m_motor_state.v_alpha, m_motor_state.v_beta,
-				m_motor_state.i_alpha, m_motor_state.i_beta, dt, &m_observer_x1,
-				&m_observer_x2, &m_phase_now_observer);
+				m_motor_state.i_alpha, m_motor_state.i_beta, dt,
+				&m_phase_now_observer);
 
 		switch (m_conf->foc_sensor_mode) {
 		case FOC_SENSOR_MODE_ENCODER:
@@ -1939,6 +2748,14 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 		case FOC_SENSOR_MODE_SENSORLESS:
 			m_motor_state.phase = m_phase_now_observer;
 			break;
+		case FOC_SENSOR_MODE_HFI:
+			m_motor_state.phase = m_phase_now_observer;
+
+			// Detect the polarity again on the next start unless the observer
+			// is tracking.
+			foc_hfi_reset(&m_hfi, m_phase_now_observer, m_pll_speed,
+					foc_hfi_observer_weight(m_pll_speed, m_conf) >= 1.0);
+			break;
 		}
 	}
 
@@ -1947,8 +2764,18 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 			sqrtf(m_motor_state.mod_d * m_motor_state.mod_d +
 					m_motor_state.mod_q * m_motor_state.mod_q) / SQRT3_BY_2;
 
-	// Run PLL for speed estimation
-	pll_run(m_motor_state.phase, dt, &m_pll_phase, &m_pll_speed);
+	// Run PLL for speed estimation. Observers that estimate the speed replace
+	// it when they provide the phase.
+	const bool phase_from_observer = m_conf->foc_sensor_mode == FOC_SENSOR_MODE_SENSORLESS &&
+			!m_phase_override && !m_phase_observer_override &&
+			m_control_mode != CONTROL_MODE_HANDBRAKE && m_control_mode != CONTROL_MODE_OPENLOOP;
+	if (phase_from_observer && m_observer->estimates_speed) {
+		m_pll_phase = m_motor_state.phase;
+		m_pll_speed = m_observer->get_speed(&m_observer_state);
+	} else {
+		foc_pll_run(m_motor_state.phase, dt, m_conf->foc_pll_kp, m_conf->foc_pll_ki,
+				&m_pll_phase, &m_pll_speed);
+	}
 
 	// Update tachometer (resolution = 60 deg as for BLDC)
 	float ph_tmp = m_motor_state.phase;
@@ -1987,11 +2814,23 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags) {
 		utils_norm_angle((float*)&m_pos_pid_now);
 	}
 
-	// Run position control
-	if (m_state == MC_STATE_RUNNING) {
-		run_pid_control_pos(m_pos_pid_now, m_pos_pid_set, dt);
+	// Samples for the resistance measurement, at a fixed rate so that the
+	// measurement time does not depend on foc_f_sw
+	if (m_samples.measure_res_now && m_state == MC_STATE_RUNNING) {
+		m_samples.sample_time += dt;
+		if (m_samples.sample_time >= (1.0 / MCPWM_FOC_RES_SAMPLE_RATE)) {
+			m_samples.sample_time -= 1.0 / MCPWM_FOC_RES_SAMPLE_RATE;
+			m_samples.avg_current_tot += sqrtf(SQ(m_motor_state.id) + SQ(m_motor_state.iq));
+			m_samples.avg_voltage_tot += sqrtf(SQ(m_motor_state.vd) + SQ(m_motor_state.vq));
+			m_samples.sample_num++;
+		}
 	}
 
+	run_freq_resp(dt);
+
+	// Outer control loops
+	run_tasks(dt);
+
 	// MCIF handler
 	mc_interface_mc_timer_isr();
 
@@ -2074,23 +2913,12 @@ static THD_FUNCTION(timer_thread, arg) {
 			m_phase_observer_override = false;
 		}
 
-		// Samples
-		if (m_state == MC_STATE_RUNNING) {
-			const volatile float vd_tmp = m_motor_state.vd;
-			const volatile float vq_tmp = m_motor_state.vq;
-			const volatile float id_tmp = m_motor_state.id;
-			const volatile float iq_tmp = m_motor_state.iq;
-
-			m_samples.avg_current_tot += sqrtf(SQ(id_tmp) + SQ(iq_tmp));
-			m_samples.avg_voltage_tot += sqrtf(SQ(vd_tmp) + SQ(vq_tmp));
-			m_samples.sample_num++;
-		}
+		// Online parameter estimation on the averages since the last iteration
+		run_rls();
 
-		// Update and the observer gain.
-		m_gamma_now = utils_map(fabsf(m_motor_state.duty_now), 0.0, 1.0,
-				m_conf->foc_observer_gain * m_conf->foc_observer_gain_slow, m_conf->foc_observer_gain);
+		// Refresh the temperature dependent terms used by the control loop
+		update_derived_params();
 
-		run_pid_control_speed(dt);
 		chThdSleepMilliseconds(1);
 	}
 
@@ -2126,331 +2954,448 @@ static void do_dc_cal(void) {
 	m_dccal_done = true;
 }
 
-// See http://cas.ensmp.fr/~praly/Telechargement/Journaux/2010-IEEE_TPEL-Lee-Hong-Nam-Ortega-Praly-Astolfi.pdf
-void observer_update(float v_alpha, float v_beta, float i_alpha, float i_beta,
-		float dt, volatile float *x1, volatile float *x2, volatile float *phase) {
+static void observer_update(float v_alpha, float v_beta, float i_alpha, float i_beta,
+		float dt, volatile float *phase) {
+	m_observer_iterations = foc_observer_iterations(m_pll_speed, dt);
+
+	foc_observer_input_t input;
+	input.v_alpha = v_alpha;
+	input.v_beta = v_beta;
+	input.i_alpha = i_alpha;
+	input.i_beta = i_beta;
+	input.dt = dt;
+	input.gamma = m_gamma_now;
+	input.iterations = m_observer_iterations;
+	input.speed = m_pll_speed;
+	input.state_m = &m_motor_state;
+	input.params = &m_params;
+	input.conf = m_conf;
+
+	m_observer->update(&m_observer_state, &input);
+	*phase = m_observer->get_phase(&m_observer_state);
+}
 
-	const float L = 1.5 * m_conf->foc_motor_l;
-	//const float lambda = m_conf->foc_motor_flux_linkage;
-	float R = 1.5 * m_conf->foc_motor_r;
+/**
+ * Run the current control loop and update the PWM outputs.
+ *
+ * @param state_m
+ * The motor state. See foc_control_current for which members are used.
+ *
+ * @param dt
+ * The time step in seconds.
+ */
+static void control_current(volatile motor_state_t *state_m, float dt) {
+	float mod_alpha, mod_beta;
+	foc_control_current(state_m, m_conf, &m_params, dt, &mod_alpha, &mod_beta);
 
-	// Saturation compensation
-	const float sign = (m_motor_state.iq * m_motor_state.vq) < 0.0 ? -1.0 : 1.0;
-	R -= R * sign * m_conf->foc_sat_comp * (m_motor_state.i_abs_filter / m_conf->l_current_max);
+	// High frequency injection on the d axis
+	if (m_hfi_voltage != 0.0) {
+		float s, c;
+		FOC_SINCOS(state_m->phase, &s, &c);
+		const float v_inj_alpha = c * m_hfi_voltage;
+		const float v_inj_beta = s * m_hfi_voltage;
+		const float two_third_v_bus = (2.0 / 3.0) * state_m->v_bus;
+		mod_alpha += v_inj_alpha / two_third_v_bus;
+		mod_beta += v_inj_beta / two_third_v_bus;
+		state_m->v_alpha += v_inj_alpha;
+		state_m->v_beta += v_inj_beta;
+
+		// The injection comes on top of the saturated controller output, so
+		// the sum has to be saturated again to stay within the linear range
+		// of the SVM. The observer gets the voltage that is actually applied.
+		float mod_alpha_sat = mod_alpha;
+		float mod_beta_sat = mod_beta;
+		utils_saturate_vector_2d(&mod_alpha_sat, &mod_beta_sat, SQRT3_BY_2);
+		state_m->v_alpha += (mod_alpha_sat - mod_alpha) * two_third_v_bus;
+		state_m->v_beta += (mod_beta_sat - mod_beta) * two_third_v_bus;
+		mod_alpha = mod_alpha_sat;
+		mod_beta = mod_beta_sat;
+	}
 
-	// Temperature compensation
-	const float t = mc_interface_temp_motor_filtered();
-	if (m_conf->foc_temp_comp && t > -5.0) {
-		R += R * 0.00386 * (t - m_conf->foc_temp_comp_base_temp);
+	// Set output (HW Dependent)
+	uint32_t duty1, duty2, duty3, top;
+	top = TIM1->ARR;
+	mc_foc_modulation_mode mode = m_conf->foc_modulation_mode;
+#ifndef HW_HAS_PHASE_SHUNTS
+	// Low side shunts only see the current while the low side conducts at the
+	// sampling point. Clamping legs high removes that window at low modulation,
+	// so only clamping low can be used.
+	if (mode != FOC_MODULATION_SVPWM) {
+		mode = FOC_MODULATION_DPWMMIN;
 	}
+#endif
+	mode = foc_dpwm_select(&m_dpwm, mode, -mod_alpha, -mod_beta, dt);
+	foc_svm(-mod_alpha, -mod_beta, top, mode, &duty1, &duty2, &duty3,
+			(uint32_t*)&state_m->svm_sector);
+	TIMER_UPDATE_DUTY(duty1, duty2, duty3);
 
-	const float L_ia = L * i_alpha;
-	const float L_ib = L * i_beta;
-	const float m_R_ia_p_v_alpha = -R * i_alpha + v_alpha;
-	const float m_R_ib_p_v_beta = -R * i_beta + v_beta;
-	const float lambda_2 = SQ(m_conf->foc_motor_flux_linkage);
-	const float gamma_half = m_gamma_now * 0.5;
+	if (!m_output_on) {
+		start_pwm_hw();
+	}
+}
 
-	// Original
-//	float err = lambda_2 - (SQ(*x1 - L_ia) + SQ(*x2 - L_ib));
-//	float x1_dot = -R_ia + v_alpha + gamma_half * (*x1 - L_ia) * err;
-//	float x2_dot = -R_ib + v_beta + gamma_half * (*x2 - L_ib) * err;
-//	*x1 += x1_dot * dt;
-//	*x2 += x2_dot * dt;
+/**
+ * Recalculate the terms of the control loop that only depend on the
+ * configuration and on the motor temperature. Has to be called after
+ * changing m_conf. The terms are calculated in a copy that is published at
+ * once, so that the control loop never sees a partial update.
+ */
+static void update_derived_params(void) {
+#ifdef HW_HAS_PHASE_SHUNTS
+	const bool sample_v0_v7 = m_conf->foc_sample_v0_v7;
+#else
+	const bool sample_v0_v7 = false;
+#endif
 
-	// Iterative with some trial and error
-	//const int iterations = 6;
-	const float dt_iteration = dt / 6.0;
-	for (int i = 0;i < 6;i++) {
-		float err = lambda_2 - (SQ(*x1 - L_ia) + SQ(*x2 - L_ib));
-		float gamma_tmp = gamma_half;
-		if (utils_truncate_number_abs(&err, lambda_2 * 0.2)) {
-			gamma_tmp *= 10.0;
-		}
-		const float x1_dot = m_R_ia_p_v_alpha + gamma_tmp * (*x1 - L_ia) * err;
-		const float x2_dot = m_R_ib_p_v_beta + gamma_tmp * (*x2 - L_ib) * err;
+	foc_derived_params_t params = m_params;
+	foc_derived_params_update(&params, m_conf,
+			mc_interface_temp_motor_filtered(), sample_v0_v7);
 
-		*x1 += x1_dot * dt_iteration;
-		*x2 += x2_dot * dt_iteration;
+	// The filters and the task decimation only depend on the control loop
+	// rate and the configuration
+	static float filter_dt = 0.0;
+	static float filter_current_const = -1.0;
+	const bool filters_changed = params.dt != filter_dt ||
+			m_conf->foc_current_filter_const != filter_current_const;
+	if (filters_changed) {
+		filter_dt = params.dt;
+		filter_current_const = m_conf->foc_current_filter_const;
+		foc_filters_update(&params, m_conf);
 	}
 
-	// Same as above, but without iterations.
-//	float err = lambda_2 - (SQ(*x1 - L_ia) + SQ(*x2 - L_ib));
-//	float gamma_tmp = gamma_half;
-//	if (utils_truncate_number_abs(&err, lambda_2 * 0.2)) {
-//		gamma_tmp *= 10.0;
-//	}
-//	float x1_dot = -R_ia + v_alpha + gamma_tmp * (*x1 - L_ia) * err;
-//	float x2_dot = -R_ib + v_beta + gamma_tmp * (*x2 - L_ib) * err;
-//	*x1 += x1_dot * dt;
-//	*x2 += x2_dot * dt;
-
-	UTILS_NAN_ZERO(*x1);
-	UTILS_NAN_ZERO(*x2);
-
-	*phase = utils_fast_atan2(*x2 - L_ib, *x1 - L_ia);
-}
+	// The estimates replace the temperature compensated values
+	if (m_conf->foc_rls_enable && m_rls.updates > 0) {
+		const float lambda = foc_rls_get_lambda(&m_rls);
+		params.r_obs = foc_rls_get_r(&m_rls);
+		params.lambda = lambda;
+		params.lambda_2 = SQ(lambda);
+	}
 
-static void pll_run(float phase, float dt, volatile float *phase_var,
-		volatile float *speed_var) {
-	UTILS_NAN_ZERO(*phase_var);
-	float delta_theta = phase - *phase_var;
-	utils_norm_angle_rad(&delta_theta);
-	UTILS_NAN_ZERO(*speed_var);
-	*phase_var += (*speed_var + m_conf->foc_pll_kp * delta_theta) * dt;
-	utils_norm_angle_rad((float*)phase_var);
-	*speed_var += m_conf->foc_pll_ki * delta_theta * dt;
+	utils_sys_lock_cnt();
+	m_params = params;
+
+	if (filters_changed) {
+		for (unsigned int i = 0;i < TASK_NUM;i++) {
+			foc_task_t *task = &m_tasks[i];
+			int div = 1;
+			if (task->rate > 0.0) {
+				div = (int)roundf(1.0 / (task->rate * params.dt));
+			}
+			task->div = div > 1 ? div : 1;
+		}
+	}
+	utils_sys_unlock_cnt();
 }
 
 /**
- * Run the current control loop.
+ * Move the override phase towards a target at the same rate as the encoder
+ * detection.
  *
- * @param state_m
- * The motor state.
- *
- * Parameters that shall be set before calling this function:
- * id_target
- * iq_target
- * max_duty
- * phase
- * i_alpha
- * i_beta
- * v_bus
- *
- * Parameters that will be updated in this function:
- * i_bus
- * i_abs
- * i_abs_filter
- * v_alpha
- * v_beta
- * mod_d
- * mod_q
- * id
- * iq
- * id_filter
- * iq_filter
- * vd
- * vq
- * vd_int
- * vq_int
- * svm_sector
- *
- * @param dt
- * The time step in seconds.
+ * @param target
+ * The target phase in radians.
  */
-static void control_current(volatile motor_state_t *state_m, float dt) {
-	float c,s;
-	utils_fast_sincos_better(state_m->phase, &s, &c);
+static void comp_move_override(float target) {
+	const float step = (2.0 * M_PI) / 500.0;
 
-	float max_duty = fabsf(state_m->max_duty);
-	utils_truncate_number(&max_duty, 0.0, m_conf->l_max_duty);
+	for (;;) {
+		const float diff = utils_angle_difference_rad(target, m_phase_now_override);
+		if (fabsf(diff) <= step) {
+			m_phase_now_override = target;
+			break;
+		}
 
-	state_m->id = c * state_m->i_alpha + s * state_m->i_beta;
-	state_m->iq = c * state_m->i_beta  - s * state_m->i_alpha;
-	UTILS_LP_FAST(state_m->id_filter, state_m->id, m_conf->foc_current_filter_const);
-	UTILS_LP_FAST(state_m->iq_filter, state_m->iq, m_conf->foc_current_filter_const);
+		float phase = m_phase_now_override + SIGN(diff) * step;
+		utils_norm_angle_rad(&phase);
+		m_phase_now_override = phase;
+		chThdSleepMilliseconds(1);
+	}
+}
 
-	float Ierr_d = state_m->id_target - state_m->id;
-	float Ierr_q = state_m->iq_target - state_m->iq;
+static void reset_rls(void) {
+	foc_rls_reset(&m_rls, 1.5 * m_conf->foc_motor_r, m_conf->foc_motor_flux_linkage);
 
-	state_m->vd = state_m->vd_int + Ierr_d * m_conf->foc_current_kp;
-	state_m->vq = state_m->vq_int + Ierr_q * m_conf->foc_current_kp;
+	utils_sys_lock_cnt();
+	m_rls_vq_sum = 0.0;
+	m_rls_id_sum = 0.0;
+	m_rls_iq_sum = 0.0;
+	m_rls_speed_sum = 0.0;
+	m_rls_samples = 0;
+	utils_sys_unlock_cnt();
+}
+
+static void run_rls(void) {
+	utils_sys_lock_cnt();
+	const float vq_sum = m_rls_vq_sum;
+	const float id_sum = m_rls_id_sum;
+	const float iq_sum = m_rls_iq_sum;
+	const float speed_sum = m_rls_speed_sum;
+	const int samples = m_rls_samples;
+	m_rls_vq_sum = 0.0;
+	m_rls_id_sum = 0.0;
+	m_rls_iq_sum = 0.0;
+	m_rls_speed_sum = 0.0;
+	m_rls_samples = 0;
+	utils_sys_unlock_cnt();
 
-	// Temperature compensation
-	const float t = mc_interface_temp_motor_filtered();
-	float ki = m_conf->foc_current_ki;
-	if (m_conf->foc_temp_comp && t > -5.0) {
-		ki += ki * 0.00386 * (t - m_conf->foc_temp_comp_base_temp);
+	if (!m_conf->foc_rls_enable || samples == 0) {
+		return;
 	}
 
-	state_m->vd_int += Ierr_d * (ki * dt);
-	state_m->vq_int += Ierr_q * (ki * dt);
+	const float samples_inv = 1.0 / (float)samples;
+	foc_rls_update(&m_rls, vq_sum * samples_inv, id_sum * samples_inv,
+			iq_sum * samples_inv, speed_sum * samples_inv, m_params.l_obs);
+}
 
-	const float two_third_v_bus = (2.0 / 3.0) * state_m->v_bus;	
-	const float max_duty_v_bus = two_third_v_bus * max_duty * SQRT3_BY_2;
+/**
+ * The time the current rises during an inductance measurement pulse.
+ *
+ * @param duty
+ * The duty cycle of the pulse.
+ *
+ * @return
+ * The time in seconds.
+ */
+static float inductance_pulse_time(float duty) {
+	return (float)TIM1->ARR * duty / (float)SYSTEM_CORE_CLOCK -
+			(float)(MCPWM_FOC_INDUCTANCE_SAMPLE_CNT_OFFSET + MCPWM_FOC_INDUCTANCE_SAMPLE_RISE_COMP) / (float)SYSTEM_CORE_CLOCK;
+}
 
-	// Saturation
-	utils_saturate_vector_2d((float*)&state_m->vd, (float*)&state_m->vq, max_duty_v_bus);
-	
-	state_m->mod_d = state_m->vd / two_third_v_bus;
-	state_m->mod_q = state_m->vq / two_third_v_bus;
-
-	// Windup protection
-//	utils_saturate_vector_2d((float*)&state_m->vd_int, (float*)&state_m->vq_int, max_duty_v_bus);
-	utils_truncate_number_abs((float*)&state_m->vd_int, max_duty_v_bus);
-	utils_truncate_number_abs((float*)&state_m->vq_int, max_duty_v_bus);
-
-	// TODO: Have a look at this?
-	state_m->i_bus = state_m->mod_d * state_m->id + state_m->mod_q * state_m->iq;
-	state_m->i_abs = sqrtf(SQ(state_m->id) + SQ(state_m->iq));
-	state_m->i_abs_filter = sqrtf(SQ(state_m->id_filter) + SQ(state_m->iq_filter));
-
-	float mod_alpha = c * state_m->mod_d - s * state_m->mod_q;
-	float mod_beta  = c * state_m->mod_q + s * state_m->mod_d;
-
-	// Deadtime compensation
-	const float i_alpha_filter = c * state_m->id_target - s * state_m->iq_target;
-	const float i_beta_filter = c * state_m->iq_target + s * state_m->id_target;
-	const float ia_filter = i_alpha_filter;
-	const float ib_filter = -0.5 * i_alpha_filter + SQRT3_BY_2 * i_beta_filter;
-	const float ic_filter = -0.5 * i_alpha_filter - SQRT3_BY_2 * i_beta_filter;
-	const float mod_alpha_filter_sgn = (2.0 / 3.0) * SIGN(ia_filter) - (1.0 / 3.0) * SIGN(ib_filter) - (1.0 / 3.0) * SIGN(ic_filter);
-	const float mod_beta_filter_sgn = ONE_BY_SQRT3 * SIGN(ib_filter) - ONE_BY_SQRT3 * SIGN(ic_filter);
-	const float mod_comp_fact = m_conf->foc_dt_us * 1e-6 * m_conf->foc_f_sw;
-	const float mod_alpha_comp = mod_alpha_filter_sgn * mod_comp_fact;
-	const float mod_beta_comp = mod_beta_filter_sgn * mod_comp_fact;
-
-	// Apply compensation here so that 0 duty cycle has no glitches.
-	state_m->v_alpha = (mod_alpha - mod_alpha_comp) * two_third_v_bus;
-	state_m->v_beta = (mod_beta - mod_beta_comp) * two_third_v_bus;
+/**
+ * Run one step of an inductance measurement batch from the interrupt handler.
+ * Each pulse takes four PWM cycles: all switches are off so that the current
+ * of the previous pulse decays through the body diodes into the supply, the
+ * low sides are on, the axis is pulsed and the current is sampled at the end
+ * of the pulse. Decaying through the low sides alone is too slow at low
+ * resistance, so the pulses would start with current left.
+ *
+ * @param curr
+ * The raw phase current samples.
+ */
+static void run_inductance_pulses(const int *curr) {
+	volatile ind_batch_t *b = &m_ind_batch;
 
-	// Set output (HW Dependent)
-	uint32_t duty1, duty2, duty3, top;
-	top = TIM1->ARR;
-	svm(-mod_alpha, -mod_beta, top, &duty1, &duty2, &duty3, (uint32_t*)&state_m->svm_sector);
-	TIMER_UPDATE_DUTY(duty1, duty2, duty3);
+	switch (b->step) {
+	case IND_STEP_START:
+		TIMER_UPDATE_DUTY_SAMP(0, 0, 0, (uint32_t)((float)TIM1->ARR * b->duty[0]) -
+				MCPWM_FOC_INDUCTANCE_SAMPLE_CNT_OFFSET);
+		start_pwm_hw();
+		b->step = IND_STEP_DECAY;
+		break;
 
-	if (!m_output_on) {
+	case IND_STEP_OFF:
+		TIMER_UPDATE_DUTY(0, 0, 0);
 		start_pwm_hw();
-	}
-}
+		b->step = IND_STEP_DECAY;
+		break;
 
-// Magnitude must not be larger than sqrt(3)/2, or 0.866
-static void svm(float alpha, float beta, uint32_t PWMHalfPeriod,
-		uint32_t* tAout, uint32_t* tBout, uint32_t* tCout, uint32_t *svm_sector) {
-	uint32_t sector;
+	case IND_STEP_DECAY:
+		b->step = IND_STEP_PULSE;
+		break;
 
-	if (beta >= 0.0f) {
-		if (alpha >= 0.0f) {
-			//quadrant I
-			if (ONE_BY_SQRT3 * beta > alpha) {
-				sector = 2;
-			} else {
-				sector = 1;
-			}
-		} else {
-			//quadrant II
-			if (-ONE_BY_SQRT3 * beta > alpha) {
-				sector = 3;
-			} else {
-				sector = 2;
-			}
-		}
-	} else {
-		if (alpha >= 0.0f) {
-			//quadrant IV5
-			if (-ONE_BY_SQRT3 * beta > alpha) {
-				sector = 5;
-			} else {
-				sector = 6;
-			}
-		} else {
-			//quadrant III
-			if (ONE_BY_SQRT3 * beta > alpha) {
-				sector = 4;
-			} else {
-				sector = 5;
-			}
+	case IND_STEP_PULSE: {
+		const ind_axis_t *ax = &m_ind_axes[b->axis];
+		const uint32_t duty_cnt = (uint32_t)((float)TIM1->ARR * b->duty[b->level]);
+		TIMER_UPDATE_DUTY(ax->high[0] ? duty_cnt : 0, ax->high[1] ? duty_cnt : 0,
+				ax->high[2] ? duty_cnt : 0);
+		b->step = IND_STEP_SAMPLE;
+	} break;
+
+	case IND_STEP_SAMPLE: {
+		const ind_axis_t *ax = &m_ind_axes[b->axis];
+		b->curr_sum[b->level][b->axis] += (float)(ax->sign * curr[ax->curr]) * FAC_CURRENT;
+		b->volt_sum[b->level][b->axis] += GET_INPUT_VOLTAGE();
+		b->cnt[b->level][b->axis]++;
+
+		b->step = IND_STEP_OFF;
+		b->axis++;
+		if (b->axis < 3) {
+			stop_pwm_hw();
+			break;
 		}
-	}
-
-	// PWM timings
-	uint32_t tA, tB, tC;
 
-	switch (sector) {
+		b->axis = 0;
+		b->rep++;
+		if (b->rep < b->reps) {
+			stop_pwm_hw();
+			break;
+		}
 
-	// sector 1-2
-	case 1: {
-		// Vector on-times
-		uint32_t t1 = (alpha - ONE_BY_SQRT3 * beta) * PWMHalfPeriod;
-		uint32_t t2 = (TWO_BY_SQRT3 * beta) * PWMHalfPeriod;
+		// Level done. Stop when its current reached the limit.
+		const int level = b->level;
+		const float i_avg = (b->curr_sum[level][0] + b->curr_sum[level][1] +
+				b->curr_sum[level][2]) / (float)(3 * b->reps);
 
-		// PWM timings
-		tA = (PWMHalfPeriod - t1 - t2) / 2;
-		tB = tA + t1;
-		tC = tB + t2;
+		b->rep = 0;
+		b->level++;
+		if (b->level < b->levels && (b->i_max <= 0.0 || i_avg < b->i_max)) {
+			stop_pwm_hw();
+			TIMER_UPDATE_DUTY_SAMP(0, 0, 0, (uint32_t)((float)TIM1->ARR * b->duty[b->level]) -
+					MCPWM_FOC_INDUCTANCE_SAMPLE_CNT_OFFSET);
+		} else {
+			stop_pwm_hw();
+			TIMER_UPDATE_SAMP(MCPWM_FOC_CURRENT_SAMP_OFFSET);
+			b->step = IND_STEP_DONE;
+		}
+	} break;
 
+	case IND_STEP_DONE:
+	default:
+		m_samples.measure_inductance_now = false;
 		break;
 	}
+}
 
-	// sector 2-3
-	case 2: {
-		// Vector on-times
-		uint32_t t2 = (alpha + ONE_BY_SQRT3 * beta) * PWMHalfPeriod;
-		uint32_t t3 = (-alpha + ONE_BY_SQRT3 * beta) * PWMHalfPeriod;
+/**
+ * Run a batch of inductance measurement pulses and average the samples.
+ *
+ * @param duty
+ * The duty cycle levels, in increasing order.
+ *
+ * @param levels
+ * The number of levels, at most MCPWM_FOC_IND_LEVELS_MAX.
+ *
+ * @param reps
+ * The number of pulses per axis at each level.
+ *
+ * @param i_max
+ * Stop after the first level whose average current reaches this. 0 for
+ * no limit.
+ *
+ * @param curr
+ * The average current for each level and axis.
+ *
+ * @param volt
+ * The average input voltage for each level and axis.
+ *
+ * @return
+ * The number of levels that were measured.
+ */
+static int measure_inductance_batch(const float *duty, int levels, int reps, float i_max,
+		float curr[][3], float volt[][3]) {
+	if (levels > MCPWM_FOC_IND_LEVELS_MAX) {
+		levels = MCPWM_FOC_IND_LEVELS_MAX;
+	}
 
-		// PWM timings
-		tB = (PWMHalfPeriod - t2 - t3) / 2;
-		tA = tB + t3;
-		tC = tA + t2;
+	if (levels <= 0 || reps <= 0) {
+		return 0;
+	}
 
-		break;
+	memset((void*)&m_ind_batch, 0, sizeof(ind_batch_t));
+	for (int i = 0;i < levels;i++) {
+		m_ind_batch.duty[i] = duty[i];
 	}
+	m_ind_batch.levels = levels;
+	m_ind_batch.reps = reps;
+	m_ind_batch.i_max = i_max;
+	m_ind_batch.step = IND_STEP_START;
 
-	// sector 3-4
-	case 3: {
-		// Vector on-times
-		uint32_t t3 = (TWO_BY_SQRT3 * beta) * PWMHalfPeriod;
-		uint32_t t4 = (-alpha - ONE_BY_SQRT3 * beta) * PWMHalfPeriod;
+	// Disable timeout
+	systime_t tout = timeout_get_timeout_msec();
+	float tout_c = timeout_get_brake_current();
+	timeout_reset();
+	timeout_configure(60000, 0.0);
 
-		// PWM timings
-		tB = (PWMHalfPeriod - t3 - t4) / 2;
-		tC = tB + t3;
-		tA = tC + t4;
+	mc_interface_lock();
 
-		break;
+	m_samples.measure_inductance_now = true;
+
+	int to_cnt = 0;
+	while (m_samples.measure_inductance_now) {
+		chThdSleepMilliseconds(1);
+		to_cnt++;
+		if (to_cnt > MCPWM_FOC_IND_TIMEOUT_MS) {
+			m_samples.measure_inductance_now = false;
+			stop_pwm_hw();
+			TIMER_UPDATE_SAMP(MCPWM_FOC_CURRENT_SAMP_OFFSET);
+			break;
+		}
 	}
 
-	// sector 4-5
-	case 4: {
-		// Vector on-times
-		uint32_t t4 = (-alpha + ONE_BY_SQRT3 * beta) * PWMHalfPeriod;
-		uint32_t t5 = (-TWO_BY_SQRT3 * beta) * PWMHalfPeriod;
+	// Enable timeout
+	timeout_configure(tout, tout_c);
 
-		// PWM timings
-		tC = (PWMHalfPeriod - t4 - t5) / 2;
-		tB = tC + t5;
-		tA = tB + t4;
+	mc_interface_unlock();
 
-		break;
-	}
+	int points = 0;
+	for (int i = 0;i < levels;i++) {
+		bool complete = true;
+		for (int j = 0;j < 3;j++) {
+			const int cnt = m_ind_batch.cnt[i][j];
+			if (cnt == 0) {
+				complete = false;
+				break;
+			}
 
-	// sector 5-6
-	case 5: {
-		// Vector on-times
-		uint32_t t5 = (-alpha - ONE_BY_SQRT3 * beta) * PWMHalfPeriod;
-		uint32_t t6 = (alpha - ONE_BY_SQRT3 * beta) * PWMHalfPeriod;
+			curr[i][j] = m_ind_batch.curr_sum[i][j] / (float)cnt;
+			volt[i][j] = m_ind_batch.volt_sum[i][j] / (float)cnt;
+		}
 
-		// PWM timings
-		tC = (PWMHalfPeriod - t5 - t6) / 2;
-		tA = tC + t5;
-		tB = tA + t6;
+		if (!complete) {
+			break;
+		}
 
-		break;
+		points++;
 	}
 
-	// sector 6-1
-	case 6: {
-		// Vector on-times
-		uint32_t t6 = (-TWO_BY_SQRT3 * beta) * PWMHalfPeriod;
-		uint32_t t1 = (alpha + ONE_BY_SQRT3 * beta) * PWMHalfPeriod;
+	return points;
+}
+
+/**
+ * Measure the inductance at one duty cycle.
+ *
+ * @param duty
+ * The duty cycle to use in the pulses.
+ *
+ * @param samples
+ * The number of pulses per axis.
+ *
+ * @param curr
+ * The average pulse current. Can be null.
+ *
+ * @param l_axis
+ * The inductance along each axis in microhenry. Can be null.
+ *
+ * @return
+ * The average d and q axis inductance in microhenry.
+ */
+static float measure_inductance_axes(float duty, int samples, float *curr, float *l_axis) {
+	float c[1][3];
+	float v[1][3];
 
-		// PWM timings
-		tA = (PWMHalfPeriod - t6 - t1) / 2;
-		tC = tA + t1;
-		tB = tC + t6;
+	if (measure_inductance_batch(&duty, 1, samples, 0.0, c, v) < 1) {
+		if (curr) {
+			*curr = 0.0;
+		}
 
-		break;
+		if (l_axis) {
+			for (int i = 0;i < 3;i++) {
+				l_axis[i] = 0.0;
+			}
+		}
+
+		return 0.0;
 	}
+
+	const float t = inductance_pulse_time(duty);
+
+	if (l_axis) {
+		for (int i = 0;i < 3;i++) {
+			l_axis[i] = ((v[0][i] * t) / c[0][i]) * 1e6 * (2.0 / 3.0);
+		}
 	}
 
-	*tAout = tA;
-	*tBout = tB;
-	*tCout = tC;
-	*svm_sector = sector;
+	const float avg_current = (c[0][0] + c[0][1] + c[0][2]) / 3.0;
+	const float avg_voltage = (v[0][0] + v[0][1] + v[0][2]) / 3.0;
+
+	if (curr) {
+		*curr = avg_current;
+	}
+
+	return ((avg_voltage * t) / avg_current) * 1e6 * (2.0 / 3.0);
 }
 
-static void run_pid_control_pos(float angle_now, float angle_set, float dt) {
+static void run_pid_control_pos(float angle_now, float angle_set,
+		float vel_set, float acc_set, float dt) {
 	static float i_term = 0;
 	static float prev_error = 0;
 	
@@ -2470,6 +3415,15 @@ static void run_pid_control_pos(float angle_now, float angle_set, float dt) {
 		}
 	}
 
+	// Trajectory feedforward
+	float ff_term = vel_set * m_conf->p_pid_ff_vel + acc_set * m_conf->p_pid_ff_acc;
+
+	if (encoder_is_configured()) {
+		if (m_conf->foc_encoder_inverted) {
+			ff_term = -ff_term;
+		}
+	}
+
 	float p_term = error * m_conf->p_pid_kp;
 	i_term += error * (m_conf->p_pid_ki * dt);
 
@@ -2501,7 +3455,7 @@ static void run_pid_control_pos(float angle_now, float angle_set, float dt) {
 	prev_error = error;
 
 	// Calculate output
-	float output = p_term + i_term + d_term;
+	float output = p_term + i_term + d_term + ff_term;
 	utils_truncate_number(&output, -1.0, 1.0);
 
 	if (encoder_is_configured()) {
@@ -2517,62 +3471,162 @@ static void run_pid_control_pos(float angle_now, float angle_set, float dt) {
 }
 
 static void run_pid_control_speed(float dt) {
-	static float i_term = 0.0;
-	static float prev_error = 0.0;
-	static float d_filter = 0.0;
-
 	// PID is off. Return.
 	if (m_control_mode != CONTROL_MODE_SPEED) {
 		// use the iterm taht would result in the actual current to keeo the actual momentum when
 		// cruise is activated during acceleration
-		i_term = m_motor_state.iq_filter / m_conf->lo_current_max;
-		prev_error = 0.0;
-		d_filter = 0.0;
+		speed_pid_reset(&m_speed_pid, m_motor_state.iq_filter / m_conf->lo_current_max);
+		return;
+	}
+
+	float rpm_set = m_speed_pid_set_rpm;
+	if (m_freq_resp.active && m_freq_resp.target == FREQ_RESP_TARGET_SPEED) {
+		rpm_set += m_freq_resp.u;
+	}
+
+	const float output = speed_pid_run(&m_speed_pid, m_conf, rpm_set,
+			mcpwm_foc_get_rpm(), m_speed_pid_cruise_control_type, m_conf->s_pid_kd_filter, dt);
+
+	m_iq_set = output * m_conf->lo_current_max;
+}
+
+/*
+ * Record the injected value and the response of this iteration, and advance
+ * the exponential chirp.
+ */
+static void run_freq_resp(float dt) {
+	if (!m_freq_resp.active) {
+		return;
+	}
+
+	if (m_freq_resp.dec_cnt == 0 && m_freq_resp.samples < ADC_SAMPLE_MAX_LEN) {
+		float y;
+		switch (m_freq_resp.target) {
+		case FREQ_RESP_TARGET_ID:
+			y = m_motor_state.id;
+			break;
+
+		case FREQ_RESP_TARGET_IQ:
+			y = m_motor_state.iq;
+			break;
+
+		default:
+			y = mcpwm_foc_get_rpm();
+			break;
+		}
+
+		float u_samp = m_freq_resp.u / m_freq_resp.scale;
+		float y_samp = y / m_freq_resp.scale;
+		utils_truncate_number_abs(&u_samp, 32767.0);
+		utils_truncate_number_abs(&y_samp, 32767.0);
+		mc_interface_sample_set_pair(m_freq_resp.samples, (int16_t)u_samp, (int16_t)y_samp);
+		m_freq_resp.samples++;
+	}
+
+	m_freq_resp.dec_cnt++;
+	if (m_freq_resp.dec_cnt >= m_freq_resp.dec) {
+		m_freq_resp.dec_cnt = 0;
+	}
+
+	m_freq_resp.time += dt;
+	if (m_freq_resp.time >= m_freq_resp.time_end) {
+		m_freq_resp.u = 0.0;
+		m_freq_resp.active = false;
 		return;
 	}
 
-	const float rpm = mcpwm_foc_get_rpm();
-	float error = m_speed_pid_set_rpm - rpm;
+	m_freq_resp.phase += 2.0 * M_PI * m_freq_resp.freq * dt;
+	utils_norm_angle_rad((float*)&m_freq_resp.phase);
+	m_freq_resp.freq *= m_freq_resp.freq_mult;
+	m_freq_resp.u = m_freq_resp.amp * sinf(m_freq_resp.phase);
+}
+
+static void run_tasks(float dt) {
+	for (unsigned int i = 0;i < TASK_NUM;i++) {
+		foc_task_t *task = &m_tasks[i];
+
+		task->cnt++;
+		if (task->cnt < task->div) {
+			continue;
+		}
+		task->cnt = 0;
+
+		const uint32_t start = TIM12->CNT;
+		task->func(dt * (float)task->div);
+		const uint32_t time = TIM12->CNT - start;
+
+		task->time_last = time;
+		if (time > task->time_max) {
+			task->time_max = time;
+		}
+	}
+}
+
+static void task_speed(float dt) {
+	run_pid_control_speed(dt);
+}
+
+static void task_pos(float dt) {
+	if (m_traj.active) {
+		if (m_control_mode != CONTROL_MODE_POS) {
+			m_traj.active = false;
+		} else {
+			m_traj.time += dt;
+
+			float pos, vel, acc;
+			foc_traj_sample((foc_traj_t*)&m_traj, m_traj.time, &pos, &vel, &acc);
+			utils_norm_angle(&pos);
+			m_pos_pid_set = pos;
+			m_pos_vel_set = vel;
+			m_pos_acc_set = acc;
+
+			if (m_traj.time >= m_traj.t_tot) {
+				m_traj.active = false;
+			}
+		}
+	}
+
+	if (m_state == MC_STATE_RUNNING) {
+		run_pid_control_pos(m_pos_pid_now, m_pos_pid_set, m_pos_vel_set, m_pos_acc_set, dt);
+	}
+}
 
-	// Too low RPM set. Reset state and return.
-	if (fabsf(m_speed_pid_set_rpm) < m_conf->s_pid_min_erpm) {
+/*
+ * Duty cycle down-ramp controller. The interrupt handler decides when it is
+ * needed and uses m_duty_pid_iq as the current set point.
+ */
+static void task_duty(float dt) {
+	static float i_term = 0.0;
+
+	if (!m_duty_pid_active || m_state != MC_STATE_RUNNING) {
 		i_term = 0.0;
-		prev_error = error;
-		d_filter = 0.0;
-		m_iq_set = 0.0;
+		m_duty_pid_iq = 0.0;
 		return;
 	}
-	
+
+	// Compensation for supply voltage variations
+	float scale = 1.0 / GET_INPUT_VOLTAGE();
+
+	// Compute error
+	float error = m_duty_pid_set - m_motor_state.duty_now;
+
 	// Compute parameters
-	float p_term = error * m_conf->s_pid_kp * 0.025; // 1.0 / 40.0
-	i_term += error * (m_conf->s_pid_ki * dt) * 0.025; // 1.0 / 40.0
-	float d_term = (error - prev_error) * (m_conf->s_pid_kd / dt) * 0.025; // 1.0 / 40.0
-	
-	// Filter D
-	UTILS_LP_FAST(d_filter, d_term, m_conf->s_pid_kd_filter);
-	d_term = d_filter;
+	float p_term = error * m_conf->foc_duty_dowmramp_kp * scale;
+	i_term += error * (m_conf->foc_duty_dowmramp_ki * dt) * scale;
 
 	// I-term wind-up protection
 	utils_truncate_number(&i_term, -1.0, 1.0);
 
-	// Store previous error
-	prev_error = error;
-
 	// Calculate output
-	float output = p_term + i_term + d_term;
+	float output = p_term + i_term;
 	utils_truncate_number(&output, -1.0, 1.0);
+	m_duty_pid_iq = output * m_conf->lo_current_max;
+}
 
-	// Optionally disable braking
-	if ((m_speed_pid_cruise_control_type == CRUISE_CONTROL_MOTOR_SETTINGS && !m_conf->s_pid_allow_braking) || m_speed_pid_cruise_control_type == CRUISE_CONTROL_BRAKING_DISABLED) {
-		if((rpm > 0.0 && output < 0.0) || (rpm < 0.0 && output > 0.0)){
-			output = 0.0;
-			i_term = 0.0;
-			prev_error = 0;
-			d_filter = 0.0;
-		}
-	}
-
-	m_iq_set = output * m_conf->lo_current_max;
+static void task_observer_gain(float dt) {
+	(void)dt;
+	m_gamma_now = utils_map(fabsf(m_motor_state.duty_now), 0.0, 1.0,
+			m_conf->foc_observer_gain * m_conf->foc_observer_gain_slow, m_conf->foc_observer_gain);
 }
 
 static void stop_pwm_hw(void) {
@@ -2659,6 +3713,18 @@ static float correct_hall(float angle, float speed, float dt) {
 	static int ang_hall_int_prev = -1;
 	float rpm_abs = fabsf(speed / ((2.0 * M_PI) / 60.0));
 	static bool using_hall = true;
+	const int hall_now = read_hall();
+
+	// Learn the transition angles from the observer. Only do it at speeds
+	// where the observer is used, so that it is accurate.
+	if (m_hall_learn && hall_now != m_hall_prev && rpm_abs > m_conf->foc_sl_erpm) {
+		float ang_edge;
+		int edge;
+		if (foc_hall_edge(m_conf->foc_hall_table, m_hall_prev, hall_now, &ang_edge, &edge)) {
+			m_hall_learn_sum[edge] += utils_angle_difference_rad(angle, ang_edge);
+			m_hall_learn_cnt[edge]++;
+		}
+	}
 
 	// Hysteresis 5 % of total speed
 	float hyst = m_conf->foc_sl_erpm * 0.1;
@@ -2673,12 +3739,14 @@ static float correct_hall(float angle, float speed, float dt) {
 	}
 
 	if (using_hall) {
-		int ang_hall_int = m_conf->foc_hall_table[read_hall()];
+		int ang_hall_int = m_conf->foc_hall_table[hall_now];
 
 		// Only override the observer if the hall sensor value is valid.
 		if (ang_hall_int < 201) {
 			static float ang_hall = 0.0;
-			float ang_hall_now = (((float)ang_hall_int / 200.0) * 360.0) * M_PI / 180.0;
+			const float ang_hall_now = m_hall_sectors.width[hall_now] > 0.0 ?
+					m_hall_sectors.centre[hall_now] :
+					(((float)ang_hall_int / 200.0) * 360.0) * M_PI / 180.0;
 
 			if (ang_hall_int_prev < 0) {
 				// Previous angle not valid
@@ -2689,18 +3757,16 @@ static float correct_hall(float angle, float speed, float dt) {
 					ang_hall = angle;
 				} else {
 					// A boot or error has occurred. Use center of hall sensor angle.
-					ang_hall = ((ang_hall_int / 200.0) * 360.0) * M_PI / 180.0;
+					ang_hall = ang_hall_now;
 				}
 			} else if (ang_hall_int != ang_hall_int_prev) {
-				// A transition was just made. The angle is in the middle of the new and old angle.
-				int ang_avg = abs(ang_hall_int - ang_hall_int_prev);
-				if (ang_avg < 100) {
-					ang_avg = (ang_hall_int + ang_hall_int_prev) / 2;
-				} else if (ang_avg != 100) {
-					ang_avg = (ang_hall_int + ang_hall_int_prev) / 2 + 100;
+				// A transition was just made. The angle is in the middle of the new and old
+				// angle, corrected with the learned position of the edge.
+				float ang_edge;
+				int edge;
+				if (foc_hall_edge(m_conf->foc_hall_table, m_hall_prev, hall_now, &ang_edge, &edge)) {
+					ang_hall = ang_edge + (float)m_conf->foc_hall_edge_corr[edge] * (0.1 * M_PI / 180.0);
 				}
-				ang_avg %= 200;
-				ang_hall = (((float)ang_avg / 200.0) * 360.0) * M_PI / 180.0;
 			}
 
 			ang_hall_int_prev = ang_hall_int;
@@ -2709,15 +3775,8 @@ static float correct_hall(float angle, float speed, float dt) {
 				// Don't interpolate on very low speed, just use the closest hall sensor
 				ang_hall = ang_hall_now;
 			} else {
-				// Interpolate
-				float diff = utils_angle_difference_rad(ang_hall, ang_hall_now);
-				if (fabsf(diff) < ((2.0 * M_PI) / 12.0)) {
-					// Do interpolation
-					ang_hall += speed * dt;
-				} else {
-					// We are too far away with the interpolation
-					ang_hall -= diff / 100.0;
-				}
+				// Interpolate within the learned sector
+				ang_hall = foc_hall_track(&m_hall_sectors, hall_now, ang_hall, speed * dt);
 			}
 
 			utils_norm_angle_rad(&ang_hall);
@@ -2738,5 +3797,7 @@ static float correct_hall(float angle, float speed, float dt) {
 		ang_hall_int_prev = -2;
 	}
 
+	m_hall_prev = hall_now;
+
 	return angle;
 }
@@ -38,6 +38,7 @@ void mcpwm_foc_set_duty_noramp(float dutyCycle);
 void mcpwm_foc_set_pid_speed(float rpm);
 void mcpwm_foc_set_pid_speed_with_cruise_status(float rpm, ppm_cruise cruise_status);
 void mcpwm_foc_set_pid_pos(float pos);
+void mcpwm_foc_set_pid_pos_move(float pos, float vel, float acc, float jerk);
 void mcpwm_foc_set_current(float current);
 void mcpwm_foc_set_brake_current(float current);
 void mcpwm_foc_set_handbrake(float current);
@@ -68,12 +69,27 @@ float mcpwm_foc_get_phase_encoder(void);
 float mcpwm_foc_get_vd(void);
 float mcpwm_foc_get_vq(void);
 void mcpwm_foc_encoder_detect(float current, bool print, float *offset, float *ratio, bool *inverted);
+void mcpwm_foc_hall_learn_start(void);
+int mcpwm_foc_hall_learn_stop(int8_t *edge_corr);
+bool mcpwm_foc_encoder_comp_detect(float current, bool print, int8_t *enc_table,
+		float *enc_scale, int8_t *cog_table, float *cog_scale);
 float mcpwm_foc_measure_resistance(float current, int samples);
 float mcpwm_foc_measure_inductance(float duty, int samples, float *curr);
+float mcpwm_foc_measure_inductance_dq(float duty, int samples, float *ld, float *lq);
+int mcpwm_foc_measure_inductance_curve(float duty_max, int levels, int samples,
+		float i_max, float *curr, float *ind);
 bool mcpwm_foc_measure_res_ind(float *res, float *ind);
 bool mcpwm_foc_hall_detect(float current, uint8_t *hall_table);
+bool mcpwm_foc_measure_freq_resp(freq_resp_target target, float amp, float f_start,
+		float f_end, float time, int points, float *freq, float *gain, float *phase,
+		float *bandwidth);
 void mcpwm_foc_print_state(void);
+void mcpwm_foc_print_tasks(bool reset);
 float mcpwm_foc_get_last_inj_adc_isr_duration(void);
+int mcpwm_foc_get_observer_iterations(void);
+float mcpwm_foc_get_fw_current(void);
+float mcpwm_foc_get_est_res(void);
+float mcpwm_foc_get_est_flux_linkage(void);
 
 // Interrupt handlers
 void mcpwm_foc_tim_sample_int_handler(void);
@@ -82,6 +98,30 @@ void mcpwm_foc_adc_int_handler(void *p, uint32_t flags);
 // Defines
 #define MCPWM_FOC_INDUCTANCE_SAMPLE_CNT_OFFSET		10 // Offset for the inductance measurement sample time in timer ticks
 #define MCPWM_FOC_INDUCTANCE_SAMPLE_RISE_COMP		50 // Current rise time compensation
+#define MCPWM_FOC_IND_LEVELS_MAX					12 // Duty cycle levels in one inductance measurement batch
+#define MCPWM_FOC_IND_TIMEOUT_MS					5000 // Inductance measurement batch timeout
+#define MCPWM_FOC_RES_SETTLE_MIN_MS					50 // Minimum settling time before the resistance samples
+#define MCPWM_FOC_RES_SETTLE_MAX_MS					500 // Maximum settling time before the resistance samples
+#define MCPWM_FOC_RES_SAMPLE_RATE					1000.0 // Resistance measurement samples per second
 #define MCPWM_FOC_CURRENT_SAMP_OFFSET				(2) // Offset from timer top for injected ADC samples
+#define MCPWM_FOC_HALL_LEARN_MIN					20 // Minimum number of passes of a hall edge for a learned correction
+#define MCPWM_FOC_FREQ_RESP_POINTS					20 // Frequency response points for the terminal and COMM_FREQ_RESPONSE
+#define MCPWM_FOC_FREQ_RESP_TIME_MAX				5.0 // Longest frequency response chirp in seconds, the timeout is disabled during it
+
+// Rates of the outer control loops in Hz. They run every n:th current control
+// loop iteration, with n derived from the control loop rate. 0 runs the loop in
+// every iteration.
+#ifndef MCPWM_FOC_RATE_SPEED
+#define MCPWM_FOC_RATE_SPEED						1000.0
+#endif
+#ifndef MCPWM_FOC_RATE_POS
+#define MCPWM_FOC_RATE_POS							0.0
+#endif
+#ifndef MCPWM_FOC_RATE_DUTY
+#define MCPWM_FOC_RATE_DUTY							0.0
+#endif
+#ifndef MCPWM_FOC_RATE_OBSERVER_GAIN
+#define MCPWM_FOC_RATE_OBSERVER_GAIN				1000.0
+#endif
 
 #endif /* MCPWM_FOC_H_ */
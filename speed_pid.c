@@ -0,0 +1,203 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "speed_pid.h"
+#include "utils.h"
+#include <math.h>
+
+/**
+ * Reset the controller state.
+ *
+ * @param pid
+ * The controller state.
+ *
+ * @param i_term
+ * The integral term to start from, e.g. the current output so that enabling
+ * the controller keeps the present torque.
+ */
+void speed_pid_reset(speed_pid_state_t *pid, float i_term) {
+	pid->i_term = i_term;
+	pid->prev_error = 0.0;
+	pid->d_filter = 0.0;
+	pid->prev_set = 0.0;
+	pid->prev_set_valid = false;
+	pid->acc_filter = 0.0;
+}
+
+/**
+ * Run one iteration of the speed controller.
+ *
+ * @param pid
+ * The controller state.
+ *
+ * @param conf
+ * The configuration with the gains and limits.
+ *
+ * @param rpm_set
+ * The speed set point in ERPM.
+ *
+ * @param rpm
+ * The present speed in ERPM.
+ *
+ * @param cruise
+ * The cruise control type, which decides whether braking is allowed.
+ *
+ * @param kd_filter
+ * The filter constant of the derivative term.
+ *
+ * @param dt
+ * The time since the previous iteration in seconds.
+ *
+ * @return
+ * The motor current as a fraction of lo_current_max.
+ */
+float speed_pid_run(speed_pid_state_t *pid, volatile mc_configuration *conf,
+		float rpm_set, float rpm, ppm_cruise cruise, float kd_filter, float dt) {
+	const float error = rpm_set - rpm;
+
+	// Too low RPM set. Reset state and return.
+	if (fabsf(rpm_set) < conf->s_pid_min_erpm) {
+		speed_pid_reset(pid, 0.0);
+		pid->prev_error = error;
+		return 0.0;
+	}
+
+	float kp, ki, kd;
+	speed_pid_get_gains(conf, rpm, &kp, &ki, &kd);
+
+	// Acceleration feedforward from the slope of the set point
+	float ff_term = 0.0;
+	if (pid->prev_set_valid) {
+		UTILS_LP_FAST(pid->acc_filter, (rpm_set - pid->prev_set) / dt, SPEED_PID_FF_ACC_FILTER);
+		ff_term = pid->acc_filter * conf->s_pid_ff_acc;
+	}
+	pid->prev_set = rpm_set;
+	pid->prev_set_valid = true;
+
+	// Compute parameters
+	float p_term = error * kp * SPEED_PID_SCALE;
+	pid->i_term += error * (ki * dt) * SPEED_PID_SCALE;
+	float d_term = (error - pid->prev_error) * (kd / dt) * SPEED_PID_SCALE;
+
+	// Filter D
+	UTILS_LP_FAST(pid->d_filter, d_term, kd_filter);
+	d_term = pid->d_filter;
+
+	// Store previous error
+	pid->prev_error = error;
+
+	// Calculate output
+	const float output_raw = p_term + pid->i_term + d_term + ff_term;
+	float output = output_raw;
+	utils_truncate_number(&output, -1.0, 1.0);
+
+	// Back-calculation anti-windup. While the output is saturated the integral
+	// term is pulled back towards the limit instead of winding up until it hits
+	// its own clamp. The tracking time constant is the geometric mean of the
+	// integral time and the sample time.
+	float track = kp > 0.0 ? sqrtf((ki * dt) / kp) : 1.0;
+	utils_truncate_number(&track, 0.0, 1.0);
+	pid->i_term += (output - output_raw) * track;
+	utils_truncate_number(&pid->i_term, -1.0, 1.0);
+
+	// Optionally disable braking
+	if ((cruise == CRUISE_CONTROL_MOTOR_SETTINGS && !conf->s_pid_allow_braking) ||
+			cruise == CRUISE_CONTROL_BRAKING_DISABLED) {
+		if ((rpm > 0.0 && output < 0.0) || (rpm < 0.0 && output > 0.0)) {
+			output = 0.0;
+			pid->i_term = 0.0;
+			pid->prev_error = 0.0;
+			pid->d_filter = 0.0;
+		}
+	}
+
+	return output;
+}
+
+/**
+ * Get the speed controller gains for a speed. With gain scheduling enabled
+ * the configured gains are multiplied with factors that are linearly
+ * interpolated between the breakpoints, and held constant outside of them.
+ * The breakpoints must be in increasing ERPM order.
+ *
+ * @param conf
+ * The configuration.
+ *
+ * @param rpm
+ * The speed in ERPM. The sign is ignored.
+ *
+ * @param kp
+ * The proportional gain.
+ *
+ * @param ki
+ * The integral gain.
+ *
+ * @param kd
+ * The derivative gain.
+ */
+void speed_pid_get_gains(volatile mc_configuration *conf, float rpm,
+		float *kp, float *ki, float *kd) {
+	*kp = conf->s_pid_kp;
+	*ki = conf->s_pid_ki;
+	*kd = conf->s_pid_kd;
+
+	int points = conf->s_pid_sched_points;
+	if (points <= 0) {
+		return;
+	}
+
+	if (points > S_PID_SCHED_LEN) {
+		points = S_PID_SCHED_LEN;
+	}
+
+	const float erpm = fabsf(rpm);
+	float fact_kp, fact_ki, fact_kd;
+
+	if (points == 1 || erpm <= conf->s_pid_sched_erpm[0]) {
+		fact_kp = conf->s_pid_sched_kp[0];
+		fact_ki = conf->s_pid_sched_ki[0];
+		fact_kd = conf->s_pid_sched_kd[0];
+	} else if (erpm >= conf->s_pid_sched_erpm[points - 1]) {
+		fact_kp = conf->s_pid_sched_kp[points - 1];
+		fact_ki = conf->s_pid_sched_ki[points - 1];
+		fact_kd = conf->s_pid_sched_kd[points - 1];
+	} else {
+		int i = 0;
+		while (i < (points - 2) && erpm >= conf->s_pid_sched_erpm[i + 1]) {
+			i++;
+		}
+
+		const float e0 = conf->s_pid_sched_erpm[i];
+		const float e1 = conf->s_pid_sched_erpm[i + 1];
+
+		if (e1 > e0) {
+			fact_kp = utils_map(erpm, e0, e1, conf->s_pid_sched_kp[i], conf->s_pid_sched_kp[i + 1]);
+			fact_ki = utils_map(erpm, e0, e1, conf->s_pid_sched_ki[i], conf->s_pid_sched_ki[i + 1]);
+			fact_kd = utils_map(erpm, e0, e1, conf->s_pid_sched_kd[i], conf->s_pid_sched_kd[i + 1]);
+		} else {
+			fact_kp = conf->s_pid_sched_kp[i + 1];
+			fact_ki = conf->s_pid_sched_ki[i + 1];
+			fact_kd = conf->s_pid_sched_kd[i + 1];
+		}
+	}
+
+	*kp *= fact_kp;
+	*ki *= fact_ki;
+	*kd *= fact_kd;
+}
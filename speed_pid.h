@@ -0,0 +1,52 @@
+/*
+	Copyright 2017 Benjamin Vedder	benjamin@vedder.se
+
+	This file is part of the VESC firmware.
+
+	The VESC firmware is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    The VESC firmware is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#ifndef SPEED_PID_H_
+#define SPEED_PID_H_
+
+#include "datatypes.h"
+
+/*
+ * Speed PID controller shared by mcpwm and mcpwm_foc. The output is the motor
+ * current as a fraction of lo_current_max. The state is kept by the caller,
+ * so that it can be reset from outside of the control loop.
+ */
+
+// Settings
+#define SPEED_PID_SCALE				0.025 // 1.0 / 40.0, scale of the configured gains
+#define SPEED_PID_FF_ACC_FILTER		0.2 // Filter constant of the set point slope for the acceleration feedforward
+
+// Types
+typedef struct {
+	float i_term;
+	float prev_error;
+	float d_filter;
+	float prev_set; // Set point of the previous iteration for the acceleration feedforward
+	bool prev_set_valid;
+	float acc_filter;
+} speed_pid_state_t;
+
+// Functions
+void speed_pid_reset(speed_pid_state_t *pid, float i_term);
+float speed_pid_run(speed_pid_state_t *pid, volatile mc_configuration *conf,
+		float rpm_set, float rpm, ppm_cruise cruise, float kd_filter, float dt);
+void speed_pid_get_gains(volatile mc_configuration *conf, float rpm,
+		float *kp, float *ki, float *kd);
+
+#endif /* SPEED_PID_H_ */
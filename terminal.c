@@ -321,6 +321,75 @@ void terminal_process_string(char *str) {
 		} else {
 			commands_printf("This command requires one argument.\n");
 		}
+	} else if (strcmp(argv[0], "foc_encoder_comp_detect") == 0) {
+		if (argc == 2) {
+			float current = -1.0;
+			sscanf(argv[1], "%f", &current);
+
+			if (current > 0.0 && current <= mcconf.l_current_max) {
+				if (encoder_is_configured()) {
+					mc_motor_type type_old = mcconf.motor_type;
+					mcconf.motor_type = MOTOR_TYPE_FOC;
+					mc_interface_set_configuration(&mcconf);
+
+					float enc_scale = 0.0;
+					float cog_scale = 0.0;
+					mcpwm_foc_encoder_comp_detect(current, true,
+							mcconf.foc_encoder_comp_table, &enc_scale,
+							mcconf.foc_cogging_comp_table, &cog_scale);
+
+					mcconf.motor_type = type_old;
+					mcconf.foc_encoder_comp_scale = enc_scale;
+					mcconf.foc_cogging_comp_scale = cog_scale;
+					mcconf.foc_encoder_comp_enable = true;
+					mcconf.foc_cogging_comp_enable = true;
+					conf_general_store_mc_configuration(&mcconf);
+					mc_interface_set_configuration(&mcconf);
+
+					commands_printf("Encoder error max : %.2f degrees", (double)(enc_scale * 127.0));
+					commands_printf("Cogging current max : %.2f A", (double)(cog_scale * 127.0));
+					commands_printf("Tables stored and enabled\n");
+				} else {
+					commands_printf("Encoder not enabled.\n");
+				}
+			} else {
+				commands_printf("Invalid argument(s).\n");
+			}
+		} else {
+			commands_printf("This command requires one argument.\n");
+		}
+	} else if (strcmp(argv[0], "foc_hall_learn") == 0) {
+		if (argc == 2) {
+			float seconds = -1.0;
+			sscanf(argv[1], "%f", &seconds);
+
+			if (seconds > 0.0 && seconds <= 120.0) {
+				commands_printf("Learning hall transitions, run the motor above %.0f ERPM",
+						(double)mcconf.foc_sl_erpm);
+
+				int8_t edge_corr[8];
+				mcpwm_foc_hall_learn_start();
+				chThdSleepMilliseconds((int)(seconds * 1000.0));
+				int edges = mcpwm_foc_hall_learn_stop(edge_corr);
+
+				for (int i = 0;i < 8;i++) {
+					commands_printf("Edge %d: %.1f degrees", i, (double)((float)edge_corr[i] / 10.0));
+				}
+
+				if (edges == 6) {
+					memcpy(mcconf.foc_hall_edge_corr, edge_corr, sizeof(edge_corr));
+					conf_general_store_mc_configuration(&mcconf);
+					mc_interface_set_configuration(&mcconf);
+					commands_printf("Corrections stored\n");
+				} else {
+					commands_printf("Only %d of 6 edges seen enough times, nothing stored\n", edges);
+				}
+			} else {
+				commands_printf("Invalid argument(s).\n");
+			}
+		} else {
+			commands_printf("This command requires one argument.\n");
+		}
 	} else if (strcmp(argv[0], "measure_res") == 0) {
 		if (argc == 2) {
 			float current = -1.0;
@@ -360,6 +429,64 @@ void terminal_process_string(char *str) {
 		} else {
 			commands_printf("This command requires one argument.\n");
 		}
+	} else if (strcmp(argv[0], "measure_ld_lq") == 0) {
+		if (argc == 2) {
+			float duty = -1.0;
+			sscanf(argv[1], "%f", &duty);
+
+			if (duty > 0.0 && duty < 0.9) {
+				mcconf.motor_type = MOTOR_TYPE_FOC;
+				mcconf.foc_f_sw = 3000.0;
+				mc_interface_set_configuration(&mcconf);
+
+				float ld, lq;
+				float ind = mcpwm_foc_measure_inductance_dq(duty, 200, &ld, &lq);
+				commands_printf("Inductance: %.2f microhenry", (double)ind);
+				commands_printf("Ld:         %.2f microhenry", (double)ld);
+				commands_printf("Lq:         %.2f microhenry\n", (double)lq);
+
+				mc_interface_set_configuration(&mcconf_old);
+			} else {
+				commands_printf("Invalid argument(s).\n");
+			}
+		} else {
+			commands_printf("This command requires one argument.\n");
+		}
+	} else if (strcmp(argv[0], "measure_ind_curve") == 0) {
+		if (argc == 3) {
+			float duty_max = -1.0;
+			int levels = -1;
+			sscanf(argv[1], "%f", &duty_max);
+			sscanf(argv[2], "%d", &levels);
+
+			if (duty_max > 0.0 && duty_max < 0.9 &&
+					levels > 0 && levels <= MCPWM_FOC_IND_LEVELS_MAX) {
+				mcconf.motor_type = MOTOR_TYPE_FOC;
+				mcconf.foc_f_sw = 3000.0;
+				mc_interface_set_configuration(&mcconf);
+
+				float curr[MCPWM_FOC_IND_LEVELS_MAX];
+				float ind[MCPWM_FOC_IND_LEVELS_MAX];
+				int points = mcpwm_foc_measure_inductance_curve(duty_max, levels, 50,
+						mcconf.l_current_max, curr, ind);
+
+				commands_printf("Current (A)  Inductance (microhenry)");
+				for (int i = 0;i < points;i++) {
+					commands_printf("%8.2f     %.2f", (double)curr[i], (double)ind[i]);
+				}
+
+				if (points < levels) {
+					commands_printf("Stopped at the current limit after %d of %d levels", points, levels);
+				}
+				commands_printf(" ");
+
+				mc_interface_set_configuration(&mcconf_old);
+			} else {
+				commands_printf("Invalid argument(s).\n");
+			}
+		} else {
+			commands_printf("This command requires two arguments.\n");
+		}
 	} else if (strcmp(argv[0], "measure_linkage") == 0) {
 		if (argc == 5) {
 			float current = -1.0;
@@ -447,6 +574,34 @@ void terminal_process_string(char *str) {
 	} else if (strcmp(argv[0], "foc_state") == 0) {
 		mcpwm_foc_print_state();
 		commands_printf(" ");
+	} else if (strcmp(argv[0], "foc_estimates") == 0) {
+		commands_printf("Estimation:    %s", mcconf.foc_rls_enable ? "On" : "Off");
+		commands_printf("R:             %.2f mOhm (configured %.2f mOhm)",
+				(double)(mcpwm_foc_get_est_res() * 1e3), (double)(mcconf.foc_motor_r * 1e3));
+		commands_printf("Flux linkage:  %.3f mWb (configured %.3f mWb)\n",
+				(double)(mcpwm_foc_get_est_flux_linkage() * 1e3), (double)(mcconf.foc_motor_flux_linkage * 1e3));
+	} else if (strcmp(argv[0], "limits") == 0) {
+		const volatile mc_configuration *conf = mc_interface_get_configuration();
+		commands_printf("Motor current:  %.2f A to %.2f A (now max %.2f A)",
+				(double)conf->lo_current_min, (double)conf->lo_current_max,
+				(double)conf->lo_current_motor_max_now);
+		commands_printf("Input current:  %.2f A to %.2f A",
+				(double)conf->lo_in_current_min, (double)conf->lo_in_current_max);
+
+		const uint32_t sources = mc_interface_get_limit_sources();
+		if (sources == 0) {
+			commands_printf("No derating active");
+		}
+
+		for (int i = 0;i < LIMIT_SOURCE_NUM;i++) {
+			if (sources & (1 << i)) {
+				commands_printf("Limited by:     %s", mc_interface_limit_source_to_string(i));
+			}
+		}
+		commands_printf(" ");
+	} else if (strcmp(argv[0], "foc_tasks") == 0) {
+		mcpwm_foc_print_tasks(argc == 2 && strcmp(argv[1], "reset") == 0);
+		commands_printf(" ");
 	} else if (strcmp(argv[0], "hw_status") == 0) {
 		commands_printf("Firmware: %d.%d", FW_VERSION_MAJOR, FW_VERSION_MINOR);
 #ifdef HW_NAME
@@ -473,6 +628,63 @@ void terminal_process_string(char *str) {
 		} else {
 			commands_printf("This command requires two arguments.\n");
 		}
+	} else if (strcmp(argv[0], "foc_freq_resp") == 0) {
+		if (argc == 6) {
+			freq_resp_target target;
+			float amp = -1.0;
+			float f_start = -1.0;
+			float f_end = -1.0;
+			float time = -1.0;
+			sscanf(argv[2], "%f", &amp);
+			sscanf(argv[3], "%f", &f_start);
+			sscanf(argv[4], "%f", &f_end);
+			sscanf(argv[5], "%f", &time);
+			utils_truncate_number(&time, 0.0, MCPWM_FOC_FREQ_RESP_TIME_MAX);
+
+			bool target_ok = true;
+			if (strcmp(argv[1], "id") == 0) {
+				target = FREQ_RESP_TARGET_ID;
+			} else if (strcmp(argv[1], "iq") == 0) {
+				target = FREQ_RESP_TARGET_IQ;
+			} else if (strcmp(argv[1], "speed") == 0) {
+				target = FREQ_RESP_TARGET_SPEED;
+			} else {
+				target = FREQ_RESP_TARGET_ID;
+				target_ok = false;
+			}
+
+			if (target_ok && amp > 0.0 && f_start > 0.0 && f_end > f_start && time > 0.0) {
+				if (mcconf.motor_type == MOTOR_TYPE_FOC) {
+					float freq[MCPWM_FOC_FREQ_RESP_POINTS];
+					float gain[MCPWM_FOC_FREQ_RESP_POINTS];
+					float phase[MCPWM_FOC_FREQ_RESP_POINTS];
+					float bandwidth = 0.0;
+
+					if (mcpwm_foc_measure_freq_resp(target, amp, f_start, f_end, time,
+							MCPWM_FOC_FREQ_RESP_POINTS, freq, gain, phase, &bandwidth)) {
+						commands_printf("   Freq (Hz)   Gain (dB)  Phase (deg)");
+						for (int i = 0;i < MCPWM_FOC_FREQ_RESP_POINTS;i++) {
+							commands_printf("%12.1f %11.2f %12.1f",
+									(double)freq[i], (double)gain[i], (double)phase[i]);
+						}
+
+						if (bandwidth > 0.0) {
+							commands_printf("Bandwidth: %.1f Hz\n", (double)bandwidth);
+						} else {
+							commands_printf("Bandwidth: above the measured range\n");
+						}
+					} else {
+						commands_printf("Measurement failed. The speed target requires speed control to run.\n");
+					}
+				} else {
+					commands_printf("Motor not in FOC mode.\n");
+				}
+			} else {
+				commands_printf("Invalid argument(s).\n");
+			}
+		} else {
+			commands_printf("This command requires five arguments.\n");
+		}
 	}
 
 	// The help command
@@ -531,12 +743,26 @@ void terminal_process_string(char *str) {
 		commands_printf("foc_encoder_detect [current]");
 		commands_printf("  Run the motor at 1Hz on open loop and compute encoder settings");
 
+		commands_printf("foc_hall_learn [seconds]");
+		commands_printf("  Learn the hall sensor transition angles from the observer while the motor runs");
+		commands_printf("  above foc_sl_erpm, then store the corrections");
+
+		commands_printf("foc_encoder_comp_detect [current]");
+		commands_printf("  Record the encoder error and the cogging current, then store and enable the");
+		commands_printf("  compensation tables. Requires detected encoder settings and a tuned position PID");
+
 		commands_printf("measure_res [current]");
 		commands_printf("  Lock the motor with a current and calculate its resistance");
 
 		commands_printf("measure_ind [duty]");
 		commands_printf("  Send short voltage pulses, measure the current and calculate the motor inductance");
 
+		commands_printf("measure_ld_lq [duty]");
+		commands_printf("  Send short voltage pulses along the phase axes and calculate the d and q axis inductance");
+
+		commands_printf("measure_ind_curve [duty_max] [levels]");
+		commands_printf("  Measure the inductance at several pulse duty cycles in one pass to see the saturation");
+
 		commands_printf("measure_linkage [current] [duty] [min_rpm] [motor_res]");
 		commands_printf("  Run the motor in BLDC delay mode and measure the flux linkage");
 		commands_printf("  example measure_linkage 5 0.5 700 0.076");
@@ -551,12 +777,25 @@ void terminal_process_string(char *str) {
 		commands_printf("foc_state");
 		commands_printf("  Print some FOC state variables.");
 
+		commands_printf("foc_estimates");
+		commands_printf("  Print the online estimates of the motor resistance and flux linkage.");
+
+		commands_printf("limits");
+		commands_printf("  Print the override current limits and what is limiting them.");
+
+		commands_printf("foc_tasks [reset]");
+		commands_printf("  Print the rate and execution time of the FOC outer control loops.");
+
 		commands_printf("hw_status");
 		commands_printf("  Print some hardware status information.");
 
 		commands_printf("foc_openloop [current] [erpm]");
 		commands_printf("  Create an open loop rotating current vector.");
 
+		commands_printf("foc_freq_resp [id/iq/speed] [amplitude] [f_start] [f_end] [seconds]");
+		commands_printf("  Measure the frequency response of the current or the speed control loop with a chirp.");
+		commands_printf("  The chirp lasts at most %.0f seconds.", (double)MCPWM_FOC_FREQ_RESP_TIME_MAX);
+
 		for (int i = 0;i < callback_write;i++) {
 			if (callbacks[i].arg_names) {
 				commands_printf("%s %s", callbacks[i].command, callbacks[i].arg_names);